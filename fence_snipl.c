@@ -0,0 +1,592 @@
+/*
+   fence_snipl - fence agent for Pacemaker with the logic of lic_vps
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   fence_snipl is provided under the terms of the enclosed common public
+   license ("agreement"). Any use, reproduction or distribution of the
+   program constitutes recipient's acceptance of this agreement.
+
+   fence_snipl speaks the protocol of the fence agents of Pacemaker: the
+   parameters come as key=value lines on stdin, the action is one of
+   them. It loads the stonith plugin lic_vps with the stonith library
+   and hands it the configuration, so a fence races the servers of the
+   image and is confirmed like with heartbeat. A fence agent runs once
+   per action, so the answers of monitor and list are kept in the state
+   file for the age of a health check ($SNIPL_HEALTH, 60 seconds by
+   default). reboot, off and on go to snipld first if it runs and serves
+   the image, its sessions are logged in already.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <stonith/stonith.h>
+#include "snipl.h"
+
+#define FENCE_FACILITY		"fence"
+#define FENCE_TTL		60	/* seconds, see SNIPL_HEALTH */
+#define FENCE_COMPAT		"snipl_file"
+
+/* exit codes of a fence agent */
+#define FENCE_OK		0
+#define FENCE_FAILED		1
+#define FENCE_OFF		2	/* status: the plug is off */
+
+struct fence_parms {
+	char *action;
+	char *plug;
+	char *compat;			/* compat_mode of lic_vps */
+	char *config;			/* lic_config of lic_vps */
+};
+
+static struct option long_options[] = {
+	{"action",         1, NULL, 'o'},
+	{"plug",           1, NULL, 'n'},
+	{"help",           0, NULL, 'h'},
+	{"version",        0, NULL, 'v'},
+	{NULL, 0, NULL, 0}
+};
+
+static const char metadata[] =
+"<?xml version=\"1.0\" ?>\n"
+"<resource-agent name=\"fence_snipl\" shortdesc=\"Fence agent for LPARs "
+"and z/VM guests with snipl\">\n"
+"<longdesc>fence_snipl fences an LPAR through the SE or HMC, or a z/VM "
+"guest through the systems management API of z/VM, with the logic of the "
+"stonith plugin lic_vps. The systems and images are taken from a snipl "
+"configuration file or line.</longdesc>\n"
+"<vendor-url>https://github.com/openmainframeproject/snipl</vendor-url>\n"
+"<parameters>\n"
+"\t<parameter name=\"action\" unique=\"0\" required=\"1\">\n"
+"\t\t<getopt mixed=\"-o, --action=[action]\" />\n"
+"\t\t<content type=\"string\" default=\"reboot\" />\n"
+"\t\t<shortdesc lang=\"en\">Fencing action</shortdesc>\n"
+"\t</parameter>\n"
+"\t<parameter name=\"plug\" unique=\"0\" required=\"1\" "
+"obsoletes=\"port\">\n"
+"\t\t<getopt mixed=\"-n, --plug=[image]\" />\n"
+"\t\t<content type=\"string\" />\n"
+"\t\t<shortdesc lang=\"en\">Name of the LPAR or z/VM guest as in the "
+"snipl configuration</shortdesc>\n"
+"\t</parameter>\n"
+"\t<parameter name=\"port\" unique=\"0\" required=\"0\" "
+"deprecated=\"1\">\n"
+"\t\t<content type=\"string\" />\n"
+"\t\t<shortdesc lang=\"en\">Name of the LPAR or z/VM guest as in the "
+"snipl configuration</shortdesc>\n"
+"\t</parameter>\n"
+"\t<parameter name=\"compat_mode\" unique=\"0\" required=\"0\">\n"
+"\t\t<content type=\"select\" default=\"" FENCE_COMPAT "\">\n"
+"\t\t\t<option value=\"snipl_file\" />\n"
+"\t\t\t<option value=\"snipl_param\" />\n"
+"\t\t</content>\n"
+"\t\t<shortdesc lang=\"en\">Whether lic_config is a snipl configuration "
+"file or line</shortdesc>\n"
+"\t</parameter>\n"
+"\t<parameter name=\"lic_config\" unique=\"0\" required=\"0\">\n"
+"\t\t<content type=\"string\" />\n"
+"\t\t<shortdesc lang=\"en\">snipl configuration file (default "
+"~/.snipl.conf or /etc/snipl.conf) or line</shortdesc>\n"
+"\t</parameter>\n"
+"</parameters>\n"
+"<actions>\n"
+"\t<action name=\"on\" automatic=\"0\" />\n"
+"\t<action name=\"off\" />\n"
+"\t<action name=\"reboot\" />\n"
+"\t<action name=\"status\" />\n"
+"\t<action name=\"list\" />\n"
+"\t<action name=\"monitor\" />\n"
+"\t<action name=\"metadata\" />\n"
+"\t<action name=\"validate-all\" />\n"
+"</actions>\n"
+"</resource-agent>\n";
+
+
+static void print_usage(const char *name)
+{
+	printf("Fence agent for LPARs and z/VM guests with the logic of "
+	       "lic_vps\n");
+	printf("Usage: %s [options] < parameters\n", name);
+	printf(" -o --action <action>            on, off, reboot, status, "
+	       "list, monitor,\n");
+	printf("                                 metadata or validate-all\n");
+	printf(" -n --plug <image>               image to fence\n");
+	printf(" -h --help                       print usage information\n");
+	printf(" -v --version                    print version of %s\n",
+	       name);
+	printf("Without --action the parameters are read from stdin as "
+	       "key=value lines:\n");
+	printf("action, plug (or port), compat_mode (%s or snipl_param) "
+	       "and lic_config\n", FENCE_COMPAT);
+}
+
+
+/*
+ * read the key=value lines of stdin into p, unknown keys are skipped
+ */
+static int read_parms(struct fence_parms *p)
+{
+	char *line = NULL, *value, **field;
+	size_t size = 0;
+	ssize_t len;
+
+	while ((len = getline(&line, &size, stdin)) != -1) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!*line || *line == '#')
+			continue;
+		value = strchr(line, '=');
+		if (!value)
+			continue;
+		*value++ = '\0';
+		if (!strcmp(line, "action") || !strcmp(line, "option"))
+			field = &p->action;
+		else if (!strcmp(line, "plug") || !strcmp(line, "port"))
+			field = &p->plug;
+		else if (!strcmp(line, "compat_mode"))
+			field = &p->compat;
+		else if (!strcmp(line, "lic_config"))
+			field = &p->config;
+		else
+			continue;
+		free(*field);
+		*field = strdup(value);
+		if (!*field) {
+			free(line);
+			return STORAGE_PROBLEM;
+		}
+	}
+	free(line);
+	return 0;
+}
+
+
+/*
+ * the configuration of lic_vps as in its set_config, NULL on errors
+ */
+static struct snipl_configuration *read_config(struct fence_parms *p)
+{
+	struct snipl_configuration *conf;
+	char *name;
+
+	if (!strcmp(p->compat, "snipl_param"))
+		return snipl_configuration_from_line(p->config);
+	name = get_config_file_name(p->config);
+	if (!name)
+		return NULL;
+	conf = snipl_configuration_from_file(name);
+	free(name);
+	return conf;
+}
+
+
+/*
+ * key of the cached answers of action for the configuration, blank free
+ */
+static void cache_key(struct fence_parms *p, const char *action, char *key,
+		      size_t size)
+{
+	unsigned int hash = 2166136261u;	/* FNV-1a */
+	const char *s;
+
+	for (s = p->compat; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 16777619u;
+	hash = (hash ^ ',') * 16777619u;
+	for (s = p->config; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 16777619u;
+	snprintf(key, size, "%s-%08x", action, hash);
+}
+
+static int cache_ttl(void)
+{
+	const char *env = getenv("SNIPL_HEALTH");
+	char *end;
+	long ttl;
+
+	if (!env)
+		return FENCE_TTL;
+	ttl = strtol(env, &end, 10);
+	if (*end || ttl < 0 || ttl > 86400)
+		return FENCE_TTL;
+	return ttl;
+}
+
+/*
+ * the cached answer of action in value, returns 1 if there is one
+ */
+static int cache_get(struct fence_parms *p, const char *action, int ttl,
+		     char *value)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+	time_t stamp, now = time(NULL);
+
+	if (!ttl)
+		return 0;
+	cache_key(p, action, key, sizeof(key));
+	if (snipl_state_get(FENCE_FACILITY, key, value, &stamp))
+		return 0;
+	return stamp <= now && now - stamp < ttl;
+}
+
+static void cache_put(struct fence_parms *p, const char *action, int ttl,
+		      const char *value)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+
+	if (!ttl || strlen(value) >= SNIPL_STATE_VALUE_LEN)
+		return;
+	cache_key(p, action, key, sizeof(key));
+	snipl_state_put(FENCE_FACILITY, key, value);
+}
+
+
+/*
+ * lic_vps with the configuration. A fence agent runs once, so lic_vps
+ * keeps no warm sessions and probes at every status.
+ */
+static Stonith *plugin_open(struct fence_parms *p)
+{
+	StonithNVpair nv[3];
+	Stonith *s;
+
+	setenv("SNIPL_WARM", "0", 1);
+	setenv("SNIPL_HEALTH", "0", 1);
+	s = stonith_new("lic_vps");
+	if (!s) {
+		fprintf(stderr, "fence_snipl: cannot load the stonith plugin "
+			"lic_vps\n");
+		return NULL;
+	}
+	nv[0] = (StonithNVpair) {"compat_mode", p->compat};
+	nv[1] = (StonithNVpair) {"lic_config", p->config};
+	nv[2] = (StonithNVpair) {NULL, NULL};
+	if (stonith_set_config(s, nv) != S_OK) {
+		fprintf(stderr, "fence_snipl: lic_vps refuses the "
+			"configuration\n");
+		stonith_delete(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+/* a server of the configuration is alive */
+static int do_monitor(struct fence_parms *p, int ttl)
+{
+	char value[SNIPL_STATE_VALUE_LEN];
+	Stonith *s;
+	int rc;
+
+	if (cache_get(p, "monitor", ttl, value))
+		return FENCE_OK;
+	s = plugin_open(p);
+	if (!s)
+		return FENCE_FAILED;
+	rc = stonith_get_status(s);
+	stonith_delete(s);
+	if (rc != S_OK)
+		return FENCE_FAILED;
+	/* only success is kept, a failure is checked again */
+	cache_put(p, "monitor", ttl, "ok");
+	return FENCE_OK;
+}
+
+
+/* the images of the configuration, one per line */
+static int do_list(struct fence_parms *p, int ttl, FILE *out)
+{
+	char value[SNIPL_STATE_VALUE_LEN];
+	char *list = NULL, **hosts, **host, *name;
+	size_t len = 0;
+	FILE *mem;
+	Stonith *s;
+
+	if (cache_get(p, "list", ttl, value)) {
+		for (name = strtok(value, " "); name; name = strtok(NULL, " "))
+			fprintf(out, "%s\n", name);
+		return FENCE_OK;
+	}
+	s = plugin_open(p);
+	if (!s)
+		return FENCE_FAILED;
+	hosts = stonith_get_hostlist(s);
+	if (!hosts) {
+		stonith_delete(s);
+		return FENCE_FAILED;
+	}
+	mem = open_memstream(&list, &len);
+	for (host = hosts; *host; host++) {
+		fprintf(out, "%s\n", *host);
+		if (mem)
+			fprintf(mem, "%s%s", host == hosts ? "" : " ", *host);
+	}
+	if (mem && !fclose(mem))
+		cache_put(p, "list", ttl, list);
+	free(list);
+	stonith_free_hostlist(hosts);
+	stonith_delete(s);
+	return FENCE_OK;
+}
+
+
+/*
+ * let snipld perform op on the plug. Returns 1 if it did so
+ * successfully, 0 if it does not run or could not do it; the fence
+ * then goes through lic_vps. Returns -1 if the request was sent but got
+ * no answer, snipld may still perform it and it must not be repeated.
+ */
+static int daemon_fence(struct snipl_configuration *conf, const char *plug,
+			int op, int *state)
+{
+	struct snipl_server *server = NULL;
+	struct snipl_image *image;
+	struct snipld_conn *conn;
+	struct snipl_result *res;
+	int rc, done = 0;
+
+	conn = snipld_open();
+	if (!conn)
+		return 0;
+	while (!done &&
+	       (image = find_next_image(conf, plug, NULL, server))) {
+		server = image->server;
+		if (!server->type || snipl_results_alloc(server, 1))
+			continue;
+		server->parms.image_op = op;
+		/* immed on z/VM, unconditionally on an LPAR, as lic_vps */
+		server->parms.force = op == DEACTIVATE ? 1 : UNDEFINED;
+		switch (snipld_call(conn, image, op, &rc)) {
+		case 0:
+			res = snipl_result_end(server, rc);
+			/* a query of an inactive image fails with its state */
+			if (state && res)
+				*state = res->state;
+			done = !rc || (state && *state != SNIPL_IMAGE_UNKNOWN);
+			if (!done)
+				fprintf(stderr, "fence_snipl: snipld: %s",
+					res && res->text ? res->text :
+					"failed\n");
+			break;
+		case 1:
+			break;
+		case 2:
+			res = snipl_result_end(server, rc);
+			fprintf(stderr, "fence_snipl: snipld: %s",
+				res && res->text ? res->text : "no answer\n");
+			snipld_close(conn);
+			return -1;
+		default:
+			snipld_close(conn);
+			return done;
+		}
+	}
+	snipld_close(conn);
+	return done;
+}
+
+
+/*
+ * the state of the plug by snipld or by a login to its servers,
+ * SNIPL_IMAGE_UNKNOWN if there is none
+ */
+static int plug_state(struct snipl_configuration *conf, const char *plug)
+{
+	struct snipl_server *server = NULL;
+	struct snipl_image *image;
+	struct snipl_result *res;
+	int rc, state = SNIPL_IMAGE_UNKNOWN;
+
+	if (daemon_fence(conf, plug, GETSTATUS, &state) > 0)
+		return state;
+	while (state == SNIPL_IMAGE_UNKNOWN &&
+	       (image = find_next_image(conf, plug, NULL, server))) {
+		server = image->server;
+		if (!server->type || snipl_results_alloc(server, 1))
+			continue;
+		server->parms.image_op = GETSTATUS;
+		rc = snipl_connect(server);
+		if (rc && rc != SERVER_IMAGE_MISMATCH) {
+			fprintf(stderr, "fence_snipl: %s",
+				server->problem ? server->problem :
+				"login failed\n");
+			continue;
+		}
+		snipl_result_begin(server, image, GETSTATUS);
+		rc = snipl_getstatus(image);
+		res = snipl_result_end(server, rc);
+		if (res)
+			state = res->state;
+		snipl_logout(server);
+	}
+	return state;
+}
+
+
+/* reboot, off or on: snipld if it serves the plug, else lic_vps */
+static int do_fence(struct fence_parms *p, struct snipl_configuration *conf)
+{
+	int request, op, rc;
+	Stonith *s;
+
+	if (!strcmp(p->action, "reboot")) {
+		request = ST_GENERIC_RESET;
+		op = RESET;
+	} else if (!strcmp(p->action, "off")) {
+		request = ST_POWEROFF;
+		op = DEACTIVATE;
+	} else {
+		request = ST_POWERON;
+		op = ACTIVATE;
+	}
+	/* snipld does not confirm a fence */
+	if (!getenv("SNIPL_VERIFY")) {
+		rc = daemon_fence(conf, p->plug, op, NULL);
+		if (rc)
+			return rc > 0 ? FENCE_OK : FENCE_FAILED;
+	}
+	s = plugin_open(p);
+	if (!s)
+		return FENCE_FAILED;
+	rc = stonith_req_reset(s, request, p->plug);
+	stonith_delete(s);
+	return rc == S_OK ? FENCE_OK : FENCE_FAILED;
+}
+
+
+/* the histories of the requests are written once, at the end */
+static void flush_state(void)
+{
+	snipl_state_flush();
+}
+
+
+/*
+ *	function: main
+ *
+ *	purpose: point of control
+ */
+int main(int argc, char **argv)
+{
+	struct fence_parms p = {NULL, NULL, NULL, NULL};
+	struct snipl_configuration *conf = NULL;
+	struct snipl_server *server;
+	int c, ttl, state, ret = FENCE_FAILED;
+	FILE *out;
+
+	atexit(flush_state);
+	while ((c = getopt_long(argc, argv, "o:n:hv", long_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 'o':
+			p.action = strdup(optarg);
+			break;
+		case 'n':
+			p.plug = strdup(optarg);
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		case 'v':
+			printf("%s\n", SNIPL_VERSION);
+			printf("%s\n", SNIPL_COPYRIGHT);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return FENCE_FAILED;
+		}
+	}
+	if (optind < argc) {
+		print_usage(argv[0]);
+		return FENCE_FAILED;
+	}
+	if (!p.action && read_parms(&p)) {
+		fprintf(stderr, "fence_snipl: out of memory\n");
+		return FENCE_FAILED;
+	}
+	if (!p.action)
+		p.action = strdup("reboot");
+	if (!p.compat)
+		p.compat = strdup(FENCE_COMPAT);
+	if (!p.config)
+		p.config = strdup("");
+	if (!p.action || !p.compat || !p.config) {
+		fprintf(stderr, "fence_snipl: out of memory\n");
+		return FENCE_FAILED;
+	}
+	if (!strcmp(p.action, "metadata")) {
+		fputs(metadata, stdout);
+		return FENCE_OK;
+	}
+
+	/* the LPAR module prints progress dots, keep them off the answer */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		fprintf(stderr, "fence_snipl: %s\n", strerror(errno));
+		return FENCE_FAILED;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	ttl = cache_ttl();
+
+	if (strcmp(p.compat, "snipl_file") &&
+	    strcmp(p.compat, "snipl_param")) {
+		fprintf(stderr, "fence_snipl: invalid compat_mode %s\n",
+			p.compat);
+	} else if (!strcmp(p.action, "monitor")) {
+		ret = do_monitor(&p, ttl);
+	} else if (!strcmp(p.action, "list")) {
+		ret = do_list(&p, ttl, out);
+	} else if (!strcmp(p.action, "validate-all") ||
+		   !strcmp(p.action, "status") ||
+		   !strcmp(p.action, "reboot") || !strcmp(p.action, "off") ||
+		   !strcmp(p.action, "on")) {
+		conf = read_config(&p);
+		if (!conf || conf->problem_class == FATAL) {
+			fprintf(stderr, "fence_snipl: invalid configuration\n");
+			if (conf && conf->problem)
+				fputs(conf->problem, stderr);
+		} else if (!strcmp(p.action, "validate-all")) {
+			ret = FENCE_OK;
+		} else if (!p.plug) {
+			fprintf(stderr, "fence_snipl: no plug for %s\n",
+				p.action);
+		} else if (!find_next_image(conf, p.plug, NULL, NULL)) {
+			fprintf(stderr, "fence_snipl: %s is not in the "
+				"configuration\n", p.plug);
+		} else if (!strcmp(p.action, "status")) {
+			state = plug_state(conf, p.plug);
+			ret = state == SNIPL_IMAGE_INACTIVE ? FENCE_OFF :
+				state == SNIPL_IMAGE_UNKNOWN ? FENCE_FAILED :
+				FENCE_OK;
+			fprintf(out, "Status: %s\n", ret == FENCE_OFF ? "OFF" :
+				ret == FENCE_OK ? "ON" : "UNKNOWN");
+		} else {
+			ret = do_fence(&p, conf);
+		}
+	} else {
+		fprintf(stderr, "fence_snipl: unknown action %s\n", p.action);
+	}
+
+	if (conf) {
+		snipl_for_each_server(conf, server)
+			snipl_results_free(server);
+		snipl_configuration_free(conf);
+	}
+	fclose(out);
+	free(p.action);
+	free(p.plug);
+	free(p.compat);
+	free(p.config);
+	return ret;
+}
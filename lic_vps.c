@@ -34,6 +34,10 @@
 #include <pils/plugin.h>
 #include <syslog.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include <snipl.h>
 
 static StonithPlugin *	lic_vps_new(const char *);
@@ -96,6 +100,9 @@ PIL_rc PIL_PLUGIN_INIT(PILPlugin*us, const PILPluginImports* imports)
  *	LIC_VPS STONITH device.
  */
 
+struct health;
+struct warm;
+
 struct pluginDevice
 {
 	StonithPlugin	sp;
@@ -106,6 +113,8 @@ struct pluginDevice
 	char		*config;
 	struct	snipl_configuration *vpslist;
 	int		hostcount;
+	struct	health	*health;	/* of the servers, see lic_vps_status */
+	struct	warm	*warm;		/* sessions, see lic_vps_reset_req */
 };
 
 
@@ -178,13 +187,570 @@ static void message(char **message_buffer)
 }
 
 
+/*
+ * health of the servers of a device. Heartbeat asks for the status at
+ * every monitor interval, the answer is the last probe if it is at most
+ * ttl seconds old. A prober thread probes all servers every ttl / 2
+ * seconds, with its own copies of them, so a probe never shares a
+ * server with a reset. $SNIPL_HEALTH=<seconds> changes the ttl, 0 turns
+ * the prober off and every status probes. The prober and the status
+ * write the queued updates of the state file, a fence never does.
+ */
+#define HEALTH_ENV	"SNIPL_HEALTH"
+#define HEALTH_TTL	60	/* seconds */
+
+struct health {
+	pthread_mutex_t lock;		/* of the members below */
+	pthread_mutex_t probe_lock;	/* one probe round at a time */
+	pthread_cond_t	wake;		/* the prober, to stop it */
+	pthread_t	thread;
+	int		started;
+	int		stop;
+	int		ttl;
+	int		ok;		/* a server was alive */
+	struct timespec	checked;	/* CLOCK_MONOTONIC, 0 = never */
+	int		nr_servers;
+	struct snipl_server **servers;	/* copies of the configuration */
+	int		*alive;		/* of every server, -1 = unknown */
+};
+
+static int health_ttl(void)
+{
+	const char *env = getenv(HEALTH_ENV);
+	char *end;
+	long ttl;
+
+	if (!env)
+		return HEALTH_TTL;
+	ttl = strtol(env, &end, 10);
+	if (*end || ttl < 0 || ttl > 86400) {
+		syslog(LOG_WARNING, "%s=%s is invalid, using %d", HEALTH_ENV,
+		       env, HEALTH_TTL);
+		return HEALTH_TTL;
+	}
+	return ttl;
+}
+
+/*
+ * copy the access data of a server of the configuration, without its
+ * images, for the prober
+ */
+static struct snipl_server *health_clone(struct snipl_server *server)
+{
+	struct snipl_server *clone;
+
+	clone = calloc(1, sizeof(*clone));
+	if (!clone)
+		return NULL;
+	*clone = (struct snipl_server) {
+		.address = server->address,
+		.type = server->type,
+		.user = server->user,
+		.password = server->password,
+		.sslfingerprint = server->sslfingerprint,
+		.port = server->port,
+		.enc = server->enc,
+		.timeout = server->timeout,
+		.timeout_given = server->timeout_given,
+		.parms = server->parms,
+	};
+	return clone;
+}
+
+static void health_free(struct health *h)
+{
+	int i;
+
+	if (!h)
+		return;
+	if (h->started) {
+		pthread_mutex_lock(&h->lock);
+		h->stop = 1;
+		pthread_cond_signal(&h->wake);
+		pthread_mutex_unlock(&h->lock);
+		/* end a probe that is running, the servers are the prober's */
+		for (i = 0; i < h->nr_servers; i++)
+			snipl_cancel(h->servers[i]);
+		pthread_join(h->thread, NULL);
+	}
+	for (i = 0; i < h->nr_servers; i++) {
+		free(h->servers[i]->problem);
+		free(h->servers[i]);
+	}
+	free(h->servers);
+	free(h->alive);
+	pthread_cond_destroy(&h->wake);
+	pthread_mutex_destroy(&h->probe_lock);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+static struct health *health_new(struct snipl_configuration *conf)
+{
+	pthread_condattr_t attr;
+	struct snipl_server *serv;
+	struct health *h;
+	int n = 0;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+	snipl_for_each_server(conf, serv)
+		n++;
+	h->servers = calloc(n, sizeof(*h->servers));
+	h->alive = calloc(n, sizeof(*h->alive));
+	if (!h->servers || !h->alive)
+		goto fail;
+	snipl_for_each_server(conf, serv) {
+		if (serv->type == NULL) {
+			syslog(LOG_WARNING, "%s: No type specified for %s",
+			       __func__, serv->address);
+			continue;
+		}
+		h->servers[h->nr_servers] = health_clone(serv);
+		if (!h->servers[h->nr_servers])
+			goto fail;
+		h->alive[h->nr_servers++] = -1;
+	}
+	h->ttl = health_ttl();
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_mutex_init(&h->probe_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&h->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	return h;
+fail:
+	for (n = 0; n < h->nr_servers; n++)
+		free(h->servers[n]);
+	free(h->servers);
+	free(h->alive);
+	free(h);
+	return NULL;
+}
+
+/*
+ * the last probe if it is fresh: returns 1 and the result in *ok
+ */
+static int health_cached(struct health *h, int *ok)
+{
+	struct timespec now;
+	int fresh;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&h->lock);
+	fresh = h->ttl && h->checked.tv_sec &&
+		now.tv_sec - h->checked.tv_sec < h->ttl;
+	*ok = h->ok;
+	pthread_mutex_unlock(&h->lock);
+	return fresh;
+}
+
+/*
+ * probe the servers, best score first, until one is alive or all of
+ * them if all is set. A server that goes down or comes back is logged.
+ * returns 1 if a server is alive.
+ */
+static int health_probe(struct health *h, int all)
+{
+	struct snipl_server *serv;
+	int order[h->nr_servers];
+	long score[h->nr_servers];
+	int i, j, t, rc, ok = 0;
+
+	for (i = 0; i < h->nr_servers; i++) {
+		score[i] = snipl_server_score(h->servers[i]);
+		for (j = i; j > 0 && score[order[j - 1]] > score[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	for (i = 0; i < h->nr_servers && (all || !ok); i++) {
+		t = order[i];
+		serv = h->servers[t];
+		/* health_free stops the probes and cancels the running one */
+		pthread_mutex_lock(&h->lock);
+		if (h->stop) {
+			pthread_mutex_unlock(&h->lock);
+			return ok;
+		}
+		if (h->ttl)
+			snipl_set_deadline(serv, h->ttl * 500);
+		pthread_mutex_unlock(&h->lock);
+		rc = snipl_probe(serv);
+		serv->deadline.tv_sec = 0;
+		if (!rc) {
+			ok = 1;
+			if (!h->alive[t])
+				syslog(LOG_INFO, "%s is alive again",
+				       serv->address);
+		} else if (h->alive[t]) {
+			syslog(LOG_ERR, "%s does not answer: %d",
+			       serv->address, rc);
+			message(&serv->problem);
+		}
+		free(serv->problem);
+		serv->problem = NULL;
+		serv->_problem_buf = NULL;
+		h->alive[t] = !rc;
+	}
+	pthread_mutex_lock(&h->lock);
+	h->ok = ok;
+	clock_gettime(CLOCK_MONOTONIC, &h->checked);
+	pthread_mutex_unlock(&h->lock);
+	return ok;
+}
+
+static void *health_prober(void *arg)
+{
+	struct health *h = arg;
+	struct timespec next;
+
+	pthread_mutex_lock(&h->lock);
+	while (!h->stop) {
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		next.tv_sec += h->ttl / 2 ? h->ttl / 2 : 1;
+		while (!h->stop &&
+		       pthread_cond_timedwait(&h->wake, &h->lock, &next) !=
+		       ETIMEDOUT)
+			;
+		if (h->stop)
+			break;
+		pthread_mutex_unlock(&h->lock);
+		pthread_mutex_lock(&h->probe_lock);
+		health_probe(h, 1);
+		pthread_mutex_unlock(&h->probe_lock);
+		/* the histories of the fences too, off their path */
+		snipl_state_flush();
+		pthread_mutex_lock(&h->lock);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+
+/*
+ * warm sessions to the servers of a device. A fence should not wait for
+ * a login: the HWMCA session of an LPAR server with its image objects,
+ * or the connected (TLS) socket of a z/VM server, is kept between
+ * requests. A refresher thread logs in to every server with images at
+ * the first reset or off and then every interval seconds, and again
+ * right after a z/VM session was used, as SMAPI takes one request per
+ * login. An instance that only answers status or list requests does
+ * not log in. A fence cancels a refresh of its server that is running
+ * and logs in itself.
+ * $SNIPL_WARM=<seconds> changes the interval, 0 turns the sessions off
+ * and every request logs in and out.
+ */
+#define WARM_ENV	"SNIPL_WARM"
+#define WARM_INTERVAL	120	/* seconds */
+
+struct warm_server {
+	struct snipl_server *server;
+	pthread_mutex_t	lock;		/* of the server and members below */
+	int		connected;
+	int		used;		/* a z/VM session took its request */
+	int		failed;		/* the last refresh failed */
+	int		refreshing;	/* under warm.lock, 2 = cancelled */
+};
+
+struct warm {
+	pthread_mutex_t	lock;		/* of the members below */
+	pthread_cond_t	wake;		/* the refresher */
+	pthread_t	thread;
+	int		started;
+	int		stop;
+	int		kick;		/* a session was used */
+	int		racing;		/* runners of fences, see struct race */
+	pthread_cond_t	idle;		/* no runner is left */
+	int		interval;
+	int		nr_servers;
+	struct warm_server *servers;
+};
+
+static int warm_interval(void)
+{
+	const char *env = getenv(WARM_ENV);
+	char *end;
+	long interval;
+
+	if (!env)
+		return WARM_INTERVAL;
+	interval = strtol(env, &end, 10);
+	if (*end || interval < 0 || interval > 86400) {
+		syslog(LOG_WARNING, "%s=%s is invalid, using %d", WARM_ENV,
+		       env, WARM_INTERVAL);
+		return WARM_INTERVAL;
+	}
+	return interval;
+}
+
+static struct warm_server *warm_find(struct warm *w,
+				     struct snipl_server *server)
+{
+	int i;
+
+	for (i = 0; w && i < w->nr_servers; i++)
+		if (w->servers[i].server == server)
+			return &w->servers[i];
+	return NULL;
+}
+
+/* called with ws locked */
+static void warm_logout(struct warm_server *ws)
+{
+	struct snipl_server *server;
+
+	if (!ws || !ws->connected)
+		return;
+	server = ws->server;
+	free(server->problem);
+	server->problem = NULL;
+	server->_problem_buf = NULL;
+	if (snipl_logout(server)) {
+		syslog(LOG_ERR, "snipl_logout error using %s\n",
+		       server->address);
+		message(&server->problem);
+	}
+	ws->connected = 0;
+	ws->used = 0;
+}
+
+/*
+ * log in to the server of ws again if its session is missing, used or
+ * old, called by the refresher with ws locked
+ */
+static void warm_refresh(struct warm *w, struct warm_server *ws, int all)
+{
+	struct snipl_server *server = ws->server;
+	int rc, cut;
+
+	if (ws->connected && !ws->used && !all)
+		return;
+	warm_logout(ws);
+	pthread_mutex_lock(&w->lock);
+	if (w->stop) {
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+	ws->refreshing = 1;
+	snipl_set_deadline(server, w->interval * 500);
+	pthread_mutex_unlock(&w->lock);
+	server->parms.image_op = GETSTATUS;
+	server->parms.force = UNDEFINED;
+	rc = snipl_connect(server);
+	pthread_mutex_lock(&w->lock);
+	cut = ws->refreshing == 2 || w->stop;
+	ws->refreshing = 0;
+	snipl_cancel_clear(server);
+	server->deadline.tv_sec = 0;
+	pthread_mutex_unlock(&w->lock);
+	/* images missing on an LPAR server fail only their request */
+	if (!rc || rc == SERVER_IMAGE_MISMATCH) {
+		ws->connected = 1;
+		if (ws->failed)
+			syslog(LOG_INFO, "session to %s is back",
+			       server->address);
+		ws->failed = 0;
+	} else if (!ws->failed && !cut) {
+		syslog(LOG_ERR, "no session to %s: %d", server->address, rc);
+		message(&server->problem);
+		ws->failed = 1;
+	}
+	free(server->problem);
+	server->problem = NULL;
+	server->_problem_buf = NULL;
+}
+
+static void *warm_refresher(void *arg)
+{
+	struct warm *w = arg;
+	struct timespec next = {0, 0};
+	int i, all;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop) {
+		while (!w->stop && !w->kick && next.tv_sec &&
+		       pthread_cond_timedwait(&w->wake, &w->lock, &next) !=
+		       ETIMEDOUT)
+			;
+		if (w->stop)
+			break;
+		all = !w->kick;
+		if (all) {
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			next.tv_sec += w->interval;
+		}
+		w->kick = 0;
+		pthread_mutex_unlock(&w->lock);
+		for (i = 0; i < w->nr_servers; i++) {
+			pthread_mutex_lock(&w->servers[i].lock);
+			warm_refresh(w, &w->servers[i], all);
+			pthread_mutex_unlock(&w->servers[i].lock);
+		}
+		snipl_state_flush();
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+static void warm_free(struct warm *w)
+{
+	int i;
+
+	if (!w)
+		return;
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	for (i = 0; i < w->nr_servers; i++)
+		if (w->servers[i].refreshing)
+			snipl_cancel(w->servers[i].server);
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	if (w->started)
+		pthread_join(w->thread, NULL);
+	/* runners of fences that were abandoned end on their own */
+	pthread_mutex_lock(&w->lock);
+	while (w->racing)
+		pthread_cond_wait(&w->idle, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < w->nr_servers; i++) {
+		warm_logout(&w->servers[i]);
+		pthread_mutex_destroy(&w->servers[i].lock);
+	}
+	free(w->servers);
+	pthread_cond_destroy(&w->idle);
+	pthread_cond_destroy(&w->wake);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+/*
+ * sessions to the servers of conf that have images, the refresher
+ * starts with warm_start
+ */
+static struct warm *warm_new(struct snipl_configuration *conf)
+{
+	pthread_condattr_t attr;
+	struct snipl_server *serv;
+	struct warm *w;
+	int n = 0;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	snipl_for_each_server(conf, serv)
+		n++;
+	w->servers = calloc(n, sizeof(*w->servers));
+	if (!w->servers) {
+		free(w);
+		return NULL;
+	}
+	snipl_for_each_server(conf, serv) {
+		if (serv->type == NULL || serv->_images == NULL)
+			continue;
+		w->servers[w->nr_servers].server = serv;
+		pthread_mutex_init(&w->servers[w->nr_servers++].lock, NULL);
+	}
+	w->interval = warm_interval();
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&w->idle, NULL);
+	return w;
+}
+
+/* start the refresher unless it runs, at the first reset or off */
+static void warm_start(struct warm *w)
+{
+	pthread_mutex_lock(&w->lock);
+	if (!w->started && !w->stop && w->interval && w->nr_servers) {
+		if (pthread_create(&w->thread, NULL, warm_refresher, w))
+			syslog(LOG_WARNING, "%s : cannot start refresher",
+			       __func__);
+		else
+			w->started = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * take the sessions of n servers for a request, in the order of the
+ * device so that two requests do not wait for each other. A refresh
+ * that is running is cancelled, the request logs in itself.
+ */
+static void warm_take(struct warm *w, struct snipl_server **servers, int n)
+{
+	struct warm_server *ws;
+	int i, j;
+
+	for (i = 0; i < w->nr_servers; i++) {
+		ws = &w->servers[i];
+		for (j = 0; j < n && servers[j] != ws->server; j++)
+			;
+		if (j == n)
+			continue;
+		pthread_mutex_lock(&w->lock);
+		if (ws->refreshing) {
+			ws->refreshing = 2;
+			snipl_cancel(ws->server);
+		}
+		pthread_mutex_unlock(&w->lock);
+		pthread_mutex_lock(&ws->lock);
+	}
+}
+
+static void warm_give(struct warm *w, struct snipl_server **servers, int n)
+{
+	struct warm_server *ws;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ws = warm_find(w, servers[i]);
+		if (ws)
+			pthread_mutex_unlock(&ws->lock);
+	}
+}
+
+/*
+ * whether the server has a session that can take a request, a server
+ * that is busy has none
+ */
+static int warm_ready(struct warm *w, struct snipl_server *server)
+{
+	struct warm_server *ws = warm_find(w, server);
+	int ready;
+
+	if (!w->interval || !ws || pthread_mutex_trylock(&ws->lock))
+		return 0;
+	ready = ws->connected && !ws->used;
+	pthread_mutex_unlock(&ws->lock);
+	return ready;
+}
+
+/* let the refresher log in again to the sessions that were used */
+static void warm_kick(struct warm *w)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->started) {
+		w->kick = 1;
+		pthread_cond_signal(&w->wake);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+/*
+ *	Status of the device: S_OK if one of its servers is alive. The
+ *	answer comes from the prober, if its last probe is too old the
+ *	servers are probed right away.
+ */
 int lic_vps_status(StonithPlugin *s)
 {
-	struct pluginDevice        *vpsd;
-	struct snipl_configuration *conf;
-	struct snipl_server        *serv;
-	_Bool server_found = 0;
-	int cert_error;
+	struct pluginDevice *vpsd;
+	struct health *h;
+	int ok;
 
 	DEBUG_PRINT("lic_vps : start of function\n");
 
@@ -192,47 +758,32 @@ int lic_vps_status(StonithPlugin *s)
 
 	vpsd = (struct pluginDevice *)s;
 
-	conf = (struct snipl_configuration*)vpsd->vpslist;
-	if (conf == NULL){
+	h = vpsd->health;
+	if (h == NULL){
 		syslog(LOG_ERR, "%s : snipl_configuration is NULL",
 		      __func__);
 		return S_OOPS;
 	}
-
-	snipl_for_each_server(conf, serv)
-	{	/* search for one operational server */
-
-		DEBUG_PRINT("server: %s\n", serv->address);
-		if (serv->type == NULL)
-			syslog(LOG_WARNING, "%s: No type specified for %s",
-			       __func__, serv->address);
+	if (health_cached(h, &ok))
+		return ok ? S_OK : S_OOPS;
+
+	pthread_mutex_lock(&h->probe_lock);
+	/* the prober may have been faster */
+	if (!health_cached(h, &ok))
+		ok = health_probe(h, 0);
+	pthread_mutex_unlock(&h->probe_lock);
+	snipl_state_flush();
+
+	pthread_mutex_lock(&h->lock);
+	if (h->ttl && !h->started) {
+		if (pthread_create(&h->thread, NULL, health_prober, h))
+			syslog(LOG_WARNING, "%s : cannot start prober",
+			       __func__);
 		else
-			DEBUG_PRINT("%s: Preparing access for %s(type %s)\n",
-			       __func__, serv->address, serv->type);
-
-		snipl_prepare(serv);	/* prepare every server */
-		if (!server_found) {
-			/* but only check and try until one success */
-			server_found = (0 == snipl_prepare_check(serv) &&
-					0 == snipl_login(serv));
-			cert_error = (serv->problem_class == CERTIFICATE_ERROR);
-			snipl_logout(serv);
-			if (!server_found &&
-			    !strcasecmp(serv->type, "VM") &&
-			    !cert_error) {
-				serv->type = "VM5";
-				snipl_prepare(serv);
-				server_found =
-					(0 == snipl_prepare_check(serv) &&
-					 0 == snipl_login(serv));
-				snipl_logout(serv);
-			}
-		}
+			h->started = 1;
 	}
-	if (server_found)
-		return S_OK;
-
-	return S_OOPS;
+	pthread_mutex_unlock(&h->lock);
+	return ok ? S_OK : S_OOPS;
 }
 
 /*
@@ -314,58 +865,143 @@ int oops_error(char *errmsg, const char *request)
 	return 1;
 }
 
+
 /*
- *	reset/activate/deactivate the given image on this Stonith device.
- *
+ * confirmation of a fence. After an acknowledged deactivate the image
+ * is polled through the session of the request until it is inactive,
+ * after a reset of an LPAR until it is no longer operating. The polls
+ * are 50 ms apart at first, doubled up to a second, for at most
+ * $SNIPL_VERIFY=<seconds>; unset or 0 turns the confirmation off. The
+ * reset of z/VM is acknowledged when the guest has been logged off and
+ * on again, there is no state to wait for.
  */
-static int
-lic_vps_reset_req2(struct snipl_image *simg, int request)
-{
-	struct snipl_server *server;
-	int rc = S_OK;
+#define VERIFY_ENV	"SNIPL_VERIFY"
+#define VERIFY_FIRST	50	/* ms, first interval */
+#define VERIFY_MAX	1000	/* ms, longest interval */
 
-	server = simg->server;
+static int verify_timeout(void)
+{
+	const char *env = getenv(VERIFY_ENV);
+	char *end;
+	long timeout;
 
-	if (server->type == NULL) {
-		syslog(LOG_ERR, "No type specified for %s", server->address);
-		return S_OOPS;
+	if (!env || !*env)
+		return 0;
+	timeout = strtol(env, &end, 10);
+	if (*end || timeout < 0 || timeout > 3600) {
+		syslog(LOG_WARNING, "%s=%s is invalid, not verifying",
+		       VERIFY_ENV, env);
+		return 0;
 	}
+	return timeout;
+}
 
-	rc = snipl_prepare(server);
-	if (!rc)
-		rc = snipl_prepare_check(server);
-	if (rc) {
-		syslog(LOG_ERR, "prepare error : %d using %s\n",
-		       rc, server->address);
-		message(&server->problem);
-		return S_OOPS;
-	}
+static long verify_msecs(const struct timespec *since)
+{
+	struct timespec now;
 
-	rc = snipl_login(server);
-	if (rc && server->problem_class == CERTIFICATE_ERROR) {
-		syslog(LOG_ERR, "Certificate fingerprint mismatch.\n");
-		goto logout;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+		(now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * one status request of the image, returns its state
+ */
+static int verify_poll(struct snipl_image *simg, int vm)
+{
+	struct snipl_server *server = simg->server;
+	struct snipl_result *res;
+	struct snipl_learn learn;
+	int rc = 0, state;
+
+	/* z/VM takes one request per login */
+	if (vm) {
+		snipl_learn_begin(server, "login", &learn);
+		rc = snipl_login(server);
+		snipl_learn_end(server, &learn, rc);
 	}
-	if (rc && !strcasecmp(server->type, "VM")) {
-		snipl_logout(server);
-		server->type = "VM5";
-		if (!snipl_prepare(server)) {
-			snipl_prepare_check(server);
-			rc = snipl_login(server);
-		}
+	res = snipl_result_begin(server, simg, GETSTATUS);
+	if (!rc) {
+		server->parms.image_op = GETSTATUS;
+		snipl_learn_begin(server, snipl_op_name(GETSTATUS), &learn);
+		rc = snipl_getstatus(simg);
+		snipl_learn_end(server, &learn, rc);
 	}
-	if (rc) {
-		syslog(LOG_ERR, "snipl_login error : %d using %s\n",
-		       rc, server->address);
-		message(&server->problem);
+	state = res ? res->state : SNIPL_IMAGE_UNKNOWN;
+	snipl_result_end(server, rc);
+	return state;
+}
+
+/*
+ * returns S_OK when the image is fenced, S_TIMEOUT if it is not after
+ * timeout seconds
+ */
+static int verify_fence(struct snipl_image *simg, int request, int timeout)
+{
+	struct snipl_server *server = simg->server;
+	int vm = !strncasecmp(server->type, "VM", 2);
+	struct timespec start, ts;
+	long elapsed, wait = VERIFY_FIRST;
+	int state;
+
+	if (request == ST_GENERIC_RESET && vm)
+		return S_OK;
+	if (!server->results && snipl_results_alloc(server, 1)) {
+		syslog(LOG_ERR, "%s : out of memory", __func__);
 		return S_OOPS;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		state = verify_poll(simg, vm);
+		elapsed = verify_msecs(&start);
+		if (request == ST_POWEROFF ?
+		    state == SNIPL_IMAGE_INACTIVE :
+		    state == SNIPL_IMAGE_INACTIVE ||
+		    state == SNIPL_IMAGE_ACTIVE) {
+			syslog(LOG_INFO, "%s is %s after %ld ms\n",
+			       simg->alias, snipl_state_name(state), elapsed);
+			return S_OK;
+		}
+		/* a runner that lost its race is cancelled */
+		if (elapsed >= timeout * 1000L || snipl_time_left(server) <= 0)
+			break;
+		if (wait > timeout * 1000L - elapsed)
+			wait = timeout * 1000L - elapsed;
+		ts.tv_sec = wait / 1000;
+		ts.tv_nsec = (wait % 1000) * 1000000L;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+		wait = wait * 2 > VERIFY_MAX ? VERIFY_MAX : wait * 2;
+	}
+	syslog(LOG_ERR, "%s is not fenced after %ld ms, state is %s\n",
+	       simg->alias, elapsed, snipl_state_name(state));
+	return S_TIMEOUT;
+}
+
+
+/*
+ *	reset/activate/deactivate the given image on this Stonith device,
+ *	the server of the image is connected already and stays connected.
+ *	A fence is confirmed with verify_fence if $SNIPL_VERIFY is set.
+ */
+static int
+lic_vps_reset_req2(struct snipl_image *simg, int request)
+{
+	struct snipl_server *server;
+	struct snipl_learn learn;
+	int rc = S_OK;
+	int timeout;
+
+	server = simg->server;
 
 	switch (request) {
 	case ST_GENERIC_RESET:
 		// reset image
 		server->parms.image_op = RESET;
+		snipl_learn_begin(server, snipl_op_name(RESET), &learn);
 		rc = snipl_reset(simg);
+		snipl_learn_end(server, &learn, rc);
 		if (rc && oops_error(server->problem, "reset")) {
 			syslog(LOG_ERR, "snipl_reset_error : %d using %s\n",
 			       rc, simg->alias);
@@ -376,7 +1012,9 @@ lic_vps_reset_req2(struct snipl_image *simg, int request)
 	case ST_POWERON:
 		// activate image
 		server->parms.image_op = ACTIVATE;
+		snipl_learn_begin(server, snipl_op_name(ACTIVATE), &learn);
 		rc = snipl_activate(simg);
+		snipl_learn_end(server, &learn, rc);
 		if (rc && oops_error(server->problem, "activate")) {
 			syslog(LOG_ERR, "snipl_activate error : %d using %s\n",
 			       rc, simg->alias);
@@ -389,7 +1027,9 @@ lic_vps_reset_req2(struct snipl_image *simg, int request)
 		server->parms.image_op = DEACTIVATE;
 		server->parms.force = 1;
 			// means immed in VM and unconditionally in LPAR
+		snipl_learn_begin(server, snipl_op_name(DEACTIVATE), &learn);
 		rc = snipl_deactivate(simg);
+		snipl_learn_end(server, &learn, rc);
 		if (rc && oops_error(server->problem, "deactivate")) {
 			syslog(LOG_ERR, "snipl_deactivate error : %d "
 			       "using %s\n", rc, simg->alias);
@@ -406,24 +1046,319 @@ lic_vps_reset_req2(struct snipl_image *simg, int request)
 	DEBUG_PRINT(_("Host %s lic_vps-reset %d request successful\n"),
 		simg->alias, request);
 
-logout:
-	if (server->problem_class == CERTIFICATE_ERROR)
-		message(&server->problem);
-	free(server->problem);
-	rc = snipl_logout(server);
-	if (rc) {
-		syslog(LOG_ERR, "snipl_logout error : %d using %s\n",
-		      rc, server->address);
-		message(&server->problem);
+	timeout = verify_timeout();
+	if (timeout && request != ST_POWERON)
+		return verify_fence(simg, request, timeout);
+	return S_OK;
+}
+
+
+/*
+ * race of a fence over the servers that define the image. The fence
+ * starts through the best server, a server with a warm session first.
+ * When it has not succeeded after the race delay, or has failed, it
+ * starts through the next server as well, and so on; the first success
+ * wins. A runner that is still running then is cancelled with
+ * snipl_cancel and ends in the background, its session stays taken until
+ * then. $SNIPL_RACE=<ms> sets the delay, 0 starts all at once. Without
+ * it the delay is the hedge percentile of the recent fences through the
+ * server (see SNIPL_HEDGE), RACE_DELAY while there are too few.
+ * Only a reset and a power off are raced, a second fence of the image is
+ * harmless. A power on is not: a second activate of an LPAR that is
+ * coming up is refused or disturbs it, so it goes through one server
+ * after the other, the next one only after a failure.
+ */
+#define RACE_ENV	"SNIPL_RACE"
+#define RACE_DELAY	1000	/* ms */
+
+struct race;
+
+struct runner {
+	struct race	*race;
+	struct snipl_image *simg;
+	int		warm;		/* the server had a session */
+	int		started;
+	int		holding;	/* the session of the server */
+	int		cut;
+	int		done;
+	int		rc;
+};
+
+struct race {
+	pthread_mutex_t	lock;		/* of the runners */
+	pthread_cond_t	cond;		/* a runner is done */
+	struct warm	*w;
+	int		request;
+	int		users;
+	int		nr_runners;
+	struct runner	runners[];
+};
+
+/*
+ * the time in ms after which the fence through the server of r is
+ * raced by the next one
+ */
+static long race_delay(struct runner *r)
+{
+	struct snipl_server *server = r->simg->server;
+	const char *env = getenv(RACE_ENV);
+	long delay, login;
+	char *end;
+	int op;
+
+	if (env && *env) {
+		delay = strtol(env, &end, 10);
+		if (!*end && delay >= 0 && delay <= 600000)
+			return delay;
+		syslog(LOG_WARNING, "%s=%s is invalid, ignored", RACE_ENV,
+		       env);
 	}
+	op = r->race->request == ST_GENERIC_RESET ? RESET : DEACTIVATE;
+	delay = snipl_hedge_delay(server, snipl_op_name(op));
+	if (delay >= 0 && !r->warm) {
+		login = snipl_hedge_delay(server, "login");
+		delay = login < 0 ? -1 : delay + login;
+	}
+	return delay < 0 ? RACE_DELAY : delay;
+}
 
-	return S_OK;
+static void race_release(struct race *race)
+{
+	int users;
+
+	pthread_mutex_lock(&race->lock);
+	users = --race->users;
+	pthread_mutex_unlock(&race->lock);
+	if (users)
+		return;
+	pthread_cond_destroy(&race->cond);
+	pthread_mutex_destroy(&race->lock);
+	free(race);
 }
 
+static int race_cut(struct runner *r)
+{
+	int cut;
+
+	pthread_mutex_lock(&r->race->lock);
+	cut = r->cut;
+	pthread_mutex_unlock(&r->race->lock);
+	return cut;
+}
 
 /*
- *	reset/activate/deactivate the given image on this Stonith device.
- *
+ * the fence through the server of one runner. If it fails on a warm
+ * session, the session may be stale and the server gets a new login.
+ */
+static void *race_run(void *arg)
+{
+	struct runner *r = arg;
+	struct race *race = r->race;
+	struct warm *w = race->w;
+	struct snipl_server *server = r->simg->server;
+	struct warm_server *ws = warm_find(w, server);
+	int keep = w->interval != 0;
+	int warm, rc = S_OOPS, kick = 0;
+
+	warm_take(w, &server, 1);
+	pthread_mutex_lock(&race->lock);
+	r->holding = 1;
+	pthread_mutex_unlock(&race->lock);
+	warm = keep && ws->connected && !ws->used;
+	while (!race_cut(r)) {
+		if (!warm) {
+			/* a session that took its request or failed */
+			warm_logout(ws);
+			if (snipl_connect(server)) {
+				if (server->problem_class == CERTIFICATE_ERROR)
+					syslog(LOG_ERR, "Certificate "
+					       "fingerprint mismatch.\n");
+				else
+					syslog(LOG_ERR, "snipl_login error "
+					       "using %s\n", server->address);
+				message(&server->problem);
+				break;
+			}
+			ws->connected = 1;
+			if (race_cut(r))
+				break;
+		}
+		rc = lic_vps_reset_req2(r->simg, race->request);
+		/* a SMAPI request server takes one request per login,
+		   VSMSERVE (type VM5) keeps its session */
+		ws->used = !strcasecmp(server->type, "VM");
+		if (!keep || rc != S_OK || ws->used) {
+			warm_logout(ws);
+			kick = keep;
+		}
+		if (!warm || rc == S_OK || rc == S_TIMEOUT)
+			break;
+		warm = 0;
+	}
+	if (!keep)
+		warm_logout(ws);
+	if (kick)
+		warm_kick(w);
+	pthread_mutex_lock(&race->lock);
+	if (r->cut && rc != S_OK)
+		syslog(LOG_INFO, "fence of %s through %s abandoned\n",
+		       r->simg->alias, server->address);
+	snipl_cancel_clear(server);
+	r->holding = 0;
+	r->rc = rc;
+	r->done = 1;
+	pthread_cond_signal(&race->cond);
+	pthread_mutex_unlock(&race->lock);
+	warm_give(w, &server, 1);
+	race_release(race);
+
+	pthread_mutex_lock(&w->lock);
+	if (!--w->racing)
+		pthread_cond_broadcast(&w->idle);
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* called with the race locked */
+static void race_start(struct runner *r)
+{
+	struct warm *w = r->race->w;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	r->started = 1;
+	r->race->users++;
+	pthread_mutex_lock(&w->lock);
+	w->racing++;
+	pthread_mutex_unlock(&w->lock);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, race_run, r)) {
+		syslog(LOG_ERR, "%s : cannot start runner", __func__);
+		r->done = 1;
+		r->rc = S_OOPS;
+		r->race->users--;
+		pthread_mutex_lock(&w->lock);
+		if (!--w->racing)
+			pthread_cond_broadcast(&w->idle);
+		pthread_mutex_unlock(&w->lock);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * a race over the n images, which are ordered: servers with a warm
+ * session first, best score first among them
+ */
+static struct race *race_new(struct warm *w, int request,
+			     struct snipl_image **simgs, int n)
+{
+	pthread_condattr_t attr;
+	struct race *race;
+	long score[n];
+	int warm[n], order[n];
+	int i, j, k;
+
+	race = calloc(1, sizeof(*race) + n * sizeof(race->runners[0]));
+	if (!race)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		warm[i] = warm_ready(w, simgs[i]->server);
+		score[i] = snipl_server_score(simgs[i]->server);
+		for (j = i; j > 0; j--) {
+			k = order[j - 1];
+			if (warm[k] > warm[i] ||
+			    (warm[k] == warm[i] && score[k] <= score[i]))
+				break;
+			order[j] = k;
+		}
+		order[j] = i;
+	}
+	for (i = 0; i < n; i++) {
+		race->runners[i].race = race;
+		race->runners[i].simg = simgs[order[i]];
+		race->runners[i].warm = warm[order[i]];
+	}
+	race->w = w;
+	race->request = request;
+	race->users = 1;
+	race->nr_runners = n;
+	pthread_mutex_init(&race->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&race->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return race;
+}
+
+/*
+ * run the race, returns S_OK if a runner succeeded, S_TIMEOUT if a fence
+ * was acknowledged but not confirmed, S_OOPS otherwise
+ */
+static int race_fence(struct race *race)
+{
+	struct timespec until;
+	struct runner *r;
+	int i, next = 0, running, late = 0, rc = S_OOPS;
+	int raced = race->request != ST_POWERON;
+	long delay;
+
+	pthread_mutex_lock(&race->lock);
+	for (;;) {
+		running = 0;
+		for (i = 0; i < next; i++) {
+			r = &race->runners[i];
+			if (r->done && r->rc == S_OK)
+				rc = S_OK;
+			else if (r->done && r->rc == S_TIMEOUT && rc != S_OK)
+				rc = S_TIMEOUT;
+			else if (!r->done)
+				running++;
+		}
+		if (rc == S_OK)
+			break;
+		if (next < race->nr_runners && (!running || late)) {
+			r = &race->runners[next++];
+			delay = raced ? race_delay(r) : 0;
+			DEBUG_PRINT("fence through %s, next after %ld ms\n",
+				    r->simg->server->address, delay);
+			race_start(r);
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_sec += delay / 1000;
+			until.tv_nsec += (delay % 1000) * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			late = 0;
+			continue;
+		}
+		if (!running)
+			break;
+		if (raced && next < race->nr_runners)
+			late = pthread_cond_timedwait(&race->cond, &race->lock,
+						      &until) == ETIMEDOUT;
+		else
+			pthread_cond_wait(&race->cond, &race->lock);
+	}
+	/* abandon the others */
+	for (i = 0; i < next; i++) {
+		r = &race->runners[i];
+		if (r->done)
+			continue;
+		r->cut = 1;
+		if (r->holding)
+			snipl_cancel(r->simg->server);
+	}
+	pthread_mutex_unlock(&race->lock);
+	return rc;
+}
+
+
+/*
+ *	reset/activate/deactivate the given image on this Stonith device,
+ *	raced over the servers that define it, a power on tried through
+ *	one after the other, see struct race.
  */
 static int
 lic_vps_reset_req(StonithPlugin *s, int request, const char* image_name)
@@ -432,7 +1367,10 @@ lic_vps_reset_req(StonithPlugin *s, int request, const char* image_name)
 	struct snipl_configuration *conf;
 	struct snipl_server *server = NULL;
 	struct snipl_image  *simg;
-	int rc = S_OK;
+	struct snipl_image  **simgs = NULL, **more;
+	struct race *race;
+	int rc;
+	int n = 0;
 
 	DEBUG_PRINT("lic_vps_reset_req: request = %d image = %s\n",
 		    request, image_name);
@@ -445,18 +1383,39 @@ lic_vps_reset_req(StonithPlugin *s, int request, const char* image_name)
 		      __func__);
 		return S_OOPS;
 	}
+	/* the sessions are kept from the first fence on */
+	if (request != ST_POWERON)
+		warm_start(vpsd->warm);
 
-	do {
-		// get snipl_server by image name:
-		simg = find_next_image(conf, image_name, NULL, server);
-		if (simg == NULL){
-			syslog(LOG_ERR, "no server for image %s found\n",
-			       image_name);
+	// get the snipl_servers by image name:
+	while ((simg = find_next_image(conf, image_name, NULL, server))) {
+		server = simg->server;
+		if (server->type == NULL) {
+			syslog(LOG_ERR, "No type specified for %s",
+			       server->address);
+			continue;
+		}
+		more = realloc(simgs, (n + 1) * sizeof(*simgs));
+		if (more == NULL) {
+			syslog(LOG_ERR, "%s : out of memory", __func__);
+			free(simgs);
 			return S_OOPS;
 		}
-		server = simg->server;
-		rc = lic_vps_reset_req2(simg, request);
-	} while (rc != S_OK);
+		simgs = more;
+		simgs[n++] = simg;
+	}
+	if (n == 0) {
+		syslog(LOG_ERR, "no server for image %s found\n", image_name);
+		return S_OOPS;
+	}
+	race = race_new(vpsd->warm, request, simgs, n);
+	free(simgs);
+	if (race == NULL) {
+		syslog(LOG_ERR, "%s : out of memory", __func__);
+		return S_OOPS;
+	}
+	rc = race_fence(race);
+	race_release(race);
 	return rc;
 }
 
@@ -531,6 +1490,12 @@ lic_vps_set_config(StonithPlugin* s, StonithNVpair *list)
 	}
 
 	vpsd->vpslist = conf;
+	vpsd->health = health_new(conf);
+	vpsd->warm = warm_new(conf);
+	if (vpsd->health == NULL || vpsd->warm == NULL) {
+		syslog(LOG_ERR, "%s : out of memory", __func__);
+		return S_OOPS;
+	}
 	// count the images and store result in vpsd
 	snipl_for_each_server(conf, serv) {
 		snipl_for_each_image(serv, image) {
@@ -652,13 +1617,21 @@ struct pluginDevice
 static void lic_vps_destroy(StonithPlugin *s)
 {
 	struct pluginDevice *vpsd = (struct pluginDevice *)s;
+	struct snipl_server *server;
 
 	DEBUG_PRINT("lic_vps : start of function\n");
 
 	VOIDERRIFWRONGDEV(s);
 
 	vpsd->pluginid = NOTpluginID;
+	health_free(vpsd->health);	/* stops the prober */
+	vpsd->health = NULL;
+	warm_free(vpsd->warm);		/* stops the refresher, logs out */
+	vpsd->warm = NULL;
+	snipl_state_flush();
 	if (vpsd->vpslist){
+		snipl_for_each_server(vpsd->vpslist, server)
+			snipl_results_free(server);	/* of verify_fence */
 		snipl_configuration_free(vpsd->vpslist);
 		vpsd->vpslist = NULL;
 	}
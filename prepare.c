@@ -17,6 +17,7 @@
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <malloc.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 #include <sys/types.h>
@@ -25,30 +26,67 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
 #include "snipl.h"
+#include "snmetrics.h"
 
 struct system_type_map {
 	char *type_name;
 	char *module_name;	/* for use with dlopen */
+	void (*prepare)(struct snipl_server *);	/* module entry point */
+	void *handle;		/* cached module handle (dynamic build) */
 };
-static struct system_type_map module_map[3] = {
+
+#ifdef SNIPL_STATIC
+/*
+ * all modules are linked into the program and register their
+ * entry points at compile time - no dlopen/dlsym is needed
+ */
+#ifdef VM_INCLUDED
+extern SNIPL_MODULE_PREPARE(vmsmapi);
+#endif
+#ifdef ZVM_INCLUDED
+extern SNIPL_MODULE_PREPARE(vmsmapi6);
+#endif
+#ifdef LPAR_INCLUDED
+extern SNIPL_MODULE_PREPARE(sniplapi);
+#endif
+
+static struct system_type_map module_map[] = {
+#ifdef VM_INCLUDED
+	{"VM5",		"libvmsmapi.so",	vmsmapi_prepare},
+#endif
+#ifdef ZVM_INCLUDED
+	{"VM",		"libvmsmapi6.so",	vmsmapi6_prepare},
+#endif
+#ifdef LPAR_INCLUDED
+	{"LPAR",	"libsniplapi.so",	sniplapi_prepare},
+#endif
+	{NULL,		NULL,			NULL}
+};
+#else
+static struct system_type_map module_map[] = {
 	{"VM5",		"libvmsmapi.so"},
 	{"VM",		"libvmsmapi6.so"},
-	{"LPAR",	"libsniplapi.so"}
+	{"LPAR",	"libsniplapi.so"},
+	{NULL,		NULL}
 };
+#endif
 
 /*
- *	return the modulename corresponding to system_type
+ *	return the module_map entry corresponding to system_type
  */
-static char *module_name(const char * system_type)
+static struct system_type_map *module_entry(const char *system_type)
 {
-	unsigned int x;
+	struct system_type_map *entry;
 
 	if (system_type) {
-		for (x = 0; x < DIMOF(module_map); ++x) {
-			if (strcasecmp(module_map[x].type_name, system_type) ==
-			    0)
-				return module_map[x].module_name;
+		for (entry = module_map; entry->type_name; ++entry) {
+			if (strcasecmp(entry->type_name, system_type) == 0)
+				return entry;
 		}
 	}
 	return NULL;
@@ -60,62 +98,881 @@ static char *module_name(const char * system_type)
  *
  *	purpose: load module defined in module_map
  *               corresponding to server type name
+ *               A module is loaded only once per process, the handle
+ *               and the resolved entry point are kept in module_map
+ *               and are shared by all servers of the same type.
  *
- *      returns _Bool : 1 if module was successful loaded
- *			0 in case of errors
+ *      returns the module_map entry if module was successful loaded
+ *		NULL in case of errors
  *	server->problem contains a detailed error-description
  */
-static _Bool snipl_load_module(struct snipl_server *server)
+static struct system_type_map *snipl_load_module(struct snipl_server *server)
 {
-	char *modulename;
+	struct system_type_map *entry;
+#ifndef SNIPL_STATIC
+	char *error;
+#endif
 
 	if (server == NULL)
-		return 0;
+		return NULL;
 
-	modulename = module_name(server->type);
-	if (modulename == NULL){
+	entry = module_entry(server->type);
+	if (entry == NULL) {
 		create_msg(server, "Modulename for type %s not found\n",
 			server->type);
 		server->problem_class = FATAL;
-		return 0;
+		return NULL;
 	}
-	if (server->module_handle) {
-		int rc = dlclose(server->module_handle);
-		if (rc) {
+#ifdef SNIPL_STATIC
+	/* the table is complete at compile time */
+	server->module_handle = NULL;
+#else
+	if (!entry->handle) {
+		entry->handle = dlopen(entry->module_name, RTLD_NOW);
+		/* (RTLD_NOW or RTLD_LAZY) [+ RTLD_GLOBAL] */
+		if (!entry->handle) {
 			create_msg(server, "Loading API module fails with %s\n",
 				dlerror());
 			server->problem_class = FATAL;
-			return 0;
-		} else server->module_handle = NULL;
+			return NULL;
+		}
+		dlerror();
+		entry->prepare = dlsym(entry->handle, "prepare");
+		error = dlerror();
+		if (error) {
+			create_msg(server, "Loading API module fails with %s\n",
+				error);
+			server->problem_class = FATAL;
+			dlclose(entry->handle);
+			entry->handle = NULL;
+			entry->prepare = NULL;
+			return NULL;
+		}
 	}
-	server->module_handle = dlopen(modulename, RTLD_NOW);
-	/* (RTLD_NOW or RTLD_LAZY) [+ RTLD_GLOBAL] */
-	if (!server->module_handle) {
-		create_msg(server, "Loading API module fails with %s\n",
-			dlerror());
-		server->problem_class = FATAL;
+	server->module_handle = entry->handle;
+#endif
+	return entry;
+}
+
+
+/* servers may be connected in parallel, see the race of lic_vps */
+static pthread_mutex_t module_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int snipl_prepare(struct snipl_server *server)
+{
+	struct system_type_map *entry;
+
+	pthread_mutex_lock(&module_lock);
+	entry = snipl_load_module(server);
+	pthread_mutex_unlock(&module_lock);
+	if (!entry)
+		return LIB_LOAD_PROBLEM;
+	entry->prepare(server);
+	return 0;
+}
+
+
+/*
+ *	function: snipl_release_modules
+ *
+ *	purpose: unload all modules loaded by snipl_prepare
+ *
+ *	returns 0 or the return code of the failing dlclose.
+ *	The error description is written to stderr.
+ */
+int snipl_release_modules(void)
+{
+	int ret = 0;
+#ifndef SNIPL_STATIC
+	struct system_type_map *entry;
+	int rc;
+
+	for (entry = module_map; entry->type_name; ++entry) {
+		if (!entry->handle)
+			continue;
+		rc = dlclose(entry->handle);
+		if (rc) {
+			fprintf(stderr, "%s\n", dlerror());
+			ret = rc;
+		}
+		entry->handle = NULL;
+		entry->prepare = NULL;
+	}
+#endif
+	return ret;
+}
+
+
+/*
+ * remembered protocol of VM servers: the socket based SMAPI request
+ * server (type VM) or the RPC based VSMSERVE server (type VM5), or none
+ * if neither answered. Until VMPROTO_FAIL_TTL is over, a connect to a
+ * server that answered neither fails at once instead of waiting for the
+ * timeouts of both again.
+ */
+#define VMPROTO_FACILITY	"vmproto"
+#define VMPROTO_TTL		3600	/* seconds a detected protocol is used */
+#define VMPROTO_FAIL_TTL	30	/* seconds a failed detection is used */
+#define VMPROTO_NONE		"none"
+
+struct vmproto {
+	char proto[8];		/* VM, VM5 or none */
+	long age;		/* seconds since the detection */
+	long skipped;		/* number of detections skipped */
+};
+
+static void vmproto_key(struct snipl_server *server, char *key, size_t len)
+{
+	snprintf(key, len, "%s:%d", server->address, server->port);
+}
+
+static void vmproto_parse(const char *value, struct vmproto *vp)
+{
+	memset(vp, 0, sizeof(*vp));
+	if (sscanf(value, "proto=%7s skipped=%ld", vp->proto,
+		   &vp->skipped) < 1)
+		vp->proto[0] = '\0';
+}
+
+static void vmproto_format(char *value, struct vmproto *vp)
+{
+	snprintf(value, SNIPL_STATE_VALUE_LEN, "proto=%s skipped=%ld",
+		 vp->proto, vp->skipped);
+}
+
+/* state update: record a detected protocol, keep the skip counter */
+static int vmproto_set(char *value, time_t *stamp, void *arg)
+{
+	struct vmproto vp;
+
+	vmproto_parse(value, &vp);
+	snprintf(vp.proto, sizeof(vp.proto), "%s", (const char *)arg);
+	vmproto_format(value, &vp);
+	*stamp = time(NULL);
+	return 1;
+}
+
+/* state update: count a skipped detection, keep the time stamp */
+static int vmproto_skip(char *value, time_t *stamp, void *arg)
+{
+	struct vmproto vp;
+
+	vmproto_parse(value, &vp);
+	if (!vp.proto[0])
+		return 0;
+	vp.skipped++;
+	vmproto_format(value, &vp);
+	return 1;
+}
+
+/*
+ * return the remembered protocol of server in vp,
+ * 0 if it is still valid, otherwise 1
+ */
+static int vmproto_lookup(struct snipl_server *server, struct vmproto *vp)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+	char value[SNIPL_STATE_VALUE_LEN];
+	time_t stamp, now = time(NULL);
+
+	vmproto_key(server, key, sizeof(key));
+	if (snipl_state_get(VMPROTO_FACILITY, key, value, &stamp))
+		return 1;
+	vmproto_parse(value, vp);
+	vp->age = now - stamp;
+	if (stamp > now)
+		return 1;
+	if (!strcmp(vp->proto, VMPROTO_NONE))
+		return vp->age >= VMPROTO_FAIL_TTL;
+	if (strcmp(vp->proto, "VM") && strcmp(vp->proto, "VM5"))
+		return 1;
+	return vp->age >= VMPROTO_TTL;
+}
+
+static void vmproto_record(struct snipl_server *server, const char *proto)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+
+	vmproto_key(server, key, sizeof(key));
+	snipl_state_update(VMPROTO_FACILITY, key, vmproto_set, (void *)proto);
+}
+
+/* the counter is written with the next flush of the state file */
+static void vmproto_count_skip(struct snipl_server *server)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+
+	vmproto_key(server, key, sizeof(key));
+	snipl_state_defer(VMPROTO_FACILITY, key, vmproto_skip, NULL, 0);
+}
+
+
+/*
+ * prepare, check and login with the current server type,
+ * *login_tried tells whether the login itself failed
+ */
+static int connect_type(struct snipl_server *server,
+			const struct snipl_parms *parms, int *login_tried)
+{
+	int rc;
+
+	*login_tried = 0;
+	rc = snipl_prepare(server);
+	if (rc)
+		return rc;
+	server->parms = *parms;
+	rc = snipl_prepare_check(server);
+	if (rc)
+		return rc;
+	*login_tried = 1;
+	return snipl_login(server);
+}
+
+
+/*
+ * circuit breaker per server endpoint: after some connects in a row
+ * failed, no connect is tried for a cool-down period and snipl fails
+ * immediately. When the period is over, one probe is let through. Its
+ * success closes the breaker, its failure opens it for another period.
+ * $SNIPL_BREAKER=<failures>[,<seconds>] changes the limits, 0 disables.
+ */
+#define BREAKER_FACILITY	"breaker"
+#define BREAKER_ENV		"SNIPL_BREAKER"
+#define BREAKER_FAILURES	3
+#define BREAKER_COOLDOWN	60	/* seconds */
+
+struct breaker {
+	int failures;		/* limit, then the connects in a row */
+	int cooldown;
+	long wait;		/* seconds until the next probe */
+	int open;
+};
+
+static void breaker_limits(struct breaker *br)
+{
+	const char *env = getenv(BREAKER_ENV);
+
+	br->failures = BREAKER_FAILURES;
+	br->cooldown = BREAKER_COOLDOWN;
+	if (env && sscanf(env, "%d,%d", &br->failures, &br->cooldown) < 1)
+		br->failures = BREAKER_FAILURES;
+	if (br->cooldown < 1)
+		br->cooldown = BREAKER_COOLDOWN;
+}
+
+/* state update: check the breaker and claim the probe if it is due */
+static int breaker_enter(char *value, time_t *stamp, void *arg)
+{
+	struct breaker *br = arg;
+	time_t now = time(NULL);
+	int failures = 0;
+
+	br->open = 0;
+	sscanf(value, "failures=%d", &failures);
+	if (failures < br->failures)
+		return 0;
+	br->failures = failures;
+	if (*stamp <= now && now - *stamp < br->cooldown) {
+		br->open = 1;
+		br->wait = br->cooldown - (now - *stamp);
 		return 0;
 	}
+	/* half-open: this connect is the probe, the others wait for it */
+	*stamp = now;
 	return 1;
 }
 
+/* state update: count a failed connect */
+static int breaker_fail(char *value, time_t *stamp, void *arg)
+{
+	int failures = 0;
 
-int snipl_prepare(struct snipl_server *server)
+	sscanf(value, "failures=%d", &failures);
+	snprintf(value, SNIPL_STATE_VALUE_LEN, "failures=%d", failures + 1);
+	*stamp = time(NULL);
+	return 1;
+}
+
+/* state update: close the breaker */
+static int breaker_close(char *value, time_t *stamp, void *arg)
 {
-	char* error;
-	void (*prep)(struct snipl_server *);
+	return -1;
+}
 
-	if (!snipl_load_module(server))
-		return LIB_LOAD_PROBLEM;
-	prep = dlsym(server->module_handle, "prepare");
-	error = dlerror();
-	if (error) {
-		create_msg(server, "Loading API module fails with %s\n", error);
+static void breaker_key(struct snipl_server *server, char *key, size_t len)
+{
+	snprintf(key, len, "%s:%d", server->address, server->port);
+}
+
+
+/*
+ * score per server endpoint: the average success rate and time of the
+ * recent logins. Servers that hold the same image are tried best score
+ * first, a record older than SCORE_TTL is forgotten so that a failed
+ * server gets another chance. The logins are queued and written to the
+ * state file together, see snipl_state_defer. $SNIPL_HEDGE=<percentile>
+ * sets when a request is hedged, see snipl_hedge_delay, 0 disables
+ * hedging.
+ */
+#define SCORE_FACILITY		"score"
+#define SCORE_TTL		600	/* seconds */
+#define SCORE_WEIGHT		4	/* a login counts 1/4 in the averages */
+#define HEDGE_ENV		"SNIPL_HEDGE"
+#define HEDGE_PERCENTILE	90
+#define HEDGE_MIN_SAMPLES	4	/* no hedging with less */
+
+struct score {
+	int known;
+	long ok;			/* success rate in per mille */
+	long latency;			/* average login time in ms */
+};
+
+struct score_login {
+	long msecs;
+	int ok;
+};
+
+static void score_parse(const char *value, struct score *sc)
+{
+	memset(sc, 0, sizeof(*sc));
+	sc->known = sscanf(value, "ok=%ld latency=%ld", &sc->ok,
+			   &sc->latency) == 2;
+}
+
+/* state update: add a login to the averages */
+static int score_record(char *value, time_t *stamp, void *arg)
+{
+	struct score_login *login = arg;
+	long ok = login->ok ? 1000 : 0;
+	struct score sc;
+
+	score_parse(value, &sc);
+	if (!sc.known || time(NULL) - *stamp >= SCORE_TTL) {
+		sc.ok = ok;
+		sc.latency = login->msecs;
+	} else {
+		sc.ok += (ok - sc.ok) / SCORE_WEIGHT;
+		sc.latency += (login->msecs - sc.latency) / SCORE_WEIGHT;
+	}
+	snprintf(value, SNIPL_STATE_VALUE_LEN, "ok=%ld latency=%ld",
+		 sc.ok, sc.latency);
+	*stamp = time(NULL);
+	return 1;
+}
+
+static void score_key(struct snipl_server *server, char *key, size_t len)
+{
+	snprintf(key, len, "%s:%d", server->address, server->port);
+}
+
+/* the recent score of server, 0 if it is unknown */
+static int score_lookup(struct snipl_server *server, struct score *sc)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+	char value[SNIPL_STATE_VALUE_LEN];
+	time_t stamp, now = time(NULL);
+
+	score_key(server, key, sizeof(key));
+	if (snipl_state_get(SCORE_FACILITY, key, value, &stamp))
+		return 0;
+	if (stamp > now || now - stamp >= SCORE_TTL)
+		return 0;
+	score_parse(value, sc);
+	return sc->known;
+}
+
+
+/*
+ * latency history per server endpoint and request type ("login" or the
+ * name of an image operation): the times of the last successful
+ * requests. Unless the user sets a timeout, a request of a known type
+ * gets LEARN_FACTOR times the 99th percentile of its history, at least
+ * LEARN_FLOOR and at most LEARN_CEILING. A hang is detected in seconds
+ * and a request that is always slow, like a load, keeps its time.
+ * The samples are queued, see snipl_state_defer, and a history is
+ * written once when the queue is flushed.
+ */
+#define LATENCY_FACILITY	"latency"
+#define LATENCY_TTL		86400	/* seconds */
+#define LATENCY_SAMPLES		16
+#define LEARN_MIN_SAMPLES	8	/* the default timeout with less */
+#define LEARN_PERCENTILE	99
+#define LEARN_FACTOR		4
+#define LEARN_FLOOR		5000	/* ms */
+#define LEARN_CEILING		600000	/* ms */
+
+struct latency {
+	long sample[LATENCY_SAMPLES];	/* latest first */
+	int nr_samples;
+};
+
+static void latency_parse(const char *value, struct latency *lat)
+{
+	const char *p;
+	int n;
+
+	lat->nr_samples = 0;
+	p = strstr(value, "last=");
+	if (!p)
+		return;
+	for (p += 5; lat->nr_samples < LATENCY_SAMPLES; p++) {
+		if (sscanf(p, "%ld%n", &lat->sample[lat->nr_samples], &n) < 1)
+			break;
+		lat->nr_samples++;
+		p += n;
+		if (*p != ',')
+			break;
+	}
+}
+
+/* state update: add the time of a successful request */
+static int latency_add(char *value, time_t *stamp, void *arg)
+{
+	struct latency lat;
+	int i, len;
+
+	latency_parse(value, &lat);
+	if (time(NULL) - *stamp >= LATENCY_TTL)
+		lat.nr_samples = 0;
+	memmove(&lat.sample[1], &lat.sample[0],
+		(LATENCY_SAMPLES - 1) * sizeof(lat.sample[0]));
+	lat.sample[0] = *(long *)arg;
+	if (lat.nr_samples < LATENCY_SAMPLES)
+		lat.nr_samples++;
+	len = snprintf(value, SNIPL_STATE_VALUE_LEN, "last=");
+	for (i = 0; i < lat.nr_samples; i++)
+		len += snprintf(value + len, SNIPL_STATE_VALUE_LEN - len,
+				"%s%ld", i ? "," : "", lat.sample[i]);
+	*stamp = time(NULL);
+	return 1;
+}
+
+static void latency_key(struct snipl_server *server, const char *what,
+			char *key, size_t len)
+{
+	snprintf(key, len, "%s:%d/%s", server->address, server->port, what);
+}
+
+/* the history of what on server, the number of samples */
+static int latency_lookup(struct snipl_server *server, const char *what,
+			  struct latency *lat)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+	char value[SNIPL_STATE_VALUE_LEN];
+	time_t stamp, now = time(NULL);
+
+	lat->nr_samples = 0;
+	latency_key(server, what, key, sizeof(key));
+	if (snipl_state_get(LATENCY_FACILITY, key, value, &stamp))
+		return 0;
+	if (stamp > now || now - stamp >= LATENCY_TTL)
+		return 0;
+	latency_parse(value, lat);
+	return lat->nr_samples;
+}
+
+static void latency_record(struct snipl_server *server, const char *what,
+			   long msecs)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+
+	latency_key(server, what, key, sizeof(key));
+	snipl_state_defer(LATENCY_FACILITY, key, latency_add, &msecs,
+			  sizeof(msecs));
+}
+
+static long latency_percentile(struct latency *lat, int percentile)
+{
+	long t;
+	int i, j;
+
+	for (i = 1; i < lat->nr_samples; i++)	/* sort ascending */
+		for (j = i; j > 0 && lat->sample[j - 1] > lat->sample[j];
+		     j--) {
+			t = lat->sample[j];
+			lat->sample[j] = lat->sample[j - 1];
+			lat->sample[j - 1] = t;
+		}
+	return lat->sample[(lat->nr_samples * percentile + 99) / 100 - 1];
+}
+
+
+/*
+ *	function: snipl_learned_timeout
+ *
+ *	purpose: return the timeout in milliseconds learned for requests
+ *		 of type what on server, 0 if the history is too short
+ */
+long snipl_learned_timeout(struct snipl_server *server, const char *what)
+{
+	struct latency lat;
+	long timeout;
+
+	if (latency_lookup(server, what, &lat) < LEARN_MIN_SAMPLES)
+		return 0;
+	timeout = latency_percentile(&lat, LEARN_PERCENTILE) * LEARN_FACTOR;
+	if (timeout < LEARN_FLOOR)
+		return LEARN_FLOOR;
+	return timeout > LEARN_CEILING ? LEARN_CEILING : timeout;
+}
+
+
+/*
+ *	function: snipl_learn_begin
+ *
+ *	purpose: start a request of type what on server. Its blocking calls
+ *		 get the learned timeout, unless the user set the timeout.
+ */
+void snipl_learn_begin(struct snipl_server *server, const char *what,
+		       struct snipl_learn *learn)
+{
+	learn->what = what;
+	learn->timeout = server->learned_timeout;
+	server->_api_rc = UNDEFINED;
+	clock_gettime(CLOCK_MONOTONIC, &learn->start);
+	if (!server->timeout_given)
+		server->learned_timeout = snipl_learned_timeout(server, what);
+}
+
+
+/*
+ *	function: snipl_learn_end
+ *
+ *	purpose: end the request started by snipl_learn_begin. Every
+ *		 request is counted in the metrics. The time of a
+ *		 successful request is added to the history, a failed
+ *		 one may have been cut short and proves nothing.
+ */
+void snipl_learn_end(struct snipl_server *server, struct snipl_learn *learn,
+		     int rc)
+{
+	struct timespec end;
+	long msecs;
+
+	server->learned_timeout = learn->timeout;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	msecs = (end.tv_sec - learn->start.tv_sec) * 1000 +
+		(end.tv_nsec - learn->start.tv_nsec) / 1000000;
+	snipl_metrics_record(server->type, server->address, server->port,
+			     learn->what, msecs, rc != 0,
+			     server->_api_rc == UNDEFINED ?
+			     SNIPL_METRICS_NO_RC : server->_api_rc);
+	if (rc)
+		return;
+	latency_record(server, learn->what, msecs);
+}
+
+
+/*
+ *	function: connect_detect
+ *
+ *	purpose: prepare, check and login to a server.
+ *		 The login to a type VM server is tried with the socket
+ *		 based SMAPI request server first and with the RPC based
+ *		 VSMSERVE server (type VM5) if it fails. The working
+ *		 protocol is remembered per address and port in the state
+ *		 file, so later calls go straight to the working module.
+ *		 When neither answers, later calls fail at once for
+ *		 VMPROTO_FAIL_TTL seconds.
+ *		 *tried tells whether a login was tried at all.
+ */
+static int connect_detect(struct snipl_server *server, int *tried)
+{
+	struct snipl_parms parms = server->parms;
+	struct vmproto vp;
+	int detect, cached, login_tried;
+	int rc;
+
+	detect = server->type && !strcasecmp(server->type, "VM");
+	cached = detect && !vmproto_lookup(server, &vp);
+	if (cached) {
+		vmproto_count_skip(server);
+		DEBUG_PRINT("%s: protocol %s remembered, %ld probes skipped\n",
+			    server->address, vp.proto, vp.skipped + 1);
+		if (!strcmp(vp.proto, VMPROTO_NONE)) {
+			*tried = 0;
+			create_msg(server, "Error: neither SMAPI nor VSMSERVE "
+				   "answered on VM server %s %ld seconds ago, "
+				   "next try in %ld seconds\n",
+				   server->address, vp.age,
+				   VMPROTO_FAIL_TTL - vp.age);
+			server->problem_class = FATAL;
+			return CONNECTION_ERROR;
+		}
+		if (!strcmp(vp.proto, "VM5"))
+			server->type = "VM5";
+	}
+
+	rc = connect_type(server, &parms, &login_tried);
+	*tried = login_tried;
+	if (!rc || !detect) {
+		if (!rc && detect && !cached)
+			vmproto_record(server, server->type);
+		return rc;
+	}
+	if (server->problem_class == CERTIFICATE_ERROR) {
+		/* the socket based server answered */
+		vmproto_record(server, "VM");
+		return rc;
+	}
+	if (!login_tried || snipl_time_left(server) <= 0)
+		return rc;
+
+	/* communication error (timeout), try the other interface */
+	snipl_logout(server);
+	server->type = strcasecmp(server->type, "VM") ? "VM" : "VM5";
+	rc = connect_type(server, &parms, &login_tried);
+	if (!rc) {
+		DEBUG_PRINT("%s is a %s server\n", server->address,
+			    strcasecmp(server->type, "VM") ?
+			    "VSMSERVE" : "socket-based");
+		vmproto_record(server, server->type);
+		return rc;
+	}
+	if (snipl_time_left(server) > 0)
+		vmproto_record(server, VMPROTO_NONE);
+	if (!login_tried && !strcmp(server->type, "VM5")) {
+		/* RPC interface not available */
+		server->type = "VM";
+		create_msg(server, "Error: login fails for VM server %s\n",
+			   server->address);
+	} else if (server->port == UNDEFINED)
+		create_msg(server, "Error: missing Port for VM server %s\n",
+			   server->address);
+	return rc;
+}
+
+/*
+ *	function: snipl_connect
+ *
+ *	purpose: connect to a server unless its circuit breaker is open.
+ *		 A failed login counts for the breaker, a certificate
+ *		 error does not because the server answered. Logins cut
+ *		 short by the deadline prove nothing either. The time and
+ *		 result of every other login are added to the score of
+ *		 the server, the login runs with the learned timeout.
+ *
+ *	returns 0 if the login was successful, otherwise the error code.
+ *	server->problem contains a detailed error-description, in case of
+ *	CERTIFICATE_ERROR the caller decides whether to continue.
+ */
+int snipl_connect(struct snipl_server *server)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+	struct snipl_learn learn;
+	struct score_login login;
+	struct timespec end;
+	struct breaker br;
+	int login_tried;
+	int rc;
+
+	breaker_limits(&br);
+	breaker_key(server, key, sizeof(key));
+	br.open = 0;
+	if (br.failures > 0)
+		snipl_state_update(BREAKER_FACILITY, key, breaker_enter, &br);
+	if (br.open) {
+		create_msg(server, "Error: connection to server %s failed %d "
+			   "times in a row, next try in %ld seconds\n",
+			   server->address, br.failures, br.wait);
 		server->problem_class = FATAL;
-		return LIB_LOAD_PROBLEM;
+		return CONNECTION_ERROR;
 	}
-	prep(server);
-	return 0;
+
+	snipl_learn_begin(server, "login", &learn);
+	rc = connect_detect(server, &login_tried);
+	snipl_learn_end(server, &learn, rc);
+	if (!login_tried || snipl_time_left(server) <= 0)
+		return rc;
+	login.ok = !rc || server->problem_class == CERTIFICATE_ERROR;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	login.msecs = (end.tv_sec - learn.start.tv_sec) * 1000 +
+		(end.tv_nsec - learn.start.tv_nsec) / 1000000;
+	/* written with the next flush, the lookups see it before */
+	score_key(server, key, sizeof(key));
+	snipl_state_defer(SCORE_FACILITY, key, score_record, &login,
+			  sizeof(login));
+
+	if (br.failures <= 0)
+		return rc;
+	breaker_key(server, key, sizeof(key));
+	if (login.ok)
+		snipl_state_update(BREAKER_FACILITY, key, breaker_close, NULL);
+	else
+		snipl_state_update(BREAKER_FACILITY, key, breaker_fail, NULL);
+	return rc;
+}
+
+
+/*
+ *	function: snipl_probe
+ *
+ *	purpose: check that a server is alive with the probe of its module,
+ *		 which needs no login: a connect to a SMAPI request server,
+ *		 the null procedure of VSMSERVE or one read of the HMC/SE.
+ *		 A VM server is probed with its remembered protocol. Without
+ *		 a probe, or when it fails, the server gets a full connect
+ *		 and logout, which also detects the protocol of a VM server
+ *		 and counts for the circuit breaker.
+ *
+ *	returns 0 if the server is alive, otherwise the error code
+ */
+int snipl_probe(struct snipl_server *server)
+{
+	struct snipl_learn learn;
+	struct vmproto vp;
+	int rc;
+
+	if (server->type && !strcasecmp(server->type, "VM") &&
+	    !vmproto_lookup(server, &vp) && !strcmp(vp.proto, "VM5"))
+		server->type = "VM5";
+	rc = snipl_prepare(server);
+	if (rc)
+		return rc;
+	if (server->ops->probe) {
+		rc = snipl_prepare_check(server);
+		if (rc)
+			return rc;
+		snipl_learn_begin(server, "probe", &learn);
+		rc = snipl_server_probe(server);
+		snipl_learn_end(server, &learn, rc);
+		snipl_logout(server);
+		if (!rc)
+			return 0;
+		/* the login tells why */
+		free(server->problem);
+		server->problem = NULL;
+		server->_problem_buf = NULL;
+	}
+	rc = snipl_connect(server);
+	if (!rc)
+		snipl_logout(server);
+	return rc;
+}
+
+
+/*
+ *	function: snipl_server_score
+ *
+ *	purpose: rate a server by its recent logins, the average login time
+ *		 divided by the success rate. Lower is better, a server
+ *		 without recent logins scores 0 and is tried first.
+ */
+long snipl_server_score(struct snipl_server *server)
+{
+	struct score sc;
+
+	if (!score_lookup(server, &sc))
+		return 0;
+	return (sc.latency + 1) * 1000 / (sc.ok < 10 ? 10 : sc.ok);
+}
+
+
+/*
+ *	function: snipl_hedge_delay
+ *
+ *	purpose: the time in ms after which a request of type what ("login",
+ *		 an operation name) to server is hedged, the configured
+ *		 percentile of its last successful requests of that type.
+ *
+ *	returns -1 for no hedging
+ */
+long snipl_hedge_delay(struct snipl_server *server, const char *what)
+{
+	const char *env = getenv(HEDGE_ENV);
+	int percentile = HEDGE_PERCENTILE;
+	struct latency lat;
+
+	if (env && sscanf(env, "%d", &percentile) < 1)
+		percentile = HEDGE_PERCENTILE;
+	if (percentile <= 0 || percentile > 100)
+		return -1;
+	if (latency_lookup(server, what, &lat) < HEDGE_MIN_SAMPLES)
+		return -1;
+	return latency_percentile(&lat, percentile);
+}
+
+
+/*
+ *	function: snipl_set_deadline
+ *
+ *	purpose: set the deadline of server to msecs from now
+ */
+void snipl_set_deadline(struct snipl_server *server, int msecs)
+{
+	clock_gettime(CLOCK_MONOTONIC, &server->deadline);
+	server->deadline.tv_sec += msecs / 1000;
+	server->deadline.tv_nsec += (msecs % 1000) * 1000000L;
+	if (server->deadline.tv_nsec >= 1000000000L) {
+		server->deadline.tv_sec++;
+		server->deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+
+/*
+ *	function: snipl_cancel
+ *
+ *	purpose: make the thread that uses server give up. The flag is the
+ *		 only part of a server that another thread may write: the
+ *		 deadline of server counts as over until the thread that
+ *		 owns it calls snipl_cancel_clear. A call that blocks in a
+ *		 wait of snipl returns within SNIPL_CANCEL_SLICE ms, a call
+ *		 into a library returns at its own timeout.
+ */
+void snipl_cancel(struct snipl_server *server)
+{
+	__atomic_store_n(&server->_cancel, 1, __ATOMIC_RELEASE);
+}
+
+
+void snipl_cancel_clear(struct snipl_server *server)
+{
+	__atomic_store_n(&server->_cancel, 0, __ATOMIC_RELEASE);
+}
+
+
+int snipl_cancelled(struct snipl_server *server)
+{
+	return __atomic_load_n(&server->_cancel, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ *	function: snipl_time_left
+ *
+ *	purpose: return the milliseconds left until the deadline of server,
+ *		 LONG_MAX if there is no deadline, 0 or less if it is over
+ *		 or server was cancelled
+ */
+long snipl_time_left(struct snipl_server *server)
+{
+	struct timespec now;
+
+	if (snipl_cancelled(server))
+		return 0;
+	if (!server->deadline.tv_sec)
+		return LONG_MAX;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (server->deadline.tv_sec - now.tv_sec) * 1000 +
+		(server->deadline.tv_nsec - now.tv_nsec) / 1000000;
+}
+
+
+/*
+ *	function: snipl_wait_time
+ *
+ *	purpose: limit the timeout (in milliseconds) of a blocking call to
+ *		 the time left until the deadline of server. The result is
+ *		 at least 1, because 0 means no timeout for some APIs.
+ */
+int snipl_wait_time(struct snipl_server *server, int timeout)
+{
+	long left = snipl_time_left(server);
+
+	if (left < 1)
+		return 1;
+	return left < timeout ? left : timeout;
 }
 
 
@@ -126,6 +983,7 @@ void create_msg(struct snipl_server *server, const char *fmt, ...)
 	va_list ap;
 	char *oldprob = server->problem;
 
+	server->_problem_buf = NULL;
 	p = calloc(1, size);
 	if (!p) {
 		server->problem = strdup("cannot allocate storage for message");
@@ -141,6 +999,8 @@ void create_msg(struct snipl_server *server, const char *fmt, ...)
 				memmove(&p[strlen(p)-6], "\n\0", 2);
 			}
 			server->problem = p;
+			server->_problem_buf = p;
+			server->_problem_len = strlen(p);
 			goto free_oldprob;
 		}
 		size = n + 1;
@@ -156,3 +1016,49 @@ free_oldprob:
 	free(oldprob);
 }
 
+
+/*
+ *	function: append_msg
+ *
+ *	purpose: append a message to server->problem.
+ *		 The buffer grows geometrically and the length of the
+ *		 message is remembered, so chaining many messages does
+ *		 not copy or scan the previous ones every time.
+ */
+void append_msg(struct snipl_server *server, const char *fmt, ...)
+{
+	size_t len, size;
+	char *p;
+	va_list ap;
+	int n;
+
+	p = server->problem;
+	size = p ? malloc_usable_size(p) : 0;
+	if (p && p == server->_problem_buf && server->_problem_len < size &&
+	    !p[server->_problem_len])
+		len = server->_problem_len;
+	else	/* message not set by create_msg/append_msg */
+		len = p ? strlen(p) : 0;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+
+	if (len + n + 1 > size) {
+		size = 2 * size > len + n + 1 ? 2 * size : len + n + 1;
+		if (size < 100)
+			size = 100;
+		p = realloc(server->problem, size);
+		if (!p)
+			return;	/* keep the previous message */
+	}
+	va_start(ap, fmt);
+	vsnprintf(p + len, n + 1, fmt, ap);
+	va_end(ap);
+
+	server->problem = p;
+	server->_problem_buf = p;
+	server->_problem_len = len + n;
+}
@@ -0,0 +1,428 @@
+/*
+   snasync.c - tracker of asynchronous operations of a server
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snasync is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   Some SMAPI functions return the ID of an asynchronous operation
+   instead of waiting until the work is done. The module that receives
+   such an ID starts tracking it with snipl_async_start, and the caller
+   reports the request as started. After all requests to the server are
+   sent, snipl_async_wait awaits the operations together: every
+   operation is queried on its own schedule, first after ASYNC_BACKOFF
+   and then with the interval doubled up to ASYNC_BACKOFF_MAX, and the
+   operation due next is queried first. So operations started in bulk
+   take as long as the slowest one, not as long as all of them.
+
+   A SMAPI request server needs a login for every query, so the queries
+   of a type VM server are sent by up to ASYNC_WORKERS workers at the
+   same time: the caller with the server itself and threads with a
+   login of their own to a copy of it. A worker that cannot log in
+   leaves the operations to the others. VSMSERVE keeps its session and
+   is queried by the caller alone.
+
+   Every operation that ends gets a result record of its own, which
+   covers the time from the start of the operation to the query that
+   saw it end. The messages of the operations are appended, so a server
+   without records still reports every operation, not only the last.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "snipl.h"
+
+#define ASYNC_BACKOFF		500	/* ms until the first query */
+#define ASYNC_BACKOFF_MAX	8000	/* ms between two queries at most */
+#define ASYNC_TIMEOUT		600000	/* ms, unless --timeout is given */
+#define ASYNC_WORKERS		4	/* queries at the same time */
+
+struct async_pool {
+	pthread_mutex_t lock;		/* of the operations of server */
+	pthread_cond_t cond;		/* an operation was queried */
+	struct snipl_server *server;
+	long limit;			/* ms an operation is awaited */
+	int ret;
+};
+
+struct async_worker {
+	struct async_pool *pool;
+	struct snipl_server *server;	/* the one of the pool or a copy */
+	pthread_t thread;
+	int used;			/* a query was sent since the login */
+};
+
+
+static long ts_msecs(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+
+static void ts_add_msecs(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+/*
+ *	function: snipl_async_start
+ *
+ *	purpose: track the asynchronous operation id that the server
+ *		 started for image. The operation is the one of the
+ *		 current record of the server, the record notes the ID.
+ *
+ *	returns 0 or STORAGE_PROBLEM
+ */
+int snipl_async_start(struct snipl_server *server, struct snipl_image *image,
+		      int id)
+{
+	struct snipl_async *async, **tail;
+
+	async = calloc(1, sizeof(*async));
+	if (!async)
+		return STORAGE_PROBLEM;
+	async->image = image;
+	async->op = server->_result ? server->_result->op : OPUNKNOWN;
+	async->id = id;
+	async->api_rc = UNDEFINED;
+	async->api_rs = UNDEFINED;
+	async->backoff = ASYNC_BACKOFF;
+	clock_gettime(CLOCK_REALTIME, &async->start);
+	clock_gettime(CLOCK_MONOTONIC, &async->next);
+	ts_add_msecs(&async->next, async->backoff);
+	if (server->_result)
+		server->_result->async_id = id;
+	for (tail = &server->_async; *tail; tail = &(*tail)->_next)
+		;
+	*tail = async;
+	return 0;
+}
+
+
+/*
+ * send one query for async through the server of worker w, with a copy
+ * of async for that server. SMAPI closes the connection after each
+ * request, so type VM needs a new login for every query but the first
+ * one of a copy, VSMSERVE keeps its session.
+ */
+static int async_query(struct async_worker *w, struct snipl_async *query)
+{
+	struct snipl_server *server = w->server;
+	struct snipl_image image = {
+		.name = query->image->name,
+		.alias = query->image->alias,
+		.server = server,
+	};
+	int rc = 0;
+
+	query->image = &image;
+	server->_busy = 0;
+	if (!strcasecmp(server->type, "VM") &&
+	    (w->used || server == w->pool->server))
+		rc = snipl_login(server);
+	w->used = 1;
+	if (!rc)
+		rc = snipl_query_async(server, query);
+	return rc;
+}
+
+
+/*
+ * complete the record of an operation that ended, failed or was given
+ * up with the return code rc of its last query
+ */
+static int async_end(struct snipl_server *server, struct snipl_async *async,
+		     int rc)
+{
+	struct snipl_result *res;
+	struct timespec now;
+	long ms;
+
+	res = snipl_result_begin(server, async->image, async->op);
+	if (res) {
+		res->start = async->start;
+		res->async_id = async->id;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	ms = ts_msecs(&async->start, &now);
+	if (res && !rc) {
+		/* a message of a query before is stale */
+		free(server->problem);
+		server->problem = NULL;
+	}
+	if (rc) {
+		append_msg(server, "%s: %s operation %d not confirmed after "
+			   "%ld ms\n", async->image->name,
+			   snipl_op_name(async->op), async->id, ms);
+		server->problem_class = FATAL;
+		if (snipl_time_left(server) <= 0)
+			rc = DEADLINE_EXCEEDED;
+	} else if (async->state == SNIPL_ASYNC_DONE) {
+		snipl_result_api(server, async->api_rc, async->api_rs);
+		/* without a record a failure before keeps its class */
+		if (res || !server->problem)
+			server->problem_class = OK;
+		append_msg(server, "%s: %s operation %d done after %ld ms, "
+			   "%d queries\n", async->image->name,
+			   snipl_op_name(async->op), async->id, ms,
+			   async->queries);
+	} else if (async->state == SNIPL_ASYNC_FAILED) {
+		snipl_result_api(server, async->api_rc, async->api_rs);
+		append_msg(server, "%s: %s operation %d failed after %ld ms, "
+			   "return code %d, reason code %d\n",
+			   async->image->name, snipl_op_name(async->op),
+			   async->id, ms, async->api_rc, async->api_rs);
+		server->problem_class = FATAL;
+		rc = CONNECTION_ERROR;
+	} else {
+		append_msg(server, "%s: %s operation %d not done after "
+			   "%ld ms\n", async->image->name, snipl_op_name(async->op),
+			   async->id, ms);
+		server->problem_class = FATAL;
+		rc = snipl_time_left(server) <= 0 ? DEADLINE_EXCEEDED :
+			STATE_NOT_REACHED;
+	}
+	snipl_result_end(server, rc);
+	return rc;
+}
+
+
+/*
+ * the operation due next that no worker queries, NULL if there is none
+ */
+static struct snipl_async *async_due(struct snipl_server *server)
+{
+	struct snipl_async *async, *due = NULL;
+
+	for (async = server->_async; async; async = async->_next)
+		if (!async->_taken &&
+		    (!due || ts_msecs(&async->next, &due->next) > 0))
+			due = async;
+	return due;
+}
+
+
+/*
+ * query the operations of the pool until all have ended. Called and
+ * returns with the pool locked.
+ */
+static void async_work(struct async_worker *w)
+{
+	struct async_pool *pool = w->pool;
+	struct snipl_server *server = pool->server;
+	struct snipl_async *async, query, **prev;
+	struct timespec now;
+	long wait, left;
+	int rc, busy;
+
+	while (server->_async) {
+		async = async_due(server);
+		if (!async) {
+			/* all are queried by others */
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = ts_msecs(&now, &async->next);
+		left = snipl_time_left(server);
+		if (wait > left)
+			wait = left;
+		if (wait > 0) {
+			ts_add_msecs(&now, wait);
+			pthread_cond_timedwait(&pool->cond, &pool->lock, &now);
+			continue;
+		}
+
+		async->_taken = 1;
+		query = *async;
+		pthread_mutex_unlock(&pool->lock);
+		rc = snipl_time_left(server) > 0 ? async_query(w, &query) : 0;
+		busy = w->server->_busy;
+		pthread_mutex_lock(&pool->lock);
+		async->_taken = 0;
+		async->state = query.state;
+		async->api_rc = query.api_rc;
+		async->api_rs = query.api_rs;
+		async->queries++;
+		pthread_cond_broadcast(&pool->cond);
+
+		if (rc && busy && snipl_time_left(server) > 0)
+			rc = 0;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (!rc && async->state == SNIPL_ASYNC_RUNNING &&
+		    snipl_time_left(server) > 0 &&
+		    ts_msecs(&async->start, &now) < pool->limit) {
+			free(w->server->problem);
+			w->server->problem = NULL;
+			async->backoff *= 2;
+			if (async->backoff > ASYNC_BACKOFF_MAX)
+				async->backoff = ASYNC_BACKOFF_MAX;
+			clock_gettime(CLOCK_MONOTONIC, &async->next);
+			ts_add_msecs(&async->next, async->backoff);
+			continue;
+		}
+
+		/* the message of a failed query of a copy */
+		if (rc && w->server != server && w->server->problem) {
+			append_msg(server, "%s", w->server->problem);
+			free(w->server->problem);
+			w->server->problem = NULL;
+		}
+		rc = async_end(server, async, rc);
+		if (rc)
+			pool->ret = rc;
+		for (prev = &server->_async; *prev != async;
+		     prev = &(*prev)->_next)
+			;
+		*prev = async->_next;
+		free(async);
+	}
+}
+
+
+/*
+ * a worker with a copy of the server of the pool, the copy logs in
+ * before its first query
+ */
+static void *async_thread(void *arg)
+{
+	struct async_worker *w = arg;
+	struct async_pool *pool = w->pool;
+
+	if (snipl_connect(w->server)) {
+		free(w->server->problem);
+		w->server->problem = NULL;
+		return NULL;
+	}
+	pthread_mutex_lock(&pool->lock);
+	async_work(w);
+	pthread_mutex_unlock(&pool->lock);
+	snipl_logout(w->server);
+	free(w->server->problem);
+	w->server->problem = NULL;
+	return NULL;
+}
+
+
+/*
+ * a copy of the access data of server, without its images, for a worker
+ */
+static struct snipl_server *async_clone(struct snipl_server *server)
+{
+	struct snipl_server *clone;
+
+	clone = calloc(1, sizeof(*clone));
+	if (!clone)
+		return NULL;
+	*clone = (struct snipl_server) {
+		.address = server->address,
+		.type = server->type,
+		.user = server->user,
+		.password = server->password,
+		.sslfingerprint = server->sslfingerprint,
+		.port = server->port,
+		.enc = server->enc,
+		.timeout = server->timeout,
+		.timeout_given = server->timeout_given,
+		.parms = server->parms,
+		.deadline = server->deadline,
+	};
+	return clone;
+}
+
+
+/*
+ *	function: snipl_async_wait
+ *
+ *	purpose: query the outstanding asynchronous operations of server
+ *		 until every one has ended, and complete a result record
+ *		 for each. A query that meets a busy server is sent again
+ *		 later, other failed queries give up the operation. An
+ *		 operation is given up after ASYNC_TIMEOUT or the timeout
+ *		 of the user, and when the deadline is exceeded. The
+ *		 queries of a SMAPI request server are sent by up to
+ *		 ASYNC_WORKERS workers at the same time.
+ *
+ *	returns 0 or the return code of the last operation that failed
+ */
+int snipl_async_wait(struct snipl_server *server)
+{
+	struct async_worker worker[ASYNC_WORKERS];
+	struct async_pool pool;
+	struct snipl_async *async;
+	pthread_condattr_t attr;
+	int i, n;
+
+	if (!server->_async)
+		return 0;
+	memset(&pool, 0, sizeof(pool));
+	pool.server = server;
+	pool.limit = server->timeout_given ? server->timeout : ASYNC_TIMEOUT;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	memset(worker, 0, sizeof(worker));
+	worker[0].pool = &pool;
+	worker[0].server = server;
+	n = 1;
+	if (!strcasecmp(server->type, "VM"))
+		for (async = server->_async->_next;
+		     async && n < ASYNC_WORKERS; async = async->_next) {
+			worker[n].pool = &pool;
+			worker[n].server = async_clone(server);
+			if (!worker[n].server)
+				break;
+			if (pthread_create(&worker[n].thread, NULL,
+					   async_thread, &worker[n])) {
+				free(worker[n].server);
+				break;
+			}
+			n++;
+		}
+
+	pthread_mutex_lock(&pool.lock);
+	async_work(&worker[0]);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 1; i < n; i++) {
+		pthread_join(worker[i].thread, NULL);
+		free(worker[i].server);
+	}
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	return pool.ret;
+}
+
+
+/*
+ * stop tracking the operations of server without waiting for them
+ */
+void snipl_async_free(struct snipl_server *server)
+{
+	struct snipl_async *async;
+
+	while ((async = server->_async)) {
+		server->_async = async->_next;
+		free(async);
+	}
+}
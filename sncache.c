@@ -0,0 +1,437 @@
+/*
+   sncache.c - status cache in shared memory, shared by snipl processes
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   sncache is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   The cache is a file in /dev/shm ($SNIPL_STATUS_CACHE) mapped by every
+   process that uses it. It holds a fixed table of slots, one per server
+   and image, with the state, the status bits and the return codes of the
+   last getstatus and the time it was read. A key is kept in one of the
+   CACHE_PROBE slots following its hash.
+
+   Every slot is a seqlock: a writer makes the sequence number odd while
+   it changes the slot and even again when it is done, a reader copies
+   the slot and retries if the sequence number was odd or has changed.
+   Readers never wait, a writer retries the lock CACHE_LOCKS times.
+
+   A status is stamped with the time its request started, and a slot is
+   only overwritten by a newer status. An operation that changes the
+   state of an image does not free its slot but writes a tombstone
+   stamped with the time it ended: the status of all requests that
+   started before is refused, so a getstatus that overlapped the
+   operation cannot bring back the old state. A getstatus may skip its
+   update when its slot stays busy, an invalidation may not: it writes
+   its tombstone into another slot of the key then, the newest slot of a
+   key is the one that counts.
+
+   The file is created by a process that reads the cache (--status-cache),
+   every other process only updates an existing cache.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stdio.h>
+#include <sched.h>
+#include "snipl.h"
+
+#define SNIPL_CACHE_ENV		"SNIPL_STATUS_CACHE"
+#define SNIPL_CACHE_FILE	"/dev/shm/snipl-status"
+
+#define CACHE_MAGIC	0x534e4332	/* "SNC2", new for a new layout */
+#define CACHE_SLOTS	1024
+#define CACHE_PROBE	8		/* slots a key may be kept in */
+#define CACHE_READS	16		/* tries of a reader */
+#define CACHE_LOCKS	1000		/* tries of a writer */
+#define CACHE_KEY_LEN	128
+
+#define CACHE_TOMBSTONE	1		/* flags: the status is unknown */
+
+struct cache_slot {
+	uint32_t seq;			/* odd while the slot is written */
+	int32_t  state;			/* enum snipl_image_state */
+	int32_t  rc;
+	int32_t  api_rc;
+	int32_t  api_rs;
+	uint32_t flags;			/* CACHE_TOMBSTONE */
+	int64_t  stamp;			/* 0 = slot is free */
+	uint64_t status;
+	char     key[CACHE_KEY_LEN];
+};
+
+struct cache_head {
+	uint32_t magic;
+	uint32_t slots;
+	struct cache_slot slot[];
+};
+
+#define CACHE_SIZE (sizeof(struct cache_head) + \
+		    CACHE_SLOTS * sizeof(struct cache_slot))
+
+static struct cache_head *cache;
+static int cache_tried;			/* opened without creating it */
+
+
+/*
+ * map the cache file, create it if create is set
+ * returns the cache or NULL if there is none
+ */
+static struct cache_head *cache_map(int create)
+{
+	struct cache_head *head;
+	struct stat statbuf;
+	const char *name;
+	int fd;
+
+	if (cache)
+		return cache;
+	if (!create && cache_tried)
+		return NULL;
+	cache_tried = 1;
+
+	name = getenv(SNIPL_CACHE_ENV);
+	if (!name)
+		name = SNIPL_CACHE_FILE;
+	if (!*name)
+		return NULL;
+	fd = open(name, O_RDWR | (create ? O_CREAT : 0), 0600);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &statbuf) == -1 ||
+	    ((size_t)statbuf.st_size < CACHE_SIZE &&
+	     (!create || ftruncate(fd, CACHE_SIZE) == -1))) {
+		close(fd);
+		return NULL;
+	}
+	head = mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	close(fd);
+	if (head == MAP_FAILED)
+		return NULL;
+	if (!__atomic_load_n(&head->magic, __ATOMIC_ACQUIRE)) {
+		head->slots = CACHE_SLOTS;
+		__sync_bool_compare_and_swap(&head->magic, 0, CACHE_MAGIC);
+	}
+	if (head->magic != CACHE_MAGIC || head->slots != CACHE_SLOTS) {
+		munmap(head, CACHE_SIZE);
+		return NULL;
+	}
+	/* another thread may have mapped it in the meantime */
+	if (!__sync_bool_compare_and_swap(&cache, NULL, head))
+		munmap(head, CACHE_SIZE);
+	return cache;
+}
+
+
+static void cache_key(struct snipl_server *server, const char *image,
+		      char *key)
+{
+	char *c;
+
+	snprintf(key, CACHE_KEY_LEN, "%s:%s:%d/%s", server->type,
+		 server->address, server->port, image);
+	/* VM image names keep a - as newline until the login */
+	for (c = key; *c; c++)
+		if (*c == '\n')
+			*c = '-';
+}
+
+
+/* FNV-1a */
+static unsigned int cache_hash(const char *key)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; *key; key++)
+		hash = (hash ^ (unsigned char)*key) * 16777619u;
+	return hash;
+}
+
+
+/*
+ * copy slot to copy, returns 0 or -1 if it is written all the time
+ */
+static int slot_read(struct cache_slot *slot, struct cache_slot *copy)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < CACHE_READS; i++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			copy->key[CACHE_KEY_LEN - 1] = '\0';
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * start writing slot, returns the sequence number to pass to slot_unlock
+ * or 0 if another writer is still busy with it after CACHE_LOCKS tries
+ */
+static uint32_t slot_lock(struct cache_slot *slot)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < CACHE_LOCKS; i++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		if (!(seq & 1) &&
+		    __sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+			return seq + 1;
+		sched_yield();
+	}
+	return 0;
+}
+
+
+static void slot_unlock(struct cache_slot *slot, uint32_t seq)
+{
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * check if slot holds a status of key that must not be replaced by
+ * entry: a newer one, or a tombstone that is not older. A tombstone
+ * replaces a status of the same second.
+ */
+static int slot_newer(const struct cache_slot *slot, const char *key,
+		      const struct snipl_cache_entry *entry, uint32_t flags)
+{
+	if (!slot->stamp || strcmp(slot->key, key))
+		return 0;
+	if (slot->stamp > entry->stamp)
+		return 1;
+	return slot->stamp == entry->stamp &&
+		(slot->flags & CACHE_TOMBSTONE) && !(flags & CACHE_TOMBSTONE);
+}
+
+
+static void slot_write(struct cache_slot *slot, const char *key,
+		       const struct snipl_cache_entry *entry, uint32_t flags)
+{
+	slot->state = entry->state;
+	slot->rc = entry->rc;
+	slot->api_rc = entry->api_rc;
+	slot->api_rs = entry->api_rs;
+	slot->status = entry->status;
+	slot->stamp = entry->stamp;
+	slot->flags = flags;
+	snprintf(slot->key, CACHE_KEY_LEN, "%s", key);
+}
+
+
+/*
+ * write the entry of key to its slot: the slot that holds key already,
+ * a free slot or the oldest one. Nothing is written if the cache has a
+ * newer status of key or a tombstone that is not older.
+ * returns 0, or -1 if the slot stayed busy
+ */
+static int cache_put(struct cache_head *head, const char *key,
+		     const struct snipl_cache_entry *entry, uint32_t flags)
+{
+	struct cache_slot *slot, *match = NULL, *victim = NULL;
+	struct cache_slot copy;
+	unsigned int hash = cache_hash(key);
+	int64_t oldest = INT64_MAX;
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < CACHE_PROBE; i++) {
+		slot = &head->slot[(hash + i) % CACHE_SLOTS];
+		if (slot_read(slot, &copy))
+			continue;
+		if (slot_newer(&copy, key, entry, flags))
+			return 0;
+		if (copy.stamp && !strcmp(copy.key, key)) {
+			if (!match)
+				match = slot;
+			continue;
+		}
+		if (copy.stamp < oldest) {
+			oldest = copy.stamp;
+			victim = slot;
+		}
+	}
+	if (match)
+		victim = match;
+	if (!victim)
+		return -1;
+	seq = slot_lock(victim);
+	if (!seq)
+		return -1;
+	/* it may have changed since it was read */
+	if (!slot_newer(victim, key, entry, flags))
+		slot_write(victim, key, entry, flags);
+	slot_unlock(victim, seq);
+	return 0;
+}
+
+
+/*
+ * mark the status of key as unknown with a tombstone stamped now. It
+ * must not get lost: if the slot of key stays busy, the tombstone goes
+ * to another slot of the key, where it wins by its stamp.
+ */
+static void cache_invalidate(struct cache_head *head, const char *key)
+{
+	struct snipl_cache_entry tomb = {
+		.state = SNIPL_IMAGE_UNKNOWN,
+		.api_rc = UNDEFINED,
+		.api_rs = UNDEFINED,
+		.stamp = time(NULL),
+	};
+	struct cache_slot *slot;
+	unsigned int hash = cache_hash(key);
+	uint32_t seq;
+	int i;
+
+	if (!cache_put(head, key, &tomb, CACHE_TOMBSTONE))
+		return;
+	for (i = 0; i < CACHE_PROBE; i++) {
+		slot = &head->slot[(hash + i) % CACHE_SLOTS];
+		seq = slot_lock(slot);
+		if (!seq)
+			continue;
+		if (!slot_newer(slot, key, &tomb, CACHE_TOMBSTONE))
+			slot_write(slot, key, &tomb, CACHE_TOMBSTONE);
+		slot_unlock(slot, seq);
+		return;
+	}
+}
+
+
+/*
+ *	function: snipl_cache_get
+ *
+ *	purpose: look up the status of image of server that was read at
+ *		 most ttl seconds ago. The cache is created if there is
+ *		 none yet.
+ *
+ *	returns 0 and the status in entry, or 1 if there is none
+ */
+int snipl_cache_get(struct snipl_server *server, const char *image, int ttl,
+		    struct snipl_cache_entry *entry)
+{
+	struct cache_head *head = cache_map(1);
+	struct cache_slot *slot;
+	struct cache_slot copy;
+	char key[CACHE_KEY_LEN];
+	unsigned int hash;
+	time_t now = time(NULL);
+	int i, found = 0, tomb = 0;
+
+	if (!head)
+		return 1;
+	cache_key(server, image, key);
+	hash = cache_hash(key);
+	for (i = 0; i < CACHE_PROBE; i++) {
+		slot = &head->slot[(hash + i) % CACHE_SLOTS];
+		if (slot_read(slot, &copy) || !copy.stamp ||
+		    strcmp(copy.key, key))
+			continue;
+		/*
+		 * two writers may have used two slots, take the newer one,
+		 * a tombstone of the same second wins
+		 */
+		if (found && (copy.stamp < entry->stamp ||
+			      (copy.stamp == entry->stamp &&
+			       !(copy.flags & CACHE_TOMBSTONE))))
+			continue;
+		tomb = copy.flags & CACHE_TOMBSTONE;
+		entry->state = copy.state;
+		entry->rc = copy.rc;
+		entry->api_rc = copy.api_rc;
+		entry->api_rs = copy.api_rs;
+		entry->status = copy.status;
+		entry->stamp = copy.stamp;
+		found = 1;
+	}
+	if (!found || tomb || entry->stamp > now || now - entry->stamp > ttl)
+		return 1;
+	return 0;
+}
+
+
+/*
+ *	function: snipl_cache_put
+ *
+ *	purpose: keep the status entry of image of server that was not read
+ *		 by a getstatus of its own, e.g. from a query of all active
+ *		 images. Like a getstatus it is only kept if there is a
+ *		 cache.
+ */
+void snipl_cache_put(struct snipl_server *server, const char *image,
+		     const struct snipl_cache_entry *entry)
+{
+	struct cache_head *head;
+	char key[CACHE_KEY_LEN];
+
+	head = cache_map(0);
+	if (!head)
+		return;
+	cache_key(server, image, key);
+	cache_put(head, key, entry, 0);
+}
+
+
+/*
+ *	function: snipl_cache_record
+ *
+ *	purpose: update the cache, if there is one, with the completed
+ *		 record res of server. A status read is kept, stamped with
+ *		 the start of its request, every operation that changes
+ *		 the state of the image replaces its status by a tombstone.
+ */
+void snipl_cache_record(struct snipl_server *server,
+			const struct snipl_result *res)
+{
+	struct snipl_cache_entry entry;
+	struct cache_head *head;
+	char key[CACHE_KEY_LEN];
+
+	if (!res->image || res->cached || res->op == LIST ||
+	    res->op == DIALOG)
+		return;
+	if (res->op == GETSTATUS && res->state == SNIPL_IMAGE_UNKNOWN)
+		return;
+	head = cache_map(0);
+	if (!head)
+		return;
+	cache_key(server, res->image->name, key);
+	if (res->op != GETSTATUS) {
+		cache_invalidate(head, key);
+		return;
+	}
+	entry = (struct snipl_cache_entry) {
+		.state = res->state,
+		.rc = res->rc,
+		.api_rc = res->api_rc,
+		.api_rs = res->api_rs,
+		.status = res->status,
+		.stamp = res->start.tv_sec,
+	};
+	cache_put(head, key, &entry, 0);
+}
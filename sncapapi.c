@@ -8,8 +8,10 @@
  *   ("agreement"). Any use, reproduction or distribution of the program
  *   constitutes recipient's acceptance of this agreement.
  */
+#include <time.h>
 #include "sncapapi.h"
 #include "sncapjob.h"
+#include "snmetrics.h"
 
 static const char *cpu_type[5] = {
 	[CPU_TYPE_ICF] "ICF",
@@ -19,6 +21,24 @@ static const char *cpu_type[5] = {
 	[CPU_TYPE_ZIIP] "IIP"
 };
 
+/*
+ *	function: api_record
+ *
+ *	purpose: count an HWMCAAPI request of type op that started at start
+ *		 in the operation metrics shared with snipl.
+ */
+static void api_record(struct sncap_api *api, const char *op,
+		       const struct timespec *start, int failed)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	snipl_metrics_record("LPAR", api->server, 0, op,
+			     (end.tv_sec - start->tv_sec) * 1000 +
+			     (end.tv_nsec - start->tv_nsec) / 1000000,
+			     failed, (int)api->ret);
+}
+
 /*
  *	function: call_HwmcaGet
  *
@@ -32,6 +52,7 @@ int call_HwmcaGet(struct sncap_api *api,
 	ULONG bytes_needed = 0ul;
 	char *data_buffer = NULL;
 	ULONG buffer_size = 0ul;
+	struct timespec start;
 
 	data_buffer = calloc(sizeof(HWMCA_DATATYPE_T) + 4096,
 				sizeof(*data_buffer));
@@ -40,12 +61,15 @@ int call_HwmcaGet(struct sncap_api *api,
 	buffer_size = sizeof(HWMCA_DATATYPE_T) + 4096;
 
 	do {
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		api->ret = HwmcaGet(&api->session,
 				snmp_object,
 				data_buffer,
 				buffer_size,
 				&bytes_needed,
 				api->timeout);
+		api_record(api, "get", &start,
+			   api->ret != HWMCA_DE_NO_ERROR);
 
 		if (api->ret != HWMCA_DE_NO_ERROR) {
 			ret = sncap_print_api_message(api->verbose, api->server,
@@ -206,6 +230,7 @@ int call_HwmcaCommand(struct sncap_api *api,
 	int correlator = 0;
 	long ltime = 0l;
 	int stime = 0;
+	struct timespec start;
 
 	assert(api);
 	assert(command);
@@ -226,6 +251,7 @@ int call_HwmcaCommand(struct sncap_api *api,
 	correlator = rand() + pid;
 
 	APIDEBUG("Sending the command to server '%s'.\n", api->server);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	api->ret = HwmcaCorrelatedCommand(&api->session,
 				cpc_snmp_id,
 				command,
@@ -247,6 +273,7 @@ int call_HwmcaCommand(struct sncap_api *api,
 
 	APIDEBUG("The command response event has been processed.\n");
 cleanup:
+	api_record(api, "command", &start, ret != 0);
 	return ret;
 }
 
@@ -846,6 +873,7 @@ int sncap_connect(struct sncap_connection *connection,
 	int ret = SNCAP_OK;
 	HWMCA_SNMP_TARGET_T *snmp_target = NULL;
 	int id_item_len;
+	struct timespec start;
 
 	APIDEBUGV("sncap_connect: function entered to connect to server.\n");
 	APIDEBUGV("Specified parameters:\nRunning in Verbose mode;\n");
@@ -899,7 +927,10 @@ int sncap_connect(struct sncap_connection *connection,
 	APIDEBUGV("sncap_connect: creating the connection to %s ...\n",
 		(*api)->server);
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	(*api)->ret = HwmcaInitialize(&(*api)->session, (*api)->timeout);
+	api_record(*api, "login", &start,
+		   (*api)->ret != HWMCA_DE_NO_ERROR);
 	if ((*api)->ret != HWMCA_DE_NO_ERROR) {
 		ret = sncap_print_api_message((*api)->verbose,
 					      snmp_target->pHost, (*api)->ret);
@@ -43,6 +43,7 @@ enum conf_key {
 	CPCID,
 	ENCRYPTION,
 	SSLFINGERPRINT,
+	SSI,
 	/* special keys */
 	UNKNOWN, /* number of valid words */
 	NR_KEYWORDS = UNKNOWN,
@@ -57,7 +58,8 @@ static const char *conf_keywords[NR_KEYWORDS] = {
 	[IMAGE]		"image",
 	[CPCID]		"cpcid",
 	[ENCRYPTION]	"encryption",
-	[SSLFINGERPRINT] "sslfingerprint"
+	[SSLFINGERPRINT] "sslfingerprint",
+	[SSI]		"ssi",
 };
 
 
@@ -349,6 +351,14 @@ conf_set_attribute(struct snipl_configuration *conf, enum conf_key key,
 	case SSLFINGERPRINT:
 		oldval = &serv->sslfingerprint;
 		break;
+	case SSI:
+		oldval = &serv->ssi;
+		if (!isID(val)) {
+			set_cfg_error(conf, "non-proper SSI cluster name",
+				      FATAL, 1);
+			return FATAL;
+		}
+		break;
 	default:
 		set_cfg_error(conf, "unknown key for conf_set_attribute", FATAL,
 			      1);
@@ -0,0 +1,333 @@
+/*
+   sndaemon.c - protocol between snipl and the snipld daemon
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   sndaemon is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   snipld keeps the logins to the servers of its configuration file and
+   performs image operations for its clients over a UNIX socket
+   ($SNIPLD_SOCKET or /run/snipld.sock). A client sends one line per
+   request:
+
+	<op> <type> <address> <user> <image> <force> <shutdown> <profile>
+
+   user and profile are - if not given, force is 1, 0 or -1 (undefined).
+   The answer is a line
+
+	ok <rc> <api_rc> <api_rs> <severity> <state> <status> <login_ms>
+	   <bits> <length>
+
+   followed by length bytes of the message of the operation, or a line
+   "no <reason>" if snipld does not serve the request. bits are the
+   status bits that are set with their names, bit:name,... or -.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include "snipl.h"
+
+#define SNIPLD_SOCKET_ENV	"SNIPLD_SOCKET"
+#define SNIPLD_SOCKET		"/run/snipld.sock"
+
+#define SNIPLD_BITS		64	/* bits of an unsigned long */
+
+struct snipld_conn {
+	int   fd;
+	FILE *in;
+};
+
+/*
+ * the status bit names received so far, for the result records. The
+ * names of a bit never change, so the table only grows.
+ */
+static struct snipl_status_bit received_bits[SNIPLD_BITS + 1];
+
+
+/*
+ *	function: snipld_socket_name
+ *
+ *	purpose: return the name of the socket of snipld, NULL if the
+ *		 daemon is disabled (SNIPLD_SOCKET set to an empty string)
+ */
+const char *snipld_socket_name(void)
+{
+	const char *env = getenv(SNIPLD_SOCKET_ENV);
+
+	if (env)
+		return *env ? env : NULL;
+	return SNIPLD_SOCKET;
+}
+
+
+/*
+ *	function: snipld_open
+ *
+ *	purpose: connect to snipld
+ *
+ *	returns the connection or NULL if snipld does not run
+ */
+struct snipld_conn *snipld_open(void)
+{
+	const char *name = snipld_socket_name();
+	struct sockaddr_un addr;
+	struct snipld_conn *conn;
+
+	if (!name || strlen(name) >= sizeof(addr.sun_path))
+		return NULL;
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, name);
+	conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn->fd == -1)
+		goto fail;
+	if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		goto fail_close;
+	conn->in = fdopen(conn->fd, "r");
+	if (conn->in)
+		return conn;
+fail_close:
+	close(conn->fd);
+fail:
+	free(conn);
+	return NULL;
+}
+
+
+void snipld_close(struct snipld_conn *conn)
+{
+	if (!conn)
+		return;
+	fclose(conn->in);
+	free(conn);
+}
+
+
+static const struct snipl_status_bit *received_bit_names(char *bits)
+{
+	struct snipl_status_bit *sb;
+	unsigned long bit;
+	char *item, *name, *save;
+
+	if (!strcmp(bits, "-"))
+		return NULL;
+	for (item = strtok_r(bits, ",", &save); item;
+	     item = strtok_r(NULL, ",", &save)) {
+		name = strchr(item, ':');
+		if (!name)
+			continue;
+		*name++ = '\0';
+		bit = strtoul(item, NULL, 0);
+		for (sb = received_bits; sb->name; sb++)
+			if (sb->bit == bit)
+				break;
+		if (sb->name || sb == &received_bits[SNIPLD_BITS])
+			continue;
+		sb->name = strdup(name);
+		if (sb->name)
+			sb->bit = bit;
+	}
+	return received_bits;
+}
+
+
+/*
+ *	function: snipld_call
+ *
+ *	purpose: let snipld perform op on image. If snipld serves the
+ *		 request, a record is started for image with the return
+ *		 codes, the state and the message of the operation, the
+ *		 caller completes it with snipl_result_end and *rc.
+ *		 If the connection fails after the request was sent,
+ *		 snipld may still perform it. The record then tells that
+ *		 the request has no answer, and the caller must not
+ *		 repeat it.
+ *
+ *	returns 0 if the request was served, 1 if snipld does not serve
+ *	it, -1 if the connection failed before the request was sent and
+ *	2 if it failed after
+ */
+int snipld_call(struct snipld_conn *conn, struct snipl_image *image, int op,
+		int *rc)
+{
+	struct snipl_server *server = image->server;
+	struct snipl_parms *parms = &server->parms;
+	struct snipl_result *res;
+	struct timeval tv = {0, 0};
+	struct timespec start;
+	char *line = NULL, *text = NULL, *name, *p;
+	char bits[1024];
+	size_t size = 0;
+	int api_rc, api_rs, severity, state, ret = 2;
+	unsigned long status;
+	long login_ms;
+	unsigned int len;
+	int msecs;
+
+	if (server->deadline.tv_sec) {
+		/* snipld has no deadline, stop waiting for it instead */
+		msecs = snipl_wait_time(server, INT_MAX);
+		tv.tv_sec = msecs / 1000;
+		tv.tv_usec = (msecs % 1000) * 1000;
+		setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+	clock_gettime(CLOCK_REALTIME, &start);
+	name = strdup(image->name);
+	if (!name)
+		return -1;
+	/* VM image names keep a - as newline until the login */
+	for (p = name; *p; p++)
+		if (*p == '\n')
+			*p = '-';
+	if (dprintf(conn->fd, "%s %s %s %s %s %d %d %s\n", snipl_op_name(op),
+		    server->type, server->address,
+		    server->user ? server->user : "-", name, parms->force,
+		    parms->shutdown_time,
+		    parms->profile ? parms->profile : "-") < 0) {
+		free(name);
+		return -1;
+	}
+	free(name);
+
+	errno = 0;
+	if (getline(&line, &size, conn->in) <= 0)
+		goto lost;
+	if (!strncmp(line, "no ", 3)) {
+		ret = 1;
+		goto out;
+	}
+	if (sscanf(line, "ok %d %d %d %d %d %lu %ld %1023s %u", rc, &api_rc,
+		   &api_rs, &severity, &state, &status, &login_ms, bits,
+		   &len) != 9)
+		goto lost;
+	text = calloc(1, len + 1);
+	if (!text || fread(text, 1, len, conn->in) != len)
+		goto lost;
+
+	res = snipl_result_begin(server, image, op);
+	if (res) {
+		res->start = start;
+		res->phase_ms[SNIPL_PHASE_LOGIN] = login_ms;
+	}
+	snipl_result_api(server, api_rc, api_rs);
+	snipl_result_state(server, state, status, received_bit_names(bits));
+	if (len)
+		create_msg(server, "%s", text);
+	server->problem_class = severity;
+	ret = 0;
+	goto out;
+lost:
+	res = snipl_result_begin(server, image, op);
+	if (res)
+		res->start = start;
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		create_msg(server, "%s: %s: no answer of snipld before the "
+			   "deadline, the request is not repeated\n",
+			   image->name, snipl_op_name(op));
+		*rc = DEADLINE_EXCEEDED;
+	} else {
+		create_msg(server, "%s: %s: connection to snipld lost after "
+			   "the request, the request is not repeated\n",
+			   image->name, snipl_op_name(op));
+		*rc = CONNECTION_ERROR;
+	}
+	server->problem_class = FATAL;
+out:
+	free(text);
+	free(line);
+	return ret;
+}
+
+
+/*
+ *	function: snipld_parse
+ *
+ *	purpose: split a request line of a client, the fields point into
+ *		 line
+ *
+ *	returns 0 or -1 if the line is not a request
+ */
+int snipld_parse(char *line, struct snipld_request *req)
+{
+	char *field[8] = {NULL}, *save;
+	char *op;
+	int n;
+
+	line[strcspn(line, "\n")] = '\0';
+	field[0] = strtok_r(line, " ", &save);
+	for (n = 1; field[n - 1] && n < 8; n++)
+		field[n] = strtok_r(NULL, " ", &save);
+	if (!field[7] || strtok_r(NULL, " ", &save))
+		return -1;
+	op = field[0];
+	for (req->op = OPUNKNOWN; req->op <= GETSTATUS; req->op++)
+		if (!strcmp(op, snipl_op_name(req->op)))
+			break;
+	req->type = field[1];
+	req->address = field[2];
+	req->user = strcmp(field[3], "-") ? field[3] : NULL;
+	req->image = field[4];
+	req->profile = strcmp(field[7], "-") ? field[7] : NULL;
+	if (req->op > GETSTATUS ||
+	    sscanf(field[5], "%d", &req->force) != 1 ||
+	    sscanf(field[6], "%d", &req->shutdown_time) != 1)
+		return -1;
+	return 0;
+}
+
+
+/*
+ *	function: snipld_answer
+ *
+ *	purpose: write the answer to a request that was served, from the
+ *		 record res of the operation
+ */
+int snipld_answer(FILE *out, const struct snipl_result *res)
+{
+	const struct snipl_status_bit *sb;
+	const char *text = res->text ? res->text : "";
+	int first = 1;
+
+	fprintf(out, "ok %d %d %d %d %d %lu %ld ", res->rc, res->api_rc,
+		res->api_rs, res->severity, res->state, res->status,
+		res->phase_ms[SNIPL_PHASE_LOGIN]);
+	for (sb = res->status_bits; sb && sb->name; sb++) {
+		if (!(res->status & sb->bit))
+			continue;
+		fprintf(out, "%s%#lx:%s", first ? "" : ",", sb->bit, sb->name);
+		first = 0;
+	}
+	fprintf(out, "%s %zu\n%s", first ? "-" : "", strlen(text), text);
+	return fflush(out);
+}
+
+
+/*
+ *	function: snipld_refuse
+ *
+ *	purpose: tell the client that the request is not served, so that
+ *		 it performs it itself
+ */
+int snipld_refuse(FILE *out, const char *reason)
+{
+	fprintf(out, "no %s\n", reason);
+	return fflush(out);
+}
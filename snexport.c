@@ -0,0 +1,281 @@
+/*
+   snexport - export the operation metrics of snipl in OpenMetrics format
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snexport is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   snexport writes the metrics that snipl, lic_vps and sncap keep in
+   shared memory (see snmetrics.c) to stdout, to a file for the textfile
+   collector of a node exporter, replaced atomically, or serves them
+   over HTTP on a port of the loopback interface for a scraper.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "snipl.h"
+#include "snmetrics.h"
+
+#define CONTENT_TYPE \
+	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+static volatile sig_atomic_t stop;
+
+static struct option long_options[] = {
+	{"output",   1, NULL, 'o'},
+	{"interval", 1, NULL, 'i'},
+	{"port",     1, NULL, 'p'},
+	{"help",     0, NULL, 'h'},
+	{"version",  0, NULL, 'v'},
+	{NULL, 0, NULL, 0}
+};
+
+
+static void print_usage(const char *name)
+{
+	printf("Export the operation metrics of snipl in OpenMetrics "
+	       "format\n");
+	printf("Usage: %s [options]\n", name);
+	printf(" -o --output <filename>          write the metrics to a file "
+	       "instead of stdout\n");
+	printf(" -i --interval <seconds>         write them again every "
+	       "<seconds>\n");
+	printf(" -p --port <port>                serve them over HTTP on "
+	       "<port> of localhost\n");
+	printf(" -h --help                       print usage information\n");
+	printf(" -v --version                    print version of %s\n",
+	       name);
+}
+
+
+static void stop_handler(int sig)
+{
+	stop = 1;
+}
+
+
+/*
+ * replace the file name with the metrics, so that a collector never
+ * reads a partial file. returns 0 or -1.
+ */
+static int write_file(const char *name)
+{
+	char *tmpname;
+	FILE *out;
+	int rc;
+
+	if (asprintf(&tmpname, "%s.tmp", name) == -1)
+		return -1;
+	out = fopen(tmpname, "w");
+	if (!out) {
+		fprintf(stderr, "snexport: %s: %s\n", tmpname,
+			strerror(errno));
+		free(tmpname);
+		return -1;
+	}
+	rc = snipl_metrics_write(out);
+	if (fclose(out) || rc == -1 || (!rc && rename(tmpname, name))) {
+		fprintf(stderr, "snexport: %s: %s\n", name, strerror(errno));
+		rc = -1;
+	}
+	if (rc)
+		unlink(tmpname);
+	free(tmpname);
+	return rc == -1 ? -1 : 0;
+}
+
+
+static int open_port(int port)
+{
+	struct sockaddr_in addr;
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(fd, 16) == -1) {
+		fprintf(stderr, "snexport: port %d: %s\n", port,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/*
+ * answer one HTTP request of a scraper, every GET gets the metrics
+ */
+static void serve(int fd)
+{
+	struct timeval tv = {2, 0};
+	char request[4096];
+	char *body = NULL;
+	size_t len = 0;
+	ssize_t n;
+	FILE *out;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	n = recv(fd, request, sizeof(request) - 1, 0);
+	if (n <= 0)
+		return;
+	request[n] = '\0';
+	if (strncmp(request, "GET ", 4)) {
+		dprintf(fd, "HTTP/1.0 405 Method Not Allowed\r\n"
+			"Allow: GET\r\nContent-Length: 0\r\n\r\n");
+		return;
+	}
+	out = open_memstream(&body, &len);
+	if (!out)
+		return;
+	if (snipl_metrics_write(out) == 1)
+		fputs("# EOF\n", out);
+	if (fclose(out)) {
+		dprintf(fd, "HTTP/1.0 500 Internal Server Error\r\n"
+			"Content-Length: 0\r\n\r\n");
+		free(body);
+		return;
+	}
+	dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+		"Content-Length: %zu\r\n\r\n", CONTENT_TYPE, len);
+	if (write(fd, body, len) != (ssize_t)len)
+		fprintf(stderr, "snexport: answer cut short\n");
+	free(body);
+}
+
+
+/*
+ *	function: main
+ *
+ *	purpose: point of control
+ */
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+	struct pollfd pfd;
+	struct timespec next, now;
+	char *output = NULL, *end;
+	long interval = 0, port = 0, timeout;
+	int c, fd, ret = 0;
+
+	while ((c = getopt_long(argc, argv, "o:i:p:hv", long_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'i':
+			interval = strtol(optarg, &end, 10);
+			if (*end || interval <= 0 || interval > 86400) {
+				fprintf(stderr, "snexport: invalid interval "
+					"%s\n", optarg);
+				return INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'p':
+			port = strtol(optarg, &end, 10);
+			if (*end || port <= 0 || port > 65535) {
+				fprintf(stderr, "snexport: invalid port %s\n",
+					optarg);
+				return INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		case 'v':
+			printf("%s\n", SNIPL_VERSION);
+			printf("%s\n", SNIPL_COPYRIGHT);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return UNKNOWN_PARAMETER;
+		}
+	}
+	if (optind < argc || (interval && !output)) {
+		print_usage(argv[0]);
+		return UNKNOWN_PARAMETER;
+	}
+
+	if (!port && !output) {
+		ret = snipl_metrics_write(stdout);
+		if (ret == 1)
+			fprintf(stderr, "snexport: no metrics recorded\n");
+		return ret ? INVALID_PARAMETER_VALUE : 0;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	pfd.fd = -1;
+	pfd.events = POLLIN;
+	if (port) {
+		pfd.fd = open_port(port);
+		if (pfd.fd == -1)
+			return CONNECTION_ERROR;
+	}
+	if (output && write_file(output))
+		ret = INVALID_PARAMETER_VALUE;
+	if (!port && !interval)
+		return ret;
+
+	/*
+	 * poll returns when the file is due, at a scrape or with EINTR at
+	 * a signal. The file is due interval seconds after it was written,
+	 * however many scrapes come in between.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	next.tv_sec += interval;
+	while (!stop) {
+		timeout = -1;
+		if (interval) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = (next.tv_sec - now.tv_sec) * 1000 +
+				(next.tv_nsec - now.tv_nsec) / 1000000;
+			if (timeout <= 0) {
+				write_file(output);
+				next = now;
+				next.tv_sec += interval;
+				continue;
+			}
+		}
+		c = poll(&pfd, 1, timeout);
+		if (c <= 0 || !(pfd.revents & POLLIN))
+			continue;
+		fd = accept4(pfd.fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1)
+			continue;
+		serve(fd);
+		close(fd);
+	}
+	if (pfd.fd != -1)
+		close(pfd.fd);
+	return 0;
+}
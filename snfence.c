@@ -0,0 +1,459 @@
+/*
+   snfence - measure the fencing latency of the stonith plugin lic_vps
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snfence is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   snfence loads lic_vps with the stonith library, like heartbeat does,
+   and sends it status checks and reset requests. It reports the time of
+   each kind of request as a distribution. The requests go to a stand-in
+   for a SMAPI request server, which snfence serves on a port of the
+   loopback interface, or to a stand-in for the hwmcaapi library
+   (snfence_hwmca.so of the source tree, which is never installed),
+   which is loaded in place of libhwmcaapi.so. Both
+   answer after a configurable latency and fail a configurable share of
+   the requests. With --config, snfence measures real servers instead.
+   snfence is built by the bench_lpar and bench_vm targets of the
+   Makefile and run from the source tree, it is not installed either.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stonith/stonith.h>
+#include "snipl.h"
+
+#define SNFENCE_IMAGE		"LINUX1"
+#define SNFENCE_HWMCA		"./snfence_hwmca.so"
+#define SNFENCE_REQUEST_MAX	65536
+
+/*
+ * latency and failures of the stand-ins, the hwmcaapi stand-in reads
+ * them from the environment
+ */
+struct standin {
+	long latency;		/* ms */
+	long jitter;		/* ms, added at random */
+	int  errors;		/* percent of the requests that fail */
+	int  fd;		/* of the SMAPI stand-in */
+	int  port;
+};
+
+static struct option long_options[] = {
+	{"type",           1, NULL, 't'},
+	{"latency",        1, NULL, 'l'},
+	{"jitter",         1, NULL, 'j'},
+	{"errors",         1, NULL, 'e'},
+	{"resets",         1, NULL, 'n'},
+	{"status",         1, NULL, 's'},
+	{"pause",          1, NULL, 'P'},
+	{"hwmca",          1, NULL, 'H'},
+	{"config",         1, NULL, 'c'},
+	{"image",          1, NULL, 'i'},
+	{"help",           0, NULL, 'h'},
+	{"version",        0, NULL, 'v'},
+	{NULL, 0, NULL, 0}
+};
+
+
+static void print_usage(const char *name)
+{
+	printf("Measure the fencing latency of the stonith plugin lic_vps\n");
+	printf("Usage: %s [options]\n", name);
+	printf(" -t --type <vm|lpar>             stand-in to fence with "
+	       "(default vm)\n");
+	printf(" -l --latency <ms>               latency of a request to "
+	       "the stand-in\n");
+	printf(" -j --jitter <ms>                random latency added to "
+	       "--latency\n");
+	printf(" -e --errors <percent>           share of the requests to "
+	       "the stand-in that fail\n");
+	printf(" -n --resets <count>             number of reset requests "
+	       "(default 100)\n");
+	printf(" -s --status <count>             number of status checks "
+	       "(default 100)\n");
+	printf(" -P --pause <ms>                 pause between requests\n");
+	printf(" -H --hwmca <library>            hwmcaapi stand-in "
+	       "(default " SNFENCE_HWMCA ")\n");
+	printf(" -c --config <configuration>     fence real servers, "
+	       "configuration in\n"
+	       "                                 snipl_param syntax\n");
+	printf(" -i --image <image>              image to reset "
+	       "(default " SNFENCE_IMAGE ")\n");
+	printf(" -h --help                       print usage information\n");
+	printf(" -v --version                    print version of %s\n",
+	       name);
+}
+
+
+static long elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, buf, len);
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/*
+ * answer one request of a SMAPI client like a request server: the
+ * request id, then the output list with return and reason code 0. A
+ * request that fails gets no answer, the connection is closed.
+ */
+struct smapi_conn {
+	struct standin *si;
+	int fd;
+};
+
+static void *smapi_serve(void *arg)
+{
+	struct smapi_conn *conn = arg;
+	struct standin *si = conn->si;
+	unsigned int seed = time(NULL) ^ conn->fd;
+	uint32_t len, answer[5];
+	static uint32_t request_id;
+	char *request = NULL;
+
+	if (read_all(conn->fd, &len, sizeof(len)))
+		goto out;
+	len = ntohl(len);
+	if (len > SNFENCE_REQUEST_MAX)
+		goto out;
+	request = malloc(len);
+	if (!request || read_all(conn->fd, request, len))
+		goto out;
+	sleep_ms(si->latency +
+		 (si->jitter ? rand_r(&seed) % si->jitter : 0));
+	if (rand_r(&seed) % 100 < si->errors)
+		goto out;
+	answer[0] = htonl(__sync_add_and_fetch(&request_id, 1));
+	answer[1] = htonl(12);
+	answer[2] = answer[0];
+	answer[3] = 0;
+	answer[4] = 0;
+	if (write(conn->fd, answer, sizeof(answer)) != sizeof(answer))
+		fprintf(stderr, "snfence: answer cut short\n");
+out:
+	free(request);
+	close(conn->fd);
+	free(conn);
+	return NULL;
+}
+
+
+static void *smapi_standin(void *arg)
+{
+	struct standin *si = arg;
+	struct smapi_conn *conn;
+	pthread_t thread;
+	int fd;
+
+	while (1) {
+		fd = accept(si->fd, NULL, NULL);
+		if (fd == -1)
+			continue;
+		conn = malloc(sizeof(*conn));
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		conn->si = si;
+		conn->fd = fd;
+		if (pthread_create(&thread, NULL, smapi_serve, conn)) {
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+
+/*
+ * serve the SMAPI stand-in on a free port of the loopback interface
+ */
+static int start_smapi(struct standin *si)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+
+	si->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (si->fd == -1)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(si->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(si->fd, 64) == -1 ||
+	    getsockname(si->fd, (struct sockaddr *)&addr, &len) == -1 ||
+	    pthread_create(&thread, NULL, smapi_standin, si)) {
+		fprintf(stderr, "snfence: SMAPI stand-in: %s\n",
+			strerror(errno));
+		close(si->fd);
+		return -1;
+	}
+	pthread_detach(thread);
+	si->port = ntohs(addr.sin_port);
+	return 0;
+}
+
+
+/*
+ * load the hwmcaapi stand-in before lic_vps loads libsniplapi.so, its
+ * soname libhwmcaapi.so satisfies the dependency of libsniplapi.so
+ */
+static int load_hwmca(struct standin *si, const char *library)
+{
+	char value[32];
+
+	snprintf(value, sizeof(value), "%ld", si->latency);
+	setenv("SNFENCE_LATENCY", value, 1);
+	snprintf(value, sizeof(value), "%ld", si->jitter);
+	setenv("SNFENCE_JITTER", value, 1);
+	snprintf(value, sizeof(value), "%d", si->errors);
+	setenv("SNFENCE_ERRORS", value, 1);
+	if (!dlopen(library, RTLD_NOW | RTLD_GLOBAL)) {
+		fprintf(stderr, "snfence: %s\n", dlerror());
+		return -1;
+	}
+	return 0;
+}
+
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+/*
+ * print the distribution of n request times in us
+ */
+static void report(FILE *out, const char *what, long *us, int n,
+		   int failed)
+{
+	long sum = 0;
+	int i;
+
+	fprintf(out, "%-7s %d requests, %d failed\n", what, n, failed);
+	if (!n)
+		return;
+	qsort(us, n, sizeof(*us), compare_long);
+	for (i = 0; i < n; i++)
+		sum += us[i];
+	fprintf(out, "        min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  "
+		"max %.3f  mean %.3f ms\n", us[0] / 1000.0, us[n / 2] / 1000.0,
+		us[n * 9 / 10] / 1000.0, us[n * 99 / 100] / 1000.0,
+		us[n - 1] / 1000.0, sum / 1000.0 / n);
+	/* the requests are sent one after the other */
+	fprintf(out, "        %.1f requests per second\n",
+		sum ? n * 1000000.0 / sum : 0.0);
+}
+
+
+static long parse_number(const char *arg, const char *what, long max)
+{
+	char *end;
+	long value;
+
+	value = strtol(arg, &end, 10);
+	if (*end || end == arg || value < 0 || value > max) {
+		fprintf(stderr, "snfence: invalid %s %s\n", what, arg);
+		exit(INVALID_PARAMETER_VALUE);
+	}
+	return value;
+}
+
+
+/*
+ *	function: main
+ *
+ *	purpose: point of control
+ */
+int main(int argc, char **argv)
+{
+	struct standin si = {0, 0, 0, -1, 0};
+	StonithNVpair nv[3];
+	struct timespec start;
+	const char *hwmca = SNFENCE_HWMCA;
+	const char *image = SNFENCE_IMAGE;
+	char *type = "vm", *config = NULL;
+	long *us, pause = 0;
+	FILE *out;
+	int resets = 100, status = 100;
+	int c, i, failed;
+	Stonith *s;
+
+	while ((c = getopt_long(argc, argv, "t:l:j:e:n:s:P:H:c:i:hv",
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			type = optarg;
+			break;
+		case 'l':
+			si.latency = parse_number(optarg, "latency", 600000);
+			break;
+		case 'j':
+			si.jitter = parse_number(optarg, "jitter", 600000);
+			break;
+		case 'e':
+			si.errors = parse_number(optarg, "errors", 100);
+			break;
+		case 'n':
+			resets = parse_number(optarg, "resets", 1000000);
+			break;
+		case 's':
+			status = parse_number(optarg, "status", 1000000);
+			break;
+		case 'P':
+			pause = parse_number(optarg, "pause", 600000);
+			break;
+		case 'H':
+			hwmca = optarg;
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		case 'v':
+			printf("%s\n", SNIPL_VERSION);
+			printf("%s\n", SNIPL_COPYRIGHT);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return UNKNOWN_PARAMETER;
+		}
+	}
+	if (optind < argc) {
+		print_usage(argv[0]);
+		return UNKNOWN_PARAMETER;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if (config) {
+		config = strdup(config);
+	} else if (!strcasecmp(type, "vm")) {
+		if (start_smapi(&si))
+			return CONNECTION_ERROR;
+		if (asprintf(&config, "server=127.0.0.1,type=VM,user=snfence,"
+			     "password=snfence,port=%d,encryption=no,"
+			     "image=%s", si.port, image) == -1)
+			config = NULL;
+	} else if (!strcasecmp(type, "lpar")) {
+		if (load_hwmca(&si, hwmca))
+			return INVALID_PARAMETER_VALUE;
+		if (asprintf(&config, "server=127.0.0.1,type=LPAR,"
+			     "user=snfence,password=snfence,image=%s",
+			     image) == -1)
+			config = NULL;
+	} else {
+		fprintf(stderr, "snfence: invalid type %s\n", type);
+		return INVALID_PARAMETER_VALUE;
+	}
+	us = calloc(resets > status ? resets : status, sizeof(*us));
+	if (!config || !us) {
+		fprintf(stderr, "snfence: out of memory\n");
+		return STORAGE_PROBLEM;
+	}
+
+	/* the LPAR module prints progress dots, keep them off the report */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		fprintf(stderr, "snfence: %s\n", strerror(errno));
+		return INTERNAL_ERROR;
+	}
+
+	s = stonith_new("lic_vps");
+	if (!s) {
+		fprintf(stderr, "snfence: cannot load the stonith plugin "
+			"lic_vps\n");
+		return INVALID_PARAMETER_VALUE;
+	}
+	nv[0] = (StonithNVpair) {"compat_mode", "snipl_param"};
+	nv[1] = (StonithNVpair) {"lic_config", config};
+	nv[2] = (StonithNVpair) {NULL, NULL};
+	if (stonith_set_config(s, nv) != S_OK) {
+		fprintf(stderr, "snfence: lic_vps refuses the configuration "
+			"%s\n", config);
+		stonith_delete(s);
+		return INVALID_PARAMETER_VALUE;
+	}
+
+	for (i = failed = 0; i < status; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (stonith_get_status(s) != S_OK)
+			failed++;
+		us[i] = elapsed_us(&start);
+		sleep_ms(pause);
+	}
+	report(out, "status", us, status, failed);
+
+	for (i = failed = 0; i < resets; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (stonith_req_reset(s, ST_GENERIC_RESET, image) != S_OK)
+			failed++;
+		us[i] = elapsed_us(&start);
+		sleep_ms(pause);
+	}
+	report(out, "reset", us, resets, failed);
+
+	stonith_delete(s);
+	fclose(out);
+	free(config);
+	free(us);
+	return 0;
+}
@@ -0,0 +1,353 @@
+/*
+   snfence_hwmca - stand-in for the hwmcaapi library, for snfence
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snfence_hwmca is provided under the terms of the enclosed common public
+   license ("agreement"). Any use, reproduction or distribution of the
+   program constitutes recipient's acceptance of this agreement.
+
+   The library has the soname libhwmcaapi.so and answers the calls that
+   sniplapi.c makes like an SE with the images of $SNFENCE_IMAGES (comma
+   separated, default LINUX1), all of them operating until a command
+   changes their status: a reset stops, a deactivate deactivates and an
+   activate or a load starts them again. Every call waits
+   $SNFENCE_LATENCY ms plus up to $SNFENCE_JITTER ms, and
+   $SNFENCE_ERRORS percent of the initializations, gets and commands
+   fail with a timeout. A command is acknowledged by the next
+   HwmcaWaitEvent after another latency.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <hwmcaapi.h>
+
+#define EVENT_ITEMS	12	/* parse_command_response reads 12 */
+#define IMAGES_DEFAULT	"LINUX1"
+#define IMAGES_MAX	64
+/* the values of an event follow each other, aligned for a long */
+#define ALIGN(len)	(((len) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+/*
+ * a command that waits for its acknowledgement
+ */
+struct pending {
+	HWMCA_INITIALIZE_T *session;
+	char target[HWMCA_MAX_ID_LEN];
+	char command[HWMCA_MAX_ID_LEN];
+	int  correlator;
+	struct pending *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pending *pendings;
+static unsigned int seed;
+/* of every image from index 1, 0 = operating */
+static unsigned int statuses[IMAGES_MAX + 1];
+
+
+static long env_number(const char *name)
+{
+	const char *value = getenv(name);
+
+	return value ? strtol(value, NULL, 10) : 0;
+}
+
+
+/*
+ * wait the latency of a call, returns 1 if the call fails
+ */
+static int standin_call(void)
+{
+	long jitter = env_number("SNFENCE_JITTER");
+	long ms = env_number("SNFENCE_LATENCY");
+	struct timespec ts;
+	int r;
+
+	pthread_mutex_lock(&lock);
+	if (!seed)
+		seed = time(NULL);
+	r = rand_r(&seed);
+	pthread_mutex_unlock(&lock);
+	if (jitter > 0)
+		ms += r % jitter;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	return (r / 7) % 100 < env_number("SNFENCE_ERRORS");
+}
+
+
+/*
+ * name of image number index (from 1), NULL if there is none
+ */
+static char *image_name(int index, char *name, size_t size)
+{
+	const char *images = getenv("SNFENCE_IMAGES");
+	const char *p;
+	size_t len;
+
+	if (!images || !*images)
+		images = IMAGES_DEFAULT;
+	for (p = images; index > 1 && p; index--) {
+		p = strchr(p, ',');
+		if (p)
+			p++;
+	}
+	if (!p || index < 1)
+		return NULL;
+	len = strcspn(p, ",");
+	if (len >= size)
+		len = size - 1;
+	memcpy(name, p, len);
+	name[len] = '\0';
+	return name;
+}
+
+
+/*
+ * put one value of type in buffer, *needed is set to its size
+ */
+static void put_value(HWMCA_DATATYPE_P buffer, ULONG size, ULONG *needed,
+		      UCHAR type, const void *value, ULONG len)
+{
+	*needed = sizeof(*buffer) + len;
+	if (*needed > size)
+		return;
+	*buffer = (HWMCA_DATATYPE_T) {
+		.ucType = type,
+		.ulLength = len,
+		.pData = buffer + 1,
+	};
+	memcpy(buffer->pData, value, len);
+}
+
+
+static void set_item(HWMCA_DATATYPE_P item, UCHAR type, void *value,
+		     ULONG len)
+{
+	*item = (HWMCA_DATATYPE_T) {
+		.ucType = type,
+		.ulLength = len,
+		.pData = value,
+	};
+}
+
+
+ULONG HwmcaInitialize(HWMCA_INITIALIZE_T *session, ULONG timeout)
+{
+	return standin_call() ? HWMCA_DE_TIMEOUT : HWMCA_DE_NO_ERROR;
+}
+
+
+ULONG HwmcaTerminate(HWMCA_INITIALIZE_T *session, ULONG timeout)
+{
+	struct pending **p, *done;
+
+	pthread_mutex_lock(&lock);
+	for (p = &pendings; *p; ) {
+		if ((*p)->session != session) {
+			p = &(*p)->next;
+			continue;
+		}
+		done = *p;
+		*p = done->next;
+		free(done);
+	}
+	pthread_mutex_unlock(&lock);
+	return HWMCA_DE_NO_ERROR;
+}
+
+
+/*
+ * the contents of the image group, the name and the status of an image
+ */
+ULONG HwmcaGet(HWMCA_INITIALIZE_T *session, char *object,
+	       HWMCA_DATATYPE_P buffer, ULONG size, ULONG *needed,
+	       ULONG timeout)
+{
+	char id[HWMCA_MAX_ID_LEN], name[HWMCA_MAX_ID_LEN];
+	char *contents = NULL;
+	unsigned int status = HWMCA_STATUS_OPERATING;
+	size_t len = 0;
+	FILE *out;
+	int i;
+
+	if (standin_call())
+		return HWMCA_DE_TIMEOUT;
+
+	snprintf(id, sizeof(id), "%s.%s", HWMCA_CPC_IMAGE_GROUP_ID,
+		 HWMCA_GROUP_CONTENTS_SUFFIX);
+	if (!strcmp(object, id)) {
+		out = open_memstream(&contents, &len);
+		if (!out)
+			return HWMCA_DE_TIMEOUT;
+		for (i = 1; image_name(i, name, sizeof(name)); i++)
+			fprintf(out, "%s%s.%d", i > 1 ? " " : "",
+				HWMCA_CPC_IMAGE_ID, i);
+		fclose(out);
+		put_value(buffer, size, needed, HWMCA_TYPE_OCTETSTRING,
+			  contents, len + 1);
+		free(contents);
+		return HWMCA_DE_NO_ERROR;
+	}
+	snprintf(id, sizeof(id), "%s.%s.", HWMCA_CPC_IMAGE_ID,
+		 HWMCA_NAME_SUFFIX);
+	if (!strncmp(object, id, strlen(id)) &&
+	    image_name(atoi(object + strlen(id)), name, sizeof(name))) {
+		put_value(buffer, size, needed, HWMCA_TYPE_OCTETSTRING,
+			  name, strlen(name) + 1);
+		return HWMCA_DE_NO_ERROR;
+	}
+	snprintf(id, sizeof(id), "%s.%s.", HWMCA_CPC_IMAGE_ID,
+		 HWMCA_STATUS_SUFFIX);
+	if (!strncmp(object, id, strlen(id))) {
+		i = atoi(object + strlen(id));
+		pthread_mutex_lock(&lock);
+		if (i > 0 && i <= IMAGES_MAX && statuses[i])
+			status = statuses[i];
+		pthread_mutex_unlock(&lock);
+		put_value(buffer, size, needed, HWMCA_TYPE_INTEGER,
+			  &status, sizeof(status));
+		return HWMCA_DE_NO_ERROR;
+	}
+	put_value(buffer, size, needed, HWMCA_TYPE_NULL, NULL, 0);
+	return HWMCA_DE_NO_ERROR;
+}
+
+
+ULONG HwmcaCorrelatedCommand(HWMCA_INITIALIZE_T *session, char *target,
+			     char *command, HWMCA_DATATYPE_P data,
+			     ULONG timeout, void *correlator, ULONG len)
+{
+	struct pending *p;
+
+	if (standin_call())
+		return HWMCA_DE_TIMEOUT;
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return HWMCA_DE_TIMEOUT;
+	p->session = session;
+	snprintf(p->target, sizeof(p->target), "%s", target);
+	snprintf(p->command, sizeof(p->command), "%s", command);
+	if (len == sizeof(p->correlator))
+		memcpy(&p->correlator, correlator, len);
+	pthread_mutex_lock(&lock);
+	p->next = pendings;
+	pendings = p;
+	pthread_mutex_unlock(&lock);
+	return HWMCA_DE_NO_ERROR;
+}
+
+
+/*
+ * the status of the target image of command once it is acknowledged
+ */
+static void apply_command(const char *target, const char *command)
+{
+	unsigned int status;
+	int i;
+
+	if (!strcmp(command, HWMCA_RESETCLEAR_COMMAND) ||
+	    !strcmp(command, HWMCA_STOP_COMMAND))
+		status = HWMCA_STATUS_NOT_OPERATING;
+	else if (!strcmp(command, HWMCA_DEACTIVATE_COMMAND))
+		status = HWMCA_STATUS_NOT_ACTIVATED;
+	else if (!strcmp(command, HWMCA_ACTIVATE_COMMAND) ||
+		 !strcmp(command, HWMCA_LOAD_COMMAND))
+		status = 0;
+	else
+		return;
+	i = atoi(target + strlen(HWMCA_CPC_IMAGE_ID) + 1);
+	if (i < 1 || i > IMAGES_MAX)
+		return;
+	pthread_mutex_lock(&lock);
+	statuses[i] = status;
+	pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * the command response event of the oldest pending command, the layout
+ * that parse_command_response in sniplapi.c checks
+ */
+ULONG HwmcaWaitEvent(HWMCA_INITIALIZE_T *session, HWMCA_DATATYPE_P buffer,
+		     ULONG size, ULONG *needed, ULONG timeout)
+{
+	struct pending **pp, *p = NULL;
+	HWMCA_DATATYPE_T item[EVENT_ITEMS];
+	char ids[3][HWMCA_MAX_ID_LEN];
+	const char *object;
+	long values[3] = {0, 0, 1};
+	char *data;
+	ULONG len;
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (pp = &pendings; *pp; pp = &(*pp)->next)
+		if ((*pp)->session == session)
+			p = *pp;
+	for (pp = &pendings; p && *pp != p; pp = &(*pp)->next)
+		;
+	if (p)
+		*pp = p->next;
+	pthread_mutex_unlock(&lock);
+	if (!p) {
+		standin_call();
+		return HWMCA_DE_TIMEOUT;
+	}
+	standin_call();
+	apply_command(p->target, p->command);
+
+	object = p->target + strlen(HWMCA_CPC_IMAGE_ID) + 1;
+	snprintf(ids[0], sizeof(ids[0]), "%s.%s.%s", HWMCA_CPC_IMAGE_ID,
+		 HWMCA_COMMAND_OBJECT_ID_SUFFIX, object);
+	snprintf(ids[1], sizeof(ids[1]), "%s.%s.%s", HWMCA_CPC_IMAGE_ID,
+		 HWMCA_COMMAND_CONDITION_CODE_SUFFIX, object);
+	snprintf(ids[2], sizeof(ids[2]), "%s.%s.%s", HWMCA_CPC_IMAGE_ID,
+		 HWMCA_COMMAND_LAST_INDICATOR_SUFFIX, object);
+	set_item(&item[0], HWMCA_TYPE_OBJECTID, p->target,
+		 strlen(p->target) + 1);
+	set_item(&item[1], HWMCA_TYPE_INTEGER, &values[0], sizeof(long));
+	set_item(&item[2], HWMCA_TYPE_OBJECTID, ids[0], strlen(ids[0]) + 1);
+	set_item(&item[3], HWMCA_TYPE_OBJECTID, p->command,
+		 strlen(p->command) + 1);
+	set_item(&item[4], HWMCA_TYPE_OBJECTID, ids[1], strlen(ids[1]) + 1);
+	set_item(&item[5], HWMCA_TYPE_INTEGER, &values[1], sizeof(long));
+	set_item(&item[6], HWMCA_TYPE_OBJECTID, ids[2], strlen(ids[2]) + 1);
+	set_item(&item[7], HWMCA_TYPE_INTEGER, &values[2], sizeof(long));
+	for (i = 8; i < EVENT_ITEMS - 1; i++)
+		set_item(&item[i], HWMCA_TYPE_NULL, NULL, 0);
+	set_item(&item[EVENT_ITEMS - 1], HWMCA_TYPE_OCTETSTRING,
+		 &p->correlator, sizeof(p->correlator));
+
+	/* the items, then their values */
+	*needed = sizeof(item);
+	for (i = 0; i < EVENT_ITEMS; i++)
+		*needed += ALIGN(item[i].ulLength);
+	if (*needed > size) {
+		free(p);
+		return HWMCA_DE_NO_ERROR;
+	}
+	data = (char *)(buffer + EVENT_ITEMS);
+	for (i = 0; i < EVENT_ITEMS; i++) {
+		len = item[i].ulLength;
+		buffer[i] = item[i];
+		buffer[i].pData = len ? data : NULL;
+		buffer[i].pNext = i + 1 < EVENT_ITEMS ? &buffer[i + 1] : NULL;
+		memcpy(data, item[i].pData, len);
+		data += ALIGN(len);
+	}
+	free(p);
+	return HWMCA_DE_NO_ERROR;
+}
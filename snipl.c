@@ -25,6 +25,8 @@
 #include <getopt.h>
 #include <dlfcn.h>
 #include <termios.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "snipl.h"
 
 #define DONE -1;
@@ -67,6 +69,17 @@ static struct option long_options[] =
 	{"port",                   1, NULL, 'z'},
 	{"shutdowntime",           1, NULL, 'X'},
 	{"noencryption",	   0, NULL, 'e'},
+	{"showstate",              0, NULL, 'K'},
+	{"output",                 1, NULL, 'J'},
+	{"ensure",                 1, NULL, 'Q'},
+	{"deadline",               1, NULL, 'G'},
+	{"wave-size",              1, NULL, 'w'},
+	{"wave-gate",              1, NULL, 'Y'},
+	{"wave-fraction",          1, NULL, 'H'},
+	{"jobfile",                1, NULL, 'j'},
+	{"parallel",               1, NULL, 'n'},
+	{"status-cache",           1, NULL, 'c'},
+	{"via-daemon",             0, NULL, 'b'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -107,6 +120,12 @@ static const char *invalid_option_combinations[256] = {
 	['p'] "P",
 	['L'] "zX",
 	['F'] "X",
+	['J'] "i",
+	['Q'] "olsDadrixg",
+	['w'] "oDdixgQ",
+	['j'] "olsDadrixgQwVLmMNARCTSWIBOEncb",
+	['n'] "ixQw",
+	['b'] "ixQwn",
 };
 
 /*
@@ -147,17 +166,38 @@ static void print_usage(const char *name)
 	printf(" -D --scsidump                   perform a SCSI dump operation (LPAR only)\n");
 	printf(" -i --dialog                     start operating system messages dialog (LPAR)\n");
 	printf(" -g --getstatus                  get status information\n");
+	printf("    --status-cache <seconds>     take a status at most <seconds> old from the\n");
+	printf("                                 status cache shared by snipl processes\n");
 	printf(" -x --listimages                 list all images of a given server\n");
+	printf("    --ensure <state>             activate or deactivate only the images that\n");
+	printf("                                 are not active, inactive or operating\n");
+	printf("    --wave-size <n>              activate, load or reset in waves of n images\n");
+	printf("    --wave-gate <gate>           start the next wave when the images are\n");
+	printf("                                 acknowledged (ack, the default), active\n");
+	printf("                                 or operating\n");
+	printf("    --wave-fraction <percent>    part of a wave that must meet the gate\n");
+	printf("                                 (default 100)\n");
+	printf("    --jobfile <filename>         run the steps of a job file, each step after\n");
+	printf("                                 the steps it depends on\n");
+	printf("    --parallel <n>               up to n requests in flight, fewer while the\n");
+	printf("                                 server is busy\n");
+	printf("    --via-daemon                 let snipld perform the operation if it\n");
+	printf("                                 serves the image\n");
 	printf("\n");
 	printf(" -F --force                      non-graceful execution\n");
 	printf("    --timeout <timeout>          Timeout (in milliseconds) for "
-	  "LPAR command\n                                 completion (default 60000ms)\n");
+	  "LPAR command\n                                 completion (default 60000ms or "
+	  "learned\n                                 from the recent requests)\n");
+	printf("    --deadline <period>          Deadline (in milliseconds) for the complete\n"
+	       "                                 invocation, limits every timeout\n");
 	printf(" -X --shutdowntime               delay for z/VM guest shutdown (default 300s)\n");
 	printf("    --msgtimeout <interval>      Interval (in milliseconds) for "
 	  "polling\n                                 LPAR operating system "
 	  "messages (default 5000ms)\n");
 	printf("                                 (for operating system messages dialog)\n");
 	printf(" -M --msgfilename                file name for saving messages\n");
+	printf("    --output <format>            output format text (default) or json\n");
+	printf("                                 (one JSON object per image and operation)\n");
 	printf("    --profilename <str>          profile name for LPAR activate\n");
 	printf(" -A --address_load <hex_la>      hexadecimal address for load\n");
 	printf("                                 (default: address of previous load)\n");
@@ -180,6 +220,7 @@ static void print_usage(const char *name)
 	printf("\n");
 	printf(" -h --help                       print usage information\n");
 	printf(" -v --version                    print version of %s\n", name);
+	printf("    --showstate                  print the remembered server state\n");
 	printf("\n");
 	printf("Please report bugs to: linux390@de.ibm.com\n");
 }
@@ -212,6 +253,14 @@ static void listimages(struct snipl_server *server)
 	int j;
 	struct snipl_image *image;
 
+	if (server->parms.output == SNIPL_OUTPUT_JSON) {
+		/* one record per image, written by the sink */
+		snipl_for_each_image(server, image) {
+			snipl_result_begin(server, image, LIST);
+			snipl_result_end(server, 0);
+		}
+		return;
+	}
 	fprintf(stdout, "\navailable images for server %s",
 		server->address);
 	if (server->user)
@@ -233,6 +282,38 @@ static void listimages(struct snipl_server *server)
 }
 
 
+/*
+ *	function: show_state
+ *
+ *	purpose: print the records of the state file
+ */
+static void show_state(void)
+{
+	char *name = snipl_state_file_name();
+
+	if (!name) {
+		fprintf(stdout, "state file is disabled\n");
+		return;
+	}
+	fprintf(stdout, "state file %s:\n", name);
+	if (snipl_state_dump(stdout))
+		fprintf(stdout, "no state recorded\n");
+	free(name);
+}
+
+
+/*
+ *	function: info_stream
+ *
+ *	purpose: informational messages go to stdout unless stdout
+ *		 carries JSON records
+ */
+static FILE *info_stream(struct snipl_server *server)
+{
+	return server->parms.output == SNIPL_OUTPUT_JSON ? stderr : stdout;
+}
+
+
 /*
  *	function: print_server_message
  *
@@ -242,7 +323,8 @@ static void listimages(struct snipl_server *server)
 static void print_server_message(struct snipl_server *server)
 {
 	if (server->problem) {
-		if (server->problem_class == OK) {
+		if (server->problem_class == OK &&
+		    server->parms.output != SNIPL_OUTPUT_JSON) {
 			fprintf(stdout, "%s", server->problem);
 		} else {
 			fprintf(stderr, "%s", server->problem);
@@ -306,6 +388,30 @@ alias_handling(struct snipl_server *input_server,
 	}
 }
 
+/*
+ * check if serv and serv2 are members of the same z/VM SSI cluster
+ */
+static int ssi_same(struct snipl_server *serv, struct snipl_server *serv2)
+{
+	return serv->ssi && serv2->ssi && !strcasecmp(serv->ssi, serv2->ssi);
+}
+
+
+/*
+ * check if image is defined for a member of the SSI cluster of serv
+ */
+static int ssi_defined(struct snipl_configuration *conf,
+		       struct snipl_server *serv, const char *name)
+{
+	struct snipl_image *image;
+
+	for (image = find_next_image(conf, name, NULL, NULL); image;
+	     image = find_next_image(conf, name, NULL, image->server))
+		if (ssi_same(serv, image->server))
+			return 1;
+	return 0;
+}
+
 /*
  *	function: find_server_in_conf_with_image
  *
@@ -320,22 +426,35 @@ find_server_in_conf_with_image(struct snipl_configuration *conf,
 {
 	struct snipl_server *serv;
 	struct snipl_server *serv2;
+	struct snipl_server *best;
 
 	serv = find_next_server(conf, server->_images->name, server->user,
 				NULL);
 	if (serv) {
 		serv2 = find_next_server(conf, server->_images->name,
 					 server->user, serv);
+		/* the image may be defined for every member of a cluster */
+		if (serv2 && ssi_same(serv, serv2))
+			serv2 = NULL;
 		if (serv2) {
 			/* another server found ==>       */
 			/*    config file info not usable */
 			fprintf(stderr, "more than one ");
 			if (strcasecmp(serv->address, serv2->address)) {
-				/* warn but continue (preserving serv) */
-				/* to allow diff. servers for an image */
+				/* warn but continue with the server */
+				/* that has the best score */
+				best = serv;
+				for (; serv2; serv2 = find_next_server(conf,
+						server->_images->name,
+						server->user, serv2))
+					if (snipl_server_score(serv2) <
+					    snipl_server_score(best))
+						best = serv2;
 				fprintf(stderr, "server found in config file "
-					"in %s for image %s\n",
-					conf->filename, server->_images->name);
+					"in %s for image %s, %s has the best "
+					"score\n", conf->filename,
+					server->_images->name, best->address);
+				serv = best;
 			} else {
 				/* don't allow diff. users */
 				/* with same server and image */
@@ -363,12 +482,16 @@ find_server_in_conf_with_image(struct snipl_configuration *conf,
 		} else {
 			server->address = serv->address;
 			server->type = serv->type;
-			fprintf(stdout, "Server %s ", server->address);
+			fprintf(info_stream(server), "Server %s ",
+				server->address);
 			if (!strcasecmp(serv->type, "VM"))
-				fprintf(stdout, "with userid %s ", serv->user);
+				fprintf(info_stream(server), "with userid %s ",
+					serv->user);
 			if (serv->port != UNDEFINED)
-				fprintf(stdout, "with port %i ", serv->port);
-			fprintf(stdout, "from config file %s is used\n",
+				fprintf(info_stream(server), "with port %i ",
+					serv->port);
+			fprintf(info_stream(server),
+				"from config file %s is used\n",
 				conf->filename);
 		}
 	}
@@ -490,14 +613,24 @@ configfile_handling (char *cfgname, struct snipl_server *server)
 						server->_images->name);
 					serv = NULL;
 				} else
-					fprintf(stdout, "Server %s ",
-						server->address);
+					fprintf(info_stream(server),
+						"Server %s ", server->address);
 				if (serv->user)
-					fprintf(stdout, "with userid %s",
-						serv->user);
-				fprintf(stdout, " from config file "
-					"%s is used\n", conf->filename);
+					fprintf(info_stream(server),
+						"with userid %s", serv->user);
+				fprintf(info_stream(server), " from config "
+					"file %s is used\n", conf->filename);
+			} else if ((serv = find_server_in_conf_with_address(
+					conf, server)) &&
+				   ssi_defined(conf, serv,
+					       server->_images->name)) {
+				/* defined for another member of its cluster */
+				fprintf(info_stream(server), "Server %s of SSI "
+					"cluster %s from config file %s is "
+					"used\n", server->address, serv->ssi,
+					conf->filename);
 			} else {
+				serv = NULL;
 				fprintf(stderr, "image %s not found in config "
 					"file %s for server %s",
 					server->_images->name, conf->filename,
@@ -565,7 +698,8 @@ configfile_handling (char *cfgname, struct snipl_server *server)
 							break;
 						}
 					}
-					if (!found) {
+					if (!found && !ssi_defined(conf, serv,
+							image->name)) {
 						fprintf(stderr, "Image %s not "
 							"contained in image list"
 							" of selected server %s "
@@ -683,6 +817,24 @@ static int parse_command_input(int argc, char **argv,
 		case 'g':
 			server->parms.image_op = GETSTATUS;
 			break;
+		case 'Q':
+			/* the operation that changes the state */
+			if (!strcasecmp(optarg, "active")) {
+				server->parms.ensure = SNIPL_IMAGE_ACTIVE;
+				server->parms.image_op = ACTIVATE;
+			} else if (!strcasecmp(optarg, "operating")) {
+				server->parms.ensure = SNIPL_IMAGE_OPERATING;
+				server->parms.image_op = ACTIVATE;
+			} else if (!strcasecmp(optarg, "inactive")) {
+				server->parms.ensure = SNIPL_IMAGE_INACTIVE;
+				server->parms.image_op = DEACTIVATE;
+			} else {
+				fprintf(stderr,
+					"invalid state for --ensure: %s\n",
+					optarg);
+				ret = INVALID_PARAMETER_VALUE;
+			}
+			break;
 		case 's':
 			server->parms.image_op = SCSILOAD;
 			break;
@@ -733,6 +885,7 @@ static int parse_command_input(int argc, char **argv,
 					optarg);
 				ret = INVALID_PARAMETER_VALUE;
 			} else {
+				server->timeout_given = 1;
 				DEBUG_PRINT("generic timeout is %i\n",
 					    server->timeout);
 			}
@@ -925,6 +1078,95 @@ static int parse_command_input(int argc, char **argv,
 			fprintf(stdout, "%s\n", SNIPL_VERSION);
 			fprintf(stdout, "%s\n", SNIPL_COPYRIGHT);
 			return DONE;
+		case 'K':
+			show_state();
+			return DONE;
+		case 'G':
+			temp_ret = sscanf(optarg, "%i%1c", &temp_len,
+					  &next_char);
+			if (!isscanf_ok(temp_ret, next_char, optarg) ||
+			    temp_len < 1) {
+				fprintf(stderr,
+					"invalid deadline: %s\n", optarg);
+				ret = INVALID_PARAMETER_VALUE;
+			} else
+				snipl_set_deadline(server, temp_len);
+			break;
+		case 'w':
+			temp_ret = sscanf(optarg, "%i%1c",
+					  &server->parms.wave_size, &next_char);
+			if (!isscanf_ok(temp_ret, next_char, optarg) ||
+			    server->parms.wave_size < 1) {
+				fprintf(stderr,
+					"invalid wave size: %s\n", optarg);
+				ret = INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'Y':
+			if (!strcasecmp(optarg, "ack"))
+				server->parms.wave_gate = SNIPL_IMAGE_UNKNOWN;
+			else if (!strcasecmp(optarg, "active"))
+				server->parms.wave_gate = SNIPL_IMAGE_ACTIVE;
+			else if (!strcasecmp(optarg, "operating"))
+				server->parms.wave_gate = SNIPL_IMAGE_OPERATING;
+			else {
+				fprintf(stderr,
+					"invalid wave gate: %s\n", optarg);
+				ret = INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'H':
+			temp_ret = sscanf(optarg, "%i%1c",
+					  &server->parms.wave_fraction,
+					  &next_char);
+			if (!isscanf_ok(temp_ret, next_char, optarg) ||
+			    server->parms.wave_fraction < 1 ||
+			    server->parms.wave_fraction > 100) {
+				fprintf(stderr,
+					"invalid wave fraction: %s\n", optarg);
+				ret = INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'n':
+			temp_ret = sscanf(optarg, "%i%1c",
+					  &server->parms.parallel, &next_char);
+			if (!isscanf_ok(temp_ret, next_char, optarg) ||
+			    server->parms.parallel < 1) {
+				fprintf(stderr,
+					"invalid parallel limit: %s\n", optarg);
+				ret = INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'b':
+			server->parms.via_daemon = 1;
+			break;
+		case 'c':
+			temp_ret = sscanf(optarg, "%i%1c",
+					  &server->parms.status_cache,
+					  &next_char);
+			if (!isscanf_ok(temp_ret, next_char, optarg) ||
+			    server->parms.status_cache < 1) {
+				fprintf(stderr,
+					"invalid status cache period: %s\n",
+					optarg);
+				ret = INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'j':
+			server->parms.jobfile = optarg;
+			DEBUG_PRINT("jobfile is %s...\n", optarg);
+			break;
+		case 'J':
+			if (!strcasecmp(optarg, "text"))
+				server->parms.output = SNIPL_OUTPUT_TEXT;
+			else if (!strcasecmp(optarg, "json"))
+				server->parms.output = SNIPL_OUTPUT_JSON;
+			else {
+				fprintf(stderr,
+					"invalid output format: %s\n", optarg);
+				ret = INVALID_PARAMETER_VALUE;
+			}
+			break;
 		default:
 			print_usage(argv[0]);
 			return UNKNOWN_PARAMETER;
@@ -947,6 +1189,17 @@ static int parse_command_input(int argc, char **argv,
 			}
 		}
 	}
+	if ((option_specified['Y'] || option_specified['H']) &&
+	    !option_specified['w']) {
+		fprintf(stderr, "options --wave-gate and --wave-fraction "
+			"require option --wave-size\n");
+		ret = CONFLICTING_OPTIONS;
+	}
+	if (option_specified['c'] && !option_specified['g']) {
+		fprintf(stderr, "option --status-cache requires option "
+			"--getstatus\n");
+		ret = CONFLICTING_OPTIONS;
+	}
 
 	/* read image names (non-optional params) and allocate image storage */
 	while (optind < argc) {
@@ -966,224 +1219,2434 @@ static int parse_command_input(int argc, char **argv,
 
 
 /*
- *	function: command_processing
+ *	function: image_operation
  *
- *	purpose: point of control
+ *	purpose: perform operation op on one image
  */
+static int image_operation(struct snipl_image *image, int op)
+{
+	struct snipl_server *server = image->server;
+
+	switch (op) {
+	case ACTIVATE:
+		return snipl_activate(image);
+	case STOP:
+		return snipl_stop(image);
+	case LOAD:
+		return snipl_load(image);
+	case SCSILOAD:
+		return snipl_scsiload(image);
+	case SCSIDUMP:
+		return snipl_scsidump(image);
+	case DEACTIVATE:
+		return snipl_deactivate(image);
+	case RESET:
+		return snipl_reset(image);
+	case DIALOG:
+		return snipl_dialog(image);
+	case GETSTATUS:
+		return snipl_getstatus(image);
+	default:
+		create_msg(server, "internal error: unknown op\n");
+		return INTERNAL_ERROR;
+	}
+}
 
-/*****************************************************************/
-static int command_processing(struct snipl_server *server)
+
+/*
+ * sinks for the result records of command_processing
+ */
+static void text_sink(struct snipl_server *server, struct snipl_result *res)
 {
-	int ret;
-	struct snipl_image *image;
-	struct snipl_parms image_parms;
-	int temp_ret;
+	snipl_result_print(res);
+}
 
-	ret = 0;
 
-	if (server->parms.image_op == LIST && !strcasecmp(server->type, "VM")) {
-		listimages(server);
-		return ret;
-	}
+static void json_sink(struct snipl_server *server, struct snipl_result *res)
+{
+	snipl_result_json(stdout, server, res);
+}
 
-	/* now we work on our own image list */
-	image_parms = server->parms;   /* save info from parameter parsing*/
-	ret = snipl_prepare(server);
-	if (ret)
-		goto out;
-	server->parms = image_parms;   /* restore info from parameter parsing*/
-	ret = snipl_prepare_check(server);
-	if (ret)
-		goto out;
 
-	ret = snipl_login(server);
-	if (ret && server->problem_class == CERTIFICATE_ERROR) {
-		print_server_message(server);
-		if (snipl_confirm(server) <= 0)
-			goto logout;
-	} else if (ret)  /* communication error (timeout) */ {
-		if (!strcasecmp(server->type, "VM")) {
-			snipl_logout(server);
-			server->type = "VM5";
-			/* try RPC interface */
-			ret = snipl_prepare(server);
-			if (ret) {
-				server->type = "VM";
-				create_msg(server, "Error: login fails for "
-					   "VM server %s\n", server->address);
-				goto out;
-			}
-			server->parms = image_parms;
-			ret = snipl_prepare_check(server);
-			if (ret)
-				goto out;
-			ret = snipl_login(server);
-			if (!ret)
-				DEBUG_PRINT("%s is a VSMSERVE server\n",
-					server->address);
-			else if (server->port == UNDEFINED)
-				create_msg(server, "Error: missing Port for "
-					   "VM server %s\n", server->address);
-		}
-		if (ret)
-			goto out;
-	} else
-		DEBUG_PRINT("%s is a socket-based server\n", server->address);
-	DEBUG_PRINT("Login to server %s successful\n", server->address);
+/*
+ * login bookkeeping of command_processing
+ */
+struct session {
+	struct timespec login_start;
+	int login_pending;	/* login not yet charged to a record */
+	int used;		/* a request was sent since the login */
+};
 
-	/*
-	 * Don't check the server type because the LIST operation for
-	 * VM type servers is handled and returned earlier.
-	 */
-	if (server->parms.image_op == LIST) {
-		listimages(server);
-		goto logout;
-	}
 
-	/* Remove newline from image name in case of VM */
-	if (!strcasecmp(server->type, "VM")) {
-		snipl_for_each_image(server, image) {
-			replace_char(image->name, 0x0a, '-');
-		}
-	}
+/*
+ *	function: connect_failed
+ *
+ *	purpose: without a connection no image can be handled. For JSON
+ *		 output report the failure for every image, so every image
+ *		 has its record.
+ */
+static void connect_failed(struct snipl_server *server, int rc,
+			   const struct timespec *login_start)
+{
+	struct snipl_image *image;
+	char *text = server->problem;
+	int severity = server->problem_class;
 
+	if (server->parms.output != SNIPL_OUTPUT_JSON)
+		return;
+	server->problem = NULL;
 	snipl_for_each_image(server, image) {
-		switch (server->parms.image_op) {
-			/* same operation on every image */
-		case ACTIVATE:
-			ret = snipl_activate(image);
-			break;
-		case STOP:
-			ret = snipl_stop(image);
-			break;
-		case LOAD:
-			ret = snipl_load(image);
-			break;
-		case SCSILOAD:
-			ret = snipl_scsiload(image);
-			break;
-		case SCSIDUMP:
-			ret = snipl_scsidump(image);
-			break;
-		case DEACTIVATE:
-			ret = snipl_deactivate(image);
-			break;
-		case RESET:
-			ret = snipl_reset(image);
-			break;
-		case DIALOG:
-			ret = snipl_dialog(image);
-			break;
-		case GETSTATUS:
-			ret = snipl_getstatus(image);
-			break;
-		default:
-			create_msg(server, "internal error: unknown op\n");
-			ret = INTERNAL_ERROR;
-		}
-		print_server_message(server);
-		if (!strcasecmp(server->type, "VM") && image->_next)
-			ret = snipl_login(server);
+		snipl_result_phase(snipl_result_begin(server, image,
+						      server->parms.image_op),
+				   SNIPL_PHASE_LOGIN, login_start);
+		if (text)
+			server->problem = strdup(text);
+		server->problem_class = severity;
+		snipl_result_end(server, rc);
 	}
+	/* the message still goes to stderr */
+	server->problem = text;
+	server->problem_class = severity;
+}
 
-logout:
-	print_server_message(server);
-	temp_ret = snipl_logout(server);
-	if (!ret)
-		ret = temp_ret;
-out:
-	print_server_message(server);
-	return ret;
+
+/*
+ * routing marks of the images of a z/VM SSI cluster, see ssi_processing
+ */
+#define SSI_CACHED		1	/* placed by the status cache */
+#define SSI_MISROUTED		2	/* not active on that member */
+#define SSI_RS_NOT_ACTIVE	12	/* "Image Not Active" of SMAPI */
+
+/*
+ * check if the member that an SSI image was sent to by the status cache
+ * answered that the image is not active there. The cache was stale then,
+ * the image may be active on another member.
+ */
+static int ssi_misrouted(struct snipl_image *image, int op,
+			 const struct snipl_result *res)
+{
+	if (image->_ssi != SSI_CACHED || !res)
+		return 0;
+	if (op != ACTIVATE && op != DEACTIVATE && op != RESET && op != STOP)
+		return 0;
+	/* RC 0 for a deactivate, RC 200 for the other operations */
+	return (res->api_rc == 0 || res->api_rc == 200) &&
+		res->api_rs == SSI_RS_NOT_ACTIVE;
 }
 
 
 /*
- *	function: main
+ *	function: image_request
  *
- *	purpose: point of control
+ *	purpose: start a result record and perform op on image. SMAPI
+ *		 closes the connection after each request, so VM needs a
+ *		 new login for every request but the first one. The login
+ *		 is charged to the record of the request it is done for.
+ *		 The caller completes the record with snipl_result_end.
+ *
+ *	returns the return code of the login or the operation
  */
+static int image_request(struct snipl_image *image, int op,
+			 struct session *session)
+{
+	struct snipl_server *server = image->server;
+	short load_timeout = server->parms.load_timeout;
+	struct snipl_result *res;
+	struct snipl_learn learn;
+	int ret = 0;
+
+	server->_busy = 0;
+	if (snipl_time_left(server) <= 0) {
+		snipl_result_begin(server, image, op);
+		create_msg(server, "%s: not processed, deadline exceeded\n",
+			   image->name);
+		server->problem_class = FATAL;
+		return DEADLINE_EXCEEDED;
+	}
+	if (session->used && !strcasecmp(server->type, "VM")) {
+		clock_gettime(CLOCK_REALTIME, &session->login_start);
+		session->login_pending = 1;
+		snipl_learn_begin(server, "login", &learn);
+		ret = snipl_login(server);
+		snipl_learn_end(server, &learn, ret);
+	}
+	session->used = 1;
+	res = snipl_result_begin(server, image, op);
+	if (session->login_pending)
+		snipl_result_phase(res, SNIPL_PHASE_LOGIN,
+				   &session->login_start);
+	session->login_pending = 0;
+	if (!ret) {
+		snipl_learn_begin(server, snipl_op_name(op), &learn);
+		if (op == LOAD && load_timeout == UNDEFINED &&
+		    server->learned_timeout)
+			/* the SE limit in seconds, 60 to 600 */
+			server->parms.load_timeout =
+				server->learned_timeout / 1000 < 60 ? 60 :
+				server->learned_timeout / 1000;
+		ret = image_operation(image, op);
+		snipl_learn_end(server, &learn, ret);
+		server->parms.load_timeout = load_timeout;
+	}
+	if (ret && snipl_time_left(server) <= 0) {
+		/* the timeouts were cut short */
+		append_msg(server, "%s: deadline exceeded\n", image->name);
+		server->problem_class = FATAL;
+		ret = DEADLINE_EXCEEDED;
+	} else if (ssi_misrouted(image, op, res)) {
+		/* the result is the one of the member that hosts it */
+		image->_ssi = SSI_MISROUTED;
+		append_msg(server, "%s: not active on %s, placed there by the "
+			   "status cache, tried again\n", image->name,
+			   server->address);
+		server->problem_class = WARNING;
+		ret = 0;
+	}
+	return ret;
+}
 
-/*****************************************************************/
-int main(int argc, char **argv)
+
+/*
+ * check if an image is in state want. A logged on z/VM guest counts
+ * as operating.
+ */
+static int state_reached(struct snipl_server *server, int state, int want)
 {
-	int ret, temp_ret;
-	char* cfgname;
-	char password[80];
-	struct snipl_server *server;
-	struct snipl_configuration *conf = NULL;
-	struct snipl_image *imag = NULL;
-	struct snipl_image *image = NULL;
+	if (want == SNIPL_IMAGE_INACTIVE)
+		return state == SNIPL_IMAGE_INACTIVE;
+	if (want == SNIPL_IMAGE_OPERATING && strcasecmp(server->type, "VM"))
+		return state == SNIPL_IMAGE_OPERATING;
+	return state == SNIPL_IMAGE_ACTIVE || state == SNIPL_IMAGE_OPERATING;
+}
 
-	if (!(server = calloc(1, sizeof (*server)))) {
-		fprintf(stderr, "cannot allocate buffer for server\n");
-		return STORAGE_PROBLEM;
-	}
 
-	server->parms = (struct snipl_parms) {
-		.force = UNDEFINED,
-		.clear = UNDEFINED,
-		.store_stat = UNDEFINED,
-		.load_timeout = UNDEFINED,
-		.scsiload_bps = UNDEFINED,
-		.msg_timeout = UNDEFINED,
-		.image_op = OPUNKNOWN,
-	};
+/*
+ * milliseconds since start (CLOCK_MONOTONIC)
+ */
+static long msecs_since(const struct timespec *start)
+{
+	struct timespec now;
 
-	ret = 0;
-	temp_ret = 0;
-	cfgname = NULL;
-	ret = parse_command_input(argc, argv, server, &cfgname);
-	if (ret < 0) {
-		ret = 0;
-		goto free_all;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
 
-	if (!server->_images && server->parms.image_op != LIST &&
-		ret != UNKNOWN_PARAMETER) {
-		fprintf(stderr, "Missing image name(s)\n");
-		ret = MISSING_IMAGENAME;
-		goto free_all;
-	}
-	if (server->parms.image_op == DIALOG &&
-		server->_images && server->_images->_next) {
-		fprintf(stderr, "More than one image name specified for DIALOG "
-			"operation\n");
-		ret = MORE_THAN_ONE_IMAGE;
-		goto free_all;
-	}
-	if (ret)
-		goto free_all;
 
-	if (server->password_prompt) {
-		server->password = password;
-		prompt_for_password(server->password);
-	}
+static long msecs_between(const struct timespec *from,
+			  const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
 
-	conf = configfile_handling(cfgname, server);
-        /* continue, even if CONFIG_FILE_ERROR */
 
-	if (!server->address) {
-		fprintf(stderr, "%s: missing server ipaddr\n\n", argv[0]);
-		ret = MISSING_SERVER;
-		goto free_all;
-	}
-	server->_next = NULL;
+/* one writer at a time on stdout and stderr, for threads */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	if (server->parms.image_op == OPUNKNOWN) {
-		fprintf(stderr, "Please specify one of the parameters:\n");
-		fprintf(stderr, "   -a --activate\n   -r --reset\n");
-		fprintf(stderr, "   -d --deactivate\n   -x --listimages\n");
-		fprintf(stderr, "   -g --getstatus\n");
-		if (!strcasecmp(server->type, "LPAR")) {
-			fprintf(stderr,	"   -o --stop\n   -l --load\n");
-			fprintf(stderr, "   -s --scsiload\n   -D --scsidump\n");
-			fprintf(stderr,	"   -i --dialog\n");
-		}
-		ret = NO_COMMAND;
-		goto free_all;
-	}
+static void locked_sink(struct snipl_server *server, struct snipl_result *res)
+{
+	pthread_mutex_lock(&output_lock);
+	if (server->parms.output == SNIPL_OUTPUT_JSON)
+		json_sink(server, res);
+	else
+		text_sink(server, res);
+	pthread_mutex_unlock(&output_lock);
+}
 
-	if (server->parms.image_op == LIST && !conf &&
+static void locked_server_message(struct snipl_server *server)
+{
+	pthread_mutex_lock(&output_lock);
+	print_server_message(server);
+	pthread_mutex_unlock(&output_lock);
+}
+
+
+/*
+ * state of the current record of server, unknown if there is none
+ */
+static int request_state(struct snipl_server *server)
+{
+	return server->_result ? server->_result->state : SNIPL_IMAGE_UNKNOWN;
+}
+
+
+/*
+ * the state of all images of server with one query_active request into
+ * state, in the order of the images. Returns -1 if the server type has
+ * no such request or it failed, the caller then asks every image.
+ */
+static int ensure_query(struct snipl_server *server, struct session *session,
+			int *state)
+{
+	struct snipl_image *image;
+	struct snipl_learn learn;
+	char **names, **name;
+	unsigned int i;
+	int rc = 0;
+
+	if (!server->ops->query_active || snipl_time_left(server) <= 0)
+		return -1;
+	if (session->used) {
+		snipl_learn_begin(server, "login", &learn);
+		rc = snipl_login(server);
+		snipl_learn_end(server, &learn, rc);
+	}
+	session->used = 1;
+	if (!rc)
+		rc = snipl_query_active(server, &names);
+	if (rc) {
+		free(server->problem);
+		server->problem = NULL;
+		return -1;
+	}
+	i = 0;
+	snipl_for_each_image(server, image) {
+		state[i] = SNIPL_IMAGE_INACTIVE;
+		for (name = names; *name; name++)
+			if (!strcasecmp(*name, image->name))
+				state[i] = SNIPL_IMAGE_ACTIVE;
+		i++;
+	}
+	free(names);
+	return 0;
+}
+
+
+/*
+ * the status record of image for a state found by ensure_query
+ */
+static void ensure_status(struct snipl_image *image, int state)
+{
+	struct snipl_server *server = image->server;
+
+	snipl_result_begin(server, image, GETSTATUS);
+	snipl_result_state(server, state, 0, NULL);
+	create_msg(server, "status of %s: %s\n", image->name,
+		   snipl_state_name(state));
+	server->problem_class = OK;
+}
+
+
+/*
+ *	function: ensure_state
+ *
+ *	purpose: bring all images into the state requested with --ensure.
+ *		 A status sweep finds the images that differ and only these
+ *		 get the operation. Then their new state is confirmed,
+ *		 repeated every 2 seconds until server->timeout has passed.
+ *		 A sweep is one query of all active images where the server
+ *		 type has it (z/VM SMAPI), otherwise a getstatus per image.
+ *		 For an LPAR server the first sweep takes the status read by
+ *		 the login, which enumerates the images anyway.
+ *		 Intermediate status records are not reported.
+ *
+ *	returns 0 or the return code of the last image that failed
+ */
+static int ensure_state(struct snipl_server *server, struct session *session)
+{
+	struct snipl_results *results = server->results;
+	snipl_result_sink sink = results->sink;
+	int want = server->parms.ensure;
+	struct snipl_image *image;
+	struct timespec start;
+	unsigned int i, images;
+	int *confirm, *state;
+	int ret, rc, pending, last, bulk;
+	long elapsed;
+
+	images = 0;
+	snipl_for_each_image(server, image)
+		images++;
+	confirm = calloc(images, sizeof(*confirm));
+	state = calloc(images, sizeof(*state));
+	if (!confirm || !state) {
+		free(confirm);
+		free(state);
+		create_msg(server, "cannot allocate buffer for --ensure\n");
+		server->problem_class = FATAL;
+		return STORAGE_PROBLEM;
+	}
+
+	/* status sweep, report the images that need no operation */
+	ret = 0;
+	pending = 0;
+	bulk = !ensure_query(server, session, state);
+	i = 0;
+	snipl_for_each_image(server, image) {
+		results->sink = NULL;
+		if (bulk) {
+			ensure_status(image, state[i]);
+			rc = 0;
+		} else
+			rc = image_request(image, GETSTATUS, session);
+		if (state_reached(server, request_state(server), want)) {
+			create_msg(server, "%s: already %s\n", image->name,
+				   snipl_state_name(request_state(server)));
+			server->problem_class = OK;
+			results->sink = sink;
+			rc = 0;
+		} else
+			confirm[i] = 1;
+		snipl_result_end(server, rc);
+		i++;
+	}
+	results->sink = sink;
+
+	/* activate or deactivate the others */
+	i = 0;
+	snipl_for_each_image(server, image) {
+		if (confirm[i]) {
+			rc = image_request(image, server->parms.image_op,
+					   session);
+			snipl_result_end(server, rc);
+			if (rc) {
+				confirm[i] = 0;
+				ret = rc;
+			} else
+				pending++;
+		}
+		i++;
+	}
+
+	/* confirm the new state */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (pending) {
+		elapsed = msecs_since(&start);
+		last = elapsed >= server->timeout ||
+			snipl_time_left(server) <= 2000;
+		pending = 0;
+		bulk = !ensure_query(server, session, state);
+		i = 0;
+		snipl_for_each_image(server, image) {
+			if (!confirm[i++])
+				continue;
+			results->sink = NULL;
+			if (bulk) {
+				ensure_status(image, state[i - 1]);
+				rc = 0;
+			} else
+				rc = image_request(image, GETSTATUS, session);
+			if (state_reached(server, request_state(server), want)) {
+				create_msg(server, "%s: now %s\n", image->name,
+					   snipl_state_name(request_state(server)));
+				server->problem_class = OK;
+				results->sink = sink;
+				confirm[i - 1] = 0;
+				rc = 0;
+			} else if (rc == DEADLINE_EXCEEDED) {
+				results->sink = sink;
+				confirm[i - 1] = 0;
+				ret = rc;
+			} else if (last) {
+				create_msg(server, "%s: not %s after %li ms, "
+					   "state is %s\n", image->name,
+					   snipl_state_name(want), elapsed,
+					   snipl_state_name(request_state(server)));
+				server->problem_class = FATAL;
+				results->sink = sink;
+				rc = ret = STATE_NOT_REACHED;
+			} else
+				pending++;
+			snipl_result_end(server, rc);
+		}
+		results->sink = sink;
+		if (pending)
+			sleep(2);
+	}
+	free(confirm);
+	free(state);
+	return ret;
+}
+
+
+/*
+ *	function: wave_processing
+ *
+ *	purpose: perform the operation on waves of wave_size images to
+ *		 avoid a boot storm. The next wave starts when wave_fraction
+ *		 percent of the acknowledged images of the current wave meet
+ *		 the wave gate: acknowledged, active or operating. The gate
+ *		 is polled every 2 seconds for at most server->timeout.
+ *		 The timing of every wave is reported.
+ *
+ *	returns 0 or the return code of the last image that failed
+ */
+static int wave_processing(struct snipl_server *server, struct session *session)
+{
+	struct snipl_results *results = server->results;
+	snipl_result_sink sink = results->sink;
+	int size = server->parms.wave_size;
+	int gate = server->parms.wave_gate;
+	int fraction = server->parms.wave_fraction;
+	struct snipl_image **wave, *image;
+	struct timespec start, wave_start;
+	int *waiting;
+	int n, i, acked, need, met, waves, total;
+	int ret, rc;
+
+	wave = calloc(size, sizeof(*wave));
+	waiting = calloc(size, sizeof(*waiting));
+	if (!wave || !waiting) {
+		free(wave);
+		free(waiting);
+		create_msg(server, "cannot allocate buffer for waves\n");
+		server->problem_class = FATAL;
+		return STORAGE_PROBLEM;
+	}
+	if (!fraction)
+		fraction = 100;
+
+	ret = 0;
+	waves = 0;
+	total = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	image = server->_images;
+	while (image) {
+		/* start the wave */
+		clock_gettime(CLOCK_MONOTONIC, &wave_start);
+		acked = 0;
+		for (n = 0; image && n < size; image = image->_next, n++) {
+			wave[n] = image;
+			rc = image_request(image, server->parms.image_op,
+					   session);
+			snipl_result_end(server, rc);
+			waiting[n] = !rc;
+			if (rc)
+				ret = rc;
+			else
+				acked++;
+		}
+		waves++;
+		total += n;
+
+		/* wait for the gate, the status records are not reported */
+		need = (acked * fraction + 99) / 100;
+		met = gate == SNIPL_IMAGE_UNKNOWN ? acked : 0;
+		while (met < need) {
+			for (i = 0; i < n && met < need; i++) {
+				if (!waiting[i])
+					continue;
+				results->sink = NULL;
+				rc = image_request(wave[i], GETSTATUS, session);
+				if (state_reached(server, request_state(server),
+						  gate)) {
+					waiting[i] = 0;
+					met++;
+				}
+				snipl_result_end(server, rc);
+			}
+			results->sink = sink;
+			if (met >= need ||
+			    msecs_since(&wave_start) >= server->timeout ||
+			    snipl_time_left(server) <= 2000)
+				break;
+			sleep(2);
+		}
+
+		fprintf(info_stream(server), "wave %i: %i images, %i "
+			"acknowledged, %i of %i %s after %li ms%s\n", waves, n,
+			acked, met, need, gate == SNIPL_IMAGE_UNKNOWN ?
+			"acknowledged" : snipl_state_name(gate),
+			msecs_since(&wave_start),
+			met < need ? ", gate not met" : "");
+	}
+	fprintf(info_stream(server), "%i waves, %i images done after %li ms\n",
+		waves, total, msecs_since(&start));
+	free(waiting);
+	free(wave);
+	return ret;
+}
+
+
+/*
+ * --parallel: the requests to a server run on up to parms.parallel
+ * logins at the same time. The window of requests in flight grows by
+ * one per window of requests answered in less than twice the fastest
+ * time and is halved when the server is busy or does not answer in
+ * time. A request that met a busy server is sent again after a backoff
+ * with jitter. The window the run settled at starts the next run.
+ */
+#define PARALLEL_FACILITY	"parallel"
+#define PARALLEL_RETRIES	5	/* sends of a request that meets busy */
+#define PARALLEL_BACKOFF	500	/* ms, doubled for every retry */
+
+enum parallel_state {
+	PARALLEL_WAITING,
+	PARALLEL_RUNNING,
+	PARALLEL_DONE,
+};
+
+struct parallel_item {
+	int state;			/* enum parallel_state */
+	int tries;
+	struct timespec not_before;	/* CLOCK_MONOTONIC */
+};
+
+struct parallel_run {
+	struct snipl_server *server;	/* of the command line */
+	pthread_mutex_t lock;		/* protects all but server */
+	pthread_cond_t cond;		/* signalled when a request ends */
+	struct parallel_item *item;	/* one per image */
+	int nr_items;
+	int done;
+	double window;			/* requests allowed in flight */
+	int limit;			/* workers with a login */
+	int in_flight;
+	int top;			/* largest window reached */
+	long fastest;			/* ms of the fastest request */
+	struct timespec last_cut;	/* when the window was halved */
+	int busy;
+	int retries;
+	int ret;
+};
+
+struct parallel_worker {
+	struct parallel_run *run;
+	struct snipl_server *server;	/* of the command line or a clone */
+	struct snipl_image **image;	/* the images of server by item */
+	struct session *session;
+	struct session own_session;
+	int connected;
+	unsigned int seed;		/* of the backoff jitter */
+	pthread_t thread;
+	int started;
+};
+
+
+static void parallel_key(struct snipl_server *server, char *key, size_t len)
+{
+	snprintf(key, len, "%s:%d", server->address, server->port);
+}
+
+
+/*
+ * the window to start with: the one the last run settled at
+ */
+static double parallel_start_window(struct snipl_server *server, int limit)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+	char value[SNIPL_STATE_VALUE_LEN];
+	time_t stamp;
+	int window;
+
+	parallel_key(server, key, sizeof(key));
+	if (snipl_state_get(PARALLEL_FACILITY, key, value, &stamp) ||
+	    sscanf(value, "window=%i", &window) != 1 || window < 1)
+		return 1;
+	return window > limit ? limit : window;
+}
+
+
+static void parallel_save_window(struct snipl_server *server, double window)
+{
+	char key[SNIPL_STATE_VALUE_LEN];
+	char value[SNIPL_STATE_VALUE_LEN];
+
+	parallel_key(server, key, sizeof(key));
+	snprintf(value, sizeof(value), "window=%i", (int)window);
+	snipl_state_put(PARALLEL_FACILITY, key, value);
+}
+
+
+/*
+ * clone the server of the command line with a copy of its image list
+ * for another login. The copy of image i is stored in image[i].
+ */
+static struct snipl_server *parallel_clone(struct snipl_server *server,
+					   struct snipl_image **image)
+{
+	struct snipl_server *clone;
+	struct snipl_image *orig, *copy, **tail;
+	int i;
+
+	clone = calloc(1, sizeof(*clone));
+	if (!clone)
+		return NULL;
+	*clone = (struct snipl_server) {
+		.address = server->address,
+		.type = server->type,
+		.user = server->user,
+		.password = server->password,
+		.sslfingerprint = server->sslfingerprint,
+		.port = server->port,
+		.enc = server->enc,
+		.timeout = server->timeout,
+		.timeout_given = server->timeout_given,
+		.parms = server->parms,
+		.deadline = server->deadline,
+	};
+	i = 0;
+	tail = &clone->_images;
+	snipl_for_each_image(server, orig) {
+		copy = calloc(1, sizeof(*copy));
+		if (copy)
+			copy->name = strdup(orig->name);
+		if (!copy || !copy->name) {
+			free(copy);
+			return clone;
+		}
+		copy->alias = orig->alias;
+		copy->server = clone;
+		copy->_ssi = orig->_ssi;
+		*tail = copy;
+		tail = &copy->_next;
+		image[i++] = copy;
+	}
+	return clone;
+}
+
+
+static void parallel_clone_free(struct snipl_server *clone)
+{
+	struct snipl_image *image, *next;
+
+	for (image = clone->_images; image; image = next) {
+		next = image->_next;
+		free(image->name);
+		free(image);
+	}
+	snipl_async_free(clone);
+	snipl_results_free(clone);
+	free(clone);
+}
+
+
+/*
+ * the next item that may be sent or -1. *wait is set to the ms until
+ * the next backoff ends, -1 if no item is backing off. Called locked.
+ */
+static int parallel_take(struct parallel_run *run, long *wait)
+{
+	struct parallel_item *item;
+	struct timespec now;
+	long ms;
+	int i;
+
+	*wait = -1;
+	if (run->in_flight >= (int)run->window)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < run->nr_items; i++) {
+		item = &run->item[i];
+		if (item->state != PARALLEL_WAITING)
+			continue;
+		ms = msecs_between(&now, &item->not_before);
+		if (ms <= 0)
+			return i;
+		if (*wait < 0 || ms < *wait)
+			*wait = ms;
+	}
+	return -1;
+}
+
+
+/*
+ * adjust the window to the outcome rc of a request that started at
+ * start and took ms. Returns 1 if the request is to be sent again. Called
+ * locked.
+ */
+static int parallel_adjust(struct parallel_worker *w, int i, int rc,
+			   int busy, const struct timespec *start, long ms)
+{
+	struct parallel_run *run = w->run;
+	struct parallel_item *item = &run->item[i];
+	long backoff;
+
+	if (!busy) {
+		if (rc)
+			return 0;
+		if (!run->fastest || ms < run->fastest)
+			run->fastest = ms;
+		if (ms <= 2 * run->fastest) {
+			run->window += 1 / run->window;
+			if (run->window > run->limit)
+				run->window = run->limit;
+			if ((int)run->window > run->top)
+				run->top = (int)run->window;
+		}
+		return 0;
+	}
+
+	/* one cut per window, the requests sent before it saw the old one */
+	run->busy++;
+	if (msecs_between(&run->last_cut, start) >= 0) {
+		run->window /= 2;
+		if (run->window < 1)
+			run->window = 1;
+		clock_gettime(CLOCK_MONOTONIC, &run->last_cut);
+	}
+	if (++item->tries >= PARALLEL_RETRIES)
+		return 0;
+	backoff = PARALLEL_BACKOFF << (item->tries - 1);
+	backoff = backoff / 2 + rand_r(&w->seed) % (backoff + 1);
+	if (snipl_time_left(w->server) <= backoff + 2000)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &item->not_before);
+	item->not_before.tv_sec += backoff / 1000;
+	item->not_before.tv_nsec += (backoff % 1000) * 1000000;
+	if (item->not_before.tv_nsec >= 1000000000) {
+		item->not_before.tv_sec++;
+		item->not_before.tv_nsec -= 1000000000;
+	}
+	run->retries++;
+	return 1;
+}
+
+
+/*
+ * login of a clone at its first request. If it fails the server has
+ * one login less for the run.
+ */
+static int parallel_connect(struct parallel_worker *w)
+{
+	struct parallel_run *run = w->run;
+	struct snipl_server *server = w->server;
+	int ret;
+
+	clock_gettime(CLOCK_REALTIME, &w->session->login_start);
+	ret = snipl_connect(server);
+	if (!ret) {
+		w->connected = 1;
+		return 0;
+	}
+	locked_server_message(server);
+	pthread_mutex_lock(&run->lock);
+	run->limit--;
+	if (run->window > run->limit)
+		run->window = run->limit;
+	pthread_mutex_unlock(&run->lock);
+	return ret;
+}
+
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel_worker *w = arg;
+	struct parallel_run *run = w->run;
+	struct snipl_server *server = w->server;
+	struct timespec start, until;
+	long wait, ms;
+	int i, rc, busy, again;
+
+	pthread_mutex_lock(&run->lock);
+	while (run->done < run->nr_items) {
+		i = parallel_take(run, &wait);
+		if (i < 0) {
+			if (wait < 0) {
+				pthread_cond_wait(&run->cond, &run->lock);
+				continue;
+			}
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += wait / 1000;
+			until.tv_nsec += (wait % 1000) * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&run->cond, &run->lock, &until);
+			continue;
+		}
+		run->item[i].state = PARALLEL_RUNNING;
+		run->in_flight++;
+		pthread_mutex_unlock(&run->lock);
+
+		if (!w->connected && parallel_connect(w)) {
+			/* leave the image to the other logins */
+			pthread_mutex_lock(&run->lock);
+			run->item[i].state = PARALLEL_WAITING;
+			run->in_flight--;
+			pthread_cond_broadcast(&run->cond);
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rc = image_request(w->image[i], server->parms.image_op,
+				   w->session);
+		ms = msecs_since(&start);
+		busy = server->_busy && rc != DEADLINE_EXCEEDED;
+
+		pthread_mutex_lock(&run->lock);
+		run->in_flight--;
+		again = parallel_adjust(w, i, rc, busy, &start, ms);
+		if (again) {
+			run->item[i].state = PARALLEL_WAITING;
+		} else {
+			run->item[i].state = PARALLEL_DONE;
+			run->done++;
+			if (rc)
+				run->ret = rc;
+		}
+		pthread_cond_broadcast(&run->cond);
+		pthread_mutex_unlock(&run->lock);
+
+		/* the record of a request sent again is not reported */
+		if (again)
+			server->results->sink = NULL;
+		snipl_result_end(server, rc);
+		server->results->sink = locked_sink;
+		pthread_mutex_lock(&run->lock);
+	}
+	pthread_mutex_unlock(&run->lock);
+
+	/* every login awaits the asynchronous operations it started */
+	if (server->_async) {
+		rc = snipl_async_wait(server);
+		pthread_mutex_lock(&run->lock);
+		if (rc)
+			run->ret = rc;
+		pthread_mutex_unlock(&run->lock);
+	}
+	return NULL;
+}
+
+
+/*
+ *	function: parallel_processing
+ *
+ *	purpose: perform the operation on the images of server with up to
+ *		 parms.parallel requests in flight. The first worker uses
+ *		 the login of the command line, every other one logs in
+ *		 with its own clone of server at its first request. The
+ *		 window the requests settled at is reported and kept in the
+ *		 state file for the next run.
+ *
+ *	returns 0 or the return code of the last image that failed
+ */
+static int parallel_processing(struct snipl_server *server,
+			       struct session *session)
+{
+	snipl_result_sink sink = server->results->sink;
+	struct parallel_worker *worker, *w;
+	struct parallel_run run;
+	struct snipl_image *image;
+	struct timespec start;
+	int n, i, j, images, ret;
+
+	memset(&run, 0, sizeof(run));
+	images = 0;
+	snipl_for_each_image(server, image)
+		images++;
+	n = server->parms.parallel < images ? server->parms.parallel : images;
+	if (n < 1)
+		n = 1;
+	run.server = server;
+	run.nr_items = images;
+	run.limit = n;
+	run.window = run.top = parallel_start_window(server, n);
+	run.item = calloc(images ? images : 1, sizeof(*run.item));
+	worker = calloc(n, sizeof(*worker));
+	if (!run.item || !worker) {
+		free(run.item);
+		free(worker);
+		create_msg(server, "cannot allocate buffer for parallel "
+			   "requests\n");
+		server->problem_class = FATAL;
+		return STORAGE_PROBLEM;
+	}
+
+	ret = 0;
+	for (i = 0; i < n; i++) {
+		w = &worker[i];
+		w->run = &run;
+		w->seed = time(NULL) ^ (i << 16) ^ getpid();
+		w->image = calloc(images ? images : 1, sizeof(*w->image));
+		if (!w->image) {
+			ret = STORAGE_PROBLEM;
+			break;
+		}
+		if (!i) {
+			w->server = server;
+			w->session = session;
+			w->connected = 1;
+			images = 0;
+			snipl_for_each_image(server, image)
+				w->image[images++] = image;
+			continue;
+		}
+		w->server = parallel_clone(server, w->image);
+		if (!w->server || !w->image[images - 1] ||
+		    snipl_results_alloc(w->server, 1)) {
+			ret = STORAGE_PROBLEM;
+			break;
+		}
+		w->server->results->sink = locked_sink;
+		w->session = &w->own_session;
+		w->session->login_pending = 1;
+	}
+	if (ret) {
+		create_msg(server, "cannot allocate buffer for parallel "
+			   "requests\n");
+		server->problem_class = FATAL;
+		goto out;
+	}
+
+	/* the first worker is this thread */
+	server->results->sink = locked_sink;
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.cond, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run.last_cut = start;
+	for (i = 1; i < n; i++) {
+		if (!pthread_create(&worker[i].thread, NULL, parallel_worker,
+				    &worker[i])) {
+			worker[i].started = 1;
+			continue;
+		}
+		pthread_mutex_lock(&run.lock);
+		run.limit--;
+		if (run.window > run.limit)
+			run.window = run.limit;
+		pthread_mutex_unlock(&run.lock);
+	}
+	parallel_worker(&worker[0]);
+	for (i = 1; i < n; i++)
+		if (worker[i].started)
+			pthread_join(worker[i].thread, NULL);
+	pthread_cond_destroy(&run.cond);
+	pthread_mutex_destroy(&run.lock);
+	server->results->sink = sink;
+
+	ret = run.ret;
+	fprintf(info_stream(server), "parallel: %i images, window settled "
+		"at %i of %i (largest %i), %i busy, %i retries after %li ms\n",
+		run.nr_items, (int)run.window, n, run.top, run.busy,
+		run.retries, msecs_since(&start));
+	parallel_save_window(server, run.window);
+
+out:
+	for (i = 1; i < n; i++) {
+		w = &worker[i];
+		if (!w->server)
+			continue;
+		if (w->connected) {
+			snipl_logout(w->server);
+			locked_server_message(w->server);
+		}
+		/* a misrouted image is tried again by ssi_processing */
+		for (j = 0; j < images && worker[0].image; j++)
+			if (w->image[j] && w->image[j]->_ssi == SSI_MISROUTED)
+				worker[0].image[j]->_ssi = SSI_MISROUTED;
+		parallel_clone_free(w->server);
+	}
+	for (i = 0; i < n; i++)
+		free(worker[i].image);
+	free(worker);
+	free(run.item);
+	return ret;
+}
+
+
+/*
+ * move the image *prev from the image list of server to the end of the
+ * list *done. It is not used for a login, so the name is final.
+ */
+static void move_image(struct snipl_server *server, struct snipl_image **prev,
+		       struct snipl_image **done)
+{
+	struct snipl_image *image = *prev;
+
+	if (!strcasecmp(server->type, "VM"))
+		replace_char(image->name, 0x0a, '-');
+	*prev = image->_next;
+	image->_next = NULL;
+	while (*done)
+		done = &(*done)->_next;
+	*done = image;
+}
+
+
+/*
+ *	function: cached_status
+ *
+ *	purpose: answer getstatus from the status cache for the images with
+ *		 a status read at most --status-cache seconds ago by any
+ *		 snipl process. These images are moved from the image list
+ *		 of server to *done, only the others are sent to the
+ *		 server.
+ *
+ *	returns 0 or the return code of the last cached status that failed
+ */
+static int cached_status(struct snipl_server *server,
+			 struct snipl_image **done)
+{
+	struct snipl_cache_entry entry;
+	struct snipl_result *res;
+	struct snipl_image *image, **prev;
+	int ret = 0;
+
+	prev = &server->_images;
+	while ((image = *prev)) {
+		if (snipl_cache_get(server, image->name,
+				    server->parms.status_cache, &entry)) {
+			prev = &image->_next;
+			continue;
+		}
+		move_image(server, prev, done);
+
+		res = snipl_result_begin(server, image, GETSTATUS);
+		if (res)
+			res->cached = 1;
+		snipl_result_api(server, entry.api_rc, entry.api_rs);
+		snipl_result_state(server, entry.state, entry.status, NULL);
+		create_msg(server, "status of %s: %s (cached %li s ago)\n",
+			   image->name, snipl_state_name(entry.state),
+			   (long)(time(NULL) - entry.stamp));
+		server->problem_class = entry.rc ? FATAL : OK;
+		snipl_result_end(server, entry.rc);
+		if (entry.rc)
+			ret = entry.rc;
+	}
+	return ret;
+}
+
+
+/*
+ *	function: daemon_processing
+ *
+ *	purpose: let snipld perform the operation on the images it serves,
+ *		 with its logins and the credentials of its configuration
+ *		 file. These images are moved from the image list of server
+ *		 to *done, the others are left to the login of snipl, all
+ *		 of them if snipld does not run. An image whose request
+ *		 was sent but not answered fails, snipld may still do it.
+ *
+ *	returns 0 or the return code of the last image snipld failed on
+ */
+static int daemon_processing(struct snipl_server *server,
+			     struct snipl_image **done)
+{
+	struct snipld_conn *conn;
+	struct snipl_image *image, **prev;
+	int ret = 0, rc;
+
+	conn = snipld_open();
+	if (!conn)
+		return 0;
+	prev = &server->_images;
+	while ((image = *prev)) {
+		switch (snipld_call(conn, image, server->parms.image_op, &rc)) {
+		case 0:
+			move_image(server, prev, done);
+			snipl_result_end(server, rc);
+			if (rc)
+				ret = rc;
+			break;
+		case 1:
+			prev = &image->_next;
+			break;
+		case 2:
+			/* snipld may still do it, never do it twice */
+			move_image(server, prev, done);
+			snipl_result_end(server, rc);
+			ret = rc;
+			/* fall through */
+		default:
+			/* snipld ended, the rest is done without it */
+			snipld_close(conn);
+			return ret;
+		}
+	}
+	snipld_close(conn);
+	return ret;
+}
+
+
+/*
+ *	function: command_processing
+ *
+ *	purpose: point of control
+ */
+
+/*****************************************************************/
+static int command_processing(struct snipl_server *server)
+{
+	int ret;
+	struct snipl_image *image, *done = NULL, **tail;
+	struct session session = {.login_pending = 1};
+	unsigned int images;
+	int op = server->parms.image_op;
+	int temp_ret, done_ret = 0;
+
+	/* one result record per image */
+	images = 0;
+	snipl_for_each_image(server, image)
+		images++;
+	ret = snipl_results_alloc(server, images);
+	if (ret) {
+		create_msg(server, "cannot allocate result records\n");
+		server->problem_class = FATAL;
+		locked_server_message(server);
+		return ret;
+	}
+	/*
+	 * the members of an SSI cluster run in threads, see ssi_processing,
+	 * records and messages are written under output_lock
+	 */
+	server->results->sink = locked_sink;
+
+	if (server->parms.image_op == LIST && !strcasecmp(server->type, "VM")) {
+		listimages(server);
+		goto out;
+	}
+
+	if (server->parms.status_cache) {
+		done_ret = cached_status(server, &done);
+		if (done && !server->_images)
+			goto out;
+	}
+	if (server->parms.via_daemon && (op == ACTIVATE || op == DEACTIVATE ||
+					 op == RESET || op == STOP ||
+					 op == GETSTATUS)) {
+		temp_ret = daemon_processing(server, &done);
+		if (temp_ret)
+			done_ret = temp_ret;
+		if (done && !server->_images)
+			goto out;
+	}
+
+	/* now we work on our own image list */
+	clock_gettime(CLOCK_REALTIME, &session.login_start);
+	ret = snipl_connect(server);
+	if (ret && server->problem_class == CERTIFICATE_ERROR) {
+		locked_server_message(server);
+		if (snipl_confirm(server) <= 0)
+			goto logout;
+	} else if (ret) {
+		if (snipl_time_left(server) <= 0) {
+			append_msg(server, "deadline exceeded\n");
+			ret = DEADLINE_EXCEEDED;
+		}
+		connect_failed(server, ret, &session.login_start);
+		goto out;
+	}
+	DEBUG_PRINT("Login to server %s successful\n", server->address);
+
+	/*
+	 * Don't check the server type because the LIST operation for
+	 * VM type servers is handled and returned earlier.
+	 */
+	if (server->parms.image_op == LIST) {
+		listimages(server);
+		goto logout;
+	}
+
+	/* Remove newline from image name in case of VM */
+	if (!strcasecmp(server->type, "VM")) {
+		snipl_for_each_image(server, image) {
+			replace_char(image->name, 0x0a, '-');
+		}
+	}
+
+	if (server->parms.ensure) {
+		ret = ensure_state(server, &session);
+		goto logout;
+	}
+	if (server->parms.wave_size) {
+		ret = wave_processing(server, &session);
+		goto logout;
+	}
+	if (server->parms.parallel) {
+		ret = parallel_processing(server, &session);
+		goto logout;
+	}
+
+	/* same operation on every image */
+	snipl_for_each_image(server, image) {
+		ret = image_request(image, server->parms.image_op, &session);
+		snipl_result_end(server, ret);
+	}
+
+logout:
+	/* the asynchronous operations started above end together */
+	if (server->_async) {
+		temp_ret = snipl_async_wait(server);
+		if (!ret)
+			ret = temp_ret;
+	}
+	locked_server_message(server);
+	temp_ret = snipl_logout(server);
+	if (!ret)
+		ret = temp_ret;
+out:
+	locked_server_message(server);
+	snipl_async_free(server);
+	snipl_results_free(server);
+	for (tail = &server->_images; *tail; tail = &(*tail)->_next)
+		;
+	*tail = done;
+	return ret ? ret : done_ret;
+}
+
+
+/*
+ * routing of the images to the members of a z/VM SSI cluster
+ */
+#define SSI_TTL_ENV		"SNIPL_SSI_TTL"
+#define SSI_TTL			10	/* seconds a placement is used */
+#define SSI_NONE		(-1)	/* image not active on any member */
+#define SSI_UNKNOWN		(-2)	/* placement of the image not known */
+
+struct ssi_run;
+
+/*
+ * a member of the SSI cluster of the command line server
+ */
+struct ssi_member {
+	struct ssi_run *run;
+	struct snipl_server *server;	/* of the command line or a clone */
+	struct snipl_cache_entry *entry; /* status of every image on the */
+					 /* member, state UNKNOWN = none */
+	int images;			/* routed to the member */
+	int ret;
+	pthread_t thread;
+	int started;
+};
+
+struct ssi_run {
+	struct snipl_server *server;	/* of the command line, member 0 */
+	const char *cluster;
+	struct snipl_image **image;	/* the images of server by index */
+	int *where;			/* member of every image or SSI_... */
+	int *defined;			/* member that defines every image */
+					/* in the configuration file */
+	int nr_images;
+	struct ssi_member *member;
+	int nr_members;
+};
+
+
+/*
+ *	function: ssi_server
+ *
+ *	purpose: find the definition of the command line server in the
+ *		 configuration file if it is a member of an SSI cluster
+ *
+ *	returns the definition or NULL
+ */
+static struct snipl_server *ssi_server(struct snipl_configuration *conf,
+				       struct snipl_server *server)
+{
+	struct snipl_server *serv;
+
+	if (strcasecmp(server->type, "VM"))
+		return NULL;
+	snipl_for_each_server(conf, serv)
+		if (serv->ssi && !strcasecmp(serv->type, "VM") &&
+		    !strcasecmp(serv->address, server->address) &&
+		    (!server->user || !serv->user ||
+		     !strcasecmp(serv->user, server->user)))
+			return serv;
+	return NULL;
+}
+
+
+/*
+ * a login to the member serv of the configuration file with the options
+ * of the command line server
+ */
+static struct snipl_server *ssi_clone(struct snipl_server *server,
+				      struct snipl_server *serv)
+{
+	struct snipl_server *clone;
+
+	clone = calloc(1, sizeof(*clone));
+	if (!clone)
+		return NULL;
+	*clone = (struct snipl_server) {
+		.address = serv->address,
+		.type = serv->type,
+		.user = serv->user ? serv->user : server->user,
+		.password = serv->password ? serv->password :
+				server->password,
+		.sslfingerprint = serv->sslfingerprint,
+		.ssi = serv->ssi,
+		.port = serv->port,
+		.enc = serv->enc != UNDEFINED ? serv->enc : server->enc,
+		.timeout = server->timeout,
+		.timeout_given = server->timeout_given,
+		.parms = server->parms,
+		.deadline = server->deadline,
+	};
+	return clone;
+}
+
+
+/* seconds a status of the status cache places an image */
+static int ssi_ttl(void)
+{
+	const char *env = getenv(SSI_TTL_ENV);
+	int ttl = SSI_TTL;
+
+	if (env && sscanf(env, "%d", &ttl) < 1)
+		ttl = SSI_TTL;
+	return ttl;
+}
+
+
+/*
+ * place every image that is not placed yet on the member that has it
+ * active, on none if every member has it inactive. Returns the number
+ * of images that are still not placed.
+ */
+static int ssi_place(struct ssi_run *run)
+{
+	int i, m, state, inactive, unknown = 0;
+
+	for (i = 0; i < run->nr_images; i++) {
+		if (run->where[i] != SSI_UNKNOWN)
+			continue;
+		inactive = 0;
+		for (m = 0; m < run->nr_members; m++) {
+			state = run->member[m].entry[i].state;
+			if (state == SNIPL_IMAGE_INACTIVE) {
+				inactive++;
+			} else if (state != SNIPL_IMAGE_UNKNOWN) {
+				run->where[i] = m;
+				break;
+			}
+		}
+		if (run->where[i] == SSI_UNKNOWN &&
+		    inactive == run->nr_members)
+			run->where[i] = SSI_NONE;
+		if (run->where[i] == SSI_UNKNOWN)
+			unknown++;
+	}
+	return unknown;
+}
+
+
+/*
+ *	function: ssi_refresh
+ *
+ *	purpose: read the status of the images that are not placed on
+ *		 one member, with one query of all active images or, if
+ *		 the module of the member has none, with a getstatus per
+ *		 image. The status is kept in the status cache, so the
+ *		 next runs find the images there.
+ */
+static void *ssi_refresh(void *arg)
+{
+	struct ssi_member *m = arg;
+	struct ssi_run *run = m->run;
+	struct snipl_server *server = m->server;
+	struct snipl_image *saved = server->_images;
+	struct snipl_image **copy, *image;
+	struct session session = {0};
+	struct snipl_result *res;
+	char *type = server->type;
+	char **names, **name;
+	time_t start;
+	int i, rc = 0;
+
+	copy = calloc(run->nr_images, sizeof(*copy));
+	if (!copy)
+		return NULL;
+	/* the images to read are the image list of the member meanwhile */
+	server->_images = NULL;
+	for (i = run->nr_images - 1; i >= 0; i--) {
+		if (run->where[i] != SSI_UNKNOWN)
+			continue;
+		image = calloc(1, sizeof(*image));
+		if (image)
+			image->name = strdup(run->image[i]->name);
+		if (!image || !image->name) {
+			free(image);
+			create_msg(server, "cannot allocate image buffer\n");
+			rc = STORAGE_PROBLEM;
+			goto out;
+		}
+		replace_char(image->name, 0x0a, '-');
+		image->alias = run->image[i]->alias;
+		image->server = server;
+		image->_next = server->_images;
+		server->_images = image;
+		copy[i] = image;
+	}
+
+	rc = snipl_connect(server);
+	if (rc)
+		goto out;
+	if (server->ops->query_active) {
+		/* stamped like a getstatus, see sncache.c */
+		start = time(NULL);
+		rc = snipl_query_active(server, &names);
+		for (i = 0; i < run->nr_images && !rc; i++) {
+			if (!copy[i])
+				continue;
+			m->entry[i] = (struct snipl_cache_entry) {
+				.state = SNIPL_IMAGE_INACTIVE,
+				.api_rc = UNDEFINED,
+				.api_rs = UNDEFINED,
+				.stamp = start,
+			};
+			for (name = names; *name; name++)
+				if (!strcasecmp(*name, copy[i]->name))
+					m->entry[i].state = SNIPL_IMAGE_ACTIVE;
+		}
+		if (!rc)
+			free(names);
+	} else {
+		/* a getstatus per image, its record is not reported */
+		rc = snipl_results_alloc(server, 1);
+		for (i = 0; i < run->nr_images && !rc; i++) {
+			if (!copy[i])
+				continue;
+			res = snipl_result_end(server, image_request(copy[i],
+						GETSTATUS, &session));
+			if (res && !res->rc)
+				m->entry[i] = (struct snipl_cache_entry) {
+					.state = res->state,
+					.api_rc = res->api_rc,
+					.api_rs = res->api_rs,
+					.status = res->status,
+					.stamp = res->start.tv_sec,
+				};
+			free(server->problem);
+			server->problem = NULL;
+		}
+		snipl_results_free(server);
+	}
+	snipl_logout(server);
+
+out:
+	if (rc) {
+		append_msg(server, "%s: images of SSI cluster %s not queried\n",
+			   server->address, run->cluster);
+		server->problem_class = WARNING;
+		locked_server_message(server);
+	}
+	free(server->problem);
+	server->problem = NULL;
+	for (i = 0; i < run->nr_images; i++) {
+		if (copy[i])
+			free(copy[i]->name);
+		free(copy[i]);
+	}
+	free(copy);
+	server->_images = saved;
+	server->type = type;
+	for (i = 0; i < run->nr_images; i++)
+		if (run->where[i] == SSI_UNKNOWN &&
+		    m->entry[i].state != SNIPL_IMAGE_UNKNOWN)
+			snipl_cache_put(server, run->image[i]->name,
+					&m->entry[i]);
+	return NULL;
+}
+
+
+/*
+ * place the images that are not placed yet by a query of all members
+ * at the same time. Returns the number of images still not placed.
+ */
+static int ssi_query(struct ssi_run *run)
+{
+	struct ssi_member *m;
+	int n;
+
+	for (n = 1; n < run->nr_members; n++) {
+		m = &run->member[n];
+		if (!pthread_create(&m->thread, NULL, ssi_refresh, m))
+			m->started = 1;
+	}
+	ssi_refresh(&run->member[0]);
+	for (n = 1; n < run->nr_members; n++) {
+		m = &run->member[n];
+		if (m->started)
+			pthread_join(m->thread, NULL);
+		else
+			ssi_refresh(m);
+		m->started = 0;
+	}
+	return ssi_place(run);
+}
+
+
+/*
+ *	function: ssi_locate
+ *
+ *	purpose: find the member that hosts every image, by the status
+ *		 cache and, for the images it does not place, by a query
+ *		 of all members at the same time
+ */
+static void ssi_locate(struct ssi_run *run)
+{
+	struct timespec start;
+	int i, n, ttl, unknown, cached;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ttl = ssi_ttl();
+	for (n = 0; n < run->nr_members && ttl > 0; n++)
+		for (i = 0; i < run->nr_images; i++)
+			if (snipl_cache_get(run->member[n].server,
+					    run->image[i]->name, ttl,
+					    &run->member[n].entry[i]))
+				run->member[n].entry[i].state =
+					SNIPL_IMAGE_UNKNOWN;
+	for (i = 0; i < run->nr_images; i++)
+		run->where[i] = SSI_UNKNOWN;
+	unknown = ssi_place(run);
+	cached = run->nr_images - unknown;
+	for (i = 0; i < run->nr_images; i++)
+		run->image[i]->_ssi = run->where[i] != SSI_UNKNOWN ?
+			SSI_CACHED : 0;
+	if (unknown)
+		unknown = ssi_query(run);
+	fprintf(info_stream(run->server), "SSI cluster %s: %i images, %i "
+		"placed by the status cache, %i by a query of %i members, "
+		"%i not placed after %li ms\n", run->cluster, run->nr_images,
+		cached, run->nr_images - cached - unknown, run->nr_members,
+		unknown, msecs_since(&start));
+}
+
+
+/*
+ * move every image with the routing mark mark to the image list of its
+ * member, every image if mark is 0. An image that is not active on any
+ * member, or not placed, goes to the member that defines it in the
+ * configuration file.
+ */
+static void ssi_route(struct ssi_run *run, int mark)
+{
+	struct snipl_server *server;
+	struct snipl_image *image;
+	int i, m;
+
+	for (m = 0; m < run->nr_members; m++) {
+		run->member[m].server->_images = NULL;
+		run->member[m].images = 0;
+	}
+	for (i = run->nr_images - 1; i >= 0; i--) {
+		if (mark && run->image[i]->_ssi != mark)
+			continue;
+		m = run->where[i] >= 0 ? run->where[i] : run->defined[i];
+		server = run->member[m].server;
+		image = run->image[i];
+		image->server = server;
+		image->_next = server->_images;
+		server->_images = image;
+		run->member[m].images++;
+	}
+}
+
+
+/* give all images back to the command line server, in their order */
+static void ssi_unroute(struct ssi_run *run)
+{
+	struct snipl_server *server = run->server;
+	struct snipl_image *image;
+	int i, m;
+
+	for (m = 0; m < run->nr_members; m++)
+		run->member[m].server->_images = NULL;
+	for (i = run->nr_images - 1; i >= 0; i--) {
+		image = run->image[i];
+		image->server = server;
+		image->_next = server->_images;
+		image->_ssi = 0;
+		server->_images = image;
+	}
+}
+
+
+/*
+ * the member that defines image i in the configuration file, the
+ * command line server if none does
+ */
+static int ssi_defined_by(struct ssi_run *run,
+			  struct snipl_configuration *conf,
+			  struct snipl_server *home, int i)
+{
+	const char *name = run->image[i]->name;
+	struct snipl_image *image;
+	int m;
+
+	for (image = find_next_image(conf, name, NULL, NULL); image;
+	     image = find_next_image(conf, name, NULL, image->server)) {
+		if (!ssi_same(home, image->server))
+			continue;
+		for (m = 0; m < run->nr_members; m++)
+			if (!strcasecmp(run->member[m].server->address,
+					image->server->address))
+				return m;
+	}
+	return 0;
+}
+
+
+static void *ssi_dispatch(void *arg)
+{
+	struct ssi_member *m = arg;
+	int ret;
+
+	/* a failure of the first run stays when images are tried again */
+	ret = command_processing(m->server);
+	if (ret)
+		m->ret = ret;
+	return NULL;
+}
+
+
+/*
+ * let every member work on the images routed to it at the same time
+ */
+static void ssi_run_members(struct ssi_run *run)
+{
+	struct ssi_member *m;
+	int n;
+
+	for (n = 1; n < run->nr_members; n++) {
+		m = &run->member[n];
+		if (m->images &&
+		    !pthread_create(&m->thread, NULL, ssi_dispatch, m))
+			m->started = 1;
+	}
+	if (run->member[0].images)
+		ssi_dispatch(&run->member[0]);
+	for (n = 1; n < run->nr_members; n++) {
+		m = &run->member[n];
+		if (m->started)
+			pthread_join(m->thread, NULL);
+		else if (m->images)
+			ssi_dispatch(m);
+		m->started = 0;
+	}
+}
+
+
+/*
+ *	function: ssi_retry
+ *
+ *	purpose: the status cache placed an image on a member that answered
+ *		 that the image is not active there. Query all members for
+ *		 these images, bypassing the cache, and perform the
+ *		 operation once more on the member that hosts each one.
+ */
+static void ssi_retry(struct ssi_run *run)
+{
+	int i, n, misrouted = 0;
+
+	for (i = 0; i < run->nr_images; i++) {
+		if (run->image[i]->_ssi != SSI_MISROUTED) {
+			/* not read again by ssi_refresh */
+			if (run->where[i] == SSI_UNKNOWN)
+				run->where[i] = SSI_NONE;
+			continue;
+		}
+		run->where[i] = SSI_UNKNOWN;
+		for (n = 0; n < run->nr_members; n++)
+			run->member[n].entry[i].state = SNIPL_IMAGE_UNKNOWN;
+		misrouted++;
+	}
+	if (!misrouted)
+		return;
+	fprintf(info_stream(run->server), "SSI cluster %s: %i images not "
+		"active on the member of the status cache, querying all "
+		"members\n", run->cluster, misrouted);
+	ssi_query(run);
+	ssi_route(run, SSI_MISROUTED);
+	for (i = 0; i < run->nr_images; i++)
+		if (run->image[i]->_ssi == SSI_MISROUTED)
+			run->image[i]->_ssi = 0;
+	ssi_run_members(run);
+}
+
+
+/*
+ *	function: ssi_processing
+ *
+ *	purpose: perform the operation on every image at the member of the
+ *		 SSI cluster that hosts it. The members are the VM servers
+ *		 of the configuration file with the ssi of the command line
+ *		 server home, one login per address. An image that is not
+ *		 active on any member goes to the member that defines it,
+ *		 or stays with the command line server if none does.
+ *		 The members work at the same time, each one the way
+ *		 command_processing does for a single server.
+ *
+ *	returns 0 or the return code of the last member that failed
+ */
+static int ssi_processing(struct snipl_server *server,
+			  struct snipl_configuration *conf,
+			  struct snipl_server *home)
+{
+	struct ssi_run run = {.server = server, .cluster = home->ssi};
+	struct snipl_server *serv;
+	struct snipl_image *image;
+	struct ssi_member *m;
+	int i, n, ret = 0;
+
+	snipl_for_each_image(server, image)
+		run.nr_images++;
+	n = 1;
+	snipl_for_each_server(conf, serv)
+		n++;
+	run.image = calloc(run.nr_images, sizeof(*run.image));
+	run.where = calloc(run.nr_images, sizeof(*run.where));
+	run.defined = calloc(run.nr_images, sizeof(*run.defined));
+	run.member = calloc(n, sizeof(*run.member));
+	if (!run.image || !run.where || !run.defined || !run.member)
+		goto nomem;
+	i = 0;
+	snipl_for_each_image(server, image)
+		run.image[i++] = image;
+
+	/* the members, one per address */
+	run.member[0].server = server;
+	run.nr_members = 1;
+	snipl_for_each_server(conf, serv) {
+		if (!serv->ssi || strcasecmp(serv->ssi, home->ssi) ||
+		    strcasecmp(serv->type, "VM"))
+			continue;
+		for (n = 0; n < run.nr_members; n++)
+			if (!strcasecmp(run.member[n].server->address,
+					serv->address))
+				break;
+		if (n < run.nr_members)
+			continue;
+		run.member[n].server = ssi_clone(server, serv);
+		if (!run.member[n].server)
+			goto nomem;
+		run.nr_members++;
+	}
+	for (n = 0; n < run.nr_members; n++) {
+		m = &run.member[n];
+		m->run = &run;
+		m->entry = calloc(run.nr_images, sizeof(*m->entry));
+		if (!m->entry)
+			goto nomem;
+	}
+	for (i = 0; i < run.nr_images; i++)
+		run.defined[i] = ssi_defined_by(&run, conf, home, i);
+	if (run.nr_members < 2) {
+		/* no other member defined, nothing to route */
+		ret = command_processing(server);
+		goto out;
+	}
+
+	ssi_locate(&run);
+	ssi_route(&run, 0);
+	ssi_run_members(&run);
+	ssi_retry(&run);
+	ssi_unroute(&run);
+	for (n = 0; n < run.nr_members; n++)
+		if (run.member[n].ret)
+			ret = run.member[n].ret;
+	goto out;
+
+nomem:
+	fprintf(stderr, "cannot allocate buffer for SSI cluster %s\n",
+		home->ssi);
+	ret = STORAGE_PROBLEM;
+out:
+	for (n = 0; run.member && n < run.nr_members; n++) {
+		if (n)
+			free(run.member[n].server);
+		free(run.member[n].entry);
+	}
+	free(run.member);
+	free(run.defined);
+	free(run.where);
+	free(run.image);
+	return ret;
+}
+
+
+/*
+ * a server of a job with its login, shared by the steps. The steps
+ * take turns, one request at a time.
+ */
+struct job_server {
+	struct snipl_server *server;
+	struct snipl_server *conf;	/* its definition in the config file */
+	pthread_mutex_t lock;
+	struct session session;
+	int connected;			/* 0 = not yet, -1 = failed */
+	int rc;				/* of the failed connect */
+	unsigned int requests;		/* number of result records */
+	struct job_server *next;
+};
+
+struct job_run;
+
+/*
+ * a step of a running job with the images it works on
+ */
+struct job_step {
+	struct job_run *run;
+	struct snipl_step *step;
+	struct snipl_image **images;
+	pthread_t thread;
+	int started;
+};
+
+struct job_run {
+	struct snipl_job *job;
+	struct snipl_server *server;	/* options of the command line */
+	struct job_server *servers;
+	struct job_step *steps;
+	struct timespec start;
+	pthread_mutex_t lock;		/* protects the step states */
+	pthread_cond_t done;		/* signalled when a step ends */
+};
+
+static const char *step_state_names[] = {
+	[SNIPL_STEP_WAITING]	"waiting",
+	[SNIPL_STEP_RUNNING]	"running",
+	[SNIPL_STEP_DONE]	"done",
+	[SNIPL_STEP_FAILED]	"failed",
+	[SNIPL_STEP_SKIPPED]	"skipped",
+};
+
+
+/*
+ *	function: job_image
+ *
+ *	purpose: find the server of an image of a job in the config file
+ *		 and return the image object of the job. Every server is
+ *		 set up once with the options of the command line, the
+ *		 same way as configfile_handling does for a single server.
+ *
+ *	returns the image or NULL if it cannot be used
+ */
+static struct snipl_image *job_image(struct job_run *run,
+				     struct snipl_configuration *conf,
+				     const char *name)
+{
+	struct snipl_server *tmpl = run->server;
+	struct snipl_server *serv, *server;
+	struct snipl_image *cimage, *image;
+	struct job_server *js;
+
+	cimage = find_next_image(conf, name, NULL, NULL);
+	if (!cimage) {
+		fprintf(stderr, "image %s not found in config file\n", name);
+		return NULL;
+	}
+	serv = cimage->server;
+	if (find_next_image(conf, name, NULL, serv))
+		fprintf(stderr, "more than one server found in config file "
+			"for image %s, server %s is used\n", name,
+			serv->address);
+	if (strcasecmp(serv->type, "VM") && strcasecmp(serv->type, "LPAR")) {
+		fprintf(stderr, "type of server %s in config file "
+			"is neither VM nor LPAR: %s\n", serv->address,
+			serv->type);
+		return NULL;
+	}
+
+	for (js = run->servers; js; js = js->next)
+		if (js->conf == serv)
+			break;
+	if (!js) {
+		js = calloc(1, sizeof(*js));
+		server = calloc(1, sizeof(*server));
+		if (!js || !server) {
+			free(js);
+			free(server);
+			fprintf(stderr, "cannot allocate buffer for server\n");
+			return NULL;
+		}
+		*server = (struct snipl_server) {
+			.address = serv->address,
+			.type = serv->type,
+			.user = tmpl->user ? tmpl->user : serv->user,
+			.password = tmpl->password ? tmpl->password :
+					serv->password,
+			.sslfingerprint = serv->sslfingerprint,
+			.port = tmpl->port != UNDEFINED ? tmpl->port :
+					serv->port,
+			.enc = tmpl->enc != UNDEFINED ? tmpl->enc : serv->enc,
+			.timeout = tmpl->timeout,
+			.timeout_given = tmpl->timeout_given,
+			.parms = tmpl->parms,
+			.deadline = tmpl->deadline,
+		};
+		if (server->enc == UNDEFINED)
+			server->enc = 1;
+		js->server = server;
+		js->conf = serv;
+		js->session.login_pending = 1;
+		pthread_mutex_init(&js->lock, NULL);
+		js->next = run->servers;
+		run->servers = js;
+	}
+	js->requests++;
+
+	server = js->server;
+	snipl_for_each_image(server, image)
+		if (!strcasecmp(image->alias, cimage->name))
+			return image;
+	image = calloc(1, sizeof(*image));
+	if (image)
+		image->name = strdup(cimage->name);
+	if (!image || !image->name) {
+		free(image);
+		fprintf(stderr, "cannot allocate image buffer\n");
+		return NULL;
+	}
+	image->alias = cimage->name;
+	if (!strcasecmp(server->type, "VM"))
+		replace_char(image->name, 0x0a, '-');
+	image->server = server;
+	image->_next = server->_images;
+	server->_images = image;
+	return image;
+}
+
+
+static struct job_server *job_server_of(struct job_run *run,
+					struct snipl_server *server)
+{
+	struct job_server *js;
+
+	for (js = run->servers; js; js = js->next)
+		if (js->server == server)
+			break;
+	return js;
+}
+
+
+/*
+ *	function: job_connect
+ *
+ *	purpose: connect to a server of a job for its first request.
+ *		 The options are checked for getstatus here, because the
+ *		 steps do different operations.
+ */
+static void job_connect(struct job_server *js)
+{
+	struct snipl_server *server = js->server;
+	int ret;
+
+	server->parms.image_op = GETSTATUS;
+	server->parms.force = UNDEFINED;
+	clock_gettime(CLOCK_REALTIME, &js->session.login_start);
+	ret = snipl_connect(server);
+	if (ret && snipl_time_left(server) <= 0) {
+		append_msg(server, "deadline exceeded\n");
+		ret = DEADLINE_EXCEEDED;
+	}
+	js->connected = ret ? -1 : 1;
+	js->rc = ret;
+	locked_server_message(server);
+}
+
+
+/*
+ *	function: job_request
+ *
+ *	purpose: perform the operation of a step on one image with the
+ *		 login of its server, connect at the first request
+ *
+ *	returns the return code of the request
+ */
+static int job_request(struct job_run *run, struct snipl_image *image, int op)
+{
+	struct snipl_server *server = image->server;
+	struct job_server *js = job_server_of(run, server);
+	int ret;
+
+	pthread_mutex_lock(&js->lock);
+	if (!js->connected)
+		job_connect(js);
+	if (js->connected < 0) {
+		snipl_result_begin(server, image, op);
+		create_msg(server, "%s: not processed, no connection to "
+			   "server %s\n", image->name, server->address);
+		server->problem_class = FATAL;
+		ret = js->rc;
+	} else {
+		server->parms.image_op = op;
+		server->parms.force = run->server->parms.force;
+		ret = image_request(image, op, &js->session);
+	}
+	snipl_result_end(server, ret);
+	/* the step is done when its asynchronous operations are */
+	if (server->_async && !ret)
+		ret = snipl_async_wait(server);
+	pthread_mutex_unlock(&js->lock);
+	return ret;
+}
+
+
+/*
+ *	function: job_step_thread
+ *
+ *	purpose: run a step when all steps of its after list are done.
+ *		 If one of them failed or was skipped, the step is skipped.
+ *		 The step of the after list that ended last is the gate of
+ *		 the step on the critical path.
+ */
+static void *job_step_thread(void *arg)
+{
+	struct job_step *js = arg;
+	struct job_run *run = js->run;
+	struct snipl_step *step = js->step;
+	struct snipl_step *dep;
+	int i, waiting, failed, rc, ret;
+
+	pthread_mutex_lock(&run->lock);
+	do {
+		waiting = 0;
+		failed = -1;
+		step->gate = -1;
+		for (i = 0; i < step->nr_after; i++) {
+			dep = &run->job->step[step->dep[i]];
+			if (dep->state == SNIPL_STEP_WAITING ||
+			    dep->state == SNIPL_STEP_RUNNING) {
+				waiting = 1;
+				continue;
+			}
+			if (dep->state != SNIPL_STEP_DONE)
+				failed = step->dep[i];
+			if (step->gate < 0 || msecs_between(
+			    &run->job->step[step->gate].end, &dep->end) > 0)
+				step->gate = step->dep[i];
+		}
+		if (waiting)
+			pthread_cond_wait(&run->done, &run->lock);
+	} while (waiting);
+	clock_gettime(CLOCK_MONOTONIC, &step->start);
+	step->state = failed < 0 ? SNIPL_STEP_RUNNING : SNIPL_STEP_SKIPPED;
+	pthread_mutex_unlock(&run->lock);
+
+	rc = 0;
+	if (failed >= 0) {
+		pthread_mutex_lock(&output_lock);
+		fprintf(info_stream(run->server), "step %s: skipped, step %s "
+			"%s\n", step->name, run->job->step[failed].name,
+			step_state_names[run->job->step[failed].state]);
+		pthread_mutex_unlock(&output_lock);
+	} else {
+		for (i = 0; i < step->nr_images; i++) {
+			ret = job_request(run, js->images[i], step->op);
+			if (ret)
+				rc = ret;
+		}
+	}
+
+	pthread_mutex_lock(&run->lock);
+	clock_gettime(CLOCK_MONOTONIC, &step->end);
+	step->rc = rc;
+	if (step->state == SNIPL_STEP_RUNNING)
+		step->state = rc ? SNIPL_STEP_FAILED : SNIPL_STEP_DONE;
+	pthread_cond_broadcast(&run->done);
+	pthread_mutex_unlock(&run->lock);
+	return NULL;
+}
+
+
+/*
+ *	function: job_report
+ *
+ *	purpose: print the timing of every step and the critical path,
+ *		 the chain of gates that ends with the step that ended last
+ */
+static void job_report(struct job_run *run)
+{
+	struct snipl_job *job = run->job;
+	FILE *out = info_stream(run->server);
+	struct snipl_step *step;
+	int *path;
+	int i, n, last;
+
+	last = -1;
+	for (i = 0; i < job->nr_steps; i++) {
+		step = &job->step[i];
+		if (step->state == SNIPL_STEP_SKIPPED) {
+			fprintf(out, "step %s: skipped\n", step->name);
+			continue;
+		}
+		fprintf(out, "step %s: %s, %i images, %li to %li ms\n",
+			step->name, step_state_names[step->state],
+			step->nr_images, msecs_between(&run->start, &step->start),
+			msecs_between(&run->start, &step->end));
+		if (last < 0 || msecs_between(&job->step[last].end,
+					      &step->end) > 0)
+			last = i;
+	}
+	path = calloc(job->nr_steps, sizeof(*path));
+	if (last < 0 || !path) {
+		free(path);
+		return;
+	}
+	n = 0;
+	for (i = last; i >= 0; i = job->step[i].gate)
+		path[n++] = i;
+	fprintf(out, "critical path:");
+	while (n--) {
+		step = &job->step[path[n]];
+		fprintf(out, " %s %li ms%s", step->name,
+			msecs_between(&step->start, &step->end),
+			n ? "," : "");
+	}
+	fprintf(out, ", %li ms in total\n",
+		msecs_between(&run->start, &job->step[last].end));
+	free(path);
+}
+
+
+/*
+ *	function: job_processing
+ *
+ *	purpose: run the steps of the job file of --jobfile. Every step
+ *		 has its thread, so independent steps run concurrently.
+ *		 The servers of the images are taken from the config file
+ *		 and every server is logged in to once for all steps.
+ *
+ *	returns 0 or the return code of the last step that failed
+ */
+static int job_processing(struct snipl_server *tmpl, char *cfgname)
+{
+	struct snipl_configuration *conf;
+	struct job_run run = {.server = tmpl};
+	struct job_server *js;
+	struct snipl_step *step;
+	struct snipl_image *image, *imag;
+	int i, n, ret;
+
+	run.job = snipl_job_from_file(tmpl->parms.jobfile);
+	if (!run.job) {
+		fprintf(stderr, "cannot allocate buffer for job\n");
+		return STORAGE_PROBLEM;
+	}
+	if (run.job->problem_class != OK)
+		fprintf(stderr, "%s", run.job->problem);
+	if (run.job->problem_class == FATAL) {
+		snipl_job_free(run.job);
+		return INVALID_PARAMETER_VALUE;
+	}
+	conf = configfile_handling(cfgname, NULL);
+	if (!conf || conf->problem_class == FATAL) {
+		fprintf(stderr, "the images of a job must be defined in "
+			"the config file\n");
+		snipl_configuration_free(conf);
+		snipl_job_free(run.job);
+		return MISSING_SERVER;
+	}
+
+	/* map the images of the steps to the servers */
+	ret = 0;
+	run.steps = calloc(run.job->nr_steps, sizeof(*run.steps));
+	if (!run.steps) {
+		fprintf(stderr, "cannot allocate buffer for job\n");
+		ret = STORAGE_PROBLEM;
+		goto out;
+	}
+	for (i = 0; i < run.job->nr_steps; i++) {
+		step = &run.job->step[i];
+		run.steps[i].run = &run;
+		run.steps[i].step = step;
+		run.steps[i].images = calloc(step->nr_images,
+					     sizeof(*run.steps[i].images));
+		if (!run.steps[i].images) {
+			fprintf(stderr, "cannot allocate buffer for job\n");
+			ret = STORAGE_PROBLEM;
+			goto out;
+		}
+		for (n = 0; n < step->nr_images; n++) {
+			image = job_image(&run, conf, step->images[n]);
+			if (!image) {
+				ret = MISSING_SERVER;
+				continue;
+			}
+			if (step->op == STOP &&
+			    !strcasecmp(image->server->type, "VM")) {
+				fprintf(stderr, "step %s: stop is not "
+					"supported for image %s of VM server "
+					"%s\n", step->name, image->name,
+					image->server->address);
+				ret = CONFLICTING_OPTIONS;
+			}
+			run.steps[i].images[n] = image;
+		}
+	}
+	for (js = run.servers; js && !ret; js = js->next) {
+		ret = snipl_results_alloc(js->server, js->requests);
+		if (ret)
+			fprintf(stderr, "cannot allocate result records\n");
+		else
+			js->server->results->sink = locked_sink;
+	}
+	if (ret)
+		goto out;
+
+	/* start all steps, they wait for their after list themselves */
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.done, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &run.start);
+	for (i = 0; i < run.job->nr_steps; i++) {
+		if (!pthread_create(&run.steps[i].thread, NULL,
+				    job_step_thread, &run.steps[i])) {
+			run.steps[i].started = 1;
+			continue;
+		}
+		pthread_mutex_lock(&run.lock);
+		step = run.steps[i].step;
+		step->start = step->end = run.start;
+		step->state = SNIPL_STEP_FAILED;
+		step->rc = FORK_PROBLEM;
+		pthread_cond_broadcast(&run.done);
+		pthread_mutex_unlock(&run.lock);
+		pthread_mutex_lock(&output_lock);
+		fprintf(stderr, "step %s: cannot start thread\n", step->name);
+		pthread_mutex_unlock(&output_lock);
+	}
+	for (i = 0; i < run.job->nr_steps; i++)
+		if (run.steps[i].started)
+			pthread_join(run.steps[i].thread, NULL);
+	pthread_cond_destroy(&run.done);
+	pthread_mutex_destroy(&run.lock);
+
+	for (i = 0; i < run.job->nr_steps; i++)
+		if (run.job->step[i].rc)
+			ret = run.job->step[i].rc;
+	job_report(&run);
+
+out:
+	while ((js = run.servers)) {
+		run.servers = js->next;
+		if (js->connected > 0) {
+			snipl_logout(js->server);
+			print_server_message(js->server);
+		}
+		snipl_results_free(js->server);
+		imag = NULL;
+		snipl_for_each_image(js->server, image) {
+			if (imag)
+				free(imag->name);
+			free(imag);
+			imag = image;
+		}
+		if (imag)
+			free(imag->name);
+		free(imag);
+		pthread_mutex_destroy(&js->lock);
+		free(js->server);
+		free(js);
+	}
+	if (run.steps)
+		for (i = 0; i < run.job->nr_steps; i++)
+			free(run.steps[i].images);
+	free(run.steps);
+	snipl_configuration_free(conf);
+	snipl_job_free(run.job);
+	return ret;
+}
+
+
+/* the histories of the requests are written once, at the end */
+static void flush_state(void)
+{
+	snipl_state_flush();
+}
+
+
+/*
+ *	function: main
+ *
+ *	purpose: point of control
+ */
+
+/*****************************************************************/
+int main(int argc, char **argv)
+{
+	int ret;
+	char* cfgname;
+	char password[80];
+	struct snipl_server *server;
+	struct snipl_configuration *conf = NULL;
+	struct snipl_server *home;
+	struct snipl_image *imag = NULL;
+	struct snipl_image *image = NULL;
+
+	if (!(server = calloc(1, sizeof (*server)))) {
+		fprintf(stderr, "cannot allocate buffer for server\n");
+		return STORAGE_PROBLEM;
+	}
+	atexit(flush_state);
+
+	server->parms = (struct snipl_parms) {
+		.force = UNDEFINED,
+		.clear = UNDEFINED,
+		.store_stat = UNDEFINED,
+		.load_timeout = UNDEFINED,
+		.scsiload_bps = UNDEFINED,
+		.msg_timeout = UNDEFINED,
+		.image_op = OPUNKNOWN,
+	};
+
+	ret = 0;
+	cfgname = NULL;
+	ret = parse_command_input(argc, argv, server, &cfgname);
+	if (ret < 0) {
+		ret = 0;
+		goto free_all;
+	}
+
+	if (server->parms.jobfile) {
+		if (server->_images && !ret) {
+			fprintf(stderr, "image names must not be specified "
+				"together with option --jobfile\n");
+			ret = CONFLICTING_OPTIONS;
+		}
+		if (ret)
+			goto free_all;
+		if (server->password_prompt) {
+			server->password = password;
+			prompt_for_password(server->password);
+		}
+		ret = job_processing(server, cfgname);
+		snipl_release_modules();
+		goto free_all;
+	}
+
+	if (!server->_images && server->parms.image_op != LIST &&
+		ret != UNKNOWN_PARAMETER) {
+		fprintf(stderr, "Missing image name(s)\n");
+		ret = MISSING_IMAGENAME;
+		goto free_all;
+	}
+	if (server->parms.image_op == DIALOG &&
+		server->_images && server->_images->_next) {
+		fprintf(stderr, "More than one image name specified for DIALOG "
+			"operation\n");
+		ret = MORE_THAN_ONE_IMAGE;
+		goto free_all;
+	}
+	if (ret)
+		goto free_all;
+
+	if (server->password_prompt) {
+		server->password = password;
+		prompt_for_password(server->password);
+	}
+
+	conf = configfile_handling(cfgname, server);
+        /* continue, even if CONFIG_FILE_ERROR */
+
+	if (!server->address) {
+		fprintf(stderr, "%s: missing server ipaddr\n\n", argv[0]);
+		ret = MISSING_SERVER;
+		goto free_all;
+	}
+	server->_next = NULL;
+
+	if (server->parms.image_op == OPUNKNOWN) {
+		fprintf(stderr, "Please specify one of the parameters:\n");
+		fprintf(stderr, "   -a --activate\n   -r --reset\n");
+		fprintf(stderr, "   -d --deactivate\n   -x --listimages\n");
+		fprintf(stderr, "   -g --getstatus\n");
+		if (!strcasecmp(server->type, "LPAR")) {
+			fprintf(stderr,	"   -o --stop\n   -l --load\n");
+			fprintf(stderr, "   -s --scsiload\n   -D --scsidump\n");
+			fprintf(stderr,	"   -i --dialog\n");
+		}
+		ret = NO_COMMAND;
+		goto free_all;
+	}
+
+	if (server->parms.image_op == LIST && !conf &&
 		(!strcasecmp(server->type, "VM"))) {
 		fprintf(stderr, "--listimages for VM server must not be "
 			"specified without config file\n");
@@ -1202,15 +3665,13 @@ int main(int argc, char **argv)
 		DEBUG_PRINT("set encryption on (default)\n");
 	}
 
-	ret = command_processing(server);
-	if (server->module_handle) {
-		temp_ret = dlclose(server->module_handle);
-		if (temp_ret) {
-			server->problem = dlerror();
-			server->problem_class = FATAL;
-			print_server_message(server);
-		}
-	}
+	if (conf && server->parms.image_op != LIST &&
+	    server->parms.image_op != DIALOG &&
+	    (home = ssi_server(conf, server)))
+		ret = ssi_processing(server, conf, home);
+	else
+		ret = command_processing(server);
+	snipl_release_modules();
 
 free_all:
 	/* free images */
@@ -13,6 +13,8 @@
  *   constitutes recipient's acceptance of this agreement.
  */
 
+#include <time.h>
+
 #define SNIPL_VERSION "snipl - Linux Image Control - version 3.1.0"
 #define SNIPL_COPYRIGHT "Copyright IBM Corp. 2001, 2016"
 
@@ -68,6 +70,8 @@ fprintf(importance, header "2: %02x %02x %02x %02x  %02x %02x %02x %02x  " \
 #define STDIN_PROBLEM           41
 #define HWMCA_PROBLEM           50
 #define BUFFER_OVERFLOW         60
+#define STATE_NOT_REACHED       70
+#define DEADLINE_EXCEEDED       71
 #define STORAGE_PROBLEM         90
 #define INTERNAL_ERROR          99
 #define CONNECTION_ERROR       100
@@ -118,8 +122,27 @@ struct snipl_parms {
 	int    msg_timeout;		/* -1=undefined */
 	int    image_op;
 	int    shutdown_time;
+	int    output;			/* SNIPL_OUTPUT_... */
+	int    ensure;			/* enum snipl_image_state, */
+					/* UNKNOWN = no --ensure */
+	int    wave_size;		/* 0 = no waves */
+	int    wave_gate;		/* enum snipl_image_state, */
+					/* UNKNOWN = acknowledged */
+	int    wave_fraction;		/* percent, 0 = 100 */
+	char  *jobfile;			/* NULL = no --jobfile */
+	int    parallel;		/* most requests in flight, */
+					/* 0 = no --parallel */
+	int    status_cache;		/* seconds a cached status is */
+					/* used, 0 = no --status-cache */
+	int    via_daemon;		/* 1 = --via-daemon */
 };
 
+/*
+ * output formats
+ */
+#define SNIPL_OUTPUT_TEXT	0
+#define SNIPL_OUTPUT_JSON	1
+
 /*
  * image attributes that are set by the specific
  * server module (e.g. for type LPAR)
@@ -137,6 +160,7 @@ struct snipl_image {
 	struct snipl_image_ops	*ops;
 	struct snipl_image	*_next;
 	struct snipl_image_private *priv;
+	int _ssi;			/* routing mark, see ssi_processing */
 };
 
 /*
@@ -226,6 +250,8 @@ static inline int snipl_getstatus(struct snipl_image *simg)
 
 struct snipl_server_ops;
 struct snipl_server_private;
+struct snipl_results;
+struct snipl_result;
 
 /*
  * server object
@@ -236,7 +262,10 @@ struct snipl_server {
 	char *password;
 	char *type;
 	char *sslfingerprint;
+	char *ssi;		/* z/VM SSI cluster of the server, NULL = none */
 	int   timeout;
+	_Bool timeout_given;	/* set by the user, nothing is learned */
+	int   learned_timeout;	/* of the running request, 0 = none */
 	int   port;
 	int   enc;
 	_Bool password_prompt;
@@ -248,8 +277,22 @@ struct snipl_server {
 	struct snipl_server_private *priv;
 	struct snipl_server *_next;
 	struct snipl_image *_images;
+	struct snipl_results *results;	/* operation records, see below */
+	struct snipl_result *_result;	/* record of the running operation */
+	char  *_problem_buf;		/* last message of append_msg */
+	size_t _problem_len;		/* and its length */
+	struct timespec deadline;	/* CLOCK_MONOTONIC, 0 = none */
+	_Bool _busy;			/* the running request met a busy */
+					/* server, see snipl_result_busy */
+	int   _api_rc;			/* of the running request, for */
+					/* the metrics, UNDEFINED = none */
+	struct snipl_async *_async;	/* outstanding asynchronous */
+					/* operations, see snasync.c */
+	int   _cancel;			/* see snipl_cancel, atomic */
 };
 
+struct snipl_async;
+
 /*
  * server functions. These are defined per server type
  */
@@ -258,6 +301,12 @@ struct snipl_server_ops {
 	int (*login)(struct snipl_server *);
 	int (*check)(struct snipl_server *);
 	int (*confirm)(struct snipl_server *);
+	int (*probe)(struct snipl_server *);	/* liveness without login, */
+						/* after check, optional */
+	/* state of an asynchronous operation, optional */
+	int (*query_async)(struct snipl_server *, struct snipl_async *);
+	/* names of all active images with one request, optional */
+	int (*query_active)(struct snipl_server *, char ***);
 };
 
 /*
@@ -273,6 +322,83 @@ struct snipl_server_ops {
  */
 extern int snipl_prepare(struct snipl_server *);
 
+/*
+ * prepare, check and login to a server, for type VM servers
+ * with detection of the SMAPI protocol (remembered in the state file)
+ */
+extern int snipl_connect(struct snipl_server *);
+
+/*
+ * check that a server is alive with the cheapest check of its module,
+ * or with a login and logout
+ */
+extern int snipl_probe(struct snipl_server *);
+
+/*
+ * servers holding the same image: score of the recent logins (lower is
+ * better)
+ */
+extern long snipl_server_score(struct snipl_server *);
+/* when to hedge a request ("login", an operation) to a server, -1 never */
+extern long snipl_hedge_delay(struct snipl_server *, const char *);
+
+/*
+ * deadline of all blocking calls of a server, in milliseconds
+ */
+extern void snipl_set_deadline(struct snipl_server *, int);
+extern long snipl_time_left(struct snipl_server *);
+extern int snipl_wait_time(struct snipl_server *, int);
+
+/*
+ * end the blocking calls of a server another thread uses, see prepare.c.
+ * Blocking waits are split in slices of SNIPL_CANCEL_SLICE milliseconds.
+ */
+#define SNIPL_CANCEL_SLICE	100
+extern void snipl_cancel(struct snipl_server *);
+extern void snipl_cancel_clear(struct snipl_server *);
+extern int snipl_cancelled(struct snipl_server *);
+
+/*
+ * timeouts learned from the latency history of a server per request
+ * type ("login" or the name of an image operation)
+ */
+struct snipl_learn {
+	const char *what;
+	struct timespec start;
+	int timeout;			/* learned timeout of the caller */
+};
+
+extern long snipl_learned_timeout(struct snipl_server *, const char *);
+extern void snipl_learn_begin(struct snipl_server *, const char *,
+			      struct snipl_learn *);
+extern void snipl_learn_end(struct snipl_server *, struct snipl_learn *, int);
+
+/* the timeout of a blocking call of the running request */
+static inline int snipl_timeout(struct snipl_server *server)
+{
+	return server->learned_timeout ? server->learned_timeout :
+		server->timeout;
+}
+
+/*
+ * unload all modules loaded by snipl_prepare
+ */
+extern int snipl_release_modules(void);
+
+/*
+ * entry point of a server type module, it sets the server and image ops.
+ * Shared modules export it as "prepare" to be found by dlsym,
+ * a static build (SNIPL_STATIC) links all modules into the program and
+ * calls <module>_prepare from the module table in prepare.c.
+ */
+#ifdef SNIPL_STATIC
+#define SNIPL_MODULE_PREPARE(module) \
+	void module##_prepare(struct snipl_server *server)
+#else
+#define SNIPL_MODULE_PREPARE(module) \
+	void prepare(struct snipl_server *server)
+#endif
+
 /*
  * prepare_check checks type specific parameters
  * This is done by the specific module function loaded by snipl_prepare.
@@ -297,6 +423,29 @@ static inline int snipl_logout(struct snipl_server *sserv)
 		sserv->ops->logout(sserv) : -1;
 }
 
+/* check that the server answers, without a login */
+static inline int snipl_server_probe(struct snipl_server *sserv)
+{
+	return (sserv && sserv->ops && sserv->ops->probe) ?
+		sserv->ops->probe(sserv) : -1;
+}
+
+/* query the state of an asynchronous operation, after a login */
+static inline int snipl_query_async(struct snipl_server *sserv,
+				    struct snipl_async *async)
+{
+	return (sserv && sserv->ops && sserv->ops->query_async) ?
+		sserv->ops->query_async(sserv, async) : -1;
+}
+
+/* the names of all active images, NULL terminated, in one buffer */
+static inline int snipl_query_active(struct snipl_server *sserv,
+				     char ***names)
+{
+	return (sserv && sserv->ops && sserv->ops->query_active) ?
+		sserv->ops->query_active(sserv, names) : -1;
+}
+
 /*
  * Confirm connection to a server.
  * Return 1, if the connection is confirmed, otherwise, if the function is
@@ -385,6 +534,258 @@ extern int isscanf_ok(int, char, char *);
 extern void create_msg(struct snipl_server *, const char *, ...)
 		       __attribute__((format(printf, 2, 3)));
 
+/* append a message to server->problem */
+extern void append_msg(struct snipl_server *, const char *, ...)
+		       __attribute__((format(printf, 2, 3)));
+
+/**********************************************************************
+ * operation result records (snresult.c)
+ *
+ * A server can keep a record per image operation in a preallocated
+ * ring. The record takes over the message from server->problem, the
+ * output is formatted from the record when it is printed.
+ *********************************************************************/
+
+/*
+ * image state as reported by the getstatus operation
+ */
+enum snipl_image_state {
+	SNIPL_IMAGE_UNKNOWN,
+	SNIPL_IMAGE_INACTIVE,	/* logged off / not activated */
+	SNIPL_IMAGE_ACTIVE,	/* logged on / activated */
+	SNIPL_IMAGE_OPERATING,	/* activated and operating (LPAR) */
+};
+
+/*
+ * name of a status bit of the management API
+ */
+struct snipl_status_bit {
+	unsigned long bit;
+	const char *name;
+};
+
+/*
+ * phases of an image operation with separate timings
+ */
+enum snipl_phase {
+	SNIPL_PHASE_LOGIN,	/* connect and login to the server */
+	SNIPL_PHASE_OPERATION,	/* the operation itself */
+	SNIPL_PHASES
+};
+
+struct snipl_result {
+	struct snipl_image *image;	/* NULL for server operations */
+	int   op;			/* enum image_op */
+	int   rc;			/* snipl return code */
+	int   api_rc;			/* return and reason code of the */
+	int   api_rs;			/* management API or UNDEFINED */
+	int   severity;			/* enum problem_class */
+	int   state;			/* enum snipl_image_state */
+	unsigned long status;		/* status bits of the API ... */
+	const struct snipl_status_bit *status_bits; /* ... and their names */
+	struct timespec start;
+	struct timespec end;
+	long  phase_ms[SNIPL_PHASES];	/* -1 if the phase was skipped */
+	char *text;			/* message, owned by the record */
+	int   cached;			/* answered by the status cache */
+	int   async_id;			/* operation ID of an asynchronous */
+					/* operation, 0 = none */
+};
+
+typedef void (*snipl_result_sink)(struct snipl_server *,
+				  struct snipl_result *);
+
+struct snipl_results {
+	unsigned int  size;		/* number of records in the ring */
+	unsigned long count;		/* number of records started */
+	snipl_result_sink sink;		/* called for every completed record */
+	struct snipl_result rec[];
+};
+
+extern int snipl_results_alloc(struct snipl_server *, unsigned int);
+extern void snipl_results_free(struct snipl_server *);
+extern struct snipl_result *snipl_result_begin(struct snipl_server *,
+					       struct snipl_image *, int);
+extern void snipl_result_api(struct snipl_server *, int, int);
+extern void snipl_result_busy(struct snipl_server *);
+extern void snipl_result_state(struct snipl_server *, int, unsigned long,
+			       const struct snipl_status_bit *);
+extern void snipl_result_phase(struct snipl_result *, int,
+			       const struct timespec *);
+extern struct snipl_result *snipl_result_end(struct snipl_server *, int);
+extern unsigned long snipl_results_first(struct snipl_server *);
+extern struct snipl_result *snipl_result_get(struct snipl_server *,
+					     unsigned long);
+extern long snipl_result_msecs(const struct snipl_result *);
+extern void snipl_result_print(const struct snipl_result *);
+extern void snipl_result_json(FILE *, struct snipl_server *,
+			      const struct snipl_result *);
+extern const char *snipl_op_name(int);
+extern const char *snipl_state_name(int);
+
+/*
+ * iterator over the records kept for a server, oldest first
+ */
+#define snipl_for_each_result(serv, res, n) \
+	for (n = snipl_results_first(serv); \
+	     (res = snipl_result_get(serv, n)) != NULL; n++)
+
+/**********************************************************************
+ * asynchronous operations (snasync.c)
+ *
+ * A SMAPI function may return before its work is done, with the ID of
+ * an asynchronous operation instead of the final result. The VM modules
+ * hand the ID to the tracker of the server, which queries all
+ * outstanding operations of the server together, each one with its own
+ * backoff, and completes a result record for every operation that ends.
+ *********************************************************************/
+enum snipl_async_state {
+	SNIPL_ASYNC_RUNNING,
+	SNIPL_ASYNC_DONE,
+	SNIPL_ASYNC_FAILED,
+};
+
+struct snipl_async {
+	struct snipl_image *image;
+	int    op;			/* enum image_op that started it */
+	int    id;			/* operation ID of the server */
+	int    state;			/* enum snipl_async_state, set by */
+	int    api_rc;			/* the query_async op of the module */
+	int    api_rs;			/* with the codes of the last query */
+	int    queries;
+	long   backoff;			/* ms until the next query */
+	struct timespec start;		/* CLOCK_REALTIME */
+	struct timespec next;		/* CLOCK_MONOTONIC, of the next query */
+	int    _taken;			/* queried by a worker, see snasync.c */
+	struct snipl_async *_next;
+};
+
+extern int snipl_async_start(struct snipl_server *, struct snipl_image *,
+			     int);
+extern int snipl_async_wait(struct snipl_server *);
+extern void snipl_async_free(struct snipl_server *);
+
+/**********************************************************************
+ * persistent state shared between invocations (snstate.c)
+ *
+ * The state file ($SNIPL_STATE or ~/.snipl.state) keeps small records
+ * identified by facility and key, e.g. the protocol detected for a
+ * VM server. Errors are not reported, a missing state file only means
+ * that nothing is remembered.
+ *********************************************************************/
+#define SNIPL_STATE_VALUE_LEN	256
+
+/* modify value/stamp and return 1 (write), 0 (keep) or -1 (remove) */
+typedef int (*snipl_state_fn)(char *value, time_t *stamp, void *arg);
+
+extern char *snipl_state_file_name(void);
+extern int snipl_state_get(const char *facility, const char *key,
+			   char *value, time_t *stamp);
+extern int snipl_state_put(const char *facility, const char *key,
+			   const char *value);
+extern int snipl_state_update(const char *facility, const char *key,
+			      snipl_state_fn fn, void *arg);
+/* updates that need not be shared at once, written together */
+#define SNIPL_STATE_DEFER_MAX	256
+extern int snipl_state_defer(const char *facility, const char *key,
+			     snipl_state_fn fn, const void *arg, size_t size);
+extern int snipl_state_flush(void);
+extern int snipl_state_dump(FILE *);
+
+/**********************************************************************
+ * status cache in shared memory (sncache.c)
+ *
+ * The status of the images read by getstatus is kept in /dev/shm
+ * ($SNIPL_STATUS_CACHE) for other snipl processes. Operations that
+ * change the state of an image remove its status.
+ *********************************************************************/
+struct snipl_cache_entry {
+	int    state;			/* enum snipl_image_state */
+	int    rc;			/* of the getstatus */
+	int    api_rc;
+	int    api_rs;
+	unsigned long status;		/* status bits of the API */
+	time_t stamp;			/* when it was read */
+};
+
+extern int snipl_cache_get(struct snipl_server *, const char *, int,
+			   struct snipl_cache_entry *);
+extern void snipl_cache_put(struct snipl_server *, const char *,
+			    const struct snipl_cache_entry *);
+extern void snipl_cache_record(struct snipl_server *,
+			       const struct snipl_result *);
+
+/**********************************************************************
+ * protocol of the snipld daemon (sndaemon.c)
+ *
+ * snipld keeps the logins to the servers of its configuration file and
+ * performs image operations for snipl over a UNIX socket.
+ *********************************************************************/
+struct snipld_conn;
+
+/* a request of a client, the strings point into the request line */
+struct snipld_request {
+	int   op;			/* enum image_op */
+	char *type;
+	char *address;
+	char *user;			/* NULL = any */
+	char *image;
+	int   force;			/* 0=no,1=yes,-1=undefined */
+	int   shutdown_time;
+	char *profile;			/* NULL = default */
+};
+
+extern const char *snipld_socket_name(void);
+extern struct snipld_conn *snipld_open(void);
+extern void snipld_close(struct snipld_conn *);
+extern int snipld_call(struct snipld_conn *, struct snipl_image *, int,
+		       int *);
+extern int snipld_parse(char *, struct snipld_request *);
+extern int snipld_answer(FILE *, const struct snipl_result *);
+extern int snipld_refuse(FILE *, const char *);
+
+/**********************************************************************
+ * job files (snjob.c)
+ *
+ * A job is a list of named steps, each one operation on some images.
+ * A step runs after all steps named in its after list are done, so
+ * the steps form a dependency graph without cycles.
+ *********************************************************************/
+enum snipl_step_state {
+	SNIPL_STEP_WAITING,
+	SNIPL_STEP_RUNNING,
+	SNIPL_STEP_DONE,
+	SNIPL_STEP_FAILED,
+	SNIPL_STEP_SKIPPED,	/* a step it runs after failed */
+};
+
+struct snipl_step {
+	char  *name;
+	int    op;			/* enum image_op */
+	char **images;
+	int    nr_images;
+	char **after;			/* names of the steps to wait for */
+	int   *dep;			/* ... and their index */
+	int    nr_after;
+	/* filled in when the job runs */
+	int    state;			/* enum snipl_step_state */
+	int    rc;
+	int    gate;			/* step of after done last or -1 */
+	struct timespec start;		/* CLOCK_MONOTONIC */
+	struct timespec end;
+};
+
+struct snipl_job {
+	const char *filename;
+	char *problem;
+	int   problem_class;
+	struct snipl_step *step;
+	int   nr_steps;
+};
+
+extern struct snipl_job *snipl_job_from_file(const char *);
+extern void snipl_job_free(struct snipl_job *);
+
 /*
  * problem class used in server and configuration
  * object to rank the error
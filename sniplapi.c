@@ -31,7 +31,7 @@
 /**************************************************************/
 /* initialize server structures                               */
 /**************************************************************/
-extern void prepare(struct snipl_server *server)
+extern SNIPL_MODULE_PREPARE(sniplapi)
 {
 	server->ops = &snipl_server_ops;
 	return;
@@ -68,36 +68,31 @@ static int snipl_lpar_prepare_check(struct snipl_server *server)
 
 	ret = 0;
 	if (server->user && !server->enc) {
-		create_msg(server, "%soption --userid must not be specified "
-			   "for unencrypted LPAR-type server connection\n",
-			   server->problem);
+		append_msg(server, "option --userid must not be specified "
+			   "for unencrypted LPAR-type server connection\n");
 		ret = USERNAME_ENC_OFF;
 	}
 	if (server->enc && !server->user) {
-		create_msg(server, "%soption --userid must be specified "
-			   "for encrypted LPAR-type server connection\n",
-			   server->problem);
+		append_msg(server, "option --userid must be specified "
+			   "for encrypted LPAR-type server connection\n");
 		ret = NO_USERNAME;
 	}
 
 	if (server->port != UNDEFINED) {
-		create_msg(server, "%soption --port must not be specified "
-			   "for an LPAR-type server\n",
-			   server->problem);
+		append_msg(server, "option --port must not be specified "
+			   "for an LPAR-type server\n");
 		ret = CONFLICTING_OPTIONS;
 	}
 
 	if (server->password &&
 	    strlen(server->password) > 16) {
-		create_msg(server, "%spassword too long - maximum size is "
-			   "16 characters\n",
-			   server->problem);
+		append_msg(server, "password too long - maximum size is "
+			   "16 characters\n");
 		ret = INVALID_PARAMETER_VALUE;
 	}
 
 	if (!server->password) {
-		create_msg(server, "%soption --password must be specified\n",
-			   server->problem);
+		append_msg(server, "option --password must be specified\n");
 		ret = MISSING_PASSWORD;
 	}
 
@@ -106,38 +101,34 @@ static int snipl_lpar_prepare_check(struct snipl_server *server)
 
 	if (server->parms.msg_timeout != -1 &&
 	    server->parms.image_op != DIALOG) {
-		create_msg(server, "%soption --msgtimeout can only be "
-			   "specified for command --dialog\n",
-			   server->problem);
+		append_msg(server, "option --msgtimeout can only be "
+			   "specified for command --dialog\n");
 		ret = CONFLICTING_OPTIONS;
 	}
 	if (server->parms.msg_timeout != -1 && server->parms.msg_timeout < 1) {
-		create_msg(server,
-			"%smsgtimeout value %i is zero or negative\n",
-			server->problem, server->parms.msg_timeout);
+		append_msg(server,
+			"msgtimeout value %i is zero or negative\n",
+			server->parms.msg_timeout);
 		ret = INVALID_PARAMETER_VALUE;
 	}
 	if (server->parms.msgfilename) {
 		if (server->parms.image_op != DIALOG) {
-			create_msg(server,
-				   "%soption --msgfilename can only be "
-				   "specified for command --dialog\n",
-				   server->problem);
+			append_msg(server,
+				   "option --msgfilename can only be "
+				   "specified for command --dialog\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 }
 
 	if (server->parms.profile) {
 		if (server->parms.image_op != ACTIVATE) {
-			create_msg(server, "%soption --profile can only be "
-				   "specified for command --activate\n",
-				   server->problem);
+			append_msg(server, "option --profile can only be "
+				   "specified for command --activate\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 		if (strlen(server->parms.profile) > 16) {
-			create_msg(server, "%sprofile_name %s too long - "
+			append_msg(server, "profile_name %s too long - "
 				   "maximum size is 16 characters\n",
-				   server->problem,
 				   server->parms.profile);
 			ret = INVALID_PARAMETER_VALUE;
 		}
@@ -147,61 +138,53 @@ static int snipl_lpar_prepare_check(struct snipl_server *server)
 	    server->parms.image_op != SCSILOAD &&
 	    server->parms.image_op != SCSIDUMP) {
 		if (server->parms.load_address) {
-			create_msg(server, "%soption --address_load can only "
+			append_msg(server, "option --address_load can only "
 				   "be specified for commands --load, "
-				   "--scsiload, and --scsidump\n",
-				   server->problem);
+				   "--scsiload, and --scsidump\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 		if (server->parms.load_parms) {
-			create_msg(server, "%soption --parameters_load can "
+			append_msg(server, "option --parameters_load can "
 				   "only be specified for command --load, "
-				   "--scsiload, and --scsidump\n",
-				   server->problem);
+				   "--scsiload, and --scsidump\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 	}
 	if (server->parms.image_op != LOAD ) {
 		if (server->parms.clear != -1) {
-			create_msg(server, "%soption --noclear can only be "
-				   "specified for command --load\n",
-				   server->problem);
+			append_msg(server, "option --noclear can only be "
+				   "specified for command --load\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 		if (server->parms.store_stat != -1) {
-			create_msg(server, "%soption --storestatus can only be "
-				   "specified for command --load\n",
-				   server->problem);
+			append_msg(server, "option --storestatus can only be "
+				   "specified for command --load\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 		if (server->parms.load_timeout != -1) {
-			create_msg(server, "%soption --load_timeout can only "
-				   "be specified for command --load\n",
-				   server->problem);
+			append_msg(server, "option --load_timeout can only "
+				   "be specified for command --load\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 	}
 	if (server->parms.load_parms) {
 		if (strlen(server->parms.load_parms) > 8) {
-			create_msg(server, "%sparameters_load %s too long - "
+			append_msg(server, "parameters_load %s too long - "
 				   "maximum length is 8\n",
-				   server->problem,
 				   server->parms.load_parms);
 			ret = INVALID_PARAMETER_VALUE;
 		}
 	}
 	if (server->parms.load_timeout != -1) {
 		if (server->parms.load_timeout < 60) {
-			create_msg(server, "%sload_timeout value %i too small "
+			append_msg(server, "load_timeout value %i too small "
 				   " - minimum value is 60\n",
-				   server->problem,
 				   server->parms.load_timeout);
 			ret = INVALID_PARAMETER_VALUE;
 		}
 		else if (server->parms.load_timeout > 600) {
-			create_msg(server, "%sload_timeout value %i too large "
+			append_msg(server, "load_timeout value %i too large "
 				   "- maximum value is 600\n",
-				   server->problem,
 				   server->parms.load_timeout);
 			ret = INVALID_PARAMETER_VALUE;
 		}
@@ -210,40 +193,35 @@ static int snipl_lpar_prepare_check(struct snipl_server *server)
 	    server->parms.image_op != SCSIDUMP) {
 		if (!strncmp(&server->parms.scsiload_wwpn[0], compare_string,
 		    16)) {
-			create_msg(server, "%soption --wwpn_scsiload can only "
+			append_msg(server, "option --wwpn_scsiload can only "
 				   "be specified for commands --scsiload and "
-				   "--scsidump\n",
-				   server->problem);
+				   "--scsidump\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 		if (!strncmp(&server->parms.scsiload_lun[0], compare_string,
 		    16)) {
-			create_msg(server, "%soption --lun_scsiload can only "
+			append_msg(server, "option --lun_scsiload can only "
 				   "be specified for command --scsiload and "
-				   "--scsidump\n",
-				   server->problem);
+				   "--scsidump\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 		if (server->parms.scsiload_bps != -1) {
-			create_msg(server, "%soption --bps_scsiload can only "
+			append_msg(server, "option --bps_scsiload can only "
 				   "be specified for command --scsiload and "
-				   "--scsidump\n",
-				   server->problem);
+				   "--scsidump\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 		if (server->parms.scsiload_ossparms) {
-			create_msg(server, "%soption --ossparms_scsiload can "
+			append_msg(server, "option --ossparms_scsiload can "
 				   "only be specified for command --scsiload "
-				   "and --scsidump\n",
-				   server->problem);
+				   "and --scsidump\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 		if (!strncmp(&server->parms.scsiload_bootrec[0],
 			     compare_string, 16)) {
-			create_msg(server, "%soption --bootrecord_scsiload can "
+			append_msg(server, "option --bootrecord_scsiload can "
 				   "only be specified for command --scsiload "
-				   "and --scsidump\n",
-				   server->problem);
+				   "and --scsidump\n");
 			ret = CONFLICTING_OPTIONS;
 		}
 	} else {
@@ -256,36 +234,32 @@ static int snipl_lpar_prepare_check(struct snipl_server *server)
 	}
 	if (server->parms.scsiload_wwpn) {
 		if (strlen(server->parms.scsiload_wwpn) > 16) {
-			create_msg(server, "%swwpn_scsiload %s too long - "
+			append_msg(server, "wwpn_scsiload %s too long - "
 				   "maximum length is 16\n",
-				   server->problem,
 				   server->parms.scsiload_wwpn);
 			ret = INVALID_PARAMETER_VALUE;
 		}
 	}
 	if (server->parms.scsiload_lun) {
 		if (strlen(server->parms.scsiload_lun) > 16) {
-			create_msg(server, "%slun_scsiload %s too long - "
+			append_msg(server, "lun_scsiload %s too long - "
 				   "maximum length is 16\n",
-				   server->problem,
 				   server->parms.scsiload_lun);
 			ret = INVALID_PARAMETER_VALUE;
 		}
 	}
 	if (server->parms.scsiload_bootrec) {
 		if (strlen(server->parms.scsiload_bootrec) > 16) {
-			create_msg(server, "%sbootrecord_scsiload %s too long "
+			append_msg(server, "bootrecord_scsiload %s too long "
 				   "- maximum length is 16\n",
-				   server->problem,
 				   server->parms.scsiload_bootrec);
 			ret = INVALID_PARAMETER_VALUE;
 		}
 	}
 	if (server->parms.scsiload_bps != -1) {
 		if (server->parms.scsiload_bps > 30) {
-			create_msg(server, "%sbps_scsiload value %i too large "
+			append_msg(server, "bps_scsiload value %i too large "
 				   "- maximum value is 30\n",
-				   server->problem,
 				   server->parms.scsiload_bps);
 			ret = INVALID_PARAMETER_VALUE;
 		}
@@ -294,9 +268,8 @@ static int snipl_lpar_prepare_check(struct snipl_server *server)
 
 	snipl_for_each_image(server, image) {
 		if (strlen(image->name) > 80) {
-			create_msg(server, "%simage_name %s too long - maximum "
+			append_msg(server, "image_name %s too long - maximum "
 				   "size is 80 characters\n",
-				   server->problem,
 				   image->name);
 			ret = INVALID_PARAMETER_VALUE;
 		}
@@ -394,9 +367,8 @@ static int snipl_lpar_prepare_check(struct snipl_server *server)
 			server->priv->msgfile = open(server->parms.msgfilename,
 				flags, mode);
 			if (server->priv->msgfile == -1) {
-				create_msg(server, "%sOpening msgfilename %s "
+				append_msg(server, "Opening msgfilename %s "
 					   "returns <%s>\n",
-					   server->problem,
 					   server->parms.msgfilename,
 					   strerror(errno));
 				ret = INVALID_PARAMETER_VALUE;
@@ -422,7 +394,8 @@ static int invoke_HwmcaInitialize(struct snipl_server *server)
 		HWMCA_SNMP_VERSION_2;
 
 	ret = 0;
-	ret = HwmcaInitialize(&server->priv->snmp_command, server->timeout);
+	ret = HwmcaInitialize(&server->priv->snmp_command,
+			      snipl_wait_time(server, snipl_timeout(server)));
 	if (ret != HWMCA_DE_NO_ERROR) {
 		create_msg(server, "return code of HwmcaInitialize is %s\n",
 			   getErrorMessage(ret));
@@ -446,7 +419,7 @@ static int invoke_HwmcaInitialize(struct snipl_server *server)
 			HWMCA_SNMP_VERSION_2;
 
 		ret = HwmcaInitialize(&server->priv->snmp_notify,
-				      server->timeout);
+				snipl_wait_time(server, snipl_timeout(server)));
 		if (ret != HWMCA_DE_NO_ERROR) {
 			create_msg(server, "return code of HwmcaInitialize for "
 				"notification is %s\n", getErrorMessage(ret));
@@ -481,7 +454,7 @@ static int invoke_HwmcaGet(struct snipl_server *server,
 				server->priv->snmp_data_p,
 				server->priv->bufsize,
 				needed,
-				server->timeout);
+				snipl_wait_time(server, snipl_timeout(server)));
 
 		if (ret != HWMCA_DE_NO_ERROR) {
 			create_msg(server, "return code of HwmcaGet is %s\n",
@@ -529,6 +502,27 @@ static int snipl_image_status(struct snipl_server *server,
 }
 
 
+/**************************************************************/
+/* liveness check without login: initialize SNMP interfaces   */
+/* and read the CPC image group object once, without reading  */
+/* the names and the status of all images                     */
+/**************************************************************/
+static int snipl_lpar_probe(struct snipl_server *server)
+{
+	unsigned long needed;
+	char  arg_string[80];
+	int   ret;
+
+	ret = invoke_HwmcaInitialize(server);
+	if (ret)
+		return ret;
+	sprintf(arg_string, "%s.%s",
+		HWMCA_CPC_IMAGE_GROUP_ID,
+		HWMCA_GROUP_CONTENTS_SUFFIX);
+	return invoke_HwmcaGet(server, arg_string, &needed);
+}
+
+
 /**************************************************************/
 /* initialize SNMP interfaces                                 */
 /* determine available LPAR objects plus LPAR names           */
@@ -541,7 +535,7 @@ static int snipl_lpar_login(struct snipl_server *server)
 	int   maxsize;
 	unsigned long needed;
 	char  arg_string[80];
-	char *tmp, *image_object_suffix;
+	char *tmp, *save, *image_object_suffix;
 	struct snipl_image *image;
 	char image_object[HWMCA_MAX_ID_LEN];
 
@@ -569,11 +563,11 @@ static int snipl_lpar_login(struct snipl_server *server)
 	/* parse group object information */
 	maxsize = HWMCA_MAX_ID_LEN;
 	/* first group object inforamtion */
-	tmp = strtok(tmp, " ");
+	tmp = strtok_r(tmp, " ", &save);
 	while (tmp) {
 		/* loop through all returned group object informations */
 		strncpy(image_object, tmp, maxsize);
-		tmp = strtok(NULL, " ");
+		tmp = strtok_r(NULL, " ", &save);
 		/* next group object information */
 		/* cut to unique number for the image object */
 		image_object_suffix = &(image_object
@@ -683,24 +677,22 @@ static int snipl_lpar_logout(struct snipl_server *server)
 	if (server->priv) {
 		if (server->priv->snmp_data_p) {
 			ret = HwmcaTerminate(&server->priv->snmp_command,
-					     server->timeout);
+				snipl_wait_time(server, snipl_timeout(server)));
 			if (ret != HWMCA_DE_NO_ERROR) {
-				create_msg(server, "%sshutdown of command snmp "
+				append_msg(server, "shutdown of command snmp "
 					   "connection failed, "
-					   "return code %d\n",
-					   server->problem, ret);
+					   "return code %d\n", ret);
 			server->problem_class = FATAL;
 			}
 			free(server->priv->snmp_data_p);
 		}
 		if (server->priv->snmp_notify_p) {
 			ret = HwmcaTerminate(&server->priv->snmp_notify,
-					     server->timeout);
+				snipl_wait_time(server, snipl_timeout(server)));
 			if (ret != HWMCA_DE_NO_ERROR) {
-				create_msg(server, "%sshutdown of notify snmp "
+				append_msg(server, "shutdown of notify snmp "
 					   "connection failed, "
-					   "return code %d\n",
-					   server->problem, ret);
+					   "return code %d\n", ret);
 				server->problem_class = FATAL;
 			}
 			free(server->priv->snmp_notify_p);
@@ -769,6 +761,7 @@ int command_handling(struct snipl_image *image)
 	char command_identifier[128];
 	unsigned long needed;
 	unsigned short tmp_force;
+	int progress;
 
 	sprintf(command_target, "%s.%s", HWMCA_CPC_IMAGE_ID,
 		image->priv->image_object);
@@ -808,7 +801,8 @@ int command_handling(struct snipl_image *image)
 				command_target,
 				command_identifier,
 				image->priv->data,
-				image->server->timeout,
+				snipl_wait_time(image->server,
+						snipl_timeout(image->server)),
 				&correlator,
 				sizeof(correlator));
 	} else
@@ -817,7 +811,8 @@ int command_handling(struct snipl_image *image)
 				command_target,
 				command_identifier,
 				NULL,
-				image->server->timeout,
+				snipl_wait_time(image->server,
+						snipl_timeout(image->server)),
 				&correlator,
 				sizeof(correlator));
 
@@ -827,11 +822,17 @@ int command_handling(struct snipl_image *image)
 			image->name,
 			image->priv->command_name,
 			getErrorMessage(ret));
+		snipl_result_api(image->server, ret, UNDEFINED);
 		image->server->problem_class = FATAL;
+		if (ret == HWMCA_DE_OBJECT_BUSY || ret == HWMCA_DE_TIMEOUT)
+			snipl_result_busy(image->server);
 		return ret+RET_PLUS;
 	}
 
-	if (strcmp(image->priv->command_id, HWMCA_SEND_OPSYS_COMMAND)) {
+	/* no progress dots for operating system commands and on JSON output */
+	progress = strcmp(image->priv->command_id, HWMCA_SEND_OPSYS_COMMAND) &&
+		image->server->parms.output == SNIPL_OUTPUT_TEXT;
+	if (progress) {
 		fprintf(stdout, "processing...");
 		fflush(stdout);
 	}
@@ -843,12 +844,22 @@ int command_handling(struct snipl_image *image)
 					image->server->priv->snmp_data_p,
 					image->server->priv->bufsize,
 					&needed,
-					image->server->timeout);
+					snipl_wait_time(image->server,
+						snipl_timeout(image->server)));
 
 		if (ret != HWMCA_DE_NO_ERROR) {
-			if (ret == HWMCA_DE_TIMEOUT) {
-				if (strcmp(image->priv->command_id,
-					   HWMCA_SEND_OPSYS_COMMAND)) {
+			if (ret == HWMCA_DE_TIMEOUT &&
+			    snipl_time_left(image->server) <= 0) {
+				if (progress)
+					fprintf(stdout, "\n");
+				create_msg(image->server, "%s: %s not "
+					   "acknowledged before the deadline\n",
+					   image->name,
+					   image->priv->command_name);
+				image->server->problem_class = FATAL;
+				return DEADLINE_EXCEEDED;
+			} else if (ret == HWMCA_DE_TIMEOUT) {
+				if (progress) {
 					/* repeat */
 					fprintf(stdout, ".");
 					fflush(stdout);
@@ -859,6 +870,7 @@ int command_handling(struct snipl_image *image)
 					   image->name,
 					   image->priv->command_name,
 					   getErrorMessage(ret));
+				snipl_result_api(image->server, ret, UNDEFINED);
 				image->server->problem_class = FATAL;
 				return ret+RET_PLUS;
 			}
@@ -884,12 +896,12 @@ int command_handling(struct snipl_image *image)
 						command_identifier,
 						correlator,
 						image);
-					if (strcmp(image->priv->command_id,
-						HWMCA_SEND_OPSYS_COMMAND))
+					if (progress)
 						fprintf(stdout, "\n");
 					switch (ret) {
 					case 1:
 						DEBUG_PRINT("Successful acknowledge...\n");
+						image->priv->status_stale = 1;
 						create_msg(image->server,
 							"%s: acknowledged.\n",
 							image->name);
@@ -907,7 +919,7 @@ int command_handling(struct snipl_image *image)
 			}
 		}
 	}
-	if (strcmp(image->priv->command_id, HWMCA_SEND_OPSYS_COMMAND))
+	if (progress)
 		fprintf(stdout, "\n");
 	return 0;
 }
@@ -1443,6 +1455,8 @@ static int parse_command_response(const HWMCA_DATATYPE_P data,
 			   "not successful - rc is %ld\n",
 			   image->name,
 			   *(long *)pdata->pData);
+		snipl_result_api(image->server, *(long *)pdata->pData,
+				 UNDEFINED);
 		image->server->problem_class = FATAL;
 		return 0;
 	}
@@ -1678,7 +1692,7 @@ static void poll_opsys_messages(struct snipl_image *image)
 					rc = write(image->server->priv->msgfile,
 					errstr, strlen(errstr));
 				rc = HwmcaTerminate(&image->server->priv->snmp_notify,
-					image->server->timeout);
+					snipl_timeout(image->server));
 				if (rc != HWMCA_DE_NO_ERROR) {
 					ret = ret + RET_PLUS;
 					goto out;
@@ -1688,7 +1702,7 @@ static void poll_opsys_messages(struct snipl_image *image)
 					HWMCA_DIRECT_INITIALIZE +
 					HWMCA_SNMP_VERSION_2;
 				rc = HwmcaInitialize(&image->server->priv->snmp_notify,
-					image->server->timeout);
+					snipl_timeout(image->server));
 				if (rc != HWMCA_DE_NO_ERROR) {
 					ret = ret + RET_PLUS;
 					goto out;
@@ -1965,56 +1979,74 @@ kill:
 }
 
 
+static const struct snipl_status_bit status_bits[] = {
+	{HWMCA_STATUS_OPERATING,		"operating"},
+	{HWMCA_STATUS_NOT_OPERATING,		"not_operating"},
+	{HWMCA_STATUS_NO_POWER,			"no_power"},
+	{HWMCA_STATUS_NOT_ACTIVATED,		"not_activated"},
+	{HWMCA_STATUS_EXCEPTIONS,		"exceptions"},
+	{HWMCA_STATUS_STATUS_CHECK,		"status_check"},
+	{HWMCA_STATUS_SERVICE,			"service"},
+	{HWMCA_STATUS_LINKNOTACTIVE,		"link_not_active"},
+	{HWMCA_STATUS_POWERSAVE,		"power_save"},
+	{HWMCA_STATUS_SERIOUSALERT,		"serious_alert"},
+	{HWMCA_STATUS_ALERT,			"alert"},
+	{HWMCA_STATUS_ENVALERT,			"env_alert"},
+	{HWMCA_STATUS_SERVICE_REQ,		"service_req"},
+	{HWMCA_STATUS_DEGRADED,			"degraded"},
+	{HWMCA_STATUS_STORAGE_EXCEEDED,		"storage_exceeded"},
+	{HWMCA_STATUS_LOGOFF_TIMEOUT,		"logoff_timeout"},
+	{HWMCA_STATUS_FORCED_SLEEP,		"forced_sleep"},
+	{HWMCA_STATUS_IMAGE_NOT_OPERATING,	"image_not_operating"},
+	{HWMCA_STATUS_IMAGE_NOT_ACTIVATED,	"image_not_activated"},
+	{HWMCA_STATUS_IMAGE_NOT_CAPABLE,	"image_not_capable"},
+	{HWMCA_STATUS_UNKNOWN,			"unknown"},
+	{0, NULL}
+};
+
+
+/*
+ * map the HWMCA status bits to the state of an image
+ */
+static int image_state(unsigned long status)
+{
+	if (status & HWMCA_STATUS_OPERATING)
+		return SNIPL_IMAGE_OPERATING;
+	if (status & (HWMCA_STATUS_NOT_ACTIVATED | HWMCA_STATUS_NO_POWER))
+		return SNIPL_IMAGE_INACTIVE;
+	if (status & HWMCA_STATUS_NOT_OPERATING)
+		return SNIPL_IMAGE_ACTIVE;
+	return SNIPL_IMAGE_UNKNOWN;
+}
+
+
 static int snipl_image_getstatus(struct snipl_image *image)
 {
-	int ret = 0;
+	struct snipl_server *server = image->server;
+	const struct snipl_status_bit *sb;
+	unsigned long status;
+	int ret;
 
-	DEBUG_PRINT("status %d\n", image->priv->status);
-	fprintf(stdout, "status of %s: ", image->name);
-	if (image->priv->status & HWMCA_STATUS_OPERATING)
-		fprintf(stdout, " operating");
-	if (image->priv->status & HWMCA_STATUS_NOT_OPERATING)
-		fprintf(stdout, " not_operating");
-	if (image->priv->status & HWMCA_STATUS_NO_POWER)
-		fprintf(stdout, " no_power");
-	if (image->priv->status & HWMCA_STATUS_NOT_ACTIVATED)
-		fprintf(stdout, " not_activated");
-	if (image->priv->status & HWMCA_STATUS_EXCEPTIONS)
-		fprintf(stdout, " exceptions");
-	if (image->priv->status & HWMCA_STATUS_STATUS_CHECK)
-		fprintf(stdout, " status_check");
-	if (image->priv->status & HWMCA_STATUS_SERVICE)
-		fprintf(stdout, " service");
-	if (image->priv->status & HWMCA_STATUS_LINKNOTACTIVE)
-		fprintf(stdout, " link_not_active");
-	if (image->priv->status & HWMCA_STATUS_POWERSAVE)
-		fprintf(stdout, " power_save");
-	if (image->priv->status & HWMCA_STATUS_SERIOUSALERT)
-		fprintf(stdout, " serious_alert");
-	if (image->priv->status & HWMCA_STATUS_ALERT)
-		fprintf(stdout, " alert");
-	if (image->priv->status & HWMCA_STATUS_ENVALERT)
-		fprintf(stdout, " env_alert");
-	if (image->priv->status & HWMCA_STATUS_SERVICE_REQ)
-		fprintf(stdout, " service_req");
-	if (image->priv->status & HWMCA_STATUS_DEGRADED)
-		fprintf(stdout, " degraded");
-	if (image->priv->status & HWMCA_STATUS_STORAGE_EXCEEDED)
-		fprintf(stdout, "storage_exceeded");
-	if (image->priv->status & HWMCA_STATUS_LOGOFF_TIMEOUT)
-		fprintf(stdout, " logoff_timeout");
-	if (image->priv->status & HWMCA_STATUS_FORCED_SLEEP)
-		fprintf(stdout, " forced_sleep");
-	if (image->priv->status & HWMCA_STATUS_IMAGE_NOT_OPERATING)
-		fprintf(stdout, " image_not_operating");
-	if (image->priv->status & HWMCA_STATUS_IMAGE_NOT_ACTIVATED)
-		fprintf(stdout, " image_not_activated");
-	if (image->priv->status & HWMCA_STATUS_IMAGE_NOT_CAPABLE)
-		fprintf(stdout, " image_not_capable");
-	if (image->priv->status & HWMCA_STATUS_UNKNOWN)
-		fprintf(stdout, " unknown");
-	fprintf(stdout, "\n");
-	return ret;
+	/*
+	 * the status read at login is outdated after a command, and
+	 * after it was reported once, for a poll of a kept session
+	 */
+	if (image->priv->status_stale) {
+		ret = snipl_image_status(server, image);
+		if (ret)
+			return ret;
+	}
+	image->priv->status_stale = 1;
+	status = image->priv->status;
+	DEBUG_PRINT("status %lu\n", status);
+	snipl_result_state(server, image_state(status), status, status_bits);
+	create_msg(server, "status of %s: ", image->name);
+	for (sb = status_bits; sb->name; sb++)
+		if (status & sb->bit)
+			append_msg(server, " %s", sb->name);
+	append_msg(server, "\n");
+	server->problem_class = OK;
+	return 0;
 }
 
 
@@ -14,10 +14,14 @@
 
 #define RET_PLUS        2000    /* constant to add to sniplapi return codes   */
 #define BUFSIZE        10000    /* buffersize used to communicate with HMC/SE */
+#ifndef HWMCA_DE_OBJECT_BUSY
+#define HWMCA_DE_OBJECT_BUSY  24  /* see errorMessage in sniplapi.c */
+#endif
 
 static int snipl_lpar_prepare_check(struct snipl_server *);
 static int snipl_lpar_logout(struct snipl_server *);
 static int snipl_lpar_login(struct snipl_server *);
+static int snipl_lpar_probe(struct snipl_server *);
 static int snipl_image_reset(struct snipl_image *);
 static int snipl_image_activate(struct snipl_image *);
 static int snipl_image_deactivate(struct snipl_image *);
@@ -43,7 +47,8 @@ static struct snipl_image_ops snipl_image_ops = {    /* image operations */
 static struct snipl_server_ops snipl_server_ops = {  /* server operations */
 	.logout  = snipl_lpar_logout,
 	.login   = snipl_lpar_login,
-	.check   = snipl_lpar_prepare_check
+	.check   = snipl_lpar_prepare_check,
+	.probe   = snipl_lpar_probe
 };
 
 struct snipl_server_private {                  /* private server info         */
@@ -65,6 +70,7 @@ struct snipl_image_private {                   /* private image info          */
 	char *command_id;                      /* HwmcaCommand identification */
 	char *command_name;                    /* HwmcaCommand in prosa       */
 	unsigned int status;                   /* image status                */
+	int status_stale;                      /* status changed by a command */
 };
 
 static int parse_command_response(const HWMCA_DATATYPE_P,
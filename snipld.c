@@ -0,0 +1,617 @@
+/*
+   snipld - daemon keeping the logins of snipl to its servers
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snipld is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   snipld reads the configuration file once and logs in to a server at
+   its first request. The login is kept, so the HWMCA session and the
+   image objects of an LPAR server are reused by all later requests.
+   Every client connection is served by a thread, the requests to one
+   server take turns. Identical requests that arrive while one of them
+   is performed get its answer. See sndaemon.c for the protocol.
+   The histories of the requests are written to the state file every
+   SNIPLD_FLUSH seconds at most, not by the requests themselves.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include "snipl.h"
+
+#define SNIPLD_FLUSH	10	/* seconds between writes of the state file */
+
+/*
+ * a server of the configuration file with its login
+ */
+struct daemon_server {
+	struct snipl_server *server;
+	pthread_mutex_t lock;		/* one request at a time */
+	int connected;
+	int used;			/* a request was sent since login */
+	struct daemon_server *next;
+};
+
+/*
+ * a request being performed, later identical requests wait for it
+ */
+struct pending {
+	char *line;			/* the request as sent */
+	int waiting;			/* clients waiting for the answer */
+	int done;
+	struct snipl_result res;	/* the answer */
+	struct pending *next;
+};
+
+static struct daemon_server *servers;
+static struct pending *pendings;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_done = PTHREAD_COND_INITIALIZER;
+static int stop;			/* set by main at SIGTERM or SIGINT */
+
+static struct option long_options[] = {
+	{"configfilename", 1, NULL, 'f'},
+	{"socket",         1, NULL, 'S'},
+	{"help",           0, NULL, 'h'},
+	{"version",        0, NULL, 'v'},
+	{NULL, 0, NULL, 0}
+};
+
+
+static void print_usage(const char *name)
+{
+	printf("Keep the logins of snipl to the servers of a configuration "
+	       "file\n");
+	printf("Usage: %s [options]\n", name);
+	printf(" -f --configfilename <filename>  name of configuration file\n");
+	printf(" -S --socket <path>              socket of the clients "
+	       "(default $SNIPLD_SOCKET\n"
+	       "                                 or /run/snipld.sock)\n");
+	printf(" -h --help                       print usage information\n");
+	printf(" -v --version                    print version of %s\n",
+	       name);
+}
+
+
+/*
+ * log a message of a server to stderr
+ */
+static void log_problem(struct snipl_server *server)
+{
+	if (!server->problem)
+		return;
+	fprintf(stderr, "snipld: %s: %s", server->address, server->problem);
+	free(server->problem);
+	server->problem = NULL;
+}
+
+
+/*
+ *	function: find_daemon_server
+ *
+ *	purpose: find the server of a request with the image in its
+ *		 configuration
+ *
+ *	returns the server and its image in *image or NULL
+ */
+static struct daemon_server *find_daemon_server(struct snipld_request *req,
+						struct snipl_image **image)
+{
+	struct daemon_server *ds;
+	struct snipl_server *server;
+
+	for (ds = servers; ds; ds = ds->next) {
+		server = ds->server;
+		if (strcasecmp(server->type, req->type) ||
+		    strcasecmp(server->address, req->address))
+			continue;
+		if (req->user && (!server->user ||
+				  strcasecmp(server->user, req->user)))
+			continue;
+		snipl_for_each_image(server, *image)
+			if (!strcasecmp((*image)->name, req->image) ||
+			    !strcasecmp((*image)->alias, req->image))
+				return ds;
+	}
+	return NULL;
+}
+
+
+/*
+ * login to the server at the first request or after a lost login
+ */
+static int daemon_connect(struct daemon_server *ds)
+{
+	struct snipl_server *server = ds->server;
+	int ret;
+
+	server->parms.image_op = GETSTATUS;
+	server->parms.force = UNDEFINED;
+	/* snipl_prepare serializes the loading of modules */
+	ret = snipl_connect(server);
+	/* images missing on an LPAR server are refused by their request */
+	if (!ret || ret == SERVER_IMAGE_MISMATCH) {
+		ds->connected = 1;
+		ds->used = 0;
+		log_problem(server);
+		return 0;
+	}
+	return ret;
+}
+
+
+static void daemon_logout(struct daemon_server *ds)
+{
+	snipl_logout(ds->server);
+	log_problem(ds->server);
+	ds->connected = 0;
+}
+
+
+/*
+ *	function: daemon_operation
+ *
+ *	purpose: perform the request on image with the login of its server.
+ *		 z/VM needs a new login for every request but the first one
+ *		 after the connect, like snipl does. A failed request to an
+ *		 LPAR server with a reused login is sent once more with a
+ *		 new login, the HMC may have ended the session.
+ *
+ *	returns the return code of the login or the operation
+ */
+static int daemon_operation(struct daemon_server *ds, struct snipl_image *image,
+			    struct snipld_request *req)
+{
+	struct snipl_server *server = ds->server;
+	struct snipl_learn learn;
+	struct timespec login_start;
+	struct snipl_result *res;
+	int vm = !strcasecmp(server->type, "VM");
+	int login, again, ret;
+
+	for (again = !vm && ds->connected; ; again = 0) {
+		clock_gettime(CLOCK_REALTIME, &login_start);
+		ret = 0;
+		login = !ds->connected || (vm && ds->used);
+		if (!ds->connected) {
+			ret = daemon_connect(ds);
+		} else if (vm && ds->used) {
+			snipl_learn_begin(server, "login", &learn);
+			ret = snipl_login(server);
+			snipl_learn_end(server, &learn, ret);
+		}
+		ds->used = 1;
+		res = snipl_result_begin(server, image, req->op);
+		if (login)
+			snipl_result_phase(res, SNIPL_PHASE_LOGIN,
+					   &login_start);
+		if (ret)
+			return ret;
+		if (!image->ops && !vm) {
+			create_msg(server, "Given LPAR name %s does not exist "
+				   "on %s\n", image->name, server->address);
+			server->problem_class = FATAL;
+			return SERVER_IMAGE_MISMATCH;
+		}
+
+		server->parms.image_op = req->op;
+		server->parms.force = req->force;
+		server->parms.shutdown_time = req->shutdown_time;
+		server->parms.profile = req->profile;
+		snipl_learn_begin(server, snipl_op_name(req->op), &learn);
+		switch (req->op) {
+		case ACTIVATE:
+			ret = snipl_activate(image);
+			break;
+		case DEACTIVATE:
+			ret = snipl_deactivate(image);
+			break;
+		case RESET:
+			ret = snipl_reset(image);
+			break;
+		case STOP:
+			ret = snipl_stop(image);
+			break;
+		default:
+			ret = snipl_getstatus(image);
+		}
+		snipl_learn_end(server, &learn, ret);
+		server->parms.profile = NULL;
+		if (!ret || !again ||
+		    (ret != HWMCA_PROBLEM && ret != CONNECTION_ERROR))
+			return ret;
+		/* forget the record and the login, then try again */
+		server->results->sink = NULL;
+		snipl_result_end(server, ret);
+		daemon_logout(ds);
+	}
+}
+
+
+/*
+ *	function: daemon_request
+ *
+ *	purpose: perform a request or wait for an identical one that is
+ *		 performed already, and write the answer
+ */
+static int daemon_request(FILE *out, char *line)
+{
+	struct snipld_request req;
+	struct daemon_server *ds;
+	struct snipl_image *image;
+	struct snipl_result *res;
+	struct pending *p, **pp;
+	char *key;
+	int ret;
+
+	key = strdup(line);
+	if (!key)
+		return snipld_refuse(out, "out of memory");
+	if (snipld_parse(line, &req)) {
+		free(key);
+		return snipld_refuse(out, "syntax error");
+	}
+	if (req.op != ACTIVATE && req.op != DEACTIVATE && req.op != RESET &&
+	    req.op != STOP && req.op != GETSTATUS) {
+		free(key);
+		return snipld_refuse(out, "operation not served");
+	}
+	ds = find_daemon_server(&req, &image);
+	if (!ds) {
+		free(key);
+		return snipld_refuse(out, "image not in configuration file");
+	}
+
+	pthread_mutex_lock(&pending_lock);
+	for (p = pendings; p; p = p->next)
+		if (!strcmp(p->line, key))
+			break;
+	if (p) {
+		free(key);
+		p->waiting++;
+		while (!p->done)
+			pthread_cond_wait(&pending_done, &pending_lock);
+		pthread_mutex_unlock(&pending_lock);
+		ret = snipld_answer(out, &p->res);
+		goto release;
+	}
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		pthread_mutex_unlock(&pending_lock);
+		free(key);
+		return snipld_refuse(out, "out of memory");
+	}
+	p->line = key;
+	p->waiting = 1;
+	p->next = pendings;
+	pendings = p;
+	pthread_mutex_unlock(&pending_lock);
+
+	pthread_mutex_lock(&ds->lock);
+	ds->server->results->sink = NULL;
+	ret = daemon_operation(ds, image, &req);
+	res = snipl_result_end(ds->server, ret);
+	if (res) {
+		/* the ring has one record, keep the answer */
+		p->res = *res;
+		p->res.text = res->text ? strdup(res->text) : NULL;
+		p->res.image = NULL;
+	} else {
+		p->res.rc = ret;
+		p->res.severity = FATAL;
+	}
+	if (!ds->connected)
+		log_problem(ds->server);
+	pthread_mutex_unlock(&ds->lock);
+
+	pthread_mutex_lock(&pending_lock);
+	p->done = 1;
+	for (pp = &pendings; *pp != p; pp = &(*pp)->next)
+		;
+	*pp = p->next;
+	pthread_cond_broadcast(&pending_done);
+	pthread_mutex_unlock(&pending_lock);
+	ret = snipld_answer(out, &p->res);
+
+release:
+	pthread_mutex_lock(&pending_lock);
+	if (--p->waiting) {
+		pthread_mutex_unlock(&pending_lock);
+		return ret;
+	}
+	pthread_mutex_unlock(&pending_lock);
+	free(p->res.text);
+	free(p->line);
+	free(p);
+	return ret;
+}
+
+
+/*
+ * serve the requests of a client until it closes the connection
+ */
+static void *client_thread(void *arg)
+{
+	int fd = (long)arg;
+	FILE *in, *out;
+	char *line = NULL;
+	size_t size = 0;
+
+	in = fdopen(fd, "r");
+	out = fdopen(dup(fd), "w");
+	if (!in || !out) {
+		if (in)
+			fclose(in);
+		else
+			close(fd);
+		if (out)
+			fclose(out);
+		return NULL;
+	}
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) &&
+	       getline(&line, &size, in) > 0)
+		if (daemon_request(out, line))
+			break;
+	free(line);
+	fclose(out);
+	fclose(in);
+	return NULL;
+}
+
+
+/*
+ *	function: setup_servers
+ *
+ *	purpose: prepare the servers of the configuration file like snipl
+ *		 does for a server given on the command line
+ *
+ *	returns the number of servers
+ */
+static int setup_servers(struct snipl_configuration *conf)
+{
+	struct snipl_server *server;
+	struct snipl_image *image;
+	struct daemon_server *ds;
+	char *c;
+	int n = 0;
+
+	snipl_for_each_server(conf, server) {
+		if (strcasecmp(server->type, "VM") &&
+		    strcasecmp(server->type, "LPAR"))
+			continue;
+		ds = calloc(1, sizeof(*ds));
+		if (!ds || snipl_results_alloc(server, 1)) {
+			free(ds);
+			fprintf(stderr, "snipld: cannot allocate buffer for "
+				"server %s\n", server->address);
+			continue;
+		}
+		if (server->enc == UNDEFINED)
+			server->enc = 1;
+		/* VM image names keep a - as newline, see snconfig.c */
+		if (!strcasecmp(server->type, "VM"))
+			snipl_for_each_image(server, image)
+				for (c = image->name; *c; c++)
+					if (*c == '\n')
+						*c = '-';
+		ds->server = server;
+		pthread_mutex_init(&ds->lock, NULL);
+		ds->next = servers;
+		servers = ds;
+		n++;
+	}
+	return n;
+}
+
+
+/*
+ *	function: open_socket
+ *
+ *	purpose: create the listening socket. A socket left over by a
+ *		 snipld that ended is replaced, a running one is not.
+ *
+ *	returns the socket or -1
+ */
+static int open_socket(const char *name)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd;
+
+	if (!name || strlen(name) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "snipld: invalid socket name\n");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, name);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		goto fail;
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "snipld: another snipld serves %s\n", name);
+		close(fd);
+		return -1;
+	}
+	unlink(name);
+	/* only the user of snipld may use its logins */
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		umask(mask);
+		goto fail;
+	}
+	umask(mask);
+	if (listen(fd, 64) == -1)
+		goto fail;
+	return fd;
+fail:
+	fprintf(stderr, "snipld: %s: %s\n", name, strerror(errno));
+	if (fd != -1)
+		close(fd);
+	return -1;
+}
+
+
+/*
+ *	function: main
+ *
+ *	purpose: point of control
+ */
+int main(int argc, char **argv)
+{
+	struct snipl_configuration *conf;
+	struct daemon_server *ds;
+	struct pollfd pfd[2];
+	sigset_t sigs;
+	const char *sockname = snipld_socket_name();
+	char *cfgname = NULL, *used_cfgname;
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct timespec now, flushed;
+	int c, fd, lfd, sfd, ret = 0;
+
+	while ((c = getopt_long(argc, argv, "f:S:hv", long_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 'f':
+			cfgname = optarg;
+			break;
+		case 'S':
+			sockname = optarg;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		case 'v':
+			printf("%s\n", SNIPL_VERSION);
+			printf("%s\n", SNIPL_COPYRIGHT);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return UNKNOWN_PARAMETER;
+		}
+	}
+	if (optind < argc) {
+		print_usage(argv[0]);
+		return UNKNOWN_PARAMETER;
+	}
+
+	used_cfgname = get_config_file_name(cfgname);
+	if (!used_cfgname) {
+		fprintf(stderr, "snipld: no configuration file could be "
+			"found/opened\n");
+		return INVALID_PARAMETER_VALUE;
+	}
+	conf = snipl_configuration_from_file(used_cfgname);
+	if (!conf || conf->problem_class != OK) {
+		fprintf(stderr, "snipld: error while reading configuration "
+			"file %s\n%s\n", used_cfgname,
+			conf && conf->problem ? conf->problem : "");
+		ret = INVALID_PARAMETER_VALUE;
+		goto out;
+	}
+	if (!setup_servers(conf)) {
+		fprintf(stderr, "snipld: no VM or LPAR server in configuration "
+			"file %s\n", used_cfgname);
+		ret = INVALID_PARAMETER_VALUE;
+		goto out;
+	}
+	lfd = open_socket(sockname);
+	if (lfd == -1) {
+		ret = CONNECTION_ERROR;
+		goto out;
+	}
+
+	/*
+	 * end at SIGTERM or SIGINT. The signals are blocked before any
+	 * thread starts, so no client thread takes them, and the accept
+	 * loop waits for them on a signalfd.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	sfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	if (sfd == -1) {
+		fprintf(stderr, "snipld: signalfd: %s\n", strerror(errno));
+		close(lfd);
+		unlink(sockname);
+		ret = CONNECTION_ERROR;
+		goto out;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pfd[0].fd = lfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sfd;
+	pfd[1].events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &flushed);
+	while (1) {
+		c = poll(pfd, 2, SNIPLD_FLUSH * 1000);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - flushed.tv_sec >= SNIPLD_FLUSH) {
+			snipl_state_flush();
+			flushed = now;
+		}
+		if (c == -1) {
+			if (errno != EINTR)
+				fprintf(stderr, "snipld: poll: %s\n",
+					strerror(errno));
+			continue;
+		}
+		if (pfd[1].revents)
+			break;
+		if (!pfd[0].revents)
+			continue;
+		fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				fprintf(stderr, "snipld: accept: %s\n",
+					strerror(errno));
+			continue;
+		}
+		if (pthread_create(&thread, &attr, client_thread,
+				   (void *)(long)fd)) {
+			fprintf(stderr, "snipld: cannot start thread\n");
+			close(fd);
+		}
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	close(sfd);
+	close(lfd);
+	unlink(sockname);
+
+	/* requests still running keep their server locked */
+	for (ds = servers; ds; ds = ds->next) {
+		pthread_mutex_lock(&ds->lock);
+		if (ds->connected)
+			daemon_logout(ds);
+	}
+	snipl_state_flush();
+	snipl_release_modules();
+out:
+	free(used_cfgname);
+	snipl_configuration_free(conf);
+	return ret;
+}
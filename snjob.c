@@ -0,0 +1,401 @@
+/*
+   snjob.c - job files with dependent steps for snipl
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snjob is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   A job file uses the syntax of the configuration file, one key = value
+   per line and # starts a comment. Every step starts with its name and
+   is followed by its operation, its images and the steps it runs after:
+
+	step  = network
+	op    = activate
+	image = LNXNET1,LNXNET2
+
+	step  = database
+	after = network
+	op    = activate
+	image = LNXDB1
+
+   image and after take a comma separated list and may be repeated,
+   "after: network" is accepted as well. The images are looked up in the
+   configuration file when the job runs.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <regex.h>
+#include <errno.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include "snipl.h"
+
+enum job_key {
+	/* accepted keys */
+	STEP,
+	OP,
+	IMAGE,
+	AFTER,
+	/* special keys */
+	UNKNOWN, /* number of valid words */
+	NR_KEYWORDS = UNKNOWN,
+};
+
+static const char *job_keywords[NR_KEYWORDS] = {
+	[STEP]		"step",
+	[OP]		"op",
+	[IMAGE]		"image",
+	[AFTER]		"after",
+};
+
+/* the operations a step can do, load and dump need more parameters */
+static const int job_ops[] = {
+	ACTIVATE,
+	DEACTIVATE,
+	RESET,
+	STOP,
+	GETSTATUS,
+};
+
+
+static enum job_key job_identify_key(const char *s)
+{
+	enum job_key key;
+
+	for (key = 0; key < NR_KEYWORDS; key++) {
+		if (!strcasecmp(s, job_keywords[key]))
+			return key;
+	}
+	return UNKNOWN;
+}
+
+
+/*
+ * append a message to job->problem, the most severe class is kept
+ */
+static void job_error(struct snipl_job *job, int severity,
+		      const char *format, ...)
+{
+	char *text, *problem;
+	va_list args;
+
+	va_start(args, format);
+	if (vasprintf(&text, format, args) < 0)
+		text = NULL;
+	va_end(args);
+	if (text && asprintf(&problem, "%s%s", job->problem ? job->problem : "",
+			     text) > 0) {
+		free(job->problem);
+		job->problem = problem;
+	}
+	free(text);
+	if (severity > job->problem_class)
+		job->problem_class = severity;
+}
+
+
+/*
+ * add the comma separated names in value to list
+ */
+static int job_add_names(char ***list, int *nr, char *value)
+{
+	char **new_list;
+	char *name, *save;
+
+	for (name = strtok_r(value, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		new_list = realloc(*list, (*nr + 1) * sizeof(**list));
+		if (!new_list)
+			return FATAL;
+		*list = new_list;
+		(*list)[*nr] = strdup(name);
+		if (!(*list)[*nr])
+			return FATAL;
+		(*nr)++;
+	}
+	return 0;
+}
+
+
+static int job_find_step(struct snipl_job *job, const char *name)
+{
+	int i;
+
+	for (i = 0; i < job->nr_steps; i++)
+		if (!strcasecmp(job->step[i].name, name))
+			return i;
+	return -1;
+}
+
+
+static int job_new_step(struct snipl_job *job, char *value, const char **text)
+{
+	struct snipl_step *step;
+
+	if (job_find_step(job, value) >= 0) {
+		*text = "step already defined";
+		return FATAL;
+	}
+	step = realloc(job->step, (job->nr_steps + 1) * sizeof(*step));
+	if (!step) {
+		*text = "out of memory";
+		return FATAL;
+	}
+	job->step = step;
+	step = &job->step[job->nr_steps];
+	memset(step, 0, sizeof(*step));
+	step->op = OPUNKNOWN;
+	step->gate = -1;
+	step->name = strdup(value);
+	if (!step->name) {
+		*text = "out of memory";
+		return FATAL;
+	}
+	job->nr_steps++;
+	return 0;
+}
+
+
+static int job_set_op(struct snipl_step *step, const char *value,
+		      const char **text)
+{
+	unsigned int i;
+
+	if (step->op != OPUNKNOWN) {
+		*text = "already defined";
+		return WARNING;
+	}
+	for (i = 0; i < DIMOF(job_ops); i++) {
+		if (!strcasecmp(value, snipl_op_name(job_ops[i]))) {
+			step->op = job_ops[i];
+			return 0;
+		}
+	}
+	*text = "non-proper op (activate, deactivate, reset, stop or "
+		"getstatus)";
+	return FATAL;
+}
+
+
+static int job_parse_line(struct snipl_job *job, char *buffer, regex_t *re,
+			  const char **text)
+{
+	regmatch_t pmatch[3];
+	struct snipl_step *step;
+	char *key, *value;
+	enum job_key keyval;
+
+	if (regexec(re, buffer, 3, pmatch, 0) == REG_NOMATCH) {
+		*text = "syntax error";
+		return FATAL;
+	}
+	key   = buffer + pmatch[1].rm_so;
+	buffer[pmatch[1].rm_eo] = '\0';
+	value = buffer + pmatch[2].rm_so;
+	buffer[pmatch[2].rm_eo] = '\0';
+
+	keyval = job_identify_key(key);
+	if (keyval == UNKNOWN) {
+		*text = "unknown keyword";
+		return WARNING;
+	}
+	if (keyval == STEP)
+		return job_new_step(job, value, text);
+	if (!job->nr_steps) {
+		*text = "no step defined yet";
+		return FATAL;
+	}
+	step = &job->step[job->nr_steps - 1];
+	*text = "out of memory";
+	switch (keyval) {
+	case OP:
+		return job_set_op(step, value, text);
+	case IMAGE:
+		return job_add_names(&step->images, &step->nr_images, value);
+	case AFTER:
+		return job_add_names(&step->after, &step->nr_after, value);
+	default:
+		return 0;
+	}
+}
+
+
+/*
+ * check that every step is complete and resolve the after lists
+ */
+static void job_check_steps(struct snipl_job *job)
+{
+	struct snipl_step *step;
+	int i, n;
+
+	for (i = 0; i < job->nr_steps; i++) {
+		step = &job->step[i];
+		if (step->op == OPUNKNOWN)
+			job_error(job, FATAL, "FATAL: %s: step %s: missing op\n",
+				  job->filename, step->name);
+		if (!step->nr_images)
+			job_error(job, FATAL, "FATAL: %s: step %s: missing "
+				  "image\n", job->filename, step->name);
+		if (!step->nr_after)
+			continue;
+		step->dep = calloc(step->nr_after, sizeof(*step->dep));
+		if (!step->dep) {
+			job_error(job, FATAL, "FATAL: %s: out of memory\n",
+				  job->filename);
+			return;
+		}
+		for (n = 0; n < step->nr_after; n++) {
+			step->dep[n] = job_find_step(job, step->after[n]);
+			if (step->dep[n] < 0)
+				job_error(job, FATAL, "FATAL: %s: step %s: "
+					  "unknown step %s in after\n",
+					  job->filename, step->name,
+					  step->after[n]);
+		}
+	}
+}
+
+
+/*
+ * check that the steps do not wait for each other. Steps that only run
+ * after finished steps finish themselves, until no step is left or
+ * the remaining steps form a cycle.
+ */
+static void job_check_cycles(struct snipl_job *job)
+{
+	struct snipl_step *step;
+	int *finished;
+	int i, n, left, progress;
+
+	finished = calloc(job->nr_steps, sizeof(*finished));
+	if (!finished) {
+		job_error(job, FATAL, "FATAL: %s: out of memory\n",
+			  job->filename);
+		return;
+	}
+	left = job->nr_steps;
+	do {
+		progress = 0;
+		for (i = 0; i < job->nr_steps; i++) {
+			if (finished[i])
+				continue;
+			step = &job->step[i];
+			for (n = 0; n < step->nr_after; n++)
+				if (!finished[step->dep[n]])
+					break;
+			if (n < step->nr_after)
+				continue;
+			finished[i] = 1;
+			left--;
+			progress = 1;
+		}
+	} while (left && progress);
+
+	for (i = 0; left && i < job->nr_steps; i++)
+		if (!finished[i])
+			job_error(job, FATAL, "FATAL: %s: step %s: waits for "
+				  "itself through its after list\n",
+				  job->filename, job->step[i].name);
+	free(finished);
+}
+
+
+/*
+ *	function: snipl_job_from_file
+ *
+ *	purpose: read and check the job file filename. Problems are
+ *		 reported in job->problem, like for the configuration.
+ *
+ *	returns the job or NULL if no memory is left
+ */
+struct snipl_job *snipl_job_from_file(const char *filename)
+{
+	static const char token_pattern[] =
+			"^[[:blank:]]*([[:alpha:]]+)[[:blank:]]*"
+			"[=:][[:blank:]]*([^[:blank:]]+)[[:blank:]]*$";
+	struct snipl_job *job;
+	const char *text;
+	char *line = NULL;
+	char *comment;
+	size_t size = 0;
+	regex_t token;
+	FILE *file;
+	int lineno, ret;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+	job->filename = filename;
+	job->problem_class = OK;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		job_error(job, FATAL, "FATAL: %s: %s\n", filename,
+			  strerror(errno));
+		return job;
+	}
+	if (regcomp(&token, token_pattern, REG_EXTENDED)) {
+		job_error(job, FATAL, "FATAL: %s: regcomp failed\n", filename);
+		fclose(file);
+		return job;
+	}
+
+	for (lineno = 1; getline(&line, &size, file) > 0; lineno++) {
+		line[strcspn(line, "\n")] = '\0';
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+		if (!line[strspn(line, " \t")])
+			continue;
+		ret = job_parse_line(job, line, &token, &text);
+		if (ret == WARNING)
+			job_error(job, WARNING, "WARNING: %s:%d: %s: `%s'\n",
+				  filename, lineno, text, line);
+		if (ret == FATAL) {
+			job_error(job, FATAL, "FATAL: %s:%d: %s: `%s'\n",
+				  filename, lineno, text, line);
+			break;
+		}
+	}
+	free(line);
+	regfree(&token);
+	fclose(file);
+
+	if (job->problem_class != FATAL)
+		job_check_steps(job);
+	if (job->problem_class != FATAL)
+		job_check_cycles(job);
+	return job;
+}
+
+
+void snipl_job_free(struct snipl_job *job)
+{
+	struct snipl_step *step;
+	int i, n;
+
+	if (!job)
+		return;
+	for (i = 0; i < job->nr_steps; i++) {
+		step = &job->step[i];
+		for (n = 0; n < step->nr_images; n++)
+			free(step->images[n]);
+		for (n = 0; n < step->nr_after; n++)
+			free(step->after[n]);
+		free(step->images);
+		free(step->after);
+		free(step->dep);
+		free(step->name);
+	}
+	free(job->step);
+	free(job->problem);
+	free(job);
+}
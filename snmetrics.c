@@ -0,0 +1,403 @@
+/*
+   snmetrics.c - operation metrics in shared memory, shared by snipl,
+		 lic_vps and sncap processes
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snmetrics is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   The metrics are a file in /dev/shm ($SNIPL_METRICS) mapped by every
+   process that records a request. It holds a fixed table of slots, a
+   slot is either a series of one operation of one server, with the
+   number of requests, the failed ones and a histogram of their
+   durations, or the count of one API return code of such a series. A
+   series is kept in one of the METRICS_PROBE slots following the hash
+   of its labels.
+
+   A free slot is claimed with a compare and swap of its state, its
+   labels are written and it is marked ready. The labels of a ready slot
+   never change again, its counters are only added to atomically, so
+   recording takes no lock. Slots are never freed, the counters grow
+   until the file is removed, as counters should.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "snmetrics.h"
+
+#define SNIPL_METRICS_ENV	"SNIPL_METRICS"
+#define SNIPL_METRICS_FILE	"/dev/shm/snipl-metrics"
+
+#define METRICS_MAGIC	0x534e4d31	/* "SNM1", new for new layout */
+#define METRICS_SLOTS	2048
+#define METRICS_PROBE	16		/* slots a series may be in */
+#define METRICS_SPIN	1000		/* waits for a claimed slot */
+
+#define SLOT_FREE	0
+#define SLOT_CLAIMED	1		/* labels are being written */
+#define SLOT_READY	2
+
+#define KIND_REQUESTS	1		/* requests of an operation */
+#define KIND_RC		2		/* one API return code */
+
+#define FAMILY_DURATION	0		/* metric families written */
+#define FAMILY_FAILURES	1
+#define FAMILY_RC	2
+
+/* upper bounds of the histogram buckets in milliseconds */
+static const long bucket_ms[] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000,
+	120000, 300000
+};
+#define METRICS_BUCKETS	(sizeof(bucket_ms) / sizeof(bucket_ms[0]))
+
+struct metrics_slot {
+	uint32_t state;
+	uint32_t kind;
+	int32_t  port;
+	int32_t  api_rc;
+	char     type[8];
+	char     op[24];
+	char     address[96];
+	uint64_t count;			/* KIND_RC: the only counter */
+	uint64_t failed;
+	uint64_t sum_ms;
+	uint64_t bucket[METRICS_BUCKETS + 1];	/* the last one is +Inf */
+};
+
+struct metrics_head {
+	uint32_t magic;
+	uint32_t slots;
+	uint64_t dropped;		/* series without a free slot */
+	struct metrics_slot slot[];
+};
+
+#define METRICS_SIZE (sizeof(struct metrics_head) + \
+		      METRICS_SLOTS * sizeof(struct metrics_slot))
+
+static struct metrics_head *metrics;
+static int metrics_tried;		/* to create it, by a recorder */
+
+
+/*
+ * map the metrics file, create it if create is set
+ * returns the metrics or NULL if there are none
+ */
+static struct metrics_head *metrics_map(int create)
+{
+	struct metrics_head *head;
+	struct stat statbuf;
+	const char *name;
+	int fd;
+
+	if (metrics)
+		return metrics;
+	/* a reader tries again, a recorder only once */
+	if (create && metrics_tried)
+		return NULL;
+	if (create)
+		metrics_tried = 1;
+
+	name = getenv(SNIPL_METRICS_ENV);
+	if (!name)
+		name = SNIPL_METRICS_FILE;
+	if (!*name)
+		return NULL;
+	fd = open(name, O_RDWR | (create ? O_CREAT : 0), 0600);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &statbuf) == -1 ||
+	    ((size_t)statbuf.st_size < METRICS_SIZE &&
+	     (!create || ftruncate(fd, METRICS_SIZE) == -1))) {
+		close(fd);
+		return NULL;
+	}
+	head = mmap(NULL, METRICS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	close(fd);
+	if (head == MAP_FAILED)
+		return NULL;
+	if (!__atomic_load_n(&head->magic, __ATOMIC_ACQUIRE)) {
+		head->slots = METRICS_SLOTS;
+		__sync_bool_compare_and_swap(&head->magic, 0, METRICS_MAGIC);
+	}
+	if (head->magic != METRICS_MAGIC || head->slots != METRICS_SLOTS) {
+		munmap(head, METRICS_SIZE);
+		return NULL;
+	}
+	/* another thread may have mapped it in the meantime */
+	if (!__sync_bool_compare_and_swap(&metrics, NULL, head))
+		munmap(head, METRICS_SIZE);
+	return metrics;
+}
+
+
+static int labels_equal(const struct metrics_slot *a,
+			const struct metrics_slot *b)
+{
+	return a->kind == b->kind && a->port == b->port &&
+		a->api_rc == b->api_rc && !strcmp(a->type, b->type) &&
+		!strcmp(a->op, b->op) && !strcmp(a->address, b->address);
+}
+
+
+/* FNV-1a over the labels */
+static unsigned int labels_hash(const struct metrics_slot *labels)
+{
+	char key[sizeof(labels->type) + sizeof(labels->op) +
+		 sizeof(labels->address) + 32];
+	unsigned int hash = 2166136261u;
+	const char *c;
+
+	snprintf(key, sizeof(key), "%u %s %s %d %s %d", labels->kind,
+		 labels->type, labels->address, labels->port, labels->op,
+		 labels->api_rc);
+	for (c = key; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	return hash;
+}
+
+
+/*
+ * return the slot of the series with labels, claim a free one if it
+ * has none yet. NULL if all slots it may be kept in are taken.
+ */
+static struct metrics_slot *slot_get(struct metrics_head *head,
+				     const struct metrics_slot *labels)
+{
+	struct metrics_slot *slot;
+	unsigned int hash = labels_hash(labels);
+	uint32_t state;
+	int i, spin;
+
+	for (i = 0; i < METRICS_PROBE; i++) {
+		slot = &head->slot[(hash + i) % METRICS_SLOTS];
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == SLOT_FREE &&
+		    __sync_bool_compare_and_swap(&slot->state, SLOT_FREE,
+						 SLOT_CLAIMED)) {
+			slot->kind = labels->kind;
+			slot->port = labels->port;
+			slot->api_rc = labels->api_rc;
+			memcpy(slot->type, labels->type, sizeof(slot->type));
+			memcpy(slot->op, labels->op, sizeof(slot->op));
+			memcpy(slot->address, labels->address,
+			       sizeof(slot->address));
+			__atomic_store_n(&slot->state, SLOT_READY,
+					 __ATOMIC_RELEASE);
+			return slot;
+		}
+		/* it may be claimed for the same series right now */
+		for (spin = 0; spin < METRICS_SPIN; spin++) {
+			state = __atomic_load_n(&slot->state,
+						__ATOMIC_ACQUIRE);
+			if (state != SLOT_CLAIMED)
+				break;
+			sched_yield();
+		}
+		if (state == SLOT_READY && labels_equal(slot, labels))
+			return slot;
+	}
+	__atomic_fetch_add(&head->dropped, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+
+/*
+ *	function: snipl_metrics_record
+ *
+ *	purpose: count a request of type op to a server in the metrics,
+ *		 if there are metrics. They are created by the first
+ *		 request.
+ */
+void snipl_metrics_record(const char *type, const char *address, int port,
+			  const char *op, long msecs, int failed, int api_rc)
+{
+	struct metrics_head *head = metrics_map(1);
+	struct metrics_slot labels, *slot;
+	unsigned int n;
+
+	if (!head || !type || !address || !op)
+		return;
+	memset(&labels, 0, sizeof(labels));
+	labels.kind = KIND_REQUESTS;
+	labels.port = port > 0 ? port : 0;
+	labels.api_rc = SNIPL_METRICS_NO_RC;
+	snprintf(labels.type, sizeof(labels.type), "%s", type);
+	snprintf(labels.op, sizeof(labels.op), "%s", op);
+	snprintf(labels.address, sizeof(labels.address), "%s", address);
+
+	slot = slot_get(head, &labels);
+	if (slot) {
+		if (msecs < 0)
+			msecs = 0;
+		for (n = 0; n < METRICS_BUCKETS; n++)
+			if (msecs <= bucket_ms[n])
+				break;
+		__atomic_fetch_add(&slot->bucket[n], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&slot->sum_ms, msecs, __ATOMIC_RELAXED);
+		if (failed)
+			__atomic_fetch_add(&slot->failed, 1,
+					   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+	}
+	if (api_rc == SNIPL_METRICS_NO_RC)
+		return;
+	labels.kind = KIND_RC;
+	labels.api_rc = api_rc;
+	slot = slot_get(head, &labels);
+	if (slot)
+		__atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * write a label value, escaped as OpenMetrics wants it
+ */
+static void write_value(FILE *out, const char *value)
+{
+	for (; *value; value++)
+		switch (*value) {
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '"':
+			fputs("\\\"", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		default:
+			fputc(*value, out);
+		}
+}
+
+
+static void write_labels(FILE *out, const struct metrics_slot *slot)
+{
+	fputs("{type=\"", out);
+	write_value(out, slot->type);
+	fputs("\",server=\"", out);
+	write_value(out, slot->address);
+	if (slot->port)
+		fprintf(out, "\",port=\"%d", slot->port);
+	fputs("\",op=\"", out);
+	write_value(out, slot->op);
+	fputc('"', out);
+}
+
+
+static void write_histogram(FILE *out, const struct metrics_slot *slot)
+{
+	uint64_t count = 0;
+	unsigned int n;
+
+	for (n = 0; n <= METRICS_BUCKETS; n++) {
+		/* the count is the sum of the buckets, they always match */
+		count += __atomic_load_n(&slot->bucket[n], __ATOMIC_RELAXED);
+		fputs("snipl_request_duration_seconds_bucket", out);
+		write_labels(out, slot);
+		if (n < METRICS_BUCKETS)
+			fprintf(out, ",le=\"%g\"} %llu\n",
+				bucket_ms[n] / 1000.0,
+				(unsigned long long)count);
+		else
+			fprintf(out, ",le=\"+Inf\"} %llu\n",
+				(unsigned long long)count);
+	}
+	fputs("snipl_request_duration_seconds_count", out);
+	write_labels(out, slot);
+	fprintf(out, "} %llu\n", (unsigned long long)count);
+	fputs("snipl_request_duration_seconds_sum", out);
+	write_labels(out, slot);
+	fprintf(out, "} %.3f\n",
+		__atomic_load_n(&slot->sum_ms, __ATOMIC_RELAXED) / 1000.0);
+}
+
+
+static void write_family(FILE *out, struct metrics_head *head,
+			 int family)
+{
+	struct metrics_slot *slot;
+	uint64_t n;
+
+	for (slot = head->slot; slot < &head->slot[METRICS_SLOTS]; slot++) {
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) !=
+		    SLOT_READY)
+			continue;
+		switch (family) {
+		case FAMILY_DURATION:
+			if (slot->kind == KIND_REQUESTS)
+				write_histogram(out, slot);
+			break;
+		case FAMILY_FAILURES:
+			if (slot->kind != KIND_REQUESTS)
+				break;
+			n = __atomic_load_n(&slot->failed, __ATOMIC_RELAXED);
+			fputs("snipl_request_failures_total", out);
+			write_labels(out, slot);
+			fprintf(out, "} %llu\n", (unsigned long long)n);
+			break;
+		case FAMILY_RC:
+			if (slot->kind != KIND_RC)
+				break;
+			n = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+			fputs("snipl_api_return_codes_total", out);
+			write_labels(out, slot);
+			fprintf(out, ",rc=\"%d\"} %llu\n", slot->api_rc,
+				(unsigned long long)n);
+			break;
+		}
+	}
+}
+
+
+/*
+ *	function: snipl_metrics_write
+ *
+ *	purpose: write all metrics in OpenMetrics text format to out. The
+ *		 samples of a metric family are written together.
+ *
+ *	returns 0, 1 if there are no metrics or -1 if writing failed
+ */
+int snipl_metrics_write(FILE *out)
+{
+	struct metrics_head *head = metrics_map(0);
+
+	if (!head)
+		return 1;
+	fputs("# TYPE snipl_request_duration_seconds histogram\n"
+	      "# UNIT snipl_request_duration_seconds seconds\n"
+	      "# HELP snipl_request_duration_seconds Duration of requests "
+	      "to the management API.\n", out);
+	write_family(out, head, FAMILY_DURATION);
+	fputs("# TYPE snipl_request_failures counter\n"
+	      "# HELP snipl_request_failures Requests that failed.\n", out);
+	write_family(out, head, FAMILY_FAILURES);
+	fputs("# TYPE snipl_api_return_codes counter\n"
+	      "# HELP snipl_api_return_codes Requests by return code of the "
+	      "management API.\n", out);
+	write_family(out, head, FAMILY_RC);
+	fprintf(out, "# TYPE snipl_metrics_dropped counter\n"
+		"# HELP snipl_metrics_dropped Requests not counted for lack "
+		"of a free slot.\n"
+		"snipl_metrics_dropped_total %llu\n# EOF\n",
+		(unsigned long long)__atomic_load_n(&head->dropped,
+						    __ATOMIC_RELAXED));
+	return ferror(out) || fflush(out) ? -1 : 0;
+}
@@ -0,0 +1,37 @@
+/*
+   snmetrics.h - operation metrics of snipl, lic_vps and sncap
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snmetrics is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+*/
+
+#ifndef SNMETRICS_H
+#define SNMETRICS_H
+
+#include <stdio.h>
+
+/* api_rc of a request without a return code of the management API */
+#define SNIPL_METRICS_NO_RC	(-1)
+
+/*
+ * count a request of type op (an image operation, "login", ...) to the
+ * server of type at address and port (0 if none) that took msecs and
+ * failed if failed is set, and its API return code api_rc
+ */
+extern void snipl_metrics_record(const char *type, const char *address,
+				 int port, const char *op, long msecs,
+				 int failed, int api_rc);
+
+/*
+ * write all metrics in OpenMetrics text format to out,
+ * returns 0, 1 if there are no metrics or -1 if writing failed
+ */
+extern int snipl_metrics_write(FILE *out);
+
+#endif /* SNMETRICS_H */
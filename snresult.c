@@ -0,0 +1,435 @@
+/*
+   snresult.c - per operation result records of a server
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snresult is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   Every image operation gets one record in a ring preallocated per server.
+   The record takes over the message the modules left in server->problem,
+   so no message text is copied. The output is formatted from the record
+   fields when the record is printed.
+
+   With a sink set for the ring, every record is handed to the sink as
+   soon as it is completed, e.g. to write it as one line of JSON.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdio.h>
+#include "snipl.h"
+
+static const char *op_names[] = {
+	[OPUNKNOWN]	"unknown",
+	[RESET]		"reset",
+	[ACTIVATE]	"activate",
+	[DEACTIVATE]	"deactivate",
+	[STOP]		"stop",
+	[LOAD]		"load",
+	[SCSILOAD]	"scsiload",
+	[SCSIDUMP]	"scsidump",
+	[DIALOG]	"dialog",
+	[LIST]		"listimages",
+	[GETSTATUS]	"getstatus",
+};
+
+static const char *state_names[] = {
+	[SNIPL_IMAGE_UNKNOWN]	"unknown",
+	[SNIPL_IMAGE_INACTIVE]	"inactive",
+	[SNIPL_IMAGE_ACTIVE]	"active",
+	[SNIPL_IMAGE_OPERATING]	"operating",
+};
+
+static const char *phase_names[] = {
+	[SNIPL_PHASE_LOGIN]	"login",
+	[SNIPL_PHASE_OPERATION]	"operation",
+};
+
+static const char *severity_names[] = {
+	[OK]			"ok",
+	[WARNING]		"warning",
+	[FATAL]			"fatal",
+	[CERTIFICATE_ERROR]	"certificate_error",
+};
+
+const char *snipl_op_name(int op)
+{
+	if (op < 0 || op >= (int)DIMOF(op_names) || !op_names[op])
+		return op_names[OPUNKNOWN];
+	return op_names[op];
+}
+
+const char *snipl_state_name(int state)
+{
+	if (state < 0 || state >= (int)DIMOF(state_names))
+		return state_names[SNIPL_IMAGE_UNKNOWN];
+	return state_names[state];
+}
+
+
+static long ts_msecs(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+
+/*
+ *	function: snipl_results_alloc
+ *
+ *	purpose: preallocate a ring of size result records for server.
+ *		 If more operations are done, the oldest records are reused.
+ *
+ *	returns 0 or STORAGE_PROBLEM
+ */
+int snipl_results_alloc(struct snipl_server *server, unsigned int size)
+{
+	struct snipl_results *results;
+
+	if (!size)
+		size = 1;
+	results = calloc(1, sizeof(*results) + size * sizeof(results->rec[0]));
+	if (!results)
+		return STORAGE_PROBLEM;
+	results->size = size;
+	snipl_results_free(server);
+	server->results = results;
+	return 0;
+}
+
+
+void snipl_results_free(struct snipl_server *server)
+{
+	unsigned int i;
+
+	if (!server->results)
+		return;
+	for (i = 0; i < server->results->size; i++)
+		free(server->results->rec[i].text);
+	free(server->results);
+	server->results = NULL;
+	server->_result = NULL;
+}
+
+
+/*
+ *	function: snipl_result_begin
+ *
+ *	purpose: start the record for operation op on image
+ *		 (image is NULL for server operations). The record stays
+ *		 the current record of the server until snipl_result_end.
+ *		 Records are claimed atomically, so threads working with
+ *		 the same ring get different records.
+ *
+ *	returns the record or NULL if the server keeps no records
+ */
+struct snipl_result *snipl_result_begin(struct snipl_server *server,
+					struct snipl_image *image, int op)
+{
+	struct snipl_results *results = server->results;
+	struct snipl_result *res;
+	unsigned long n;
+
+	if (!results)
+		return NULL;
+	n = __sync_fetch_and_add(&results->count, 1);
+	res = &results->rec[n % results->size];
+	free(res->text);
+	memset(res, 0, sizeof(*res));
+	res->image = image;
+	res->op = op;
+	res->api_rc = UNDEFINED;
+	res->api_rs = UNDEFINED;
+	for (n = 0; n < SNIPL_PHASES; n++)
+		res->phase_ms[n] = -1;
+	clock_gettime(CLOCK_REALTIME, &res->start);
+	server->_result = res;
+	return res;
+}
+
+
+/*
+ *	function: snipl_result_api
+ *
+ *	purpose: note return and reason code of the management API
+ *		 in the current record of the server and for the metrics
+ *		 of the running request
+ */
+void snipl_result_api(struct snipl_server *server, int rc, int rs)
+{
+	server->_api_rc = rc;
+	if (!server->_result)
+		return;
+	server->_result->api_rc = rc;
+	server->_result->api_rs = rs;
+}
+
+
+/*
+ *	function: snipl_result_busy
+ *
+ *	purpose: note that the server refused the running request as busy
+ *		 or did not answer in time. With --parallel such requests
+ *		 are tried again with fewer requests in flight.
+ */
+void snipl_result_busy(struct snipl_server *server)
+{
+	server->_busy = 1;
+}
+
+
+/*
+ *	function: snipl_result_state
+ *
+ *	purpose: note the image state and the raw status bits of the
+ *		 management API in the current record of the server.
+ *		 names decodes the status bits and may be NULL.
+ */
+void snipl_result_state(struct snipl_server *server, int state,
+			unsigned long status,
+			const struct snipl_status_bit *names)
+{
+	if (!server->_result)
+		return;
+	server->_result->state = state;
+	server->_result->status = status;
+	server->_result->status_bits = names;
+}
+
+
+/*
+ *	function: snipl_result_phase
+ *
+ *	purpose: account the time from since up to now to phase of the
+ *		 record. A record started later than since is moved back
+ *		 to since, so the total time covers the phase. The
+ *		 operation phase is the time not accounted to other phases.
+ *		 Nothing is accounted if since is NULL.
+ */
+void snipl_result_phase(struct snipl_result *res, int phase,
+			const struct timespec *since)
+{
+	struct timespec now;
+
+	if (!res || !since || phase < 0 || phase >= SNIPL_PHASES)
+		return;
+	clock_gettime(CLOCK_REALTIME, &now);
+	res->phase_ms[phase] = ts_msecs(since, &now);
+	if (ts_msecs(since, &res->start) > 0)
+		res->start = *since;
+}
+
+
+/*
+ *	function: snipl_result_end
+ *
+ *	purpose: complete the current record of the server with the return
+ *		 code rc. The record takes over server->problem and the
+ *		 status cache is updated with it.
+ *
+ *	returns the completed record or NULL if there is none
+ */
+struct snipl_result *snipl_result_end(struct snipl_server *server, int rc)
+{
+	struct snipl_result *res = server->_result;
+	long ms;
+	int n;
+
+	if (!res)
+		return NULL;
+	clock_gettime(CLOCK_REALTIME, &res->end);
+	ms = ts_msecs(&res->start, &res->end);
+	for (n = 0; n < SNIPL_PHASES; n++)
+		if (n != SNIPL_PHASE_OPERATION && res->phase_ms[n] > 0)
+			ms -= res->phase_ms[n];
+	res->phase_ms[SNIPL_PHASE_OPERATION] = ms < 0 ? 0 : ms;
+	res->rc = rc;
+	res->text = server->problem;
+	server->problem = NULL;
+	if (res->text)
+		res->severity = server->problem_class;
+	else
+		res->severity = rc ? FATAL : OK;
+	server->_result = NULL;
+	snipl_cache_record(server, res);
+	if (server->results->sink)
+		server->results->sink(server, res);
+	return res;
+}
+
+
+/*
+ * return the number of the oldest record still kept
+ */
+unsigned long snipl_results_first(struct snipl_server *server)
+{
+	struct snipl_results *results = server->results;
+
+	if (!results || results->count <= results->size)
+		return 0;
+	return results->count - results->size;
+}
+
+
+/*
+ * return record number n or NULL if it is not (or no longer) kept
+ */
+struct snipl_result *snipl_result_get(struct snipl_server *server,
+				      unsigned long n)
+{
+	struct snipl_results *results = server->results;
+
+	if (!results || n >= results->count || n < snipl_results_first(server))
+		return NULL;
+	return &results->rec[n % results->size];
+}
+
+
+/*
+ * return the duration of the operation in milliseconds
+ */
+long snipl_result_msecs(const struct snipl_result *res)
+{
+	return ts_msecs(&res->start, &res->end);
+}
+
+
+/*
+ *	function: snipl_result_print
+ *
+ *	purpose: print the message of a record, to stdout if the
+ *		 operation was successful, otherwise to stderr
+ */
+void snipl_result_print(const struct snipl_result *res)
+{
+	if (!res->text)
+		return;
+	fputs(res->text, res->severity == OK ? stdout : stderr);
+}
+
+
+/*
+ * write str as JSON string, NULL as null
+ */
+static void json_string(FILE *out, const char *str)
+{
+	const unsigned char *c;
+
+	if (!str) {
+		fputs("null", out);
+		return;
+	}
+	fputc('"', out);
+	for (c = (const unsigned char *)str; *c; c++) {
+		switch (*c) {
+		case '"':
+		case '\\':
+			fprintf(out, "\\%c", *c);
+			break;
+		case '\n':
+			/* messages end with a newline, drop it */
+			if (c[1])
+				fputs("\\n", out);
+			break;
+		case '\t':
+			fputs("\\t", out);
+			break;
+		default:
+			if (*c < 0x20)
+				fprintf(out, "\\u%04x", *c);
+			else
+				fputc(*c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+
+static void json_int(FILE *out, int value)
+{
+	if (value == UNDEFINED)
+		fputs("null", out);
+	else
+		fprintf(out, "%d", value);
+}
+
+
+static void json_time(FILE *out, const struct timespec *ts)
+{
+	char buf[32];
+	struct tm tm;
+
+	gmtime_r(&ts->tv_sec, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+	fprintf(out, "\"%s.%03ldZ\"", buf, ts->tv_nsec / 1000000);
+}
+
+
+/*
+ *	function: snipl_result_json
+ *
+ *	purpose: write a record as one line of JSON and flush it, so a
+ *		 reader sees every record as soon as it is completed
+ */
+void snipl_result_json(FILE *out, struct snipl_server *server,
+		       const struct snipl_result *res)
+{
+	const struct snipl_status_bit *sb;
+	int n, first;
+
+	fputs("{\"server\":", out);
+	json_string(out, server->address);
+	fputs(",\"type\":", out);
+	json_string(out, server->type);
+	fputs(",\"image\":", out);
+	json_string(out, res->image ? res->image->name : NULL);
+	fprintf(out, ",\"op\":\"%s\",\"rc\":%d,\"api_rc\":",
+		snipl_op_name(res->op), res->rc);
+	json_int(out, res->api_rc);
+	fputs(",\"api_rs\":", out);
+	json_int(out, res->api_rs);
+	fprintf(out, ",\"severity\":\"%s\"",
+		res->severity >= 0 && res->severity < (int)DIMOF(severity_names)
+		? severity_names[res->severity] : "unknown");
+	if (res->op == GETSTATUS) {
+		fprintf(out, ",\"state\":\"%s\"",
+			snipl_state_name(res->state));
+		fputs(",\"status\":[", out);
+		first = 1;
+		for (sb = res->status_bits; sb && sb->name; sb++) {
+			if (!(res->status & sb->bit))
+				continue;
+			if (!first)
+				fputc(',', out);
+			json_string(out, sb->name);
+			first = 0;
+		}
+		fputc(']', out);
+		if (res->cached)
+			fputs(",\"cached\":true", out);
+	}
+	if (res->async_id)
+		fprintf(out, ",\"async_id\":%d", res->async_id);
+	fputs(",\"start\":", out);
+	json_time(out, &res->start);
+	fputs(",\"end\":", out);
+	json_time(out, &res->end);
+	fputs(",\"timings_ms\":{", out);
+	for (n = 0; n < SNIPL_PHASES; n++)
+		if (res->phase_ms[n] >= 0)
+			fprintf(out, "\"%s\":%ld,", phase_names[n],
+				res->phase_ms[n]);
+	fprintf(out, "\"total\":%ld}", snipl_result_msecs(res));
+	fputs(",\"message\":", out);
+	json_string(out, res->text);
+	fputs("}\n", out);
+	fflush(out);
+}
@@ -0,0 +1,693 @@
+/*
+   snstate.c - persistent state shared between snipl/stonith invocations
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snstate is provided under the terms of the enclosed common public license
+   ("agreement"). Any use, reproduction or distribution of the program
+   constitutes recipient's acceptance of this agreement.
+
+   The state file holds one record per line:
+
+	<facility> <key> <stamp> <value>
+
+   facility and key must not contain blanks, stamp is the time in seconds
+   since the epoch when the record was written and value is the rest of
+   the line. Every access locks the complete file with flock, so
+   concurrent snipl processes and lic_vps instances see a consistent file.
+   An update writes the new contents to a temporary file and renames it
+   over the state file, so a crash leaves either the old or the new file,
+   and an update that changes nothing writes nothing. The file is not
+   synced, the state is a hint that a crash of the system may lose.
+   Updates that need not be seen by other processes at once, like
+   counters and histories, are queued with snipl_state_defer and written
+   together by snipl_state_flush. Queued updates of one record are kept
+   in one entry, so a run costs one replacement of the file.
+   The state only avoids redundant work - all errors are silently ignored
+   by the callers and treated like a missing record.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "snipl.h"
+
+#define SNIPL_STATE_ENV  "SNIPL_STATE"
+#define SNIPL_HOME_STATE "/.snipl.state"
+
+struct state_rec {
+	char *facility;
+	char *key;
+	time_t stamp;
+	char *value;
+};
+
+
+/*
+ *	function: snipl_state_file_name
+ *
+ *	purpose: return the name of the state file, NULL if the state
+ *		 file is disabled (SNIPL_STATE set to an empty string)
+ *		 The name has to be freed by the caller.
+ */
+char *snipl_state_file_name(void)
+{
+	char *env = getenv(SNIPL_STATE_ENV);
+	char *home;
+	char *name;
+
+	if (env)
+		return *env ? strdup(env) : NULL;
+	home = getenv("HOME");
+	if (!home)
+		return NULL;
+	if (asprintf(&name, "%s%s", home, SNIPL_HOME_STATE) < 0)
+		return NULL;
+	return name;
+}
+
+
+/*
+ * check that fd is still the file called name: an update renames a new
+ * file over the one it locked, and whoever waited for that lock has to
+ * open the new file
+ */
+static int state_current(int fd, const char *name)
+{
+	struct stat fdstat, namestat;
+
+	if (fstat(fd, &fdstat) == -1 || stat(name, &namestat) == -1)
+		return 0;
+	return fdstat.st_dev == namestat.st_dev &&
+		fdstat.st_ino == namestat.st_ino;
+}
+
+
+/*
+ * open and lock the state file name, returns the file descriptor or -1
+ */
+static int state_open(const char *name, int lock)
+{
+	int fd;
+
+	if (!name)
+		return -1;
+	do {
+		if (lock == LOCK_EX)
+			fd = open(name, O_RDWR | O_CREAT, 0600);
+		else
+			fd = open(name, O_RDONLY);
+		if (fd == -1)
+			return -1;
+		while (flock(fd, lock) == -1) {
+			if (errno != EINTR) {
+				close(fd);
+				return -1;
+			}
+		}
+		if (lock != LOCK_EX || state_current(fd, name))
+			break;
+		close(fd);
+	} while (1);
+	return fd;
+}
+
+
+static void state_close(int fd)
+{
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+
+/*
+ * read the complete state file into a buffer, returns NULL on errors
+ */
+static char *state_read(int fd)
+{
+	struct stat statbuf;
+	char *buffer, *pos;
+	size_t size;
+	ssize_t ret;
+
+	if (fstat(fd, &statbuf) == -1)
+		return NULL;
+	size = statbuf.st_size;
+	buffer = calloc(1, size + 1);
+	if (!buffer)
+		return NULL;
+	pos = buffer;
+	while (size) {
+		ret = pread(fd, pos, size, pos - buffer);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		pos += ret;
+		size -= ret;
+	}
+	*pos = '\0';
+	return buffer;
+}
+
+
+/*
+ * split the next line of a state buffer into a record,
+ * returns the start of the following line or NULL at the end.
+ * Malformed lines are returned with rec->facility == NULL.
+ */
+static char *state_next(char *line, struct state_rec *rec)
+{
+	char *next, *stamp, *end;
+
+	if (!line || !*line)
+		return NULL;
+	next = strchr(line, '\n');
+	if (next)
+		*next++ = '\0';
+	else
+		next = line + strlen(line);
+
+	memset(rec, 0, sizeof(*rec));
+	rec->facility = strtok_r(line, " ", &end);
+	rec->key = strtok_r(NULL, " ", &end);
+	stamp = strtok_r(NULL, " ", &end);
+	if (!rec->key || !stamp) {
+		rec->facility = NULL;
+		return next;
+	}
+	rec->stamp = strtoll(stamp, NULL, 10);
+	rec->value = end ? end : "";
+	return next;
+}
+
+
+static int state_match(struct state_rec *rec, const char *facility,
+		       const char *key)
+{
+	return rec->facility && !strcmp(rec->facility, facility) &&
+		!strcmp(rec->key, key);
+}
+
+
+static void state_append(FILE *out, const char *facility, const char *key,
+			 time_t stamp, const char *value)
+{
+	fprintf(out, "%s %s %lld %s\n", facility, key, (long long)stamp,
+		value);
+}
+
+
+/*
+ * replace the state file name by a file with len bytes of data.
+ * The caller holds the lock of the current file, which stays valid
+ * until the rename.
+ */
+static int state_write(const char *name, const char *data, size_t len)
+{
+	char *tmp;
+	ssize_t written;
+	int fd, ret = -1;
+
+	if (asprintf(&tmp, "%s.XXXXXX", name) < 0)
+		return -1;
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		free(tmp);
+		return -1;
+	}
+	for (; len; data += written, len -= written) {
+		written = write(fd, data, len);
+		if (written < 0 && errno == EINTR)
+			written = 0;
+		else if (written <= 0)
+			goto out;
+	}
+	if (close(fd) == -1) {
+		fd = -1;
+		goto out;
+	}
+	fd = -1;
+	if (rename(tmp, name) == -1)
+		goto out;
+	ret = 0;
+out:
+	if (fd != -1)
+		close(fd);
+	if (ret)
+		unlink(tmp);
+	free(tmp);
+	return ret;
+}
+
+
+/*
+ * a change of one record, see snipl_state_update: fn is called nr_args
+ * times, with the arguments of size bytes each in args. A deferred change
+ * owns a copy of its arguments and waits in the queue for
+ * snipl_state_flush, later updates of the record by the same fn are
+ * appended to it.
+ */
+struct state_change {
+	char *facility;
+	char *key;
+	snipl_state_fn fn;
+	char *args;
+	size_t size;
+	int nr_args;
+	struct state_change *next;
+};
+
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct state_change *deferred;
+static struct state_change **deferred_tail = &deferred;
+static int nr_deferred;
+
+
+/*
+ * call fn of the change for all its arguments, in the order they were
+ * given. Returns the action like a single call: -1 if the record ends
+ * removed, 1 if it is to be written, 0 if it stays unchanged.
+ */
+static int state_change_apply(struct state_change *c, char *value,
+			      time_t *stamp)
+{
+	int i, action, ret = 0;
+
+	for (i = 0; i < c->nr_args; i++) {
+		action = c->fn(value, stamp, c->args + i * c->size);
+		if (action < 0) {
+			*value = '\0';
+			*stamp = 0;
+			ret = -1;
+		} else if (action > 0)
+			ret = 1;
+	}
+	return ret;
+}
+
+
+/*
+ * apply the deferred changes of the record <facility> <key> to value and
+ * stamp, so a process sees what it has not written yet
+ */
+static void state_apply_deferred(const char *facility, const char *key,
+				 char *value, time_t *stamp)
+{
+	struct state_change *c;
+
+	pthread_mutex_lock(&deferred_lock);
+	for (c = deferred; c; c = c->next) {
+		if (strcmp(c->facility, facility) || strcmp(c->key, key))
+			continue;
+		state_change_apply(c, value, stamp);
+	}
+	pthread_mutex_unlock(&deferred_lock);
+}
+
+
+/*
+ *	function: snipl_state_get
+ *
+ *	purpose: look up the record <facility> <key>
+ *		 value must provide SNIPL_STATE_VALUE_LEN bytes,
+ *		 stamp may be NULL.
+ *
+ *	returns 0 if the record was found, 1 if not, -1 on errors
+ */
+int snipl_state_get(const char *facility, const char *key,
+		    char *value, time_t *stamp)
+{
+	struct state_rec rec;
+	char *buffer, *line, *name;
+	time_t my_stamp = 0;
+	int fd, ret = 1;
+
+	name = snipl_state_file_name();
+	if (!name)
+		return -1;
+	fd = state_open(name, LOCK_SH);
+	free(name);
+	if (fd != -1) {
+		buffer = state_read(fd);
+		state_close(fd);
+	} else if (errno == ENOENT) {
+		/* not written yet, there may be queued updates */
+		buffer = strdup("");
+	} else
+		return -1;
+	if (!buffer)
+		return -1;
+
+	for (line = state_next(buffer, &rec); line;
+	     line = state_next(line, &rec)) {
+		if (!state_match(&rec, facility, key))
+			continue;
+		snprintf(value, SNIPL_STATE_VALUE_LEN, "%s", rec.value);
+		if (stamp)
+			*stamp = rec.stamp;
+		ret = 0;
+		break;
+	}
+	free(buffer);
+	if (ret) {
+		value[0] = '\0';
+		my_stamp = 0;
+		if (stamp)
+			*stamp = 0;
+	}
+	state_apply_deferred(facility, key, value, stamp ? stamp : &my_stamp);
+	if (!*value && (stamp ? *stamp : my_stamp) == 0)
+		return ret;
+	return 0;
+}
+
+
+/*
+ * apply the changes to the state file under one exclusive lock, the file
+ * is replaced at most once. Records that are not changed keep their
+ * place, changed ones move to the end.
+ */
+static int state_change_all(struct state_change *changes)
+{
+	struct state_rec *recs = NULL, *rec, *more;
+	struct state_change *c;
+	char value[SNIPL_STATE_VALUE_LEN];
+	char *buffer, *line, *name, *out = NULL, **owned = NULL;
+	size_t outlen = 0;
+	time_t stamp;
+	FILE *outfile;
+	int fd, i, n = 0, size = 0, nr_owned = 0, action, changed = 0;
+	int ret = -1;
+
+	name = snipl_state_file_name();
+	fd = state_open(name, LOCK_EX);
+	if (fd == -1) {
+		free(name);
+		return -1;
+	}
+	buffer = state_read(fd);
+	if (!buffer)
+		goto out_close;
+
+	/* the records, one more for every change */
+	for (c = changes; c; c = c->next)
+		size++;
+	for (line = buffer; *line; line++)
+		if (*line == '\n')
+			size++;
+	recs = calloc(size + 2, sizeof(*recs));
+	owned = calloc(2 * size + 1, sizeof(*owned));
+	if (!recs || !owned)
+		goto out_free;
+	for (line = state_next(buffer, &recs[n]); line;
+	     line = state_next(line, &recs[n]))
+		if (recs[n].facility)
+			n++;
+
+	for (c = changes; c; c = c->next) {
+		for (rec = recs, i = 0; i < n; i++, rec++)
+			if (state_match(rec, c->facility, c->key))
+				break;
+		if (i < n) {
+			snprintf(value, sizeof(value), "%s", rec->value);
+			stamp = rec->stamp;
+		} else {
+			value[0] = '\0';
+			stamp = 0;
+		}
+		action = state_change_apply(c, value, &stamp);
+		/* values must stay on one line */
+		for (line = value; *line; ++line)
+			if (*line == '\n')
+				*line = ' ';
+		if (action == 0 || (action < 0 && i == n) ||
+		    (action > 0 && i < n && stamp == rec->stamp &&
+		     !strcmp(value, rec->value)))
+			continue;
+		changed = 1;
+		if (action < 0) {
+			rec->facility = NULL;
+			continue;
+		}
+		if (i == n) {
+			rec->facility = c->facility;
+			rec->key = c->key;
+			n++;
+		} else {
+			/* to the end */
+			more = &recs[n];
+			*more = *rec;
+			rec->facility = NULL;
+			rec = more;
+			n++;
+		}
+		owned[nr_owned] = strdup(value);
+		if (!owned[nr_owned])
+			goto out_free;
+		rec->value = owned[nr_owned++];
+		rec->stamp = stamp;
+	}
+	if (!changed) {
+		ret = 0;
+		goto out_free;
+	}
+
+	outfile = open_memstream(&out, &outlen);
+	if (!outfile)
+		goto out_free;
+	for (rec = recs, i = 0; i < n; i++, rec++)
+		if (rec->facility)
+			state_append(outfile, rec->facility, rec->key,
+				     rec->stamp, rec->value);
+	if (fclose(outfile))
+		goto out_free;
+
+	ret = state_write(name, out, outlen);
+out_free:
+	free(out);
+	while (owned && nr_owned)
+		free(owned[--nr_owned]);
+	free(owned);
+	free(recs);
+	free(buffer);
+out_close:
+	state_close(fd);
+	free(name);
+	return ret;
+}
+
+
+/*
+ *	function: snipl_state_update
+ *
+ *	purpose: read-modify-write of the record <facility> <key>
+ *		 under an exclusive lock of the state file.
+ *		 fn is called with the current value and stamp (empty
+ *		 and 0 for a new record) and returns
+ *		  1 to write the (modified) value and stamp,
+ *		  0 to keep the record unchanged,
+ *		 -1 to remove the record.
+ *		 The file is only replaced if its contents change.
+ *
+ *	returns 0 on success, -1 on errors
+ */
+int snipl_state_update(const char *facility, const char *key,
+		       snipl_state_fn fn, void *arg)
+{
+	struct state_change change = {
+		.facility = (char *)facility,
+		.key = (char *)key,
+		.fn = fn,
+		.args = arg,
+		.nr_args = 1,
+	};
+
+	return state_change_all(&change);
+}
+
+
+/*
+ *	function: snipl_state_defer
+ *
+ *	purpose: queue an update of the record <facility> <key> like
+ *		 snipl_state_update, with a copy of the size bytes of arg.
+ *		 The queue is written by snipl_state_flush with one
+ *		 replacement of the state file, or when it holds
+ *		 SNIPL_STATE_DEFER_MAX updates. Updates of one record by
+ *		 the same fn share an entry and count once. Until the
+ *		 flush snipl_state_get returns the record with the queued
+ *		 updates applied.
+ *
+ *	returns 0 on success, -1 on errors
+ */
+int snipl_state_defer(const char *facility, const char *key,
+		      snipl_state_fn fn, const void *arg, size_t size)
+{
+	struct state_change *c;
+	char *name, *args;
+	int full;
+
+	/* nothing to write without a state file */
+	name = snipl_state_file_name();
+	if (!name)
+		return -1;
+	free(name);
+	pthread_mutex_lock(&deferred_lock);
+	for (c = deferred; c; c = c->next)
+		if (c->fn == fn && c->size == size &&
+		    !strcmp(c->facility, facility) && !strcmp(c->key, key))
+			break;
+	if (c) {
+		args = realloc(c->args, (c->nr_args + 1) * size + 1);
+		if (!args) {
+			pthread_mutex_unlock(&deferred_lock);
+			return -1;
+		}
+		c->args = args;
+		if (size)
+			memcpy(args + c->nr_args * size, arg, size);
+		c->nr_args++;
+		pthread_mutex_unlock(&deferred_lock);
+		return 0;
+	}
+	c = calloc(1, sizeof(*c));
+	if (c) {
+		c->facility = strdup(facility);
+		c->key = strdup(key);
+		c->args = malloc(size + 1);
+	}
+	if (!c || !c->facility || !c->key || !c->args) {
+		pthread_mutex_unlock(&deferred_lock);
+		if (c) {
+			free(c->facility);
+			free(c->key);
+			free(c->args);
+		}
+		free(c);
+		return -1;
+	}
+	c->fn = fn;
+	c->size = size;
+	c->nr_args = 1;
+	if (size)
+		memcpy(c->args, arg, size);
+	*deferred_tail = c;
+	deferred_tail = &c->next;
+	full = ++nr_deferred >= SNIPL_STATE_DEFER_MAX;
+	pthread_mutex_unlock(&deferred_lock);
+	if (full)
+		snipl_state_flush();
+	return 0;
+}
+
+
+/*
+ *	function: snipl_state_flush
+ *
+ *	purpose: write the updates queued by snipl_state_defer, all with
+ *		 one replacement of the state file. They are dropped if
+ *		 that fails, like any other error of the state file.
+ *
+ *	returns 0 on success, -1 on errors
+ */
+int snipl_state_flush(void)
+{
+	struct state_change *changes, *c;
+	int ret;
+
+	pthread_mutex_lock(&deferred_lock);
+	changes = deferred;
+	deferred = NULL;
+	deferred_tail = &deferred;
+	nr_deferred = 0;
+	pthread_mutex_unlock(&deferred_lock);
+	if (!changes)
+		return 0;
+	ret = state_change_all(changes);
+	while ((c = changes)) {
+		changes = c->next;
+		free(c->facility);
+		free(c->key);
+		free(c->args);
+		free(c);
+	}
+	return ret;
+}
+
+
+static int state_set(char *value, time_t *stamp, void *arg)
+{
+	snprintf(value, SNIPL_STATE_VALUE_LEN, "%s", (const char *)arg);
+	*stamp = time(NULL);
+	return 1;
+}
+
+
+/*
+ *	function: snipl_state_put
+ *
+ *	purpose: write the record <facility> <key> with the current time
+ *
+ *	returns 0 on success, -1 on errors
+ */
+int snipl_state_put(const char *facility, const char *key, const char *value)
+{
+	return snipl_state_update(facility, key, state_set, (void *)value);
+}
+
+
+/*
+ *	function: snipl_state_dump
+ *
+ *	purpose: print all records of the state file with their age
+ *
+ *	returns 0 on success, -1 if the state file cannot be read
+ */
+int snipl_state_dump(FILE *out)
+{
+	struct state_rec rec;
+	char *buffer, *line;
+	time_t now = time(NULL);
+	char *name;
+	int fd;
+
+	name = snipl_state_file_name();
+	if (!name)
+		return -1;
+	fd = state_open(name, LOCK_SH);
+	free(name);
+	if (fd != -1) {
+		buffer = state_read(fd);
+		state_close(fd);
+	} else if (errno == ENOENT) {
+		/* not written yet, there may be queued updates */
+		buffer = strdup("");
+	} else
+		return -1;
+	if (!buffer)
+		return -1;
+
+	for (line = state_next(buffer, &rec); line;
+	     line = state_next(line, &rec)) {
+		if (!rec.facility)
+			continue;
+		fprintf(out, "%-10s %-32s age %6llds  %s\n", rec.facility,
+			rec.key, (long long)(now - rec.stamp), rec.value);
+	}
+	free(buffer);
+	return 0;
+}
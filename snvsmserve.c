@@ -0,0 +1,647 @@
+/*
+   snvsmserve - stand-in for the VSMSERVE RPC server of z/VM
+
+   Copyright IBM Corp. 2016
+
+   Published under the terms and conditions of the CPL (common public license)
+
+   PLEASE NOTE:
+   snvsmserve is provided under the terms of the enclosed common public
+   license ("agreement"). Any use, reproduction or distribution of the
+   program constitutes recipient's acceptance of this agreement.
+
+   snvsmserve serves the VSMSERVE interface of dmsvsma.x on TCP and
+   registers it with the portmapper, so snipl and lic_vps reach it like a
+   VSMSERVE service machine. The XDR routines are the ones rpcgen
+   generates for libvmsmapi.so. It answers LOGIN, LOGOUT, IMAGE_ACTIVATE,
+   IMAGE_DEACTIVATE, IMAGE_RECYCLE and IMAGE_STATUS_QUERY after a
+   configurable latency, fails a configurable share of the image requests
+   with a configurable return code and lets session tokens expire after a
+   number of requests. Images are active until they are deactivated.
+   With --async the image operations are asynchronous: they answer with
+   an operation ID right away, take effect later and are followed with
+   QUERY_ASYNCHRONOUS_OPERATION.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <rpc/rpc.h>
+#include <rpc/pmap_clnt.h>
+#include "dmsvsma.h"
+#include "snipl.h"
+
+#define VSMSERVE_IMAGES		256
+#define VSMSERVE_SESSIONS	1024
+#define VSMSERVE_OPERATIONS	1024
+
+/* asynchronous operations, the reason code of RC_ASYNC is the ID */
+#define RC_ASYNC		592
+#define RS_ASYNC_SUCCEEDED	100
+#define RS_ASYNC_IN_PROGRESS	104
+#define RS_ASYNC_FAILED		108
+
+struct vsmserve {
+	long latency;		/* ms */
+	long jitter;		/* ms, added at random */
+	int  errors;		/* percent of the image requests that fail */
+	int  error_rc;		/* return code of a failed request */
+	long session;		/* requests per session token, 0 unlimited */
+	long async;		/* ms an image operation runs, 0 = sync */
+	unsigned int seed;
+	unsigned long requests;
+	unsigned long failed;
+};
+
+/* a session token carries the session and the requests done with it */
+struct token {
+	uint32_t id;
+	uint32_t uses;
+};
+
+static struct vsmserve vs = {0, 0, 0, RCERR_DMSCSL, 0, 0, 0, 0, 0};
+static uint32_t last_session;
+static struct {
+	uint32_t id;		/* 0 if the slot is free or logged out */
+} sessions[VSMSERVE_SESSIONS];
+static struct {
+	char name[9];
+	int inactive;
+} images[VSMSERVE_IMAGES];
+static uint32_t last_operation;
+static struct {
+	uint32_t id;		/* 0 if the slot is free */
+	int *inactive;		/* of the image */
+	int result;		/* state of the image when it ends */
+	int pending;		/* not yet ended */
+	struct timespec end;	/* CLOCK_MONOTONIC */
+} operations[VSMSERVE_OPERATIONS];
+
+static struct option long_options[] = {
+	{"port",           1, NULL, 'p'},
+	{"latency",        1, NULL, 'l'},
+	{"jitter",         1, NULL, 'j'},
+	{"errors",         1, NULL, 'e'},
+	{"rc",             1, NULL, 'r'},
+	{"session",        1, NULL, 's'},
+	{"async",          1, NULL, 'a'},
+	{"help",           0, NULL, 'h'},
+	{"version",        0, NULL, 'v'},
+	{NULL, 0, NULL, 0}
+};
+
+
+static void print_usage(const char *name)
+{
+	printf("Stand-in for the VSMSERVE RPC server of z/VM\n");
+	printf("Usage: %s [options]\n", name);
+	printf(" -p --port <port>                TCP port (default: any, "
+	       "registered\n"
+	       "                                 with the portmapper)\n");
+	printf(" -l --latency <ms>               latency of a request\n");
+	printf(" -j --jitter <ms>                random latency added to "
+	       "--latency\n");
+	printf(" -e --errors <percent>           share of the image requests "
+	       "that fail\n");
+	printf(" -r --rc <rc>                    return code of a failed "
+	       "request\n"
+	       "                                 (default %d, %d lets the "
+	       "token expire)\n", RCERR_DMSCSL, RCERR_TOKEN);
+	printf(" -s --session <requests>         requests a session token "
+	       "is valid for\n"
+	       "                                 (default: unlimited)\n");
+	printf(" -a --async <ms>                 image operations are "
+	       "asynchronous and\n"
+	       "                                 end after ms plus "
+	       "--jitter\n");
+	printf(" -h --help                       print usage information\n");
+	printf(" -v --version                    print version of %s\n",
+	       name);
+}
+
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+
+static void token_set(char *dest, const struct token *t)
+{
+	memset(dest, 0, sizeof(Session_Token));
+	memcpy(dest, t, sizeof(Session_Token) < sizeof(*t) ?
+	       sizeof(Session_Token) : sizeof(*t));
+}
+
+static void token_get(struct token *t, const char *src)
+{
+	memset(t, 0, sizeof(*t));
+	memcpy(t, src, sizeof(Session_Token) < sizeof(*t) ?
+	       sizeof(Session_Token) : sizeof(*t));
+}
+
+
+/*
+ * check the token of a request and advance it for the reply,
+ * returns RCERR_TOKEN if the session is unknown or expired
+ */
+static int session_use(const char *in, char *out)
+{
+	struct token t;
+
+	token_get(&t, in);
+	memset(out, 0, sizeof(Session_Token));
+	if (!t.id || sessions[t.id % VSMSERVE_SESSIONS].id != t.id)
+		return RCERR_TOKEN;
+	if (vs.session && t.uses >= vs.session) {
+		sessions[t.id % VSMSERVE_SESSIONS].id = 0;
+		return RCERR_TOKEN;
+	}
+	t.uses++;
+	token_set(out, &t);
+	return RC_OK;
+}
+
+
+/* let the asynchronous operations that are due end */
+static void operations_end(void)
+{
+	struct timespec now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < VSMSERVE_OPERATIONS; i++) {
+		if (!operations[i].pending ||
+		    now.tv_sec < operations[i].end.tv_sec ||
+		    (now.tv_sec == operations[i].end.tv_sec &&
+		     now.tv_nsec < operations[i].end.tv_nsec))
+			continue;
+		*operations[i].inactive = operations[i].result;
+		operations[i].pending = 0;
+	}
+}
+
+
+/* the state of an image, every image exists and starts active */
+static int *image_inactive(const char *name)
+{
+	int i;
+
+	operations_end();
+	for (i = 0; i < VSMSERVE_IMAGES && images[i].name[0]; i++)
+		if (!strncasecmp(images[i].name, name, 8))
+			return &images[i].inactive;
+	if (i == VSMSERVE_IMAGES)
+		i = rand_r(&vs.seed) % VSMSERVE_IMAGES;
+	snprintf(images[i].name, sizeof(images[i].name), "%s", name);
+	images[i].inactive = 0;
+	return &images[i].inactive;
+}
+
+
+/*
+ * common part of the image requests: the token, the latency and the
+ * failures. Returns the return code and sets *rs, RC_OK lets the
+ * request be done.
+ */
+static int image_request(const char *in, char *out, int *rs)
+{
+	int rc;
+
+	vs.requests++;
+	*rs = RS_NONE;
+	rc = session_use(in, out);
+	if (rc)
+		return rc;
+	sleep_ms(vs.latency + (vs.jitter ? rand_r(&vs.seed) % vs.jitter : 0));
+	if (rand_r(&vs.seed) % 100 < (unsigned int)vs.errors) {
+		vs.failed++;
+		if (vs.error_rc == RCERR_TOKEN) {
+			struct token t;
+
+			token_get(&t, in);
+			sessions[t.id % VSMSERVE_SESSIONS].id = 0;
+		}
+		return vs.error_rc;
+	}
+	return RC_OK;
+}
+
+/*
+ * with --async start the operation that leaves the image inactive or
+ * active as result, returns RC_ASYNC and the ID as *rs
+ */
+static int operation_start(int *inactive, int result, int *rs)
+{
+	long ms;
+	int i;
+
+	if (!vs.async)
+		return RC_OK;
+	if (!++last_operation)
+		last_operation = 1;
+	i = last_operation % VSMSERVE_OPERATIONS;
+	operations[i].id = last_operation;
+	operations[i].inactive = inactive;
+	operations[i].result = result;
+	operations[i].pending = 1;
+	ms = vs.async + (vs.jitter ? rand_r(&vs.seed) % vs.jitter : 0);
+	clock_gettime(CLOCK_MONOTONIC, &operations[i].end);
+	operations[i].end.tv_sec += ms / 1000;
+	operations[i].end.tv_nsec += (ms % 1000) * 1000000;
+	if (operations[i].end.tv_nsec >= 1000000000) {
+		operations[i].end.tv_sec++;
+		operations[i].end.tv_nsec -= 1000000000;
+	}
+	*rs = last_operation;
+	return RC_ASYNC;
+}
+
+/* the reply of IMAGE_ACTIVATE, IMAGE_DEACTIVATE and IMAGE_RECYCLE */
+#define IMAGEOP_REPLY(res, type, code, reason, token)			\
+do {									\
+	memset(&(res), 0, sizeof(res));					\
+	(res).rc = (code);						\
+	if ((code) == RC_OK) {						\
+		(res).type##_res_u.resok.rs = (reason);			\
+		memcpy((res).type##_res_u.resok.SessionToken, (token),	\
+		       sizeof(Session_Token));				\
+	} else if ((code) == RCERR_IMAGEOP) {				\
+		(res).type##_res_u.resfailbuf.rs = (reason);		\
+		memcpy((res).type##_res_u.resfailbuf.			\
+		       type##_resfail_buffer_u.resfail_nobuf.		\
+		       SessionToken, (token), sizeof(Session_Token));	\
+	} else {							\
+		(res).type##_res_u.resfail.rs = (reason);		\
+		memcpy((res).type##_res_u.resfail.SessionToken,		\
+		       (token), sizeof(Session_Token));			\
+	}								\
+} while (0)
+
+
+static void do_login(LOGIN_args *args, LOGIN_res *res)
+{
+	struct token t = {0, 0};
+
+	memset(res, 0, sizeof(*res));
+	sleep_ms(vs.latency + (vs.jitter ? rand_r(&vs.seed) % vs.jitter : 0));
+	if (!args->AuthenticatedUserid || !*args->AuthenticatedUserid) {
+		res->rc = RCERR_USER_PW_BAD;
+		res->LOGIN_res_u.resfail.rs = RS_NONE;
+		return;
+	}
+	if (!++last_session)
+		last_session = 1;
+	t.id = last_session;
+	sessions[t.id % VSMSERVE_SESSIONS].id = t.id;
+	res->rc = RC_OK;
+	token_set(res->LOGIN_res_u.resok.SessionToken, &t);
+}
+
+static void do_logout(LOGOUT_args *args, LOGOUT_res *res)
+{
+	struct token t;
+
+	token_get(&t, args->SessionToken);
+	memset(res, 0, sizeof(*res));
+	if (t.id && sessions[t.id % VSMSERVE_SESSIONS].id == t.id)
+		sessions[t.id % VSMSERVE_SESSIONS].id = 0;
+	res->rc = RC_OK;
+}
+
+static void do_activate(IMAGEACTIVATE_args *args, IMAGEACTIVATE_res *res)
+{
+	Session_Token token;
+	int rc, rs, *inactive;
+
+	rc = image_request(args->SessionToken, token, &rs);
+	if (!rc) {
+		inactive = image_inactive(args->TargetIdentifier);
+		if (!*inactive) {
+			rc = RCERR_IMAGEOP;
+			rs = RS_ALREADY_ACTIVE;
+		} else
+			rc = operation_start(inactive, 0, &rs);
+		if (rc != RC_ASYNC)
+			*inactive = 0;
+	}
+	IMAGEOP_REPLY(*res, IMAGEACTIVATE, rc, rs, token);
+}
+
+static void do_deactivate(IMAGEDEACTIVATE_args *args,
+			  IMAGEDEACTIVATE_res *res)
+{
+	Session_Token token;
+	int rc, rs, *inactive;
+
+	rc = image_request(args->SessionToken, token, &rs);
+	if (!rc) {
+		inactive = image_inactive(args->TargetIdentifier);
+		if (*inactive) {
+			rc = RCERR_IMAGEOP;
+			rs = RS_NOT_ACTIVE;
+		} else
+			rc = operation_start(inactive, 1, &rs);
+		if (rc != RC_ASYNC)
+			*inactive = 1;
+	}
+	IMAGEOP_REPLY(*res, IMAGEDEACTIVATE, rc, rs, token);
+}
+
+static void do_recycle(IMAGERECYCLE_args *args, IMAGERECYCLE_res *res)
+{
+	Session_Token token;
+	int rc, rs, *inactive;
+
+	rc = image_request(args->SessionToken, token, &rs);
+	if (!rc) {
+		inactive = image_inactive(args->TargetIdentifier);
+		if (*inactive) {
+			rc = RCERR_IMAGEOP;
+			rs = RS_NOT_ACTIVE;
+		} else
+			rc = operation_start(inactive, 0, &rs);
+	}
+	IMAGEOP_REPLY(*res, IMAGERECYCLE, rc, rs, token);
+}
+
+static void do_status(IMAGESTATUSQUERY_args *args, IMAGESTATUSQUERY_res *res)
+{
+	Session_Token token;
+	int rc, rs;
+
+	rc = image_request(args->SessionToken, token, &rs);
+	memset(res, 0, sizeof(*res));
+	res->rc = rc;
+	if (rc) {
+		res->IMAGESTATUSQUERY_res_u.resfail.rs = rs;
+		memcpy(res->IMAGESTATUSQUERY_res_u.resfail.SessionToken, token,
+		       sizeof(Session_Token));
+		return;
+	}
+	res->IMAGESTATUSQUERY_res_u.resok.rs =
+		*image_inactive(args->TargetIdentifier) ?
+		RS_NOT_ACTIVE : RS_NONE;
+	memcpy(res->IMAGESTATUSQUERY_res_u.resok.SessionToken, token,
+	       sizeof(Session_Token));
+}
+
+static void do_query_async(QUERYASYNCHRONOUSOPERATION_args *args,
+			   QUERYASYNCHRONOUSOPERATION_res *res)
+{
+	Session_Token token;
+	int i, rc;
+
+	vs.requests++;
+	rc = session_use(args->SessionToken, token);
+	if (!rc)
+		sleep_ms(vs.latency +
+			 (vs.jitter ? rand_r(&vs.seed) % vs.jitter : 0));
+	memset(res, 0, sizeof(*res));
+	res->rc = rc;
+	if (rc) {
+		memcpy(res->QUERYASYNCHRONOUSOPERATION_res_u.resfail.
+		       SessionToken, token, sizeof(Session_Token));
+		return;
+	}
+	operations_end();
+	i = (uint32_t)args->OperationId % VSMSERVE_OPERATIONS;
+	res->QUERYASYNCHRONOUSOPERATION_res_u.resok.rs =
+		operations[i].id != (uint32_t)args->OperationId ?
+		RS_ASYNC_FAILED : operations[i].pending ?
+		RS_ASYNC_IN_PROGRESS : RS_ASYNC_SUCCEEDED;
+	memcpy(res->QUERYASYNCHRONOUSOPERATION_res_u.resok.SessionToken,
+	       token, sizeof(Session_Token));
+}
+
+
+/*
+ * dispatch a call of the VSMSERVE program, the procedure number
+ * selects the XDR routines of its arguments and result
+ */
+static void vsmserve_dispatch(struct svc_req *req, SVCXPRT *xprt)
+{
+	union {
+		LOGIN_args login;
+		LOGOUT_args logout;
+		IMAGEACTIVATE_args activate;
+		IMAGEDEACTIVATE_args deactivate;
+		IMAGERECYCLE_args recycle;
+		IMAGESTATUSQUERY_args status;
+		QUERYASYNCHRONOUSOPERATION_args query_async;
+	} args;
+	union {
+		LOGIN_res login;
+		LOGOUT_res logout;
+		IMAGEACTIVATE_res activate;
+		IMAGEDEACTIVATE_res deactivate;
+		IMAGERECYCLE_res recycle;
+		IMAGESTATUSQUERY_res status;
+		QUERYASYNCHRONOUSOPERATION_res query_async;
+	} res;
+	xdrproc_t xdr_args, xdr_res;
+
+	switch (req->rq_proc) {
+	case NULLPROC:
+		svc_sendreply(xprt, (xdrproc_t)xdr_void, NULL);
+		return;
+	case LOGIN:
+		xdr_args = (xdrproc_t)xdr_LOGIN_args;
+		xdr_res = (xdrproc_t)xdr_LOGIN_res;
+		break;
+	case LOGOUT:
+		xdr_args = (xdrproc_t)xdr_LOGOUT_args;
+		xdr_res = (xdrproc_t)xdr_LOGOUT_res;
+		break;
+	case IMAGE_ACTIVATE:
+		xdr_args = (xdrproc_t)xdr_IMAGEACTIVATE_args;
+		xdr_res = (xdrproc_t)xdr_IMAGEACTIVATE_res;
+		break;
+	case IMAGE_DEACTIVATE:
+		xdr_args = (xdrproc_t)xdr_IMAGEDEACTIVATE_args;
+		xdr_res = (xdrproc_t)xdr_IMAGEDEACTIVATE_res;
+		break;
+	case IMAGE_RECYCLE:
+		xdr_args = (xdrproc_t)xdr_IMAGERECYCLE_args;
+		xdr_res = (xdrproc_t)xdr_IMAGERECYCLE_res;
+		break;
+	case IMAGE_STATUS_QUERY:
+		xdr_args = (xdrproc_t)xdr_IMAGESTATUSQUERY_args;
+		xdr_res = (xdrproc_t)xdr_IMAGESTATUSQUERY_res;
+		break;
+	case QUERY_ASYNCHRONOUS_OPERATION:
+		xdr_args = (xdrproc_t)xdr_QUERYASYNCHRONOUSOPERATION_args;
+		xdr_res = (xdrproc_t)xdr_QUERYASYNCHRONOUSOPERATION_res;
+		break;
+	default:
+		svcerr_noproc(xprt);
+		return;
+	}
+
+	memset(&args, 0, sizeof(args));
+	if (!svc_getargs(xprt, xdr_args, (caddr_t)&args)) {
+		svcerr_decode(xprt);
+		return;
+	}
+	switch (req->rq_proc) {
+	case LOGIN:
+		do_login(&args.login, &res.login);
+		break;
+	case LOGOUT:
+		do_logout(&args.logout, &res.logout);
+		break;
+	case IMAGE_ACTIVATE:
+		do_activate(&args.activate, &res.activate);
+		break;
+	case IMAGE_DEACTIVATE:
+		do_deactivate(&args.deactivate, &res.deactivate);
+		break;
+	case IMAGE_RECYCLE:
+		do_recycle(&args.recycle, &res.recycle);
+		break;
+	case IMAGE_STATUS_QUERY:
+		do_status(&args.status, &res.status);
+		break;
+	case QUERY_ASYNCHRONOUS_OPERATION:
+		do_query_async(&args.query_async, &res.query_async);
+		break;
+	}
+	if (!svc_sendreply(xprt, xdr_res, (caddr_t)&res))
+		svcerr_systemerr(xprt);
+	svc_freeargs(xprt, xdr_args, (caddr_t)&args);
+}
+
+
+static void stop(int sig)
+{
+	svc_exit();
+}
+
+
+static long parse_number(const char *arg, const char *what, long max)
+{
+	char *end;
+	long value;
+
+	value = strtol(arg, &end, 10);
+	if (*end || end == arg || value < 0 || value > max) {
+		fprintf(stderr, "snvsmserve: invalid %s %s\n", what, arg);
+		exit(INVALID_PARAMETER_VALUE);
+	}
+	return value;
+}
+
+
+/*
+ *	function: main
+ *
+ *	purpose: point of control
+ */
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	SVCXPRT *xprt;
+	int c, fd, port = 0;
+
+	while ((c = getopt_long(argc, argv, "p:l:j:e:r:s:a:hv", long_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			port = parse_number(optarg, "port", 65535);
+			break;
+		case 'l':
+			vs.latency = parse_number(optarg, "latency", 600000);
+			break;
+		case 'j':
+			vs.jitter = parse_number(optarg, "jitter", 600000);
+			break;
+		case 'e':
+			vs.errors = parse_number(optarg, "errors", 100);
+			break;
+		case 'r':
+			vs.error_rc = parse_number(optarg, "rc", 9999);
+			break;
+		case 's':
+			vs.session = parse_number(optarg, "session",
+						  1000000000);
+			break;
+		case 'a':
+			vs.async = parse_number(optarg, "async", 600000);
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		case 'v':
+			printf("%s\n", SNIPL_VERSION);
+			printf("%s\n", SNIPL_COPYRIGHT);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return UNKNOWN_PARAMETER;
+		}
+	}
+	if (optind < argc) {
+		print_usage(argv[0]);
+		return UNKNOWN_PARAMETER;
+	}
+	vs.seed = time(NULL) ^ getpid();
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		fprintf(stderr, "snvsmserve: %s\n", strerror(errno));
+		return CONNECTION_ERROR;
+	}
+	c = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &c, sizeof(c));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(fd, SOMAXCONN) == -1 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+		fprintf(stderr, "snvsmserve: port %d: %s\n", port,
+			strerror(errno));
+		return CONNECTION_ERROR;
+	}
+	xprt = svctcp_create(fd, 0, 0);
+	if (!xprt) {
+		fprintf(stderr, "snvsmserve: cannot create the TCP service\n");
+		return CONNECTION_ERROR;
+	}
+	pmap_unset(VSMAPI_PROGRAM, VSMAPI_V2);
+	if (!svc_register(xprt, VSMAPI_PROGRAM, VSMAPI_V2, vsmserve_dispatch,
+			  IPPROTO_TCP)) {
+		fprintf(stderr, "snvsmserve: cannot register with the "
+			"portmapper, is rpcbind running?\n");
+		svc_destroy(xprt);
+		return CONNECTION_ERROR;
+	}
+	printf("snvsmserve: serving VSMSERVE on TCP port %d\n",
+	       ntohs(addr.sin_port));
+	fflush(stdout);
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+	svc_run();
+
+	svc_unregister(VSMAPI_PROGRAM, VSMAPI_V2);
+	printf("snvsmserve: %lu image requests, %lu failed\n", vs.requests,
+	       vs.failed);
+	return 0;
+}
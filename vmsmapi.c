@@ -26,6 +26,12 @@
 /*  and furtheron each VM SM API function call returns a new          */
 /*  SessionToken. The SessionToken is saved to an instance of the     */
 /*  static structure snipl_server_private.                            */
+/*                                                                    */
+/*  The session of a server is kept for the whole invocation: a login */
+/*  with a valid SessionToken does nothing, and all images of the     */
+/*  server use the same CLIENT handle and session. Only when VSMSERVE */
+/*  rejects the SessionToken (RCERR_TOKEN) the server is logged in    */
+/*  again and the request is repeated once.                           */
 /*--------------------------------------------------------------------*/
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -73,7 +79,7 @@ static const char *get_rpc_function(int fid)
 }
 
 
-extern void prepare(struct snipl_server *server)
+extern SNIPL_MODULE_PREPARE(vmsmapi)
 {
 	struct snipl_image * image;
 
@@ -101,6 +107,25 @@ static int vm_check(struct snipl_server *server)
 	return parms_check_vm(server);
 }
 
+/*--------------------------------------------------------------------*/
+/*
+   Limit the next RPC call to the learned timeout or the timeout of the
+   rpcgen stubs, and to the time left until the deadline.
+*/
+#define RPC_TIMEOUT_MS 25000
+
+static void rpc_deadline(struct snipl_server *server)
+{
+	struct timeval tv;
+	int msecs;
+
+	msecs = snipl_wait_time(server, server->learned_timeout ?
+				server->learned_timeout : RPC_TIMEOUT_MS);
+	tv.tv_sec = msecs / 1000;
+	tv.tv_usec = (msecs % 1000) * 1000;
+	clnt_control(server->priv->serverP, CLSET_TIMEOUT, (char *)&tv);
+}
+
 /*--------------------------------------------------------------------*/
 static int connectServer(struct snipl_server *server)
 {
@@ -129,7 +154,74 @@ static int connectServer(struct snipl_server *server)
 
 
 /*--------------------------------------------------------------------*/
-Return_Code vm_image_activate(struct snipl_image *image)
+/*
+   run an image request in the session of the server, after a login
+   again if VSMSERVE does not know the SessionToken anymore
+*/
+static int session_request(struct snipl_image *image,
+			   int (*request)(struct snipl_image *))
+{
+	struct snipl_server *server = image->server;
+	int rc;
+
+	rc = request(image);
+	if (rc != RCERR_TOKEN)
+		return rc;
+	DEBUG_PRINT("vmsmapi : session token expired, login again\n");
+	server->priv->logged_in = 0;
+	rc = vm_server_login(server);
+	if (rc)
+		return rc;
+	return request(image);
+}
+
+static int vm_image_activate(struct snipl_image *image)
+{
+	return session_request(image, image_activate_rpc);
+}
+
+static int vm_image_deactivate(struct snipl_image *image)
+{
+	return session_request(image, image_deactivate_rpc);
+}
+
+static int vm_image_reset(struct snipl_image *image)
+{
+	return session_request(image, image_recycle_rpc);
+}
+
+static int vm_image_getstatus(struct snipl_image *image)
+{
+	return session_request(image, image_status_query_rpc);
+}
+
+
+/*--------------------------------------------------------------------*/
+/*
+   VSMSERVE started an asynchronous operation for the request fname of
+   image, the reason code is the ID of the operation
+*/
+static int async_started(struct snipl_image *image, const char *fname,
+			 int id)
+{
+	struct snipl_server *server = image->server;
+
+	snipl_result_api(server, RC_ASYNC, id);
+	create_msg(server, "* %s : Image %s %s, operation ID %d\n", fname,
+		   image->name, vmsmapi_get_error_description(RC_ASYNC, id),
+		   id);
+	if (snipl_async_start(server, image, id)) {
+		append_msg(server,
+			   "cannot allocate storage to track the operation\n");
+		server->problem_class = FATAL;
+		return STORAGE_PROBLEM;
+	}
+	server->problem_class = OK;
+	return RC_OK;
+}
+
+/*--------------------------------------------------------------------*/
+static int image_activate_rpc(struct snipl_image *image)
 {
 	int rc;
 	int rs;
@@ -147,6 +239,7 @@ Return_Code vm_image_activate(struct snipl_image *image)
 		image->server->priv->session_token,
 		sizeof(Session_Token));
 	ia_args.TargetIdentifier = image->name;
+	rpc_deadline(image->server);
 	ia_res = image_activate_1(&ia_args,image->server->priv->serverP);
 	if (!ia_res) {
 		rpcError(image->server, IMAGE_ACTIVATE);
@@ -169,9 +262,8 @@ Return_Code vm_image_activate(struct snipl_image *image)
 			image->server->problem_class = WARNING;
 			filP = image_retbuf->FailingImagesList;
 			for (; filP; filP = filP->next_entry) {
-				create_msg(image->server, "%s * %s rc=%d "
+				append_msg(image->server, " * %s rc=%d "
 					   "reason=%d\n",
-					   image->server->problem,
 					   filP->ImageName,
 					   filP->ImageReturnCode,
 					   filP->ImageReasonCode);
@@ -184,6 +276,7 @@ Return_Code vm_image_activate(struct snipl_image *image)
 			       sizeof(Session_Token));
 		} else {
 			err_dsc = vmsmapi_get_error_description(rc, rs);
+			snipl_result_api(image->server, rc, rs);
 			create_msg(image->server,
 				   "* ImageActivate : Image %s %s\n",
 				   image->name, err_dsc);
@@ -195,9 +288,17 @@ Return_Code vm_image_activate(struct snipl_image *image)
 				       resfail_nobuf.SessionToken,
 			       sizeof(Session_Token));
 		}
+	} else if (rc == RC_ASYNC) {
+		rc = async_started(image, "ImageActivate",
+				   ia_res->IMAGEACTIVATE_res_u.resfail.rs);
+		/* save session token */
+		memcpy(image->server->priv->session_token,
+		       ia_res->IMAGEACTIVATE_res_u.resfail.SessionToken,
+		       sizeof(Session_Token));
 	} else if (rc) {	/* all other bad cases */
 		rs = ia_res->IMAGEACTIVATE_res_u.resfail.rs;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
 		create_msg(image->server, "* ImageActivate : Image %s %s\n",
 			   image->name, err_dsc);
 		image->server->problem_class = FATAL;
@@ -209,6 +310,7 @@ Return_Code vm_image_activate(struct snipl_image *image)
 	} else {	/* ok case */
 		rs = ia_res->IMAGEACTIVATE_res_u.resok.rs;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
 		create_msg(image->server, "* ImageActivate : Image %s %s\n",
 			   image->name, err_dsc);
 		image->server->problem_class = OK;
@@ -221,7 +323,7 @@ Return_Code vm_image_activate(struct snipl_image *image)
 } /* vmsmapi_imageActivate() */
 
 /*--------------------------------------------------------------------*/
-Return_Code vm_image_reset(struct snipl_image *image)
+static int image_recycle_rpc(struct snipl_image *image)
 {
 	int rc;
 	int rs;
@@ -238,6 +340,7 @@ Return_Code vm_image_reset(struct snipl_image *image)
 	       image->server->priv->session_token,
 	       sizeof(Session_Token));
 	ir_args.TargetIdentifier = image->name;
+	rpc_deadline(image->server);
 	ir_res = image_recycle_1(&ir_args,image->server->priv->serverP);
 	if (!ir_res) {
 		rpcError(image->server, IMAGE_RECYCLE);
@@ -260,8 +363,7 @@ Return_Code vm_image_reset(struct snipl_image *image)
 		filP = image_retbuf->FailingImagesList;
 		for (; filP; filP = filP->next_entry) {
 			/* message chaining */
-			create_msg(image->server, "%s * %s rc=%d reason=%d\n",
-				   image->server->problem,
+			append_msg(image->server, " * %s rc=%d reason=%d\n",
 				   filP->ImageName,
 				   filP->ImageReturnCode,
 				   filP->ImageReasonCode);
@@ -275,6 +377,7 @@ Return_Code vm_image_reset(struct snipl_image *image)
 
 	} else { /* (rs == RS_SOME_NOT_RECYC) */
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
 		create_msg(image->server, "* ImageRecycle : Image %s %s\n",
 			   image->name, err_dsc);
 		image->server->problem_class = FATAL;
@@ -286,9 +389,17 @@ Return_Code vm_image_reset(struct snipl_image *image)
 		       sizeof(Session_Token));
 	} /* (rc == RCERR_IMAGEOP) */
 
+	} else if (rc == RC_ASYNC) {
+		rc = async_started(image, "ImageRecycle",
+				   ir_res->IMAGERECYCLE_res_u.resfail.rs);
+		/* save session token */
+		memcpy(image->server->priv->session_token,
+		       ir_res->IMAGERECYCLE_res_u.resfail.SessionToken,
+		       sizeof(Session_Token));
 	} else if (rc) {
 		rs = ir_res->IMAGERECYCLE_res_u.resfail.rs;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
 		create_msg(image->server, "* ImageRecycle : Image %s %s\n",
 			   image->name, err_dsc);
 		image->server->problem_class = FATAL;
@@ -300,6 +411,7 @@ Return_Code vm_image_reset(struct snipl_image *image)
 	} else {
 		rs = ir_res->IMAGERECYCLE_res_u.resok.rs;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
 		create_msg(image->server, "* ImageRecycle : Image %s %s\n",
 			   image->name, err_dsc);
 		image->server->problem_class = OK;
@@ -316,7 +428,7 @@ Return_Code vm_image_reset(struct snipl_image *image)
 /*
    deactivate image - api
 */
-Return_Code vm_image_deactivate(struct snipl_image *image)
+static int image_deactivate_rpc(struct snipl_image *image)
 {
 	int rc;
 	int rs;
@@ -341,6 +453,7 @@ Return_Code vm_image_deactivate(struct snipl_image *image)
 	       sizeof(Session_Token));
 	id_args.TargetIdentifier = image->name;
 	id_args.ForceTime = force_time;
+	rpc_deadline(image->server);
 	id_res = image_deactivate_1(&id_args,image->server->priv->serverP);
 	if (!id_res) {
 		rpcError(image->server, IMAGE_DEACTIVATE);
@@ -364,9 +477,8 @@ Return_Code vm_image_deactivate(struct snipl_image *image)
 			filP = image_retbuf->FailingImagesList;
 			for (; filP; filP = filP->next_entry) {
 				/* message chaining */
-				create_msg(image->server,
-					   "%s * %s rc=%d reason=%d\n",
-					   image->server->problem,
+				append_msg(image->server,
+					   " * %s rc=%d reason=%d\n",
 					   filP->ImageName,
 					   filP->ImageReturnCode,
 					   filP->ImageReasonCode);
@@ -380,6 +492,7 @@ Return_Code vm_image_deactivate(struct snipl_image *image)
 			       sizeof(Session_Token));
 		} else { /* rs != RS_NOT_ALL */
 			err_dsc = vmsmapi_get_error_description(rc, rs);
+			snipl_result_api(image->server, rc, rs);
 			create_msg(image->server,
 				   "* ImageDeactivate : Image %s %s\n",
 				   image->name, err_dsc);
@@ -391,9 +504,17 @@ Return_Code vm_image_deactivate(struct snipl_image *image)
 			       resfail_nobuf.SessionToken,
 			       sizeof(Session_Token));
 		} /* else */
+	} else if (rc == RC_ASYNC) {
+		rc = async_started(image, "ImageDeactivate",
+				   id_res->IMAGEDEACTIVATE_res_u.resfail.rs);
+		/* save session token */
+		memcpy(image->server->priv->session_token,
+		       id_res->IMAGEDEACTIVATE_res_u.resfail.SessionToken,
+		       sizeof(Session_Token));
 	} else if (rc) {
 		rs = id_res->IMAGEDEACTIVATE_res_u.resfail.rs;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
 		create_msg(image->server, "* ImageDeactivate : Image %s %s\n",
 			   image->name, err_dsc);
 		image->server->problem_class = FATAL;
@@ -408,6 +529,7 @@ Return_Code vm_image_deactivate(struct snipl_image *image)
 		 * */
 		rs = RS_NONE;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
 		create_msg(image->server, "* ImageDeactivate : Image %s %s\n",
 			   image->name, err_dsc);
 		image->server->problem_class = OK;
@@ -423,7 +545,7 @@ Return_Code vm_image_deactivate(struct snipl_image *image)
 
 
 /*--------------------------------------------------------------------*/
-Return_Code vm_image_getstatus(struct snipl_image *image)
+static int image_status_query_rpc(struct snipl_image *image)
 {
 	int rc, rs;
 	IMAGESTATUSQUERY_args is_args;
@@ -437,6 +559,7 @@ Return_Code vm_image_getstatus(struct snipl_image *image)
 	       image->server->priv->session_token,
 	       sizeof(Session_Token));
 	is_args.TargetIdentifier = image->name;
+	rpc_deadline(image->server);
 	is_res = image_status_query_2(&is_args, image->server->priv->serverP);
 	if (!is_res) {
 		rpcError(image->server, IMAGE_STATUS_QUERY);
@@ -447,6 +570,10 @@ Return_Code vm_image_getstatus(struct snipl_image *image)
 	if (rc) {
 		rs = is_res->IMAGESTATUSQUERY_res_u.resfail.rs;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
+		if (rc == RCERR_IMAGEOP && rs == RS_NOT_ACTIVE)
+			snipl_result_state(image->server,
+					   SNIPL_IMAGE_INACTIVE, 0, NULL);
 		create_msg(image->server,
 			   "* ImageStatusQuery : Image %s %s\n",
 			   image->name, err_dsc);
@@ -458,6 +585,11 @@ Return_Code vm_image_getstatus(struct snipl_image *image)
 	} else {
 		rs = is_res->IMAGESTATUSQUERY_res_u.resok.rs;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(image->server, rc, rs);
+		snipl_result_state(image->server, rs == RS_NONE ?
+				   SNIPL_IMAGE_ACTIVE : rs == RS_NOT_ACTIVE ?
+				   SNIPL_IMAGE_INACTIVE : SNIPL_IMAGE_UNKNOWN,
+				   0, NULL);
 		if (rs == RS_NONE)
 			err_dsc = image_active;
 		create_msg(image->server,
@@ -474,11 +606,91 @@ Return_Code vm_image_getstatus(struct snipl_image *image)
 }
 
 
+/*--------------------------------------------------------------------*/
+/*
+   query the state of an asynchronous operation in the session of the
+   server, after a login again like session_request
+*/
+static int vm_query_async(struct snipl_server *server,
+			  struct snipl_async *async)
+{
+	int rc;
+
+	rc = query_async_rpc(server, async);
+	if (rc != RCERR_TOKEN)
+		return rc;
+	DEBUG_PRINT("vmsmapi : session token expired, login again\n");
+	server->priv->logged_in = 0;
+	rc = vm_server_login(server);
+	if (rc)
+		return rc;
+	return query_async_rpc(server, async);
+}
+
+static int query_async_rpc(struct snipl_server *server,
+			   struct snipl_async *async)
+{
+	int rc, rs;
+	QUERYASYNCHRONOUSOPERATION_args qa_args;
+	QUERYASYNCHRONOUSOPERATION_res *qa_res = 0;
+
+	DEBUG_PRINT("vmsmapi : start of function\n");
+
+	/* obtain session token */
+	memcpy(qa_args.SessionToken,
+	       server->priv->session_token,
+	       sizeof(Session_Token));
+	qa_args.TargetIdentifier = async->image->name;
+	qa_args.OperationId = async->id;
+	rpc_deadline(server);
+	qa_res = query_asynchronous_operation_1(&qa_args,
+						server->priv->serverP);
+	if (!qa_res) {
+		rpcError(server, QUERY_ASYNCHRONOUS_OPERATION);
+		return 396;
+	}
+
+	rc = qa_res->rc;
+	if (rc) {
+		rs = qa_res->QUERYASYNCHRONOUSOPERATION_res_u.resfail.rs;
+		/* save session token */
+		memcpy(server->priv->session_token,
+		       qa_res->QUERYASYNCHRONOUSOPERATION_res_u.resfail.
+			       SessionToken,
+		       sizeof(Session_Token));
+	} else {
+		rs = qa_res->QUERYASYNCHRONOUSOPERATION_res_u.resok.rs;
+		/* save session token */
+		memcpy(server->priv->session_token,
+		       qa_res->QUERYASYNCHRONOUSOPERATION_res_u.resok.
+			       SessionToken,
+		       sizeof(Session_Token));
+	}
+	if (rc == RCERR_TOKEN) {
+		create_msg(server, "* QueryAsynchronousOperation : Image %s "
+			   "%s\n", async->image->name,
+			   vmsmapi_get_error_description(rc, rs));
+		server->problem_class = FATAL;
+		return rc;
+	}
+	async->api_rc = rc;
+	async->api_rs = rs;
+	if (rc == RC_OK && rs == RS_ASYNC_IN_PROGRESS)
+		async->state = SNIPL_ASYNC_RUNNING;
+	else if (rc == RC_OK && rs == RS_ASYNC_SUCCEEDED)
+		async->state = SNIPL_ASYNC_DONE;
+	else
+		async->state = SNIPL_ASYNC_FAILED;
+	return RC_OK;
+}
+
+
 /*--------------------------------------------------------------------*/
 /*
    login to vm server :
    connect to server
    then do a login using userid and password
+   A server that is logged in already keeps its session.
 */
 Return_Code vm_server_login(struct snipl_server *server)
 {
@@ -490,12 +702,15 @@ Return_Code vm_server_login(struct snipl_server *server)
 
 	DEBUG_PRINT("vmsmapi : start of function\n");
 
+	if (server->priv->logged_in && server->priv->serverP)
+		return RC_OK;
 	rc = connectServer(server);
 	if (rc != RC_OK)
 		return rc;
 
 	loginArgs.AuthenticatedUserid = server->user;
 	loginArgs.loginpw             = server->password;;
+	rpc_deadline(server);
 	login_res = login_1(&loginArgs,server->priv->serverP);
 	if (!login_res) {
 		rpcError(server, LOGIN);
@@ -508,9 +723,11 @@ Return_Code vm_server_login(struct snipl_server *server)
 		memcpy(server->priv->session_token,
 			login_res->LOGIN_res_u.resok.SessionToken,
 			sizeof (Session_Token));
+		server->priv->logged_in = 1;
 	} else {
 		rs = login_res->LOGIN_res_u.resfail.rs;
 		err_dsc = vmsmapi_get_error_description(rc, rs);
+		snipl_result_api(server, rc, rs);
 		create_msg(server, "* login error(%d/%d) : %s\n", rc, rs,
 			   err_dsc);
 		server->problem_class = FATAL;
@@ -520,12 +737,51 @@ Return_Code vm_server_login(struct snipl_server *server)
 } /* vmsmapi_login() */
 
 
+/*--------------------------------------------------------------------*/
+/*
+   liveness check of VSMSERVE without login: a call of the null
+   procedure, which every RPC server answers. A logged in server is
+   probed over the connection of its session.
+*/
+static int vm_server_probe(struct snipl_server *server)
+{
+	struct timeval tv = {RPC_TIMEOUT_MS / 1000, 0};
+	int keep = server->priv->logged_in && server->priv->serverP;
+	enum clnt_stat stat;
+	int rc = RC_OK;
+
+	DEBUG_PRINT("vmsmapi : start of function\n");
+
+	if (!keep)
+		rc = connectServer(server);
+	if (rc != RC_OK)
+		return rc;
+	rpc_deadline(server);
+	stat = clnt_call(server->priv->serverP, NULLPROC,
+			 (xdrproc_t)xdr_void, NULL,
+			 (xdrproc_t)xdr_void, NULL, tv);
+	if (stat != RPC_SUCCESS) {
+		create_msg(server, "* Error calling the null procedure : %s\n",
+			   clnt_sperrno(stat));
+		server->problem_class = FATAL;
+		if (stat == RPC_TIMEDOUT)
+			snipl_result_busy(server);
+		rc = RCERR_CONNECT;
+		keep = 0;
+	}
+	if (!keep)
+		free_priv_conn(server->priv);
+	return rc;
+}
+
+
 static inline void free_priv_conn(struct snipl_server_private *priv)
 {
 	if (priv->serverP) {
 		clnt_destroy(priv->serverP);	// destroy old connection
 		priv->serverP = NULL;
 	}
+	priv->logged_in = 0;
 }
 
 static int vm_server_logout(struct snipl_server *server)
@@ -548,12 +804,18 @@ static int vm_server_logout(struct snipl_server *server)
  * else 0 is returned and server->problem is set to NULL */
 static void rpcError(struct snipl_server *server, int fnum)
 {
-	char *msgP = NULL;
+	struct rpc_err err;
 
-	msgP = clnt_sperror(server->priv->serverP, 0);
-	create_msg(server, "* Error calling %s : %d %s",
-		   get_rpc_function(fnum), (int)*(msgP + 1), msgP + 5);
+	/* clnt_sperror of libtirpc returns NULL without a prefix */
+	clnt_geterr(server->priv->serverP, &err);
+	create_msg(server, "* Error calling %s : %d %s\n",
+		   get_rpc_function(fnum), err.re_status,
+		   clnt_sperrno(err.re_status));
 	server->problem_class = FATAL;
+	if (err.re_status == RPC_TIMEDOUT)
+		snipl_result_busy(server);
+	/* the session token of the lost reply is unknown */
+	server->priv->logged_in = 0;
 	return;
 } /* rpcError(...) */
 
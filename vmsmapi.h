@@ -24,6 +24,7 @@
 struct snipl_server_private {
 	Session_Token   session_token;
 	CLIENT         *serverP;
+	int             logged_in;	/* session_token is valid */
 };
 
 static int vm_image_activate(struct snipl_image *);
@@ -34,11 +35,15 @@ static int vm_image_getstatus(struct snipl_image *);
 static int vm_check(struct snipl_server *);
 static int vm_server_login(struct snipl_server *);
 static int vm_server_logout(struct snipl_server *);
+static int vm_server_probe(struct snipl_server *);
+static int vm_query_async(struct snipl_server *, struct snipl_async *);
 
 static struct snipl_server_ops vm_server_ops = {
 	.login = vm_server_login,
 	.logout = vm_server_logout,
 	.check = vm_check,
+	.probe = vm_server_probe,
+	.query_async = vm_query_async,
 };
 
 static struct snipl_image_ops vm_image_ops = {
@@ -48,12 +53,22 @@ static struct snipl_image_ops vm_image_ops = {
 	.getstatus      = vm_image_getstatus,
 };
 
+static int image_activate_rpc(struct snipl_image *);
+static int image_deactivate_rpc(struct snipl_image *);
+static int image_recycle_rpc(struct snipl_image *);
+static int image_status_query_rpc(struct snipl_image *);
+static int query_async_rpc(struct snipl_server *, struct snipl_async *);
+
 static int connectServer(struct snipl_server *);
 static void rpcError(struct snipl_server *, int);
 static inline void free_priv_conn(struct snipl_server_private *);
 
 #define RS_ANY (-1)
 #define RCERR_CONNECT (2000)
+#define RC_ASYNC (592)			/* RS = operation ID */
+#define RS_ASYNC_SUCCEEDED (100)
+#define RS_ASYNC_IN_PROGRESS (104)
+#define RS_ASYNC_FAILED (108)
 
 static struct {
 	int RC;
@@ -62,6 +77,10 @@ static struct {
 } error_codes[] = {
 	{ RC_OK,         RS_NONE,               "Request Successful"},
 	{ RC_OK,         RS_NOT_ACTIVE,         "Image Not Active"},
+	{ RC_OK,         RS_ASYNC_SUCCEEDED,    "Asynchronous Operation Succeeded"},
+	{ RC_OK,         RS_ASYNC_IN_PROGRESS,  "Asynchronous Operation In Progress"},
+	{ RC_OK,         RS_ASYNC_FAILED,       "Asynchronous Operation Failed"},
+	{ RC_ASYNC,      RS_ANY,                "Asynchronous Operation Started"},
 	{ RCERR_TOKEN,   RS_NONE,               "Session Token Not Valid"},
 	{ RCERR_SYNTAX,  RS_ANY,                "Syntax Error in Function Parameter"},
 	{ RCERR_AUTH,    RS_AUTHERR_ESM,        "Request Not Authorized by External Security Manager"},
@@ -52,7 +52,7 @@ const char *vmsmapi6_get_error_description(int rc, int rs)
 }
 
 
-extern void prepare(struct snipl_server *server)
+extern SNIPL_MODULE_PREPARE(vmsmapi6)
 {
 	struct snipl_image *image;
 
@@ -198,8 +198,10 @@ int vm6_wait_for_response(struct snipl_server *server, char *fname_print,
 	int epoll;
 	struct epoll_event event;
 	int rc = 0;
+	int slice;
 
 	DEBUG_PRINT("vmsmapi6 : start of function\n");
+	timeout = snipl_wait_time(server, timeout);
 	event.events = in_or_out;
 	event.data.ptr = NULL;
 	epoll = epoll_create(1);
@@ -212,18 +214,31 @@ int vm6_wait_for_response(struct snipl_server *server, char *fname_print,
 		server->problem_class = FATAL;
 		goto out;
 	}
-	rc = epoll_wait(epoll, &event, 1, timeout);
+	/* wait in slices, so that snipl_cancel ends the wait */
+	do {
+		slice = timeout < SNIPL_CANCEL_SLICE ?
+			timeout : SNIPL_CANCEL_SLICE;
+		rc = epoll_wait(epoll, &event, 1, slice);
+		timeout -= slice;
+	} while (!rc && timeout > 0 && !snipl_cancelled(server));
 	if (rc < 0) {
 		DEBUG_PRINT("epoll_wait return_code = %08x = %i\n", rc, rc);
 		create_msg(server,
 			"%s: %s failed, return_code of epoll_wait is %i %s\n",
 			server->address, fname_print, errno, strerror(errno));
 		server->problem_class = FATAL;
+	} else if (rc == 0 && snipl_cancelled(server)) {
+		DEBUG_PRINT("epoll_wait cancelled\n");
+		create_msg(server, "%s: %s cancelled\n",
+			server->address, fname_print);
+		server->problem_class = FATAL;
+		rc = -ECANCELED;
 	} else if (rc == 0) {
 		DEBUG_PRINT("epoll_wait timeout reached\n");
 		create_msg(server, "%s: %s timed out\n",
 			server->address, fname_print);
 		server->problem_class = FATAL;
+		snipl_result_busy(server);
 		rc = -ETIME;
 	} else {
 		rc = 0;
@@ -320,6 +335,13 @@ static int vm6_build_input(struct snipl_image *image, char *fname)
 	/* add force_time */
 	if (!strcmp(fname, "Image_Deactivate\0"))
 		tmp = vm6_handle_force(server, tmp);
+	/* add operation_id */
+	if (!strcmp(fname, "Query_Asynchronous_Operation_DM\0")) {
+		*((uint32_t *)tmp) = htonl(server->priv->operation_id);
+		DEBUG_PRINT("operation_id = %08x = %u\n",
+			*((uint32_t *)tmp), *((uint32_t *)tmp));
+		tmp = (char *)((unsigned long)tmp + 4);
+	}
 	/* insert total_length */
 	len = (unsigned long)tmp - (unsigned long)server->priv->inlist - 4;
 	tmp = (char *)((unsigned long)server->priv->inlist);
@@ -350,7 +372,7 @@ int vm6_recv_all(struct snipl_server *server, char *fname, int len)
 			    SSL_get_error(server->priv->sslhandle, rc) ==
 			    SSL_ERROR_WANT_READ) {
 				rc = vm6_wait_for_response(server, fname,
-						EPOLLIN, server->timeout);
+						EPOLLIN, snipl_timeout(server));
 				if (!rc)
 					continue;
 			}
@@ -377,28 +399,78 @@ int vm6_recv_all(struct snipl_server *server, char *fname, int len)
 }
 
 /*--------------------------------------------------------------------*/
-int vm6_command_handling(struct snipl_image *image, char *fname)
+/*
+   Receive the len bytes of output data that follow the response header
+   into buf
+*/
+static int vm6_recv_data(struct snipl_server *server, char *fname_print,
+			 char *buf, int len)
+{
+	int total = 0;
+	int rc;
+
+	while (total < len) {
+		if (server->enc)
+			rc = SSL_read(server->priv->sslhandle, buf + total,
+				      len - total);
+		else
+			rc = recv(server->priv->sockid, buf + total,
+				  len - total, 0);
+		if (rc < 0) {
+			if ((!server->enc && errno == EAGAIN) ||
+			    (server->enc &&
+			     SSL_get_error(server->priv->sslhandle, rc) ==
+			     SSL_ERROR_WANT_READ)) {
+				rc = vm6_wait_for_response(server, fname_print,
+						EPOLLIN, snipl_timeout(server));
+				if (!rc)
+					continue;
+				return rc;
+			}
+			create_msg(server,
+				   "%s: %s failed, return_code of recv is "
+				   "%i %s\n", server->address, fname_print,
+				   errno, strerror(errno));
+			server->problem_class = FATAL;
+			return rc;
+		} else if (!rc) {
+			create_msg(server, "%s: %s output data not received\n",
+				   server->address, fname_print);
+			server->problem_class = FATAL;
+			return INTERNAL_ERROR;
+		}
+		total += rc;
+	}
+	return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/*
+   Map the return and reason code of Image_Status_Query to the image state
+*/
+static int vm6_image_state(int rc, int rs)
+{
+	if (rc == RC_OK && rs == RS_NONE)
+		return SNIPL_IMAGE_ACTIVE;
+	if ((rc == RC_OK || rc == RCERR_IMAGEOP) && rs == RS_NOT_ACTIVE)
+		return SNIPL_IMAGE_INACTIVE;
+	return SNIPL_IMAGE_UNKNOWN;
+}
+
+/*--------------------------------------------------------------------*/
+/*
+   Send the request fname for image and receive the request id and the
+   header of the output list into server->priv->outlist
+*/
+static int vm6_request(struct snipl_image *image, char *fname,
+		       char *fname_print)
 {
 	struct snipl_server *server = image->server;
-	char *tmp;
 	int request_id;
 	int inlen;
 	int total = 0;
 	int bytesleft;
 	int rc = 0;
-	struct vm6_image_response *resp_hdr;
-	const char *err_dsc;
-	char fname_print[18] = "Image\0";
-
-	DEBUG_PRINT("vmsmapi6 : start of function\n");
-	tmp = strchr(fname, '_') + 1;
-	memcpy(&fname_print[5], tmp, strlen(fname) - 6);
-	tmp = memchr(fname_print, '_', 16);
-	if (tmp) {
-		memmove(tmp, tmp + 1,
-			strlen(fname_print) + fname_print - tmp - 1);
-		fname_print[strlen(fname_print) - 1] = '\0';
-	}
 
 	inlen = vm6_build_input(image, fname) + 4;
 	bytesleft = inlen;
@@ -415,7 +487,8 @@ int vm6_command_handling(struct snipl_image *image, char *fname)
 			     SSL_get_error(server->priv->sslhandle, rc) ==
 			     SSL_ERROR_WANT_WRITE)) {
 				rc = vm6_wait_for_response(server, fname_print,
-						EPOLLOUT, server->timeout);
+						EPOLLOUT,
+						snipl_timeout(server));
 				if (!rc)
 					continue;
 			}
@@ -434,7 +507,7 @@ int vm6_command_handling(struct snipl_image *image, char *fname)
 	}
 
 	rc = vm6_wait_for_response(server, fname_print, EPOLLIN,
-				   server->timeout);
+				   snipl_timeout(server));
 	if (rc)
 		return rc;
 	/* Receive the request id */
@@ -457,7 +530,7 @@ int vm6_command_handling(struct snipl_image *image, char *fname)
 	DEBUG_PRINT("request_id = %08x = %u\n", request_id, request_id);
 
 	rc = vm6_wait_for_response(server, fname_print, EPOLLIN,
-				   server->timeout);
+				   snipl_timeout(server));
 	if (rc)
 		return rc;
 	/* Receive the API output list */
@@ -475,6 +548,35 @@ int vm6_command_handling(struct snipl_image *image, char *fname)
 		server->problem_class = FATAL;
 		return INTERNAL_ERROR;
 	}
+	if (request_id != ((struct vm6_image_response *)
+			   server->priv->outlist)->request_id)
+		DEBUG_PRINT("internal error - request id\n");
+	return 0;
+}
+
+/*--------------------------------------------------------------------*/
+int vm6_command_handling(struct snipl_image *image, char *fname)
+{
+	struct snipl_server *server = image->server;
+	char *tmp;
+	int rc = 0;
+	struct vm6_image_response *resp_hdr;
+	const char *err_dsc;
+	char fname_print[18] = "Image\0";
+
+	DEBUG_PRINT("vmsmapi6 : start of function\n");
+	tmp = strchr(fname, '_') + 1;
+	memcpy(&fname_print[5], tmp, strlen(fname) - 6);
+	tmp = memchr(fname_print, '_', 16);
+	if (tmp) {
+		memmove(tmp, tmp + 1,
+			strlen(fname_print) + fname_print - tmp - 1);
+		fname_print[strlen(fname_print) - 1] = '\0';
+	}
+
+	rc = vm6_request(image, fname, fname_print);
+	if (rc)
+		return rc;
 
 	/* Analyze and return result */
 	resp_hdr = (struct vm6_image_response *)server->priv->outlist;
@@ -490,21 +592,36 @@ int vm6_command_handling(struct snipl_image *image, char *fname)
 		resp_hdr->processed, resp_hdr->processed);
 	DEBUG_PRINT("not processed = %08x = %i\n",
 		resp_hdr->not_processed, resp_hdr->not_processed);
-	if (request_id != resp_hdr->request_id)
-		DEBUG_PRINT("internal error - request id\n");
 	err_dsc = vmsmapi6_get_error_description(resp_hdr->return_code,
 						 resp_hdr->reason_code);
+	snipl_result_api(server, resp_hdr->return_code,
+			 resp_hdr->reason_code);
+	if (!strcmp(fname, "Image_Status_Query\0"))
+		snipl_result_state(server,
+				   vm6_image_state(resp_hdr->return_code,
+						   resp_hdr->reason_code),
+				   0, NULL);
 	if (!strcmp(fname, "Image_Status_Query\0") &&
 	    (resp_hdr->return_code == RC_OK) &&
 	    (resp_hdr->reason_code == RS_NONE))
 		err_dsc = image_active;
 	create_msg(server, "* %s : Image %s %s\n",
 		fname_print, image->name, err_dsc);
-	if (resp_hdr->return_code) {
+	if (resp_hdr->return_code == RC_ASYNC) {
+		/* the reason code is the ID of the operation */
+		create_msg(server, "* %s : Image %s %s, operation ID %i\n",
+			   fname_print, image->name, err_dsc,
+			   resp_hdr->reason_code);
+		rc = snipl_async_start(server, image, resp_hdr->reason_code);
+		if (rc)
+			append_msg(server, "cannot allocate storage to track "
+				   "the operation\n");
+		server->problem_class = rc ? FATAL : OK;
+	} else if (resp_hdr->return_code) {
 		server->problem_class = FATAL;
-		fprintf(stderr, "* Error during SMAPI server communication: "
-			"return code %i, reason code %i\n",
-			resp_hdr->return_code, resp_hdr->reason_code);
+		append_msg(server, "* Error during SMAPI server communication: "
+			   "return code %i, reason code %i\n",
+			   resp_hdr->return_code, resp_hdr->reason_code);
 		rc = CONNECTION_ERROR;
 	} else {
 		server->problem_class = OK;
@@ -548,6 +665,148 @@ int vm6_image_getstatus(struct snipl_image *image)
 	return vm6_command_handling(image, FNAME);
 }
 
+/*--------------------------------------------------------------------*/
+/*
+   Query the state of an asynchronous operation started for an image
+*/
+static int vm6_query_async(struct snipl_server *server,
+			   struct snipl_async *async)
+{
+	char FNAME[] = "Query_Asynchronous_Operation_DM\0";
+	char fname_print[] = "QueryAsyncOperation";
+	struct vm6_image_response *resp_hdr;
+	int rc;
+
+	DEBUG_PRINT("vmsmapi6 : start of function\n");
+	server->priv->operation_id = async->id;
+	rc = vm6_request(async->image, FNAME, fname_print);
+	if (rc)
+		return rc;
+
+	resp_hdr = (struct vm6_image_response *)server->priv->outlist;
+	DEBUG_PRINT("return_code = %08x = %i\n",
+		resp_hdr->return_code, resp_hdr->return_code);
+	DEBUG_PRINT("reason_code = %08x = %i\n",
+		resp_hdr->reason_code, resp_hdr->reason_code);
+	async->api_rc = resp_hdr->return_code;
+	async->api_rs = resp_hdr->reason_code;
+	if (resp_hdr->return_code == RC_OK &&
+	    resp_hdr->reason_code == RS_ASYNC_IN_PROGRESS)
+		async->state = SNIPL_ASYNC_RUNNING;
+	else if (resp_hdr->return_code == RC_OK &&
+		 resp_hdr->reason_code == RS_ASYNC_SUCCEEDED)
+		async->state = SNIPL_ASYNC_DONE;
+	else
+		async->state = SNIPL_ASYNC_FAILED;
+	return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/*
+   Query the names of all active images of the server with one
+   Image_Status_Query for the target "*". The output data is taken as
+   the length of the image name array followed by the names, each one
+   with its length. The names are returned in *names, terminated by
+   NULL, in one buffer that the caller frees.
+*/
+static int vm6_query_active(struct snipl_server *server, char ***names)
+{
+	char FNAME[] = "Image_Status_Query\0";
+	char fname_print[] = "ImageStatusQuery";
+	struct snipl_image all = {
+		.name = "*",
+		.alias = "*",
+		.server = server,
+	};
+	struct vm6_image_response *resp_hdr;
+	uint32_t array_len, name_len;
+	char *data, *pos, *end, *str;
+	char **list;
+	int len, count, rc;
+
+	DEBUG_PRINT("vmsmapi6 : start of function\n");
+	rc = vm6_request(&all, FNAME, fname_print);
+	if (rc)
+		return rc;
+
+	resp_hdr = (struct vm6_image_response *)server->priv->outlist;
+	DEBUG_PRINT("return_code = %08x = %i\n",
+		resp_hdr->return_code, resp_hdr->return_code);
+	DEBUG_PRINT("reason_code = %08x = %i\n",
+		resp_hdr->reason_code, resp_hdr->reason_code);
+	if (resp_hdr->return_code != RC_OK) {
+		create_msg(server, "* %s : Image * %s\n", fname_print,
+			   vmsmapi6_get_error_description(
+				resp_hdr->return_code,
+				resp_hdr->reason_code));
+		append_msg(server, "* Error during SMAPI server communication: "
+			   "return code %i, reason code %i\n",
+			   resp_hdr->return_code, resp_hdr->reason_code);
+		server->problem_class = FATAL;
+		return CONNECTION_ERROR;
+	}
+
+	/* output_length counts request_id, return_code and reason_code */
+	len = resp_hdr->output_length - 12;
+	if (len < 0)
+		len = 0;
+	data = malloc(len + 4);
+	if (!data) {
+		create_msg(server, "cannot allocate buffer for %s\n",
+			   fname_print);
+		server->problem_class = FATAL;
+		return STORAGE_PROBLEM;
+	}
+	rc = vm6_recv_data(server, fname_print, data, len);
+	if (rc) {
+		free(data);
+		return rc;
+	}
+	array_len = 0;
+	if (len >= 4) {
+		memcpy(&array_len, data, 4);
+		array_len = ntohl(array_len);
+		if (array_len > (uint32_t)len - 4)
+			array_len = len - 4;
+	}
+	end = data + 4 + array_len;
+
+	count = 0;
+	for (pos = data + 4; pos + 4 <= end; pos += 4 + name_len) {
+		memcpy(&name_len, pos, 4);
+		name_len = ntohl(name_len);
+		if (name_len > (uint32_t)(end - pos - 4))
+			break;
+		count++;
+	}
+	list = malloc((count + 1) * sizeof(*list) + array_len + count);
+	if (!list) {
+		free(data);
+		create_msg(server, "cannot allocate buffer for %s\n",
+			   fname_print);
+		server->problem_class = FATAL;
+		return STORAGE_PROBLEM;
+	}
+	str = (char *)(list + count + 1);
+	pos = data + 4;
+	for (count = 0; pos + 4 <= end; pos += 4 + name_len) {
+		memcpy(&name_len, pos, 4);
+		name_len = ntohl(name_len);
+		if (name_len > (uint32_t)(end - pos - 4))
+			break;
+		memcpy(str, pos + 4, name_len);
+		str[name_len] = '\0';
+		list[count++] = str;
+		str += name_len + 1;
+	}
+	list[count] = NULL;
+	free(data);
+	DEBUG_PRINT("%i active images\n", count);
+	*names = list;
+	server->problem_class = OK;
+	return 0;
+}
+
 /*--------------------------------------------------------------------*/
 static int vm6_check_certificate(struct snipl_server *server)
 {
@@ -636,6 +895,7 @@ int vm6_server_login(struct snipl_server *server)
 {
 	int protolevel = SOL_SOCKET;
 	int option = 1;
+	socklen_t optlen;
 	char FNAME[] = "Connect\0";
 	struct addrinfo *ai_result = NULL;
 	struct addrinfo hints;
@@ -768,8 +1028,16 @@ int vm6_server_login(struct snipl_server *server)
 					? sizeof(struct sockaddr_in)
 					: sizeof(struct sockaddr_in6)));
 
-	if (errno == EINPROGRESS)
+	if (errno == EINPROGRESS) {
 		rc = vm6_wait_for_response(server, FNAME, EPOLLOUT, 1000);
+		/* a refused connect is writable, too */
+		optlen = sizeof(option);
+		if (!rc && !getsockopt(server->priv->sockid, SOL_SOCKET,
+				       SO_ERROR, &option, &optlen) && option) {
+			errno = option;
+			rc = -1;
+		}
+	}
 	if (rc < 0) {
 		DEBUG_PRINT("connect return_code = %08x = %i\n", rc, rc);
 		create_msg(server, "%s: connect failed, return_code is %i %s\n",
@@ -830,6 +1098,65 @@ int vm6_server_login(struct snipl_server *server)
 }
 
 
+/*
+   liveness check of the SMAPI request server without login:
+   a TCP connect to its port, closed again right away
+*/
+static int vm6_server_probe(struct snipl_server *server)
+{
+	char FNAME[] = "Probe";
+	struct addrinfo hints, *ai_result;
+	char serverPortStr[8];
+	socklen_t optlen;
+	int option, rc;
+
+	DEBUG_PRINT("vmsmapi6 : start of function\n");
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	snprintf(serverPortStr, sizeof(serverPortStr), "%d", server->port);
+	rc = getaddrinfo(server->address, serverPortStr, &hints, &ai_result);
+	if (rc) {
+		create_msg(server,
+			"%s: host name cannot be resolved, return_code is %i\n",
+			server->address, rc);
+		server->problem_class = FATAL;
+		return INTERNAL_ERROR;
+	}
+	server->priv->sockid = socket(ai_result->ai_family,
+				      SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (server->priv->sockid < 0) {
+		freeaddrinfo(ai_result);
+		create_msg(server, "%s: socket failed, return_code is %i %s\n",
+			   server->address, errno, strerror(errno));
+		server->problem_class = FATAL;
+		return INTERNAL_ERROR;
+	}
+	rc = connect(server->priv->sockid, ai_result->ai_addr,
+		     ai_result->ai_addrlen);
+	freeaddrinfo(ai_result);
+	if (rc < 0 && errno == EINPROGRESS) {
+		rc = vm6_wait_for_response(server, FNAME, EPOLLOUT, 1000);
+		/* a refused connect is writable, too */
+		optlen = sizeof(option);
+		if (!rc && !getsockopt(server->priv->sockid, SOL_SOCKET,
+				       SO_ERROR, &option, &optlen) && option) {
+			errno = option;
+			rc = -1;
+		}
+	}
+	if (rc == -1) {
+		create_msg(server, "%s: connect failed, return_code is %i %s\n",
+			   server->address, errno, strerror(errno));
+		server->problem_class = FATAL;
+	}
+	close(server->priv->sockid);
+	return rc;
+}
+
+
 static int vm6_server_logout(struct snipl_server *server)
 {
 	struct snipl_image *image;
@@ -14,7 +14,7 @@
 
 
 #define STIMEOUT 20000
-#define INPUT_LEN 100
+#define INPUT_LEN 128
 
 enum socket_state {
 	NOT_CREATED,
@@ -29,6 +29,7 @@ struct snipl_server_private {	/* vm server private data */
 	char	*outlist;
 	SSL     *sslhandle;
 	SSL_CTX *sslcontext;
+	int	operation_id;	/* of Query_Asynchronous_Operation_DM */
 };
 
 static int vm6_image_activate(struct snipl_image *);
@@ -40,12 +41,18 @@ static int vm6_check(struct snipl_server *);
 static int vm6_server_login(struct snipl_server *);
 static int vm6_server_logout(struct snipl_server *);
 static int vm6_confirm(struct snipl_server *);
+static int vm6_server_probe(struct snipl_server *);
+static int vm6_query_async(struct snipl_server *, struct snipl_async *);
+static int vm6_query_active(struct snipl_server *, char ***);
 
 static struct snipl_server_ops vm6_server_ops = {
 	.login = vm6_server_login,
 	.logout = vm6_server_logout,
 	.check = vm6_check,
 	.confirm = vm6_confirm,
+	.probe = vm6_server_probe,
+	.query_async = vm6_query_async,
+	.query_active = vm6_query_active,
 };
 
 static struct snipl_image_ops vm6_image_ops = {
@@ -55,7 +62,7 @@ static struct snipl_image_ops vm6_image_ops = {
 	.getstatus      = vm6_image_getstatus,
 };
 
-extern int vm6_prepare(struct snipl_server *server);
+extern SNIPL_MODULE_PREPARE(vmsmapi6);
 
 #define RC_OK					0
 #define RCERR_SYNTAX				24
@@ -64,6 +71,7 @@ extern int vm6_prepare(struct snipl_server *server);
 #define RCERR_PW_EXPIRED			128
 #define RCERR_IMAGEOP				200
 #define RCERR_SERVER				900
+#define RC_ASYNC				592	/* RS = operation ID */
 
 #define RS_ANY					(-1)
 #define RS_NONE					0
@@ -79,6 +87,9 @@ extern int vm6_prepare(struct snipl_server *server);
 #define RS_SOME_NOT_RECYC			36
 #define RS_SFS_ERROR				24
 #define RS_DEACT_TIME				300
+#define RS_ASYNC_SUCCEEDED			100
+#define RS_ASYNC_IN_PROGRESS			104
+#define RS_ASYNC_FAILED				108
 
 static struct {
 	int RC;
@@ -88,6 +99,10 @@ static struct {
 	{ RC_OK,         RS_NONE,               "Request Successful"},
 	{ RC_OK,         RS_DEACT_TIME,         "Request Successful"},
 	{ RC_OK,         RS_NOT_ACTIVE,         "Image Not Active"},
+	{ RC_OK,         RS_ASYNC_SUCCEEDED,    "Asynchronous Operation Succeeded"},
+	{ RC_OK,         RS_ASYNC_IN_PROGRESS,  "Asynchronous Operation In Progress"},
+	{ RC_OK,         RS_ASYNC_FAILED,       "Asynchronous Operation Failed"},
+	{ RC_ASYNC,      RS_ANY,                "Asynchronous Operation Started"},
 	{ RCERR_SYNTAX,  RS_ANY,                "Syntax Error in Function Parameter"},
 	{ RCERR_AUTH,    RS_AUTHERR_ESM,        "Request Not Authorized by External Security Manager"},
 	{ RCERR_AUTH,    RS_AUTHERR_SERVER,     "Request Not Authorized by Server"},